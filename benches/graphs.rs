@@ -0,0 +1,313 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+//! Macrobenchmarks of whole scripts: importing graphs, recursive reachability, and the
+//! graph algorithms, on synthetic graphs and on the air-routes dataset in `tests/`.
+//!
+//! Run with `cargo bench --bench graphs [-- <name filter>...]`. The synthetic graphs have
+//! `10000 * COZO_BENCH_SCALE` nodes.
+
+use serde_json::{json, Map, Value};
+
+use cozo::Db;
+
+use harness::{Bencher, Rng, TempDir};
+
+mod harness;
+
+const NODES: usize = 10_000;
+const OUT_DEGREE: usize = 4;
+
+/// How the targets of edges are picked.
+#[derive(Copy, Clone)]
+enum Shape {
+    /// Uniformly among all nodes.
+    Uniform,
+    /// Skewed towards the nodes with the smallest ids, which become hubs, as in social
+    /// and citation graphs.
+    Skewed,
+}
+
+impl Shape {
+    fn name(self) -> &'static str {
+        match self {
+            Shape::Uniform => "uniform",
+            Shape::Skewed => "skewed",
+        }
+    }
+}
+
+/// `[fr, to, weight]` rows of a graph without self loops, the same for every run.
+fn synthetic_edges(nodes: usize, shape: Shape) -> Vec<Value> {
+    let mut rng = Rng::new(42);
+    let mut edges = Vec::with_capacity(nodes * OUT_DEGREE);
+    for fr in 0..nodes as u64 {
+        for _ in 0..OUT_DEGREE {
+            let to = match shape {
+                Shape::Uniform => rng.below(nodes as u64),
+                Shape::Skewed => (rng.unit().powi(3) * nodes as f64) as u64,
+            };
+            if to != fr {
+                edges.push(json!([fr, to, 1.0 + rng.unit()]));
+            }
+        }
+    }
+    edges
+}
+
+fn params_of(edges: &[Value]) -> Map<String, Value> {
+    let mut params = Map::new();
+    params.insert("edges".to_string(), Value::Array(edges.to_vec()));
+    params
+}
+
+fn run(db: &Db, script: &str) -> Value {
+    db.run_script(script, &Default::default())
+        .unwrap_or_else(|err| panic!("{:?}\nwhen running\n{}", err, script))
+}
+
+const CREATE_EDGES: &str = r#"
+    ?[fr, to, weight] <- $edges
+    :create edge {fr: Int, to: Int => weight: Float}
+"#;
+
+const BULK_LOAD_EDGES: &str = r#"
+    ?[fr, to, weight] <- $edges
+    :create edge {fr: Int, to: Int => weight: Float}
+    :bulk_load
+"#;
+
+fn import_benches(b: &Bencher, edges: &[Value], shape: Shape) {
+    let params = params_of(edges);
+    let info = json!({"nodes": NODES * b.scale(), "edges": edges.len(), "shape": shape.name()});
+    for (name, script) in [
+        ("import.create", CREATE_EDGES),
+        ("import.bulk_load", BULK_LOAD_EDGES),
+    ] {
+        b.run_with_setup(
+            &format!("{}.{}", name, shape.name()),
+            info.clone(),
+            edges.len() as u64,
+            || {
+                let dir = TempDir::new("import");
+                (Db::new(dir.path()).unwrap(), dir)
+            },
+            |(db, _)| {
+                db.run_script(script, &params).unwrap();
+            },
+        );
+    }
+}
+
+/// Scripts run against `*edge[fr, to, weight]`, by name.
+const GRAPH_QUERIES: [(&str, &str); 11] = [
+    (
+        "reach.from_one",
+        r#"
+        reach[to] := *edge[0, to, _]
+        reach[to] := reach[mid], *edge[mid, to, _]
+        ?[count(to)] := reach[to]
+        "#,
+    ),
+    (
+        "reach.magic_bound",
+        r#"
+        reach[fr, to] := *edge[fr, to, _]
+        reach[fr, to] := reach[fr, mid], *edge[mid, to, _]
+        ?[count(to)] := reach[0, to]
+        "#,
+    ),
+    (
+        "reach.three_hops_all",
+        r#"
+        ?[count(d)] := *edge[a, b, _], *edge[b, c, _], *edge[c, d, _]
+        "#,
+    ),
+    (
+        "algo.pagerank",
+        r#"
+        ?[] <~ PageRank(*edge[])
+        "#,
+    ),
+    (
+        "algo.dijkstra_single_source",
+        r#"
+        starting[] <- [[0]]
+        ?[] <~ ShortestPathDijkstra(*edge[], starting[])
+        "#,
+    ),
+    (
+        "algo.bfs",
+        r#"
+        starting[] <- [[0]]
+        nodes[n] := *edge[n, _, _]
+        ?[] <~ BFS(*edge[], nodes[n], starting[], condition: (n == -1))
+        "#,
+    ),
+    (
+        "algo.strongly_connected_components",
+        r#"
+        ?[] <~ StronglyConnectedComponents(*edge[])
+        "#,
+    ),
+    (
+        "algo.connected_components",
+        r#"
+        ?[] <~ ConnectedComponents(*edge[])
+        "#,
+    ),
+    (
+        "algo.label_propagation",
+        r#"
+        ?[] <~ LabelPropagation(*edge[])
+        "#,
+    ),
+    (
+        "algo.louvain",
+        r#"
+        ?[] <~ CommunityDetectionLouvain(*edge[])
+        "#,
+    ),
+    (
+        "algo.clustering_coefficients",
+        r#"
+        ?[] <~ ClusteringCoefficients(*edge[])
+        "#,
+    ),
+];
+
+fn query_benches(b: &Bencher, edges: &[Value], shape: Shape) {
+    if !GRAPH_QUERIES
+        .iter()
+        .any(|(name, _)| b.enabled(&format!("{}.{}", name, shape.name())))
+    {
+        return;
+    }
+    let dir = TempDir::new("graph");
+    let db = Db::new(dir.path()).unwrap();
+    db.run_script(CREATE_EDGES, &params_of(edges)).unwrap();
+    let info = json!({"nodes": NODES * b.scale(), "edges": edges.len(), "shape": shape.name()});
+    for (name, script) in GRAPH_QUERIES {
+        b.run(
+            &format!("{}.{}", name, shape.name()),
+            info.clone(),
+            edges.len() as u64,
+            || {
+                run(&db, script);
+            },
+        );
+    }
+}
+
+const AIR_ROUTES_LOAD: [&str; 3] = [
+    r#"
+    res[idx, label, typ, code, icao, desc, region, runways, longest, elev, country, city, lat, lon] <~
+        CsvReader(types: ['Int', 'Any', 'Any', 'Any', 'Any', 'Any', 'Any', 'Int?', 'Float?', 'Float?', 'Any', 'Any', 'Float?', 'Float?'],
+                  url: 'file://./tests/air-routes-latest-nodes.csv',
+                  has_headers: true)
+    ?[code, desc, country, lat, lon] :=
+        res[idx, label, typ, code, icao, desc, region, runways, longest, elev, country, city, lat, lon],
+        label == 'airport'
+    :replace airport { code: String => desc: String, country: String, lat: Float, lon: Float }
+    "#,
+    r#"
+    res[idx, label, typ, code] <~
+        CsvReader(types: ['Int', 'Any', 'Any', 'Any'],
+                  url: 'file://./tests/air-routes-latest-nodes.csv',
+                  has_headers: true)
+    ?[idx, code] := res[idx, label, typ, code]
+    :replace idx2code { idx: Int => code: String }
+    "#,
+    r#"
+    res[] <~
+        CsvReader(types: ['Int', 'Int', 'Int', 'String', 'Float?'],
+                  url: 'file://./tests/air-routes-latest-edges.csv',
+                  has_headers: true)
+    ?[fr, to, dist] :=
+        res[idx, fr_i, to_i, typ, dist],
+        typ == 'route',
+        *idx2code[fr_i, fr],
+        *idx2code[to_i, to]
+    :replace route { fr: String, to: String => dist: Float }
+    "#,
+];
+
+fn load_air_routes(db: &Db) {
+    for script in AIR_ROUTES_LOAD {
+        run(db, script);
+    }
+}
+
+const AIR_ROUTES_QUERIES: [(&str, &str); 5] = [
+    (
+        "air_routes.two_hops_from_each",
+        r#"
+        ?[fr, count(dst)] := *route[fr, mid, _], *route[mid, dst, _]
+        "#,
+    ),
+    (
+        "air_routes.reachable_within_country",
+        r#"
+        reach[to] := *route['LHR', to, _], *airport[to, _, 'UK', _, _]
+        reach[to] := reach[mid], *route[mid, to, _], *airport[to, _, 'UK', _, _]
+        ?[count(to)] := reach[to]
+        "#,
+    ),
+    (
+        "air_routes.pagerank",
+        r#"
+        ?[] <~ PageRank(*route[])
+        "#,
+    ),
+    (
+        "air_routes.dijkstra",
+        r#"
+        starting[] <- [['JFK']]
+        ending[] <- [['KUL']]
+        ?[] <~ ShortestPathDijkstra(*route[], starting[], ending[])
+        "#,
+    ),
+    (
+        "air_routes.k_shortest_paths",
+        r#"
+        starting[] <- [['PEK']]
+        ending[] <- [['SIN']]
+        ?[] <~ KShortestPathYen(*route[], starting[], ending[], k: 5)
+        "#,
+    ),
+];
+
+fn air_routes_benches(b: &Bencher) {
+    b.run_with_setup(
+        "air_routes.load",
+        json!({}),
+        1,
+        || {
+            let dir = TempDir::new("air_routes_load");
+            (Db::new(dir.path()).unwrap(), dir)
+        },
+        |(db, _)| load_air_routes(db),
+    );
+    if !AIR_ROUTES_QUERIES.iter().any(|(name, _)| b.enabled(name)) {
+        return;
+    }
+    let dir = TempDir::new("air_routes");
+    let db = Db::new(dir.path()).unwrap();
+    load_air_routes(&db);
+    for (name, script) in AIR_ROUTES_QUERIES {
+        b.run(name, json!({}), 1, || {
+            run(&db, script);
+        });
+    }
+}
+
+fn main() {
+    let b = Bencher::from_env();
+    for shape in [Shape::Uniform, Shape::Skewed] {
+        let edges = synthetic_edges(NODES * b.scale(), shape);
+        import_benches(&b, &edges, shape);
+        query_benches(&b, &edges, shape);
+    }
+    air_routes_benches(&b);
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+//! A minimal benchmark harness shared by the benches, which are built with `harness = false`.
+//!
+//! Every benchmark writes one JSON object per line to stdout, and a summary to stderr, so
+//! that the results of two runs can be compared by a script. Arguments not starting with
+//! `-` select the benchmarks whose names contain them. `COZO_BENCH_SCALE` multiplies the
+//! sizes of the data, `COZO_BENCH_SECS` sets how long each benchmark is measured for, and
+//! `COZO_BENCH_OUTPUT` names a file the JSON lines are appended to as well.
+
+#![allow(dead_code)]
+
+use std::fs::{File, OpenOptions};
+use std::io::Write;
+use std::path::PathBuf;
+use std::sync::Mutex;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use std::{env, fs, process};
+
+use serde_json::{json, Value};
+
+/// Measured runs are stopped after this many, however short they are.
+const MAX_SAMPLES: usize = 1000;
+/// Measured runs are only stopped after at least this many, however long they are.
+const MIN_SAMPLES: usize = 3;
+
+pub struct Bencher {
+    filters: Vec<String>,
+    scale: usize,
+    measure_for: Duration,
+    output: Option<Mutex<File>>,
+}
+
+impl Bencher {
+    pub fn from_env() -> Self {
+        let filters = env::args()
+            .skip(1)
+            .filter(|arg| !arg.starts_with('-'))
+            .collect();
+        let scale = env::var("COZO_BENCH_SCALE")
+            .ok()
+            .and_then(|s| s.parse().ok())
+            .unwrap_or(1);
+        let secs: f64 = env::var("COZO_BENCH_SECS")
+            .ok()
+            .and_then(|s| s.parse().ok())
+            .unwrap_or(3.0);
+        let output = env::var("COZO_BENCH_OUTPUT").ok().map(|path| {
+            let file = OpenOptions::new()
+                .create(true)
+                .append(true)
+                .open(&path)
+                .unwrap_or_else(|err| panic!("cannot open {}: {}", path, err));
+            Mutex::new(file)
+        });
+        Self {
+            filters,
+            scale,
+            measure_for: Duration::from_secs_f64(secs),
+            output,
+        }
+    }
+    pub fn scale(&self) -> usize {
+        self.scale
+    }
+    pub fn enabled(&self, name: &str) -> bool {
+        self.filters.is_empty() || self.filters.iter().any(|f| name.contains(f.as_str()))
+    }
+    /// Measures `f`, each call of which processes `elements` items.
+    pub fn run(&self, name: &str, params: Value, elements: u64, mut f: impl FnMut()) {
+        self.run_with_setup(name, params, elements, || (), |_| f())
+    }
+    /// Measures `f` on the results of `setup`, which is run before every call of `f`. Neither
+    /// `setup` nor dropping its results is measured.
+    pub fn run_with_setup<T>(
+        &self,
+        name: &str,
+        params: Value,
+        elements: u64,
+        mut setup: impl FnMut() -> T,
+        mut f: impl FnMut(&mut T),
+    ) {
+        if !self.enabled(name) {
+            return;
+        }
+        // warms up caches and allocators, and is not counted
+        f(&mut setup());
+        let mut samples = vec![];
+        let started = Instant::now();
+        while samples.len() < MAX_SAMPLES
+            && (samples.len() < MIN_SAMPLES || started.elapsed() < self.measure_for)
+        {
+            let mut input = setup();
+            let start = Instant::now();
+            f(&mut input);
+            samples.push(start.elapsed().as_nanos() as f64);
+            drop(input);
+        }
+        self.report(name, params, elements, samples);
+    }
+    fn report(&self, name: &str, params: Value, elements: u64, mut samples: Vec<f64>) {
+        samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let n = samples.len() as f64;
+        let mean = samples.iter().sum::<f64>() / n;
+        let stddev = (samples.iter().map(|s| (s - mean).powi(2)).sum::<f64>() / n).sqrt();
+        let median = samples[samples.len() / 2];
+        let per_sec = elements as f64 / (median / 1e9);
+        let line = json!({
+            "name": name,
+            "params": params,
+            "scale": self.scale,
+            "version": env!("CARGO_PKG_VERSION"),
+            "timestamp": SystemTime::now().duration_since(UNIX_EPOCH).unwrap().as_secs(),
+            "samples": samples.len(),
+            "elements": elements,
+            "min_ns": samples[0],
+            "median_ns": median,
+            "mean_ns": mean,
+            "max_ns": samples[samples.len() - 1],
+            "stddev_ns": stddev,
+            "elements_per_sec": per_sec,
+        });
+        eprintln!(
+            "{:<40} {:>12.3} ms  (+/- {:.3})  {:>14.0} elements/s",
+            name,
+            median / 1e6,
+            stddev / 1e6,
+            per_sec
+        );
+        println!("{}", line);
+        if let Some(output) = &self.output {
+            writeln!(output.lock().unwrap(), "{}", line).unwrap();
+        }
+    }
+}
+
+/// A directory for a database, removed on drop.
+pub struct TempDir(pub PathBuf);
+
+impl TempDir {
+    pub fn new(name: &str) -> Self {
+        let path = env::temp_dir().join(format!("cozo_bench_{}_{}", name, process::id()));
+        _ = fs::remove_dir_all(&path);
+        fs::create_dir_all(&path).unwrap();
+        Self(path)
+    }
+    pub fn path(&self) -> &str {
+        self.0.to_str().unwrap()
+    }
+}
+
+impl Drop for TempDir {
+    fn drop(&mut self) {
+        _ = fs::remove_dir_all(&self.0);
+    }
+}
+
+/// SplitMix64, so that the data generated is the same on every platform and with every
+/// version of the dependencies.
+pub struct Rng(u64);
+
+impl Rng {
+    pub fn new(seed: u64) -> Self {
+        Self(seed)
+    }
+    pub fn next_u64(&mut self) -> u64 {
+        self.0 = self.0.wrapping_add(0x9e37_79b9_7f4a_7c15);
+        let mut z = self.0;
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+        z ^ (z >> 31)
+    }
+    /// In `0..n`.
+    pub fn below(&mut self, n: u64) -> u64 {
+        self.next_u64() % n
+    }
+    /// In `[0, 1)`.
+    pub fn unit(&mut self) -> f64 {
+        (self.next_u64() >> 11) as f64 / (1u64 << 53) as f64
+    }
+}
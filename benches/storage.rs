@@ -0,0 +1,211 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+//! Microbenchmarks of the storage bridge, scans and point reads and writes through the
+//! transactions of cozorocks, and of the encoding of rows as stored keys and values.
+//!
+//! Run with `cargo bench --bench storage [-- <name filter>...]`.
+
+use serde_json::{json, Value};
+
+use cozo::internals::EncodingBench;
+use cozorocks::{DbBuilder, RocksDb};
+
+use harness::{Bencher, Rng, TempDir};
+
+mod harness;
+
+/// Rows per relation, times `COZO_BENCH_SCALE`.
+const ROWS: usize = 100_000;
+/// Size of the values stored with the keys.
+const VALUE_LEN: usize = 64;
+
+const RELATION_PREFIX_LEN: usize = 8;
+
+fn key(relation: u64, i: u64) -> Vec<u8> {
+    let mut ret = Vec::with_capacity(RELATION_PREFIX_LEN + 8);
+    ret.extend(relation.to_be_bytes());
+    ret.extend(i.to_be_bytes());
+    ret
+}
+
+/// Opened as the database does, so that prefix bloom filters are used alike.
+fn open(dir: &TempDir) -> RocksDb {
+    DbBuilder::default()
+        .path(dir.path())
+        .create_if_missing(true)
+        .use_capped_prefix_extractor(true, RELATION_PREFIX_LEN + 1)
+        .use_bloom_filter(true, 9.9, true)
+        .build()
+        .unwrap()
+}
+
+/// Writes `rows` keys of relation 1 and compacts them into SST files, so that reads do
+/// not only hit the memtable.
+fn fill(db: &RocksDb, rows: usize) {
+    let value = vec![7u8; VALUE_LEN];
+    let mut tx = db.transact().start();
+    for i in 0..rows as u64 {
+        tx.put(&key(1, i), &value).unwrap();
+    }
+    tx.commit().unwrap();
+    db.range_compact(&key(1, 0), &key(2, 0)).unwrap();
+}
+
+fn tx_benches(b: &Bencher) {
+    let rows = ROWS * b.scale();
+    let dir = TempDir::new("tx");
+    let db = open(&dir);
+    fill(&db, rows);
+    let params = json!({"rows": rows, "value_len": VALUE_LEN});
+    let value = vec![7u8; VALUE_LEN];
+
+    let mut n = 0u64;
+    b.run("tx.put_commit", params.clone(), rows as u64, || {
+        // to another relation each time, so that no write overwrites an earlier one
+        n += 1;
+        let mut tx = db.transact().start();
+        for i in 0..rows as u64 {
+            tx.put(&key(n + 1, i), &value).unwrap();
+        }
+        tx.commit().unwrap();
+    });
+
+    let mut rng = Rng::new(1);
+    let lookups = (0..rows)
+        .map(|_| key(1, rng.below(rows as u64)))
+        .collect::<Vec<_>>();
+    let tx = db.transact_read_only().start();
+    b.run("tx.get_hit", params.clone(), rows as u64, || {
+        for k in &lookups {
+            assert!(tx.get(k, false).unwrap().is_some());
+        }
+    });
+    let misses = (0..rows)
+        .map(|i| key(1, rows as u64 + i as u64))
+        .collect::<Vec<_>>();
+    b.run("tx.get_miss", params.clone(), rows as u64, || {
+        for k in &misses {
+            assert!(tx.get(k, false).unwrap().is_none());
+        }
+    });
+    b.run("tx.multi_get_hit", params, rows as u64, || {
+        for chunk in lookups.chunks(1024) {
+            let found = tx.multi_get(chunk, false).unwrap();
+            assert_eq!(found.len(), chunk.len());
+        }
+    });
+}
+
+fn iter_benches(b: &Bencher) {
+    let rows = ROWS * b.scale();
+    let dir = TempDir::new("iter");
+    let db = open(&dir);
+    fill(&db, rows);
+    let params = json!({"rows": rows, "value_len": VALUE_LEN});
+    let tx = db.transact_read_only().start();
+    let lower = key(1, 0);
+    let upper = key(2, 0);
+
+    b.run("iter.scan_per_row", params.clone(), rows as u64, || {
+        let mut it = tx
+            .iterator()
+            .lower_bound(&lower)
+            .upper_bound(&upper)
+            .start();
+        it.seek(&lower);
+        let mut n = 0;
+        while let Some((k, v)) = it.pair().unwrap() {
+            n += k.len() + v.len();
+            it.next();
+        }
+        assert!(n > 0);
+    });
+    b.run("iter.scan_batched", params.clone(), rows as u64, || {
+        let mut it = tx
+            .iterator()
+            .lower_bound(&lower)
+            .upper_bound(&upper)
+            .start();
+        it.seek(&lower);
+        let mut n = 0;
+        loop {
+            let batch = it.next_batch(1024, 1 << 20).unwrap();
+            if batch.is_empty() {
+                break;
+            }
+            n += batch.len();
+        }
+        assert_eq!(n, rows);
+    });
+
+    // short scans from random positions, as done for each tuple probed by a join
+    let seeks = 10_000 * b.scale();
+    let mut rng = Rng::new(2);
+    let starts = (0..seeks)
+        .map(|_| key(1, rng.below(rows as u64)))
+        .collect::<Vec<_>>();
+    b.run(
+        "iter.seek_and_take_8",
+        json!({"rows": rows, "seeks": seeks}),
+        seeks as u64,
+        || {
+            let mut it = tx
+                .iterator()
+                .lower_bound(&lower)
+                .upper_bound(&upper)
+                .start();
+            for start in &starts {
+                it.seek(start);
+                for _ in 0..8 {
+                    if it.pair().unwrap().is_none() {
+                        break;
+                    }
+                    it.next();
+                }
+            }
+        },
+    );
+}
+
+fn encoding_benches(b: &Bencher) {
+    let rows = ROWS * b.scale();
+    let mut rng = Rng::new(3);
+    let data: Vec<Value> = (0..rows)
+        .map(|i| {
+            json!([
+                i,
+                format!("node-{}", rng.below(1 << 20)),
+                rng.unit(),
+                [rng.below(100), rng.below(100)],
+                null
+            ])
+        })
+        .collect();
+    let params = json!({"rows": rows, "columns": ["int", "string", "float", "list", "null"]});
+    let mut enc = EncodingBench::new(&data);
+    b.run("memcmp.encode_keys", params.clone(), rows as u64, || {
+        assert!(enc.encode_keys() > 0);
+    });
+    b.run("memcmp.decode_keys", params.clone(), rows as u64, || {
+        assert_eq!(enc.decode_keys(), rows * 5);
+    });
+    b.run("values.encode", params.clone(), rows as u64, || {
+        assert!(enc.encode_values() > 0);
+    });
+    b.run("values.decode_all", params.clone(), rows as u64, || {
+        assert_eq!(enc.decode_values(None), rows * 5);
+    });
+    let needed = [false, true, false, false, false];
+    b.run("values.decode_one", params, rows as u64, || {
+        assert_eq!(enc.decode_values(Some(&needed)), rows * 5);
+    });
+}
+
+fn main() {
+    let b = Bencher::from_env();
+    tx_benches(&b);
+    iter_benches(&b);
+    encoding_benches(&b);
+}
@@ -36,6 +36,54 @@ char *cozo_open_db(const char *path, int32_t *db_id);
  */
 bool cozo_close_db(int32_t id);
 
+/**
+ * Write a consistent copy of a database while it keeps running, by hard linking its
+ * files where possible. The copy can be opened with `cozo_open_db`.
+ *
+ * `db_id`: the ID representing the database to copy.
+ * `path`:  the UTF-8 encoded path name of the copy as a null-terminated C-string.
+ *          It must not exist yet.
+ *
+ * When the function is successful, null pointer is returned,
+ * otherwise a pointer to a C-string containing the error message will be returned.
+ * The returned C-string must be freed with `cozo_free_str`.
+ */
+char *cozo_checkpoint(int32_t db_id, const char *path);
+
+/**
+ * Back up a database while it keeps running. Backups in the same directory share their
+ * files, so only the files written since the last backup there are copied.
+ *
+ * `db_id`:      the ID representing the database to back up.
+ * `backup_dir`: the UTF-8 encoded path name of the backup directory as a null-terminated
+ *               C-string.
+ * `rate_limit`: the bytes per second that may be copied, or zero for no limit.
+ * `keep`:       the number of the newest backups to keep, or zero to keep all.
+ * `backup_id`:  will contain the id of the new backup.
+ *
+ * When the function is successful, null pointer is returned,
+ * otherwise a pointer to a C-string containing the error message will be returned.
+ * The returned C-string must be freed with `cozo_free_str`.
+ */
+char *cozo_backup(int32_t db_id,
+                  const char *backup_dir,
+                  uint64_t rate_limit,
+                  uint32_t keep,
+                  uint32_t *backup_id);
+
+/**
+ * Restore the newest backup made by `cozo_backup` as a database, which must not be open.
+ *
+ * `backup_dir`: the UTF-8 encoded path name of the backup directory as a null-terminated
+ *               C-string.
+ * `path`:       the UTF-8 encoded path name of the database as a null-terminated C-string.
+ *
+ * When the function is successful, null pointer is returned,
+ * otherwise a pointer to a C-string containing the error message will be returned.
+ * The returned C-string must be freed with `cozo_free_str`.
+ */
+char *cozo_restore_backup(const char *backup_dir, const char *path);
+
 /**
  * Run query against a database.
  *
@@ -53,6 +101,121 @@ bool cozo_close_db(int32_t id);
  */
 char *cozo_run_query(int32_t db_id, const char *script_raw, const char *params_raw);
 
+/**
+ * Run query against a database, with params and result encoded as MessagePack.
+ *
+ * `db_id`: the ID representing the database to run the query.
+ * `script_raw`: a UTF-8 encoded C-string for the CozoScript to execute.
+ * `params_raw`: the params of the query as a MessagePack map. May be null if
+ *               `params_len` is zero.
+ * `params_len`: the length of `params_raw` in bytes.
+ * `out_len`:    will contain the length of the returned bytes.
+ *
+ * Returns bytes that **must** be freed with `cozo_free_bytes`.
+ * The bytes contain the return value of the query as a MessagePack map, with the same
+ * structure as the JSON returned by `cozo_run_query`.
+ */
+uint8_t *cozo_run_query_msgpack(int32_t db_id,
+                                const char *script_raw,
+                                const uint8_t *params_raw,
+                                uintptr_t params_len,
+                                uintptr_t *out_len);
+
+/**
+ * Free any bytes returned from the Cozo C API.
+ * Must be called exactly once for each returned byte array.
+ *
+ * `bytes`: the bytes to free.
+ * `len`:   their length, as returned together with them.
+ */
+void cozo_free_bytes(uint8_t *bytes, uintptr_t len);
+
+/**
+ * Prepare a query to be run many times with different params, which is faster than
+ * running it each time with `cozo_run_query`.
+ *
+ * `db_id`: the ID representing the database to run the query.
+ * `script_raw`: a UTF-8 encoded C-string for the CozoScript to prepare.
+ *               It must not contain system ops.
+ * `query_id`:   will contain the ID of the prepared query.
+ *
+ * When the function is successful, null pointer is returned,
+ * otherwise a pointer to a C-string containing the error message will be returned.
+ * The returned C-string must be freed with `cozo_free_str`.
+ */
+char *cozo_prepare(int32_t db_id, const char *script_raw, int32_t *query_id);
+
+/**
+ * Run a query prepared with `cozo_prepare`.
+ *
+ * `query_id`:   the ID of the prepared query.
+ * `params_raw`: a UTF-8 encoded C-string for the params of the query,
+ *               in JSON format. You must always pass in a valid JSON map,
+ *               even if you do not use params in your query
+ *               (pass "{}" in this case).
+ *
+ * Returns a UTF-8-encoded C-string that **must** be freed with `cozo_free_str`.
+ * The string contains the JSON return value of the query.
+ */
+char *cozo_run_prepared(int32_t query_id, const char *params_raw);
+
+/**
+ * Close a query returned by `cozo_prepare`.
+ *
+ * `query_id`: the ID of the prepared query to close.
+ *
+ * Returns `true` if the query is closed,
+ * `false` if it has already been closed, or does not exist.
+ */
+bool cozo_close_prepared(int32_t query_id);
+
+/**
+ * Start running a query against a database, with its result streamed in batches.
+ *
+ * `db_id`: the ID representing the database to run the query.
+ * `script_raw`: a UTF-8 encoded C-string for the CozoScript to execute.
+ * `params_raw`: a UTF-8 encoded C-string for the params of the query,
+ *               in JSON format, as for `cozo_run_query`.
+ * `batch_size`: the number of rows in each batch.
+ * `cursor_id`:  will contain the id of the cursor for reading the result.
+ *
+ * When the function is successful, null pointer is returned,
+ * otherwise a pointer to a C-string containing the error message will be returned.
+ * The returned C-string must be freed with `cozo_free_str`.
+ * Errors of the query itself are returned by `cozo_query_next_batch` instead.
+ */
+char *cozo_query_open(int32_t db_id,
+                      const char *script_raw,
+                      const char *params_raw,
+                      uint32_t batch_size,
+                      int32_t *cursor_id);
+
+/**
+ * Read the next batch of the result of a query started with `cozo_query_open`.
+ * Blocks until the batch is ready.
+ *
+ * `cursor_id`: the ID of the cursor returned by `cozo_query_open`.
+ *
+ * Returns a UTF-8-encoded C-string that **must** be freed with `cozo_free_str`.
+ * The string contains a JSON object with the `rows` of the batch, where the first
+ * batch with rows also contains the `headers`. The last batch has `"done": true`
+ * together with the other parts of the return value of the query, or is the error if
+ * the query failed. After the last batch, or if the cursor does not exist, a null
+ * pointer is returned.
+ */
+char *cozo_query_next_batch(int32_t cursor_id);
+
+/**
+ * Close a cursor returned by `cozo_query_open`. A query that is still running is
+ * stopped. Must be called for every cursor, even after its last batch has been read.
+ *
+ * `cursor_id`: the ID of the cursor to close.
+ *
+ * Returns `true` if the cursor is closed,
+ * `false` if it has already been closed, or does not exist.
+ */
+bool cozo_query_close(int32_t cursor_id);
+
 /**
  * Free any C-string returned from the Cozo C API.
  * Must be called exactly once for each returned C-string.
@@ -11,6 +11,22 @@ void run_query(int32_t db_id, const char *query) {
     cozo_free_str(res);
 }
 
+void stream_query(int32_t db_id, const char *query) {
+    int32_t cursor_id;
+    char *err = cozo_query_open(db_id, query, "{}", 2, &cursor_id);
+    if (err) {
+        printf("%s\n", err);
+        cozo_free_str(err);
+        return;
+    }
+    char *batch;
+    while ((batch = cozo_query_next_batch(cursor_id))) {
+        printf("%s\n", batch);
+        cozo_free_str(batch);
+    }
+    cozo_query_close(cursor_id);
+}
+
 int main() {
     int32_t db_id;
     char *err = cozo_open_db("_test_db", &db_id);
@@ -22,6 +38,7 @@ int main() {
     }
 
     run_query(db_id, "?[] <- [[1, 2, 3]]");
+    stream_query(db_id, "?[a, b] <- [[1, 2], [3, 4], [5, 6]]");
 
     cozo_close_db(db_id);
 
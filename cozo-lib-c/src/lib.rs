@@ -6,23 +6,34 @@
 use std::collections::BTreeMap;
 use std::ffi::{c_char, CStr, CString};
 use std::ptr::null_mut;
+use std::slice;
 use std::sync::atomic::{AtomicI32, Ordering};
-use std::sync::Mutex;
+use std::sync::{Arc, Mutex};
 
 use lazy_static::lazy_static;
 
-use cozo::Db;
+use cozo::{Db, PreparedQuery, QueryStream};
 
 #[derive(Default)]
 struct Handles {
     current: AtomicI32,
     dbs: Mutex<BTreeMap<i32, Db>>,
+    current_query: AtomicI32,
+    // each stream has its own lock, so that waiting for a batch blocks no other stream
+    queries: Mutex<BTreeMap<i32, Arc<Mutex<QueryStream>>>>,
+    current_prepared: AtomicI32,
+    prepared: Mutex<BTreeMap<i32, (Db, PreparedQuery)>>,
 }
 
 lazy_static! {
     static ref HANDLES: Handles = Handles::default();
 }
 
+// {"ok": false, "message": "script is not UTF-8 encoded"}
+const MSGPACK_BAD_SCRIPT: &[u8] = b"\x82\xa2ok\xc2\xa7message\xbbscript is not UTF-8 encoded";
+// {"ok": false, "message": "database closed"}
+const MSGPACK_DB_CLOSED: &[u8] = b"\x82\xa2ok\xc2\xa7message\xafdatabase closed";
+
 /// Open a database.
 ///
 /// `path`:  should contain the UTF-8 encoded path name as a null-terminated C-string.
@@ -65,6 +76,105 @@ pub unsafe extern "C" fn cozo_close_db(id: i32) -> bool {
     db.is_some()
 }
 
+/// Write a consistent copy of a database while it keeps running, by hard linking its
+/// files where possible. The copy can be opened with `cozo_open_db`.
+///
+/// `db_id`: the ID representing the database to copy.
+/// `path`:  the UTF-8 encoded path name of the copy as a null-terminated C-string.
+///          It must not exist yet.
+///
+/// When the function is successful, null pointer is returned,
+/// otherwise a pointer to a C-string containing the error message will be returned.
+/// The returned C-string must be freed with `cozo_free_str`.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_checkpoint(db_id: i32, path: *const c_char) -> *mut c_char {
+    let path = match CStr::from_ptr(path).to_str() {
+        Ok(p) => p,
+        Err(err) => return CString::new(format!("{}", err)).unwrap().into_raw(),
+    };
+    let db = {
+        let dbs = HANDLES.dbs.lock().unwrap();
+        match dbs.get(&db_id) {
+            None => return CString::new("database closed").unwrap().into_raw(),
+            Some(db) => db.clone(),
+        }
+    };
+    match db.checkpoint(path) {
+        Ok(()) => null_mut(),
+        Err(err) => CString::new(format!("{}", err)).unwrap().into_raw(),
+    }
+}
+
+/// Back up a database while it keeps running. Backups in the same directory share their
+/// files, so only the files written since the last backup there are copied.
+///
+/// `db_id`:      the ID representing the database to back up.
+/// `backup_dir`: the UTF-8 encoded path name of the backup directory as a null-terminated
+///               C-string.
+/// `rate_limit`: the bytes per second that may be copied, or zero for no limit.
+/// `keep`:       the number of the newest backups to keep, or zero to keep all.
+/// `backup_id`:  will contain the id of the new backup.
+///
+/// When the function is successful, null pointer is returned,
+/// otherwise a pointer to a C-string containing the error message will be returned.
+/// The returned C-string must be freed with `cozo_free_str`.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_backup(
+    db_id: i32,
+    backup_dir: *const c_char,
+    rate_limit: u64,
+    keep: u32,
+    backup_id: &mut u32,
+) -> *mut c_char {
+    let backup_dir = match CStr::from_ptr(backup_dir).to_str() {
+        Ok(p) => p,
+        Err(err) => return CString::new(format!("{}", err)).unwrap().into_raw(),
+    };
+    let db = {
+        let dbs = HANDLES.dbs.lock().unwrap();
+        match dbs.get(&db_id) {
+            None => return CString::new("database closed").unwrap().into_raw(),
+            Some(db) => db.clone(),
+        }
+    };
+    match db.backup(backup_dir, rate_limit, keep) {
+        Ok(id) => {
+            *backup_id = id;
+            null_mut()
+        }
+        Err(err) => CString::new(format!("{}", err)).unwrap().into_raw(),
+    }
+}
+
+/// Restore the newest backup made by `cozo_backup` as a database, which must not be open.
+///
+/// `backup_dir`: the UTF-8 encoded path name of the backup directory as a null-terminated
+///               C-string.
+/// `path`:       the UTF-8 encoded path name of the database as a null-terminated C-string.
+///
+/// When the function is successful, null pointer is returned,
+/// otherwise a pointer to a C-string containing the error message will be returned.
+/// The returned C-string must be freed with `cozo_free_str`.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_restore_backup(
+    backup_dir: *const c_char,
+    path: *const c_char,
+) -> *mut c_char {
+    let (backup_dir, path) = match (
+        CStr::from_ptr(backup_dir).to_str(),
+        CStr::from_ptr(path).to_str(),
+    ) {
+        (Ok(backup_dir), Ok(path)) => (backup_dir, path),
+        (Err(err), _) | (_, Err(err)) => {
+            return CString::new(format!("{}", err)).unwrap().into_raw()
+        }
+    };
+    match Db::restore_backup(backup_dir, path) {
+        Ok(()) => null_mut(),
+        Err(err) => CString::new(format!("{}", err)).unwrap().into_raw(),
+    }
+}
+
 /// Run query against a database.
 ///
 /// `db_id`: the ID representing the database to run the query.
@@ -121,6 +231,242 @@ pub unsafe extern "C" fn cozo_run_query(
     CString::new(result).unwrap().into_raw()
 }
 
+/// Run query against a database, with params and result encoded as MessagePack.
+///
+/// `db_id`: the ID representing the database to run the query.
+/// `script_raw`: a UTF-8 encoded C-string for the CozoScript to execute.
+/// `params_raw`: the params of the query as a MessagePack map. May be null if
+///               `params_len` is zero.
+/// `params_len`: the length of `params_raw` in bytes.
+/// `out_len`:    will contain the length of the returned bytes.
+///
+/// Returns bytes that **must** be freed with `cozo_free_bytes`.
+/// The bytes contain the return value of the query as a MessagePack map, with the same
+/// structure as the JSON returned by `cozo_run_query`.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_run_query_msgpack(
+    db_id: i32,
+    script_raw: *const c_char,
+    params_raw: *const u8,
+    params_len: usize,
+    out_len: &mut usize,
+) -> *mut u8 {
+    let db = {
+        let dbs = HANDLES.dbs.lock().unwrap();
+        dbs.get(&db_id).cloned()
+    };
+    let result = match (CStr::from_ptr(script_raw).to_str(), db) {
+        (Err(_), _) => MSGPACK_BAD_SCRIPT.to_vec(),
+        (_, None) => MSGPACK_DB_CLOSED.to_vec(),
+        (Ok(script), Some(db)) => {
+            let params = if params_len == 0 {
+                &[]
+            } else {
+                slice::from_raw_parts(params_raw, params_len)
+            };
+            db.run_script_msgpack(script, params)
+        }
+    };
+    let result = result.into_boxed_slice();
+    *out_len = result.len();
+    Box::into_raw(result) as *mut u8
+}
+
+/// Free any bytes returned from the Cozo C API.
+/// Must be called exactly once for each returned byte array.
+///
+/// `bytes`: the bytes to free.
+/// `len`:   their length, as returned together with them.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_free_bytes(bytes: *mut u8, len: usize) {
+    let _ = Box::from_raw(slice::from_raw_parts_mut(bytes, len));
+}
+
+/// Prepare a query to be run many times with different params, which is faster than
+/// running it each time with `cozo_run_query`.
+///
+/// `db_id`: the ID representing the database to run the query.
+/// `script_raw`: a UTF-8 encoded C-string for the CozoScript to prepare.
+///               It must not contain system ops.
+/// `query_id`:   will contain the ID of the prepared query.
+///
+/// When the function is successful, null pointer is returned,
+/// otherwise a pointer to a C-string containing the error message will be returned.
+/// The returned C-string must be freed with `cozo_free_str`.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_prepare(
+    db_id: i32,
+    script_raw: *const c_char,
+    query_id: &mut i32,
+) -> *mut c_char {
+    let script = match CStr::from_ptr(script_raw).to_str() {
+        Ok(p) => p,
+        Err(_) => {
+            return CString::new("script is not UTF-8 encoded")
+                .unwrap()
+                .into_raw()
+        }
+    };
+    let db = {
+        let dbs = HANDLES.dbs.lock().unwrap();
+        match dbs.get(&db_id) {
+            None => return CString::new("database closed").unwrap().into_raw(),
+            Some(db) => db.clone(),
+        }
+    };
+    match db.prepare(script) {
+        Ok(query) => {
+            let id = HANDLES.current_prepared.fetch_add(1, Ordering::AcqRel);
+            HANDLES.prepared.lock().unwrap().insert(id, (db, query));
+            *query_id = id;
+            null_mut()
+        }
+        Err(err) => CString::new(format!("{}", err)).unwrap().into_raw(),
+    }
+}
+
+/// Run a query prepared with `cozo_prepare`.
+///
+/// `query_id`:   the ID of the prepared query.
+/// `params_raw`: a UTF-8 encoded C-string for the params of the query,
+///               in JSON format. You must always pass in a valid JSON map,
+///               even if you do not use params in your query
+///               (pass "{}" in this case).
+///
+/// Returns a UTF-8-encoded C-string that **must** be freed with `cozo_free_str`.
+/// The string contains the JSON return value of the query.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_run_prepared(
+    query_id: i32,
+    params_raw: *const c_char,
+) -> *mut c_char {
+    let (db, query) = match HANDLES.prepared.lock().unwrap().get(&query_id) {
+        None => {
+            return CString::new(r##"{"ok":false,"message":"prepared query closed"}"##)
+                .unwrap()
+                .into_raw();
+        }
+        Some(prepared) => prepared.clone(),
+    };
+    let params_str = match CStr::from_ptr(params_raw).to_str() {
+        Ok(p) => p,
+        Err(_) => {
+            return CString::new(
+                r##"{"ok":false,"message":"params argument is not UTF-8 encoded"}"##,
+            )
+            .unwrap()
+            .into_raw();
+        }
+    };
+
+    let result = db.run_prepared_str(&query, params_str);
+    CString::new(result).unwrap().into_raw()
+}
+
+/// Close a query returned by `cozo_prepare`.
+///
+/// `query_id`: the ID of the prepared query to close.
+///
+/// Returns `true` if the query is closed,
+/// `false` if it has already been closed, or does not exist.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_close_prepared(query_id: i32) -> bool {
+    let prepared = HANDLES.prepared.lock().unwrap().remove(&query_id);
+    prepared.is_some()
+}
+
+/// Start running a query against a database, with its result streamed in batches.
+///
+/// `db_id`: the ID representing the database to run the query.
+/// `script_raw`: a UTF-8 encoded C-string for the CozoScript to execute.
+/// `params_raw`: a UTF-8 encoded C-string for the params of the query,
+///               in JSON format, as for `cozo_run_query`.
+/// `batch_size`: the number of rows in each batch.
+/// `cursor_id`:  will contain the id of the cursor for reading the result.
+///
+/// When the function is successful, null pointer is returned,
+/// otherwise a pointer to a C-string containing the error message will be returned.
+/// The returned C-string must be freed with `cozo_free_str`.
+/// Errors of the query itself are returned by `cozo_query_next_batch` instead.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_query_open(
+    db_id: i32,
+    script_raw: *const c_char,
+    params_raw: *const c_char,
+    batch_size: u32,
+    cursor_id: &mut i32,
+) -> *mut c_char {
+    let script = match CStr::from_ptr(script_raw).to_str() {
+        Ok(p) => p,
+        Err(_) => {
+            return CString::new("script is not UTF-8 encoded")
+                .unwrap()
+                .into_raw()
+        }
+    };
+    let params_str = match CStr::from_ptr(params_raw).to_str() {
+        Ok(p) => p,
+        Err(_) => {
+            return CString::new("params argument is not UTF-8 encoded")
+                .unwrap()
+                .into_raw()
+        }
+    };
+    let db = {
+        let dbs = HANDLES.dbs.lock().unwrap();
+        match dbs.get(&db_id) {
+            None => return CString::new("database closed").unwrap().into_raw(),
+            Some(db) => db.clone(),
+        }
+    };
+    let stream = db.run_script_streaming_str(script, params_str, batch_size as usize);
+    let id = HANDLES.current_query.fetch_add(1, Ordering::AcqRel);
+    HANDLES
+        .queries
+        .lock()
+        .unwrap()
+        .insert(id, Arc::new(Mutex::new(stream)));
+    *cursor_id = id;
+    null_mut()
+}
+
+/// Read the next batch of the result of a query started with `cozo_query_open`.
+/// Blocks until the batch is ready.
+///
+/// `cursor_id`: the ID of the cursor returned by `cozo_query_open`.
+///
+/// Returns a UTF-8-encoded C-string that **must** be freed with `cozo_free_str`.
+/// The string contains a JSON object with the `rows` of the batch, where the first
+/// batch with rows also contains the `headers`. The last batch has `"done": true`
+/// together with the other parts of the return value of the query, or is the error if
+/// the query failed. After the last batch, or if the cursor does not exist, a null
+/// pointer is returned.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_query_next_batch(cursor_id: i32) -> *mut c_char {
+    let stream = match HANDLES.queries.lock().unwrap().get(&cursor_id) {
+        None => return null_mut(),
+        Some(stream) => stream.clone(),
+    };
+    let batch = stream.lock().unwrap().next_batch();
+    match batch {
+        None => null_mut(),
+        Some(batch) => CString::new(batch.to_string()).unwrap().into_raw(),
+    }
+}
+
+/// Close a cursor returned by `cozo_query_open`. A query that is still running is
+/// stopped. Must be called for every cursor, even after its last batch has been read.
+///
+/// `cursor_id`: the ID of the cursor to close.
+///
+/// Returns `true` if the cursor is closed,
+/// `false` if it has already been closed, or does not exist.
+#[no_mangle]
+pub unsafe extern "C" fn cozo_query_close(cursor_id: i32) -> bool {
+    let stream = HANDLES.queries.lock().unwrap().remove(&cursor_id);
+    stream.is_some()
+}
+
 /// Free any C-string returned from the Cozo C API.
 /// Must be called exactly once for each returned C-string.
 ///
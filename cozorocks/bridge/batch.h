@@ -0,0 +1,71 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_BATCH_H
+#define COZOROCKS_BATCH_H
+
+#include "common.h"
+#include "slice.h"
+#include "status.h"
+#include "cf.h"
+
+// Writes collected outside of any transaction and applied atomically, without taking
+// row locks or checking for conflicts. Only for keys no transaction can be writing to.
+struct WriteBatchBridge {
+    // exactly one of these is set
+    TransactionDB *tdb;
+    OptimisticTransactionDB *odb;
+    shared_ptr<ColumnFamilies> column_families;
+    WriteBatch batch;
+
+    explicit WriteBatchBridge(TransactionDB *tdb_, OptimisticTransactionDB *odb_,
+                              shared_ptr<ColumnFamilies> column_families_) :
+            tdb(tdb_), odb(odb_), column_families(std::move(column_families_)), batch() {}
+
+    inline void put(uint32_t cf, RustBytes key, RustBytes val, RocksDbStatus &status) {
+        auto handle = column_families->get_checked(cf, status);
+        if (handle != nullptr) {
+            write_status(batch.Put(handle, convert_slice(key), convert_slice(val)), status);
+        }
+    }
+
+    inline void del(uint32_t cf, RustBytes key, RocksDbStatus &status) {
+        auto handle = column_families->get_checked(cf, status);
+        if (handle != nullptr) {
+            write_status(batch.Delete(handle, convert_slice(key)), status);
+        }
+    }
+
+    inline void del_range(uint32_t cf, RustBytes start, RustBytes end, RocksDbStatus &status) {
+        auto handle = column_families->get_checked(cf, status);
+        if (handle != nullptr) {
+            write_status(batch.DeleteRange(handle, convert_slice(start), convert_slice(end)), status);
+        }
+    }
+
+    [[nodiscard]] inline size_t count() const {
+        return batch.Count();
+    }
+
+    [[nodiscard]] inline size_t data_size() const {
+        return batch.GetDataSize();
+    }
+
+    inline void commit(RocksDbStatus &status) {
+        WriteOptions w_opts;
+        if (tdb != nullptr) {
+            TransactionDBWriteOptimizations optimizations;
+            optimizations.skip_concurrency_control = true;
+            write_status(tdb->Write(w_opts, optimizations, &batch), status);
+        } else if (odb != nullptr) {
+            // optimistic transactions overlapping these keys fail at commit instead
+            write_status(odb->Write(w_opts, &batch), status);
+        } else {
+            write_status(Status::NotSupported("write to secondary instance"), status);
+        }
+        batch.Clear();
+    }
+};
+
+#endif //COZOROCKS_BATCH_H
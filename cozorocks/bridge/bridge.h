@@ -11,5 +11,12 @@
 #include "status.h"
 #include "opts.h"
 #include "iter.h"
+#include "cf.h"
+#include "batch.h"
+#include "perf.h"
+#include "compact.h"
+#include "prefix.h"
+#include "merge.h"
+#include "ttl.h"
 
 #endif //COZOROCKS_BRIDGE_H
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_CF_H
+#define COZOROCKS_CF_H
+
+#include <map>
+#include <shared_mutex>
+
+#include "common.h"
+#include "status.h"
+
+// Handles of all column families of a database, keyed by their (persistent) ids.
+// Handles of dropped column families are kept until the database is closed,
+// so that transactions still holding them never see a dangling pointer.
+struct ColumnFamilies {
+    DB *db;
+    ColumnFamilyOptions base_options;
+    bool use_ribbon_filter;
+    mutable shared_mutex mutex;
+    map<uint32_t, ColumnFamilyHandle *> handles;
+
+    ColumnFamilies() : db(nullptr), base_options(), use_ribbon_filter(false), mutex(), handles() {}
+
+    [[nodiscard]] inline ColumnFamilyHandle *get(uint32_t id) const {
+        shared_lock<shared_mutex> lock(mutex);
+        auto it = handles.find(id);
+        if (it == handles.end()) {
+            return nullptr;
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] inline ColumnFamilyHandle *get_checked(uint32_t id, RocksDbStatus &status) const {
+        auto handle = get(id);
+        if (handle == nullptr) {
+            write_status(Status::InvalidArgument("column family not found"), status);
+        }
+        return handle;
+    }
+
+    uint32_t create(rust::Str name, const CfOpts &opts, RocksDbStatus &status);
+
+    void drop(uint32_t id, RocksDbStatus &status);
+
+    void release();
+};
+
+#endif //COZOROCKS_CF_H
@@ -13,14 +13,32 @@
 #include "rocksdb/utilities/transaction_db.h"
 #include "rocksdb/utilities/optimistic_transaction_db.h"
 #include "rocksdb/table.h"
+#include "rocksdb/table_properties.h"
 #include "rocksdb/filter_policy.h"
 #include "rocksdb/slice_transform.h"
+#include "rocksdb/cache.h"
+#include "rocksdb/write_buffer_manager.h"
+#include "rocksdb/convenience.h"
+#include "rocksdb/utilities/options_util.h"
+#include "rocksdb/statistics.h"
+#include "rocksdb/perf_context.h"
+#include "rocksdb/iostats_context.h"
+#include "rocksdb/rate_limiter.h"
+#include "rocksdb/sst_file_reader.h"
+#include "rocksdb/utilities/object_registry.h"
 
 using namespace rocksdb;
 using namespace std;
 
 struct RocksDbStatus;
 struct DbOpts;
+struct CacheStats;
+struct DbStats;
+struct PerfCounters;
+struct CfOpts;
+struct CompactOpts;
+struct CompactionProgress;
+struct RangeEstimate;
 
 typedef Status::Code StatusCode;
 typedef Status::SubCode StatusSubCode;
@@ -0,0 +1,32 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_COMPACT_H
+#define COZOROCKS_COMPACT_H
+
+#include <atomic>
+
+#include "common.h"
+
+// Cancellation flag of a manual compaction, set from any thread. RocksDB checks it between
+// the files it compacts, so cancelling takes effect within the current file.
+struct CompactionBridge {
+    mutable atomic<bool> canceled;
+
+    CompactionBridge() : canceled(false) {}
+
+    inline void cancel() const {
+        canceled.store(true, memory_order_release);
+    }
+
+    [[nodiscard]] inline bool is_canceled() const {
+        return canceled.load(memory_order_acquire);
+    }
+};
+
+inline shared_ptr<CompactionBridge> new_compaction() {
+    return make_shared<CompactionBridge>();
+}
+
+#endif //COZOROCKS_COMPACT_H
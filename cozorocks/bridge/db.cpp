@@ -4,9 +4,46 @@
 
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include "db.h"
+#include "rocksdb/utilities/backup_engine.h"
+#include "rocksdb/utilities/checkpoint.h"
 #include "cozorocks/src/bridge/mod.rs.h"
 
+BlockBasedTableOptions default_table_options() {
+    BlockBasedTableOptions table_options;
+    table_options.block_size = 16 * 1024;
+    table_options.cache_index_and_filter_blocks = true;
+    table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+    table_options.format_version = 5;
+    return table_options;
+}
+
+// Everything touching the table options goes through here, so that settings compose
+// instead of replacing each other.
+BlockBasedTableOptions make_table_options(const DbOpts &opts, const shared_ptr<Cache> &block_cache) {
+    auto table_options = default_table_options();
+    if (opts.use_bloom_filter) {
+        if (opts.use_ribbon_filter) {
+            table_options.filter_policy.reset(NewRibbonFilterPolicy(opts.bloom_filter_bits_per_key));
+        } else {
+            table_options.filter_policy.reset(NewBloomFilterPolicy(opts.bloom_filter_bits_per_key, false));
+        }
+        table_options.whole_key_filtering = opts.bloom_filter_whole_key_filtering;
+    }
+    if (opts.partition_index_and_filters) {
+        table_options.index_type = BlockBasedTableOptions::kTwoLevelIndexSearch;
+        table_options.partition_filters = table_options.filter_policy != nullptr;
+        table_options.metadata_block_size = 4096;
+        table_options.cache_index_and_filter_blocks_with_high_priority = true;
+        table_options.pin_top_level_index_and_filter = true;
+    }
+    if (block_cache != nullptr) {
+        table_options.block_cache = block_cache;
+    }
+    return table_options;
+}
+
 Options default_db_options() {
     Options options = Options();
     options.bottommost_compression = kZSTD;
@@ -15,14 +52,7 @@ Options default_db_options() {
     options.max_background_jobs = 6;
     options.bytes_per_sync = 1048576;
     options.compaction_pri = kMinOverlappingRatio;
-    BlockBasedTableOptions table_options;
-    table_options.block_size = 16 * 1024;
-    table_options.cache_index_and_filter_blocks = true;
-    table_options.pin_l0_filter_and_index_blocks_in_cache = true;
-    table_options.format_version = 5;
-
-    auto table_factory = NewBlockBasedTableFactory(table_options);
-    options.table_factory.reset(table_factory);
+    options.table_factory.reset(NewBlockBasedTableFactory(default_table_options()));
 
     return options;
 }
@@ -33,20 +63,69 @@ ColumnFamilyOptions default_cf_options() {
     options.compression = kLZ4Compression;
     options.level_compaction_dynamic_level_bytes = true;
     options.compaction_pri = kMinOverlappingRatio;
-    BlockBasedTableOptions table_options;
-    table_options.block_size = 16 * 1024;
-    table_options.cache_index_and_filter_blocks = true;
-    table_options.pin_l0_filter_and_index_blocks_in_cache = true;
-    table_options.format_version = 5;
-
-    auto table_factory = NewBlockBasedTableFactory(table_options);
-    options.table_factory.reset(table_factory);
+    options.table_factory.reset(NewBlockBasedTableFactory(default_table_options()));
 
     return options;
 }
 
+// Caches and memtable budgets shared by all databases opened in this process that ask for
+// sharing. They are created by the first such database, with the sizes it asks for.
+static mutex shared_resources_mutex;
+static shared_ptr<Cache> shared_block_cache;
+static shared_ptr<WriteBufferManager> shared_write_buffer_manager;
+
+shared_ptr<Cache> make_block_cache(const DbOpts &opts) {
+    if (opts.block_cache_capacity == 0) {
+        return nullptr;
+    }
+    if (!opts.share_block_cache) {
+        return NewLRUCache(opts.block_cache_capacity, opts.block_cache_shard_bits);
+    }
+    lock_guard<mutex> guard(shared_resources_mutex);
+    if (shared_block_cache == nullptr) {
+        shared_block_cache = NewLRUCache(opts.block_cache_capacity, opts.block_cache_shard_bits);
+    }
+    return shared_block_cache;
+}
+
+shared_ptr<WriteBufferManager> make_write_buffer_manager(const DbOpts &opts, const shared_ptr<Cache> &cache) {
+    if (opts.memtable_budget == 0) {
+        return nullptr;
+    }
+    // charging memtables to the block cache makes `block_cache_capacity` an upper bound
+    // for both kinds of memory
+    if (!opts.share_memtable_budget) {
+        return make_shared<WriteBufferManager>(opts.memtable_budget, cache);
+    }
+    lock_guard<mutex> guard(shared_resources_mutex);
+    if (shared_write_buffer_manager == nullptr) {
+        shared_write_buffer_manager = make_shared<WriteBufferManager>(opts.memtable_budget, cache);
+    }
+    return shared_write_buffer_manager;
+}
+
+void register_tuple_prefix_transform() {
+    static once_flag registered;
+    call_once(registered, [] {
+        ObjectLibrary::Default()->AddFactory<const SliceTransform>(
+                ObjectLibrary::PatternEntry(TuplePrefixTransform::kClassName(), false).AddNumber("."),
+                [](const string &uri, unique_ptr<const SliceTransform> *guard, string * /*errmsg*/) {
+                    auto n_columns = stoul(uri.substr(uri.rfind('.') + 1));
+                    guard->reset(new TuplePrefixTransform(n_columns));
+                    return guard->get();
+                });
+    });
+}
+
 shared_ptr<RocksDbBridge> open_db(const DbOpts &opts, RocksDbStatus &status) {
+    register_tuple_prefix_transform();
     auto options = default_db_options();
+    auto block_cache = make_block_cache(opts);
+    auto write_buffer_manager = make_write_buffer_manager(opts, block_cache);
+    shared_ptr<Cache> row_cache = nullptr;
+    if (opts.row_cache_capacity > 0) {
+        row_cache = NewLRUCache(opts.row_cache_capacity, opts.block_cache_shard_bits);
+    }
 
     if (opts.prepare_for_bulk_load) {
         options.PrepareForBulkLoad();
@@ -58,6 +137,7 @@ shared_ptr<RocksDbBridge> open_db(const DbOpts &opts, RocksDbStatus &status) {
         options.OptimizeLevelStyleCompaction();
     }
     options.create_if_missing = opts.create_if_missing;
+    options.allow_ingest_behind = opts.allow_ingest_behind;
     options.paranoid_checks = opts.paranoid_checks;
     if (opts.enable_blob_files) {
         options.enable_blob_files = true;
@@ -68,47 +148,412 @@ shared_ptr<RocksDbBridge> open_db(const DbOpts &opts, RocksDbStatus &status) {
 
         options.enable_blob_garbage_collection = opts.enable_blob_garbage_collection;
     }
-    if (opts.use_bloom_filter) {
-        BlockBasedTableOptions table_options;
-        table_options.filter_policy.reset(NewBloomFilterPolicy(opts.bloom_filter_bits_per_key, false));
-        table_options.whole_key_filtering = opts.bloom_filter_whole_key_filtering;
-        options.table_factory.reset(NewBlockBasedTableFactory(table_options));
-    }
+    options.table_factory.reset(NewBlockBasedTableFactory(make_table_options(opts, block_cache)));
     if (opts.use_capped_prefix_extractor) {
         options.prefix_extractor.reset(NewCappedPrefixTransform(opts.capped_prefix_extractor_len));
     }
     if (opts.use_fixed_prefix_extractor) {
         options.prefix_extractor.reset(NewFixedPrefixTransform(opts.fixed_prefix_extractor_len));
     }
+    if (row_cache != nullptr) {
+        options.row_cache = row_cache;
+    }
+    if (write_buffer_manager != nullptr) {
+        options.write_buffer_manager = write_buffer_manager;
+    }
+    if (opts.enable_statistics) {
+        options.statistics = CreateDBStatistics();
+    }
+    // only flushes and compactions are limited, so that foreground reads keep their latency
+    if (opts.rate_limit_bytes_per_sec > 0) {
+        options.rate_limiter.reset(NewGenericRateLimiter(static_cast<int64_t>(opts.rate_limit_bytes_per_sec),
+                                                         100 * 1000, 10, RateLimiter::Mode::kWritesOnly,
+                                                         opts.rate_limit_auto_tune));
+    }
+    options.use_direct_reads = opts.use_direct_reads;
+    options.use_direct_io_for_flush_and_compaction = opts.use_direct_io_for_flush_and_compaction;
+    if (opts.compaction_readahead_size > 0) {
+        options.compaction_readahead_size = opts.compaction_readahead_size;
+    } else if (opts.use_direct_reads || opts.use_direct_io_for_flush_and_compaction) {
+        // without the page cache, compactions need to read ahead by themselves
+        options.compaction_readahead_size = 2 << 20;
+    }
+    if (opts.max_total_wal_size > 0) {
+        options.max_total_wal_size = opts.max_total_wal_size;
+    }
     options.create_missing_column_families = true;
+    options.merge_operator = make_shared<RustMergeOperator>();
+    auto ttl_rules = make_shared<TtlRules>();
+    options.compaction_filter_factory = make_shared<TtlCompactionFilterFactory>(ttl_rules);
 
     shared_ptr<RocksDbBridge> db = make_shared<RocksDbBridge>();
+    db->ttl_rules = ttl_rules;
+    db->column_families = make_shared<ColumnFamilies>();
+    db->column_families->base_options = ColumnFamilyOptions(options);
+    db->column_families->use_ribbon_filter = opts.use_ribbon_filter;
+
+    db->block_cache = block_cache;
+    db->row_cache = row_cache;
+    db->write_buffer_manager = write_buffer_manager;
 
     db->db_path = string(opts.db_path);
 
-    TransactionDB *txn_db = nullptr;
-    write_status(
-            TransactionDB::Open(options, TransactionDBOptions(), db->db_path,&txn_db),
-            status);
-    db->db.reset(txn_db);
+    // every column family ever created must be opened, with the options it was created with
+    vector<ColumnFamilyDescriptor> descriptors;
+    descriptors.emplace_back(kDefaultColumnFamilyName, db->column_families->base_options);
+    DBOptions loaded_db_options;
+    vector<ColumnFamilyDescriptor> loaded_descriptors;
+    auto *main_table_options = options.table_factory->GetOptions<BlockBasedTableOptions>();
+    if (LoadLatestOptions(ConfigOptions(), db->db_path, &loaded_db_options, &loaded_descriptors).ok()) {
+        for (auto &desc: loaded_descriptors) {
+            if (desc.name == kDefaultColumnFamilyName) {
+                continue;
+            }
+            // the options file does not record objects such as caches, and only records our own
+            // prefix extractors, merge operator and compaction filters by name
+            desc.options.merge_operator = options.merge_operator;
+            desc.options.compaction_filter_factory = options.compaction_filter_factory;
+            auto *loaded_extractor = desc.options.prefix_extractor.get();
+            if (loaded_extractor == nullptr ||
+                string(loaded_extractor->Name()).rfind(TuplePrefixTransform::kClassName(), 0) != 0) {
+                desc.options.prefix_extractor = options.prefix_extractor;
+            }
+            auto *loaded_table_options = desc.options.table_factory->GetOptions<BlockBasedTableOptions>();
+            if (loaded_table_options != nullptr && main_table_options != nullptr) {
+                auto table_options = *loaded_table_options;
+                table_options.block_cache = main_table_options->block_cache;
+                desc.options.table_factory.reset(NewBlockBasedTableFactory(table_options));
+            }
+            descriptors.push_back(std::move(desc));
+        }
+    }
+
+    vector<ColumnFamilyHandle *> handles;
+    DB *txn_db = nullptr;
+    if (!opts.secondary_path.empty()) {
+        // secondary instances keep all files open, as the primary may delete them at any time
+        options.max_open_files = -1;
+        // secondary instances take no lock of their own, and two of them must not share
+        // their files, which include those of queries
+        auto *env = Env::Default();
+        string secondary_path(opts.secondary_path);
+        env->CreateDirIfMissing(secondary_path);
+        auto s = env->LockFile(secondary_path + "/LOCK", &db->secondary_lock);
+        if (!s.ok()) {
+            write_status(Status::Busy("the secondary path is in use: " + s.ToString()), status);
+            return db;
+        }
+        DB *s_db = nullptr;
+        write_status(
+                DB::OpenAsSecondary(options, db->db_path, string(opts.secondary_path), descriptors, &handles, &s_db),
+                status);
+        db->sdb.reset(s_db);
+        txn_db = s_db;
+        if (s_db != nullptr) {
+            db->catch_up = make_unique<SecondaryCatchUp>(s_db, opts.catch_up_interval_ms);
+            db->catch_up->start();
+        }
+        // files of this instance, such as those spilled by queries, go next to its own
+        db->db_path = string(opts.secondary_path);
+    } else if (opts.optimistic) {
+        OptimisticTransactionDB *o_db = nullptr;
+        write_status(
+                OptimisticTransactionDB::Open(options, db->db_path, descriptors, &handles, &o_db),
+                status);
+        db->odb.reset(o_db);
+        txn_db = o_db;
+    } else {
+        TransactionDB *p_db = nullptr;
+        write_status(
+                TransactionDB::Open(options, TransactionDBOptions(), db->db_path, descriptors, &handles, &p_db),
+                status);
+        db->tdb.reset(p_db);
+        txn_db = p_db;
+    }
     db->destroy_on_exit = opts.destroy_on_exit;
+    if (txn_db != nullptr) {
+        db->column_families->db = txn_db;
+        for (auto *handle: handles) {
+            if (handle->GetID() == 0) {
+                // the default column family is reached through `DefaultColumnFamily()` instead
+                txn_db->DestroyColumnFamilyHandle(handle);
+            } else {
+                db->column_families->handles[handle->GetID()] = handle;
+            }
+        }
+        db->column_families->handles[0] = txn_db->DefaultColumnFamily();
+    }
 
 
     return db;
 }
 
+void RocksDbBridge::create_checkpoint(rust::Str path, RocksDbStatus &status) const {
+    Checkpoint *checkpoint_ptr = nullptr;
+    auto s = Checkpoint::Create(get_base_db(), &checkpoint_ptr);
+    unique_ptr<Checkpoint> checkpoint(checkpoint_ptr);
+    if (!s.ok()) {
+        write_status(s, status);
+        return;
+    }
+    write_status(checkpoint->CreateCheckpoint(string(path)), status);
+}
+
+void RocksDbBridge::create_backup(rust::Str backup_dir, uint64_t rate_limit, uint32_t keep, uint32_t &backup_id,
+                                  RocksDbStatus &status) const {
+    BackupEngineOptions backup_options{string(backup_dir)};
+    backup_options.backup_rate_limit = rate_limit;
+    // files with the same name, size and checksum as one already backed up are shared
+    backup_options.share_files_with_checksum = true;
+    BackupEngine *engine_ptr = nullptr;
+    auto s = BackupEngine::Open(Env::Default(), backup_options, &engine_ptr);
+    unique_ptr<BackupEngine> engine(engine_ptr);
+    if (!s.ok()) {
+        write_status(s, status);
+        return;
+    }
+    CreateBackupOptions create_options;
+    // the live WAL files are backed up instead, so that memtables are not flushed for it
+    create_options.flush_before_backup = false;
+    BackupID id = 0;
+    s = engine->CreateNewBackup(create_options, get_base_db(), &id);
+    if (s.ok() && keep > 0) {
+        s = engine->PurgeOldBackups(keep);
+    }
+    backup_id = id;
+    write_status(s, status);
+}
+
+void restore_backup(rust::Str backup_dir, rust::Str db_path, RocksDbStatus &status) {
+    BackupEngineReadOnly *engine_ptr = nullptr;
+    auto s = BackupEngineReadOnly::Open(Env::Default(), BackupEngineOptions{string(backup_dir)}, &engine_ptr);
+    unique_ptr<BackupEngineReadOnly> engine(engine_ptr);
+    if (!s.ok()) {
+        write_status(s, status);
+        return;
+    }
+    string path(db_path);
+    // taken the same way by the database when it opens, so that it is not replaced under
+    // an open database, in this process or another
+    auto *env = Env::Default();
+    FileLock *lock = nullptr;
+    s = env->LockFile(path + "/LOCK", &lock);
+    if (!s.ok()) {
+        write_status(Status::Busy("the database to restore into is open: " + s.ToString()), status);
+        return;
+    }
+    s = engine->RestoreDBFromLatestBackup(path, path);
+    env->UnlockFile(lock);
+    write_status(s, status);
+}
+
+void RocksDbBridge::get_cache_stats(CacheStats &stats) const {
+    auto cache = block_cache;
+    if (cache == nullptr) {
+        auto db_options = get_db()->GetOptions();
+        auto *table_options = db_options.table_factory->GetOptions<BlockBasedTableOptions>();
+        if (table_options != nullptr) {
+            cache = table_options->block_cache;
+        }
+    }
+    if (cache != nullptr) {
+        stats.block_cache_capacity = cache->GetCapacity();
+        stats.block_cache_usage = cache->GetUsage();
+        stats.block_cache_pinned_usage = cache->GetPinnedUsage();
+    }
+    if (row_cache != nullptr) {
+        stats.row_cache_capacity = row_cache->GetCapacity();
+        stats.row_cache_usage = row_cache->GetUsage();
+    }
+    if (write_buffer_manager != nullptr) {
+        stats.memtable_budget = write_buffer_manager->buffer_size();
+        stats.memtable_usage = write_buffer_manager->memory_usage();
+    }
+}
+
+void RocksDbBridge::get_stats(DbStats &stats) const {
+    auto statistics = get_db()->GetDBOptions().statistics;
+    if (statistics == nullptr) {
+        return;
+    }
+    stats.enabled = true;
+    for (const auto &[ticker, name]: TickersNameMap) {
+        stats.tickers.push_back(TickerStat{rust::String(name), statistics->getTickerCount(ticker)});
+    }
+    for (const auto &[histogram, name]: HistogramsNameMap) {
+        HistogramData data;
+        statistics->histogramData(histogram, &data);
+        stats.histograms.push_back(HistogramStat{rust::String(name), data.count, data.sum, data.median,
+                                                 data.percentile95, data.percentile99, data.max});
+    }
+}
+
+void RocksDbBridge::compact_range_cf(uint32_t cf, RustBytes start, RustBytes end, const CompactOpts &opts,
+                                     const CompactionBridge &job, RocksDbStatus &status) const {
+    auto handle = column_families->get_checked(cf, status);
+    if (handle == nullptr) {
+        return;
+    }
+    CompactRangeOptions options;
+    // let automatic compactions, and with them the flushes foreground writes wait for,
+    // run alongside this one
+    options.exclusive_manual_compaction = opts.exclusive;
+    options.bottommost_level_compaction = opts.force_bottommost ? BottommostLevelCompaction::kForceOptimized
+                                                                : BottommostLevelCompaction::kIfHaveCompactionFilter;
+    options.allow_write_stall = opts.allow_write_stall;
+    options.max_subcompactions = opts.max_subcompactions;
+    options.canceled = &job.canceled;
+    auto start_s = convert_slice(start);
+    auto end_s = convert_slice(end);
+    auto s = get_db()->CompactRange(options, handle,
+                                    start.empty() ? nullptr : &start_s,
+                                    end.empty() ? nullptr : &end_s);
+    write_status(s, status);
+}
+
+void RocksDbBridge::get_compaction_progress(CompactionProgress &progress) const {
+    auto db_ = get_db();
+    uint64_t val = 0;
+    if (db_->GetIntProperty(DB::Properties::kNumRunningCompactions, &val)) {
+        progress.running_compactions = val;
+    }
+    if (db_->GetIntProperty(DB::Properties::kEstimatePendingCompactionBytes, &val)) {
+        progress.pending_compaction_bytes = val;
+    }
+    if (db_->GetIntProperty(DB::Properties::kCompactionPending, &val)) {
+        progress.compaction_pending = val != 0;
+    }
+    if (db_->GetIntProperty(DB::Properties::kActualDelayedWriteRate, &val)) {
+        progress.delayed_write_rate = val;
+    }
+    if (db_->GetIntProperty(DB::Properties::kIsWriteStopped, &val)) {
+        progress.write_stopped = val != 0;
+    }
+}
+
+void perf_collect(PerfCounters &counters) {
+    auto *perf = get_perf_context();
+    counters.user_key_comparison_count = perf->user_key_comparison_count;
+    counters.block_cache_hit_count = perf->block_cache_hit_count;
+    counters.block_read_count = perf->block_read_count;
+    counters.block_read_byte = perf->block_read_byte;
+    counters.block_read_nanos = perf->block_read_time;
+    counters.get_read_bytes = perf->get_read_bytes;
+    counters.multiget_read_bytes = perf->multiget_read_bytes;
+    counters.iter_read_bytes = perf->iter_read_bytes;
+    counters.internal_key_skipped_count = perf->internal_key_skipped_count;
+    counters.internal_delete_skipped_count = perf->internal_delete_skipped_count;
+    counters.get_from_memtable_count = perf->get_from_memtable_count;
+    counters.seek_on_memtable_count = perf->seek_on_memtable_count;
+    counters.next_on_memtable_count = perf->next_on_memtable_count;
+    counters.bloom_memtable_hit_count = perf->bloom_memtable_hit_count;
+    counters.bloom_memtable_miss_count = perf->bloom_memtable_miss_count;
+    counters.bloom_sst_hit_count = perf->bloom_sst_hit_count;
+    counters.bloom_sst_miss_count = perf->bloom_sst_miss_count;
+    counters.get_from_output_files_nanos = perf->get_from_output_files_time;
+    counters.seek_internal_seek_nanos = perf->seek_internal_seek_time;
+    auto *io = get_iostats_context();
+    counters.io_bytes_read = io->bytes_read;
+    counters.io_bytes_written = io->bytes_written;
+    counters.io_read_nanos = io->read_nanos;
+    counters.io_cpu_read_nanos = io->cpu_read_nanos;
+}
+
+uint32_t ColumnFamilies::create(rust::Str name, const CfOpts &opts, RocksDbStatus &status) {
+    ColumnFamilyOptions cf_options = base_options;
+    if (opts.compression >= 0) {
+        cf_options.compression = static_cast<CompressionType>(opts.compression);
+        cf_options.bottommost_compression = static_cast<CompressionType>(opts.compression);
+    }
+    if (opts.compaction_style >= 0) {
+        cf_options.compaction_style = static_cast<CompactionStyle>(opts.compaction_style);
+    }
+    if (opts.block_size > 0 || opts.bloom_bits_per_key >= 0) {
+        auto *base_table_options = base_options.table_factory->GetOptions<BlockBasedTableOptions>();
+        auto table_options = base_table_options == nullptr ? default_table_options() : *base_table_options;
+        if (opts.block_size > 0) {
+            table_options.block_size = opts.block_size;
+        }
+        if (opts.bloom_bits_per_key == 0) {
+            table_options.filter_policy.reset();
+            table_options.partition_filters = false;
+        } else if (opts.bloom_bits_per_key > 0) {
+            if (use_ribbon_filter) {
+                table_options.filter_policy.reset(NewRibbonFilterPolicy(opts.bloom_bits_per_key));
+            } else {
+                table_options.filter_policy.reset(NewBloomFilterPolicy(opts.bloom_bits_per_key, false));
+            }
+        }
+        cf_options.table_factory.reset(NewBlockBasedTableFactory(table_options));
+    }
+    if (opts.prefix_columns > 0) {
+        cf_options.prefix_extractor = make_shared<TuplePrefixTransform>(opts.prefix_columns);
+    }
+
+    unique_lock<shared_mutex> lock(mutex);
+    ColumnFamilyHandle *handle = nullptr;
+    auto s = db->CreateColumnFamily(cf_options, string(name), &handle);
+    write_status(s, status);
+    if (!s.ok()) {
+        return 0;
+    }
+    auto id = handle->GetID();
+    handles[id] = handle;
+    return id;
+}
+
+void ColumnFamilies::drop(uint32_t id, RocksDbStatus &status) {
+    if (id == 0) {
+        write_status(Status::InvalidArgument("cannot drop the default column family"), status);
+        return;
+    }
+    auto handle = get_checked(id, status);
+    if (handle == nullptr) {
+        return;
+    }
+    write_status(db->DropColumnFamily(handle), status);
+}
+
+void ColumnFamilies::release() {
+    unique_lock<shared_mutex> lock(mutex);
+    for (auto &[id, handle]: handles) {
+        if (id == 0) {
+            // owned by the database
+            continue;
+        }
+        auto s = db->DestroyColumnFamilyHandle(handle);
+        if (!s.ok()) {
+            cerr << s.ToString() << endl;
+        }
+    }
+    handles.clear();
+}
+
 RocksDbBridge::~RocksDbBridge() {
+    if (catch_up != nullptr) {
+        catch_up->stop();
+    }
+    auto *db = get_db();
+    if (column_families != nullptr && db != nullptr) {
+        column_families->release();
+    }
     if (destroy_on_exit && (db != nullptr)) {
         cerr << "destroying database on exit: " << db_path << endl;
         auto status = db->Close();
         if (!status.ok()) {
             cerr << status.ToString() << endl;
         }
-        db.reset();
+        tdb.reset();
+        odb.reset();
+        sdb.reset();
         Options options{};
         auto status2 = DestroyDB(db_path, options);
         if (!status2.ok()) {
             cerr << status2.ToString() << endl;
         }
     }
+    if (secondary_lock != nullptr) {
+        sdb.reset();
+        Env::Default()->UnlockFile(secondary_lock);
+    }
 }
@@ -10,20 +10,14 @@
 #include "iostream"
 #include "common.h"
 #include "tx.h"
+#include "batch.h"
+#include "compact.h"
+#include "prefix.h"
+#include "merge.h"
+#include "ttl.h"
+#include "secondary.h"
 #include "slice.h"
 
-struct SnapshotBridge {
-    const Snapshot *snapshot;
-    DB *db;
-
-    explicit SnapshotBridge(const Snapshot *snapshot_, DB *db_) : snapshot(snapshot_), db(db_) {}
-
-    ~SnapshotBridge() {
-        db->ReleaseSnapshot(snapshot);
-//        printf("released snapshot\n");
-    }
-};
-
 struct SstFileWriterBridge {
     SstFileWriter inner;
 
@@ -40,16 +34,82 @@ struct SstFileWriterBridge {
 
 };
 
+// Iterates over an SST file in key order. Shares ownership of the reader, which has to
+// outlive the iterator.
+struct SstIterBridge {
+    shared_ptr<SstFileReader> reader;
+    unique_ptr<Iterator> iter;
+
+    explicit SstIterBridge(shared_ptr<SstFileReader> reader_) : reader(std::move(reader_)), iter() {
+        ReadOptions r_opts;
+        // the files may have been written with a prefix extractor, but are read in total order
+        r_opts.total_order_seek = true;
+        iter.reset(reader->NewIterator(r_opts));
+    }
+
+    inline void to_start() {
+        iter->SeekToFirst();
+    }
+
+    inline void seek(RustBytes key) {
+        iter->Seek(convert_slice(key));
+    }
+
+    [[nodiscard]] inline bool is_valid() const {
+        return iter->Valid();
+    }
+
+    inline void next() {
+        iter->Next();
+    }
+
+    [[nodiscard]] inline RustBytes key() const {
+        return convert_slice_back(iter->key());
+    }
+
+    inline void status(RocksDbStatus &status) const {
+        write_status(iter->status(), status);
+    }
+};
+
+// Reads an SST file written by `SstFileWriterBridge` without ingesting it.
+struct SstFileReaderBridge {
+    shared_ptr<SstFileReader> inner;
+
+    explicit SstFileReaderBridge(const Options &opts) : inner(std::make_shared<SstFileReader>(opts)) {
+    }
+
+    [[nodiscard]] inline unique_ptr<SstIterBridge> iterator() const {
+        return make_unique<SstIterBridge>(inner);
+    }
+};
+
 struct RocksDbBridge {
-    unique_ptr<TransactionDB> db;
+    // exactly one of these is open
+    unique_ptr<TransactionDB> tdb;
+    unique_ptr<OptimisticTransactionDB> odb;
+    // a read-only secondary instance, following the primary writing to the same files
+    unique_ptr<DB> sdb;
+    unique_ptr<SecondaryCatchUp> catch_up;
+    // held by a secondary instance on its own path for as long as it is open
+    FileLock *secondary_lock = nullptr;
+    shared_ptr<Cache> block_cache;
+    shared_ptr<Cache> row_cache;
+    shared_ptr<WriteBufferManager> write_buffer_manager;
+    shared_ptr<ColumnFamilies> column_families;
+    shared_ptr<TtlRules> ttl_rules;
 
     bool destroy_on_exit;
     string db_path;
 
-    inline unique_ptr<SstFileWriterBridge> get_sst_writer(rust::Str path, RocksDbStatus &status) const {
+    inline unique_ptr<SstFileWriterBridge>
+    get_sst_writer(rust::Str path, uint32_t cf, RocksDbStatus &status) const {
         DB *db_ = get_base_db();
-        auto cf = db->DefaultColumnFamily();
-        Options options_ = db_->GetOptions(cf);
+        auto handle = column_families->get_checked(cf, status);
+        if (handle == nullptr) {
+            return nullptr;
+        }
+        Options options_ = db_->GetOptions(handle);
         auto sst_file_writer = std::make_unique<SstFileWriterBridge>(EnvOptions(), options_);
         string path_(path);
 
@@ -57,51 +117,186 @@ struct RocksDbBridge {
         return sst_file_writer;
     }
 
+    inline unique_ptr<SstFileReaderBridge> get_sst_reader(rust::Str path, RocksDbStatus &status) const {
+        DB *db_ = get_base_db();
+        auto sst_file_reader = std::make_unique<SstFileReaderBridge>(db_->GetOptions());
+        string path_(path);
+
+        write_status(sst_file_reader->inner->Open(path_), status);
+        return sst_file_reader;
+    }
+
     inline void ingest_sst(rust::Str path, RocksDbStatus &status) const {
         IngestExternalFileOptions ifo;
         DB *db_ = get_base_db();
         string path_(path);
-        auto cf = db->DefaultColumnFamily();
+        auto cf = db_->DefaultColumnFamily();
         write_status(db_->IngestExternalFile(cf, {std::move(path_)}, ifo), status);
     }
 
+    // Ingests files with disjoint key ranges in one go. `ingest_behind` is only honoured
+    // if the database was opened with `allow_ingest_behind`, and is only correct if none of
+    // the keys already exist.
+    inline void ingest_sst_files(uint32_t cf, rust::Slice<const rust::String> paths, bool move_files,
+                                 bool ingest_behind, RocksDbStatus &status) const {
+        auto handle = column_families->get_checked(cf, status);
+        if (handle == nullptr) {
+            return;
+        }
+        DB *db_ = get_base_db();
+        IngestExternalFileOptions ifo;
+        ifo.move_files = move_files;
+        ifo.ingest_behind = ingest_behind && db_->GetDBOptions().allow_ingest_behind;
+        vector<string> paths_;
+        paths_.reserve(paths.size());
+        for (const auto &path: paths) {
+            paths_.emplace_back(path);
+        }
+        write_status(db_->IngestExternalFile(handle, paths_, ifo), status);
+    }
+
     [[nodiscard]] inline const string &get_db_path() const {
         return db_path;
     }
 
 
+    // transactions of secondary instances are always read-only
     [[nodiscard]] inline unique_ptr<TxBridge> transact() const {
-        auto ret = make_unique<TxBridge>(&*this->db, db->DefaultColumnFamily());
-        return ret;
+        if (tdb != nullptr) {
+            return make_unique<TxBridge>(&*tdb, tdb->DefaultColumnFamily(), column_families);
+        } else if (odb != nullptr) {
+            return make_unique<TxBridge>(&*odb, odb->DefaultColumnFamily(), column_families);
+        } else {
+            return transact_read_only();
+        }
+    }
+
+    [[nodiscard]] inline unique_ptr<TxBridge> transact_read_only() const {
+        if (sdb != nullptr) {
+            return make_unique<TxBridge>(&*sdb, sdb->DefaultColumnFamily(), column_families, catch_up->read_lock());
+        }
+        auto base_db = get_base_db();
+        return make_unique<TxBridge>(base_db, base_db->DefaultColumnFamily(), column_families);
+    }
+
+    [[nodiscard]] inline bool is_secondary() const {
+        return sdb != nullptr;
+    }
+
+    [[nodiscard]] inline uint64_t catch_up_count() const {
+        return catch_up == nullptr ? 0 : catch_up->caught_up.load(memory_order_acquire);
+    }
+
+    // Catches up with the primary now, instead of waiting for the next time it is due.
+    inline void catch_up_with_primary(RocksDbStatus &status) const {
+        if (catch_up == nullptr) {
+            write_status(Status::NotSupported("not a secondary instance"), status);
+            return;
+        }
+        catch_up->catch_up(status);
+    }
+
+    [[nodiscard]] inline unique_ptr<WriteBatchBridge> write_batch() const {
+        return make_unique<WriteBatchBridge>(tdb.get(), odb.get(), column_families);
     }
 
     inline void del_range(RustBytes start, RustBytes end, RocksDbStatus &status) const {
+        if (sdb != nullptr) {
+            write_status(Status::NotSupported("write to secondary instance"), status);
+            return;
+        }
         WriteBatch batch;
-        auto cf = db->DefaultColumnFamily();
+        auto cf = get_db()->DefaultColumnFamily();
         auto s = batch.DeleteRange(cf, convert_slice(start), convert_slice(end));
         if (!s.ok()) {
             write_status(s, status);
             return;
         }
         WriteOptions w_opts;
+        if (tdb == nullptr) {
+            write_status(odb->Write(w_opts, &batch), status);
+            return;
+        }
         TransactionDBWriteOptimizations optimizations;
         optimizations.skip_concurrency_control = true;
         optimizations.skip_duplicate_key_check = true;
-        auto s2 = db->Write(w_opts, optimizations, &batch);
+        auto s2 = tdb->Write(w_opts, optimizations, &batch);
         write_status(s2, status);
     }
 
     void compact_range(RustBytes start, RustBytes end, RocksDbStatus &status) const {
         CompactRangeOptions options;
-        auto cf = db->DefaultColumnFamily();
+        auto cf = get_db()->DefaultColumnFamily();
         auto start_s = convert_slice(start);
         auto end_s = convert_slice(end);
-        auto s = db->CompactRange(options, cf, &start_s, &end_s);
+        auto s = get_db()->CompactRange(options, cf, &start_s, &end_s);
         write_status(s, status);
     }
 
-    DB *get_base_db() const {
-        return db->GetBaseDB();
+    // Blocks until done or cancelled through `job`. Empty bounds are open.
+    void compact_range_cf(uint32_t cf, RustBytes start, RustBytes end, const CompactOpts &opts,
+                          const CompactionBridge &job, RocksDbStatus &status) const;
+
+    void get_compaction_progress(CompactionProgress &progress) const;
+
+    inline void drop_column_family(uint32_t id, RocksDbStatus &status) const {
+        column_families->drop(id, status);
+    }
+
+    // including those dropped since the database was opened
+    [[nodiscard]] inline rust::Vec<uint32_t> column_family_ids() const {
+        shared_lock<shared_mutex> lock(column_families->mutex);
+        rust::Vec<uint32_t> ret;
+        for (auto &[id, handle]: column_families->handles) {
+            if (id != 0) {
+                ret.push_back(id);
+            }
+        }
+        return ret;
+    }
+
+    // Takes effect from the next compaction on.
+    inline void set_ttl(uint64_t relation, size_t column, uint64_t ttl_secs) const {
+        ttl_rules->set(relation, TtlRule{column, ttl_secs});
+    }
+
+    inline void remove_ttl(uint64_t relation) const {
+        ttl_rules->remove(relation);
+    }
+
+    // Hard links the files of a consistent snapshot of all column families into `path`,
+    // which must not exist yet. Files on another file system are copied instead.
+    void create_checkpoint(rust::Str path, RocksDbStatus &status) const;
+
+    // Adds a backup to `backup_dir`, copying only the SST files not already there, at no
+    // more than `rate_limit` bytes per second unless zero. Then only the newest `keep`
+    // backups are kept, unless zero.
+    void create_backup(rust::Str backup_dir, uint64_t rate_limit, uint32_t keep, uint32_t &backup_id,
+                       RocksDbStatus &status) const;
+
+    void get_cache_stats(CacheStats &stats) const;
+
+    // leaves `stats` empty if the database was opened without statistics
+    void get_stats(DbStats &stats) const;
+
+    [[nodiscard]] DB *get_db() const {
+        if (tdb != nullptr) {
+            return tdb.get();
+        }
+        if (odb != nullptr) {
+            return odb.get();
+        }
+        return sdb.get();
+    }
+
+    [[nodiscard]] DB *get_base_db() const {
+        if (tdb != nullptr) {
+            return tdb->GetBaseDB();
+        }
+        if (odb != nullptr) {
+            return odb->GetBaseDB();
+        }
+        return sdb.get();
     }
 
     ~RocksDbBridge();
@@ -110,4 +305,7 @@ struct RocksDbBridge {
 shared_ptr<RocksDbBridge>
 open_db(const DbOpts &opts, RocksDbStatus &status);
 
+// Restores the newest backup in `backup_dir` into `db_path`, where no database may be open.
+void restore_backup(rust::Str backup_dir, rust::Str db_path, RocksDbStatus &status);
+
 #endif //COZOROCKS_DB_H
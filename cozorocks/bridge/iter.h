@@ -12,18 +12,31 @@
 struct IterBridge {
     DB *db;
     Transaction *tx;
+    ColumnFamilyHandle *cf_handle;
     unique_ptr<Iterator> iter;
     string lower_storage;
     string upper_storage;
     Slice lower_bound;
     Slice upper_bound;
     unique_ptr<ReadOptions> r_opts;
+    string batch_arena;
+    vector<size_t> batch_offsets;
+
+    explicit IterBridge(Transaction *tx_, ColumnFamilyHandle *cf_handle_) : db(nullptr), tx(tx_),
+                                                                         cf_handle(cf_handle_),
+                                                                         iter(nullptr), lower_bound(),
+                                                                         upper_bound(),
+                                                                         r_opts(new ReadOptions) {
+        r_opts->ignore_range_deletions = true;
+        r_opts->auto_prefix_mode = true;
+    }
 
-    explicit IterBridge(Transaction *tx_) : db(nullptr), tx(tx_), iter(nullptr), lower_bound(),
-                                                                     upper_bound(),
-                                                                     r_opts(new ReadOptions) {
+    explicit IterBridge(DB *db_, ColumnFamilyHandle *cf_handle_, const Snapshot *snapshot) :
+            db(db_), tx(nullptr), cf_handle(cf_handle_), iter(nullptr), lower_bound(), upper_bound(),
+            r_opts(new ReadOptions) {
         r_opts->ignore_range_deletions = true;
         r_opts->auto_prefix_mode = true;
+        r_opts->snapshot = snapshot;
     }
 
     inline void set_snapshot(const Snapshot *snapshot) {
@@ -82,15 +95,19 @@ struct IterBridge {
     }
 
     inline void start() {
-        if (db == nullptr) {
-            iter.reset(tx->GetIterator(*r_opts));
+        if (cf_handle == nullptr) {
+            iter.reset(NewErrorIterator(Status::InvalidArgument("column family not found")));
+        } else if (db == nullptr) {
+            iter.reset(tx->GetIterator(*r_opts, cf_handle));
         } else {
-            iter.reset(db->NewIterator(*r_opts));
+            iter.reset(db->NewIterator(*r_opts, cf_handle));
         }
     }
 
     inline void reset() {
         iter.reset();
+        batch_arena.clear();
+        batch_offsets.clear();
         clear_bounds();
     }
 
@@ -133,6 +150,37 @@ struct IterBridge {
     [[nodiscard]] inline RustBytes val() const {
         return convert_slice_back(iter->value());
     }
+
+    // Copies up to `max_rows` rows starting at the current position into the batch arena
+    // and advances past them. At least one row is taken if the iterator is valid, even if
+    // it exceeds `max_bytes`. The arena stays valid until the next call or until `reset`.
+    inline size_t next_batch(size_t max_rows, size_t max_bytes) {
+        batch_arena.clear();
+        batch_offsets.clear();
+        size_t n_rows = 0;
+        while (n_rows < max_rows && iter->Valid()) {
+            auto k = iter->key();
+            auto v = iter->value();
+            if (n_rows > 0 && batch_arena.size() + k.size() + v.size() > max_bytes) {
+                break;
+            }
+            batch_arena.append(k.data(), k.size());
+            batch_offsets.push_back(batch_arena.size());
+            batch_arena.append(v.data(), v.size());
+            batch_offsets.push_back(batch_arena.size());
+            iter->Next();
+            ++n_rows;
+        }
+        return n_rows;
+    }
+
+    [[nodiscard]] inline RustBytes batch_data() const {
+        return {reinterpret_cast<const std::uint8_t *>(batch_arena.data()), batch_arena.size()};
+    }
+
+    [[nodiscard]] inline rust::Slice<const size_t> batch_ends() const {
+        return {batch_offsets.data(), batch_offsets.size()};
+    }
 };
 
 #endif //COZOROCKS_ITER_H
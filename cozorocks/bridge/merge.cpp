@@ -0,0 +1,32 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#include "merge.h"
+#include "slice.h"
+#include "cozorocks/src/bridge/mod.rs.h"
+
+bool RustMergeOperator::FullMergeV2(const MergeOperationInput &merge_in, MergeOperationOutput *merge_out) const {
+    // the operands are passed in one buffer, each preceded by its length as a big-endian u32
+    string operands;
+    for (const auto &operand: merge_in.operand_list) {
+        auto len = static_cast<uint32_t>(operand.size());
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            operands.push_back(static_cast<char>((len >> shift) & 0xFF));
+        }
+        operands.append(operand.data(), operand.size());
+    }
+    auto *existing = merge_in.existing_value;
+    RustBytes existing_bytes;
+    if (existing != nullptr) {
+        existing_bytes = convert_slice_back(*existing);
+    }
+    rust::Vec<uint8_t> merged;
+    if (!merge_with_rust(existing != nullptr, existing_bytes,
+                         RustBytes(reinterpret_cast<const uint8_t *>(operands.data()), operands.size()),
+                         merged)) {
+        return false;
+    }
+    merge_out->new_value.assign(reinterpret_cast<const char *>(merged.data()), merged.size());
+    return true;
+}
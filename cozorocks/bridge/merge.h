@@ -0,0 +1,23 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_MERGE_H
+#define COZOROCKS_MERGE_H
+
+#include "common.h"
+#include "rocksdb/merge_operator.h"
+
+// Combines the operands merged into a key by calling back into Rust, where the function
+// registered with `set_merge_fn` understands them. Operands are only combined together with
+// the value they apply to, so that no partial order of merges needs to be defined.
+class RustMergeOperator : public MergeOperator {
+public:
+    static const char *kClassName() { return "cozo.RustMergeOperator"; }
+
+    [[nodiscard]] const char *Name() const override { return kClassName(); }
+
+    bool FullMergeV2(const MergeOperationInput &merge_in, MergeOperationOutput *merge_out) const override;
+};
+
+#endif //COZOROCKS_MERGE_H
@@ -0,0 +1,24 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_PERF_H
+#define COZOROCKS_PERF_H
+
+#include "common.h"
+
+// The perf and IO stats contexts are thread local: they count what the calling thread
+// does between `perf_start` and `perf_stop`. Timers are much more expensive than counters.
+inline void perf_start(bool timed) {
+    SetPerfLevel(timed ? PerfLevel::kEnableTimeExceptForMutex : PerfLevel::kEnableCount);
+    get_perf_context()->Reset();
+    get_iostats_context()->Reset();
+}
+
+inline void perf_stop() {
+    SetPerfLevel(PerfLevel::kDisable);
+}
+
+void perf_collect(PerfCounters &counters);
+
+#endif //COZOROCKS_PERF_H
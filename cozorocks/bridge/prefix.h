@@ -0,0 +1,136 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_PREFIX_H
+#define COZOROCKS_PREFIX_H
+
+#include "common.h"
+
+// Keys are an 8 byte relation id followed by the memcmp encoded key columns, see
+// `src/data/memcmp.rs` of cozo. The tags below must be kept in sync with it.
+namespace tuple_tags {
+    const uint8_t INIT = 0x00;
+    const uint8_t NUM = 0x05;
+    const uint8_t STR = 0x06;
+    const uint8_t BYTES = 0x07;
+    const uint8_t UUID = 0x08;
+    const uint8_t REGEX = 0x09;
+    const uint8_t LIST = 0x0A;
+    const uint8_t SET = 0x0B;
+    const uint8_t APPROX_INT = 0x04;
+    const size_t GROUP_SIZE = 8;
+    const uint8_t GROUP_MARKER = 0xFF;
+}
+
+// Returns the end of the encoded value starting at `p`, or null if it is cut short.
+inline const uint8_t *skip_encoded_value(const uint8_t *p, const uint8_t *end) {
+    using namespace tuple_tags;
+    if (p >= end) {
+        return nullptr;
+    }
+    auto tag = *p++;
+    auto skip_groups = [end](const uint8_t *q) -> const uint8_t * {
+        while (true) {
+            if (end - q < static_cast<ptrdiff_t>(GROUP_SIZE + 1)) {
+                return nullptr;
+            }
+            auto marker = q[GROUP_SIZE];
+            q += GROUP_SIZE + 1;
+            if (marker != GROUP_MARKER) {
+                return q;
+            }
+        }
+    };
+    switch (tag) {
+        case NUM: {
+            if (end - p < 9) {
+                return nullptr;
+            }
+            auto kind = p[8];
+            p += 9;
+            if (kind == APPROX_INT) {
+                if (end - p < 8) {
+                    return nullptr;
+                }
+                p += 8;
+            }
+            return p;
+        }
+        case STR:
+        case BYTES:
+        case REGEX:
+            return skip_groups(p);
+        case UUID:
+            if (end - p < 8) {
+                return nullptr;
+            }
+            return skip_groups(p + 8);
+        case LIST:
+        case SET:
+            while (p < end && *p != INIT) {
+                p = skip_encoded_value(p, end);
+                if (p == nullptr) {
+                    return nullptr;
+                }
+            }
+            return p < end ? p + 1 : nullptr;
+        default:
+            // null, booleans and the bounds are a single tag
+            return p;
+    }
+}
+
+// Prefixes made of the relation id and the first `n_columns` key columns, so that prefix
+// bloom filters work for scans fixing these columns. Keys with fewer columns are out of
+// the domain.
+class TuplePrefixTransform : public SliceTransform {
+    size_t n_columns;
+    string id;
+
+    [[nodiscard]] inline size_t prefix_len(const Slice &key) const {
+        const size_t relation_id_len = 8;
+        if (key.size() < relation_id_len) {
+            return 0;
+        }
+        auto *start = reinterpret_cast<const uint8_t *>(key.data());
+        auto *end = start + key.size();
+        auto *p = start + relation_id_len;
+        for (size_t i = 0; i < n_columns; ++i) {
+            p = skip_encoded_value(p, end);
+            if (p == nullptr) {
+                return 0;
+            }
+        }
+        return p - start;
+    }
+
+public:
+    static const char *kClassName() { return "cozo.TuplePrefix"; }
+
+    explicit TuplePrefixTransform(size_t n_columns_) :
+            n_columns(n_columns_), id(string(kClassName()) + "." + to_string(n_columns_)) {}
+
+    // recorded in the options file and in every SST file, so they must identify `n_columns`
+    [[nodiscard]] const char *Name() const override { return id.c_str(); }
+
+    [[nodiscard]] string GetId() const override { return id; }
+
+    [[nodiscard]] Slice Transform(const Slice &key) const override {
+        return {key.data(), prefix_len(key)};
+    }
+
+    [[nodiscard]] bool InDomain(const Slice &key) const override {
+        return prefix_len(key) != 0;
+    }
+
+    // appending to complete columns leaves them unchanged
+    [[nodiscard]] bool SameResultWhenAppended(const Slice &prefix) const override {
+        return InDomain(prefix);
+    }
+};
+
+// Lets the options file loader recreate the transforms of existing column families.
+void register_tuple_prefix_transform();
+
+#endif //COZOROCKS_PREFIX_H
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_SECONDARY_H
+#define COZOROCKS_SECONDARY_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+#include "common.h"
+#include "status.h"
+
+// Keeps a secondary instance up to date with its primary, by catching up every `interval_ms`
+// in a background thread. Secondary instances have no snapshots, so transactions hold a
+// read lock instead, and catching up waits until they are done. Transactions starting in
+// the meantime wait behind it, so that a steady stream of reads cannot hold it off forever,
+// but only for up to `max_gate_hold` at a time: a thread may be starting a transaction
+// while holding another one. Catching up then lets them through and tries again, for up to
+// `interval_ms` in all.
+struct SecondaryCatchUp {
+    static constexpr chrono::milliseconds max_gate_hold{10};
+
+    DB *db;
+    uint64_t interval_ms;
+    mutable shared_timed_mutex readers;
+    mutable mutex gate;
+    mutex wait_mutex;
+    condition_variable wake;
+    bool stopping;
+    // successful catch ups so far, each of which may have brought changes to the schema
+    atomic<uint64_t> caught_up;
+    thread worker;
+
+    explicit SecondaryCatchUp(DB *db_, uint64_t interval_ms_) :
+            db(db_), interval_ms(interval_ms_), readers(), gate(), wait_mutex(), wake(), stopping(false), caught_up(0),
+            worker() {}
+
+    [[nodiscard]] inline shared_lock<shared_timed_mutex> read_lock() const {
+        lock_guard<mutex> gate_lock(gate);
+        return shared_lock<shared_timed_mutex>(readers);
+    }
+
+    inline Status try_catch_up() {
+        auto hold = min(chrono::milliseconds(interval_ms), max_gate_hold);
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(interval_ms);
+        while (true) {
+            {
+                lock_guard<mutex> gate_lock(gate);
+                unique_lock<shared_timed_mutex> lock(readers, hold);
+                if (lock.owns_lock()) {
+                    auto s = db->TryCatchUpWithPrimary();
+                    if (s.ok()) {
+                        caught_up.fetch_add(1, memory_order_acq_rel);
+                    }
+                    return s;
+                }
+            }
+            if (chrono::steady_clock::now() + hold >= deadline) {
+                return Status::Busy("transactions kept running while catching up with primary");
+            }
+            // lets the transactions waiting behind the gate start before trying again
+            this_thread::sleep_for(hold);
+        }
+    }
+
+    inline void catch_up(RocksDbStatus &status) {
+        write_status(try_catch_up(), status);
+    }
+
+    inline void start() {
+        worker = thread([this] {
+            unique_lock<mutex> lock(wait_mutex);
+            while (!wake.wait_for(lock, chrono::milliseconds(interval_ms), [this] { return stopping; })) {
+                lock.unlock();
+                auto s = try_catch_up();
+                if (!s.ok()) {
+                    cerr << "cannot catch up with primary: " << s.ToString() << endl;
+                }
+                lock.lock();
+            }
+        });
+    }
+
+    // must be called before the database is closed
+    inline void stop() {
+        {
+            lock_guard<mutex> lock(wait_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+};
+
+#endif //COZOROCKS_SECONDARY_H
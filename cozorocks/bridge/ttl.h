@@ -0,0 +1,130 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+#ifndef COZOROCKS_TTL_H
+#define COZOROCKS_TTL_H
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <shared_mutex>
+
+#include "common.h"
+#include "prefix.h"
+#include "rocksdb/compaction_filter.h"
+
+// How long the rows of a relation live: the key column at `column` holds the time of the
+// row, as seconds since the epoch.
+struct TtlRule {
+    size_t column;
+    uint64_t ttl_secs;
+};
+
+// The rules of all relations with a TTL, keyed by relation id. They are not persisted by
+// RocksDB, and are set again from the relation metadata every time the database is opened.
+struct TtlRules {
+    mutable shared_mutex mutex;
+    map<uint64_t, TtlRule> rules;
+
+    inline void set(uint64_t relation, TtlRule rule) {
+        unique_lock<shared_mutex> lock(mutex);
+        rules[relation] = rule;
+    }
+
+    inline void remove(uint64_t relation) {
+        unique_lock<shared_mutex> lock(mutex);
+        rules.erase(relation);
+    }
+
+    [[nodiscard]] inline map<uint64_t, TtlRule> snapshot() const {
+        shared_lock<shared_mutex> lock(mutex);
+        return rules;
+    }
+};
+
+// Drops the rows, and the merge operands, of relations with a TTL once they have expired.
+// The cutoffs are fixed when the compaction starts, so no lock is taken per key.
+class TtlCompactionFilter : public CompactionFilter {
+    struct Cutoff {
+        size_t column;
+        double before;
+    };
+    map<uint64_t, Cutoff> cutoffs;
+
+    [[nodiscard]] inline bool expired(const Slice &key) const {
+        const size_t relation_id_len = 8;
+        if (key.size() < relation_id_len) {
+            return false;
+        }
+        auto *p = reinterpret_cast<const uint8_t *>(key.data());
+        auto *end = p + key.size();
+        uint64_t relation = 0;
+        for (size_t i = 0; i < relation_id_len; ++i) {
+            relation = (relation << 8) | p[i];
+        }
+        auto it = cutoffs.find(relation);
+        if (it == cutoffs.end()) {
+            return false;
+        }
+        p += relation_id_len;
+        for (size_t i = 0; i < it->second.column; ++i) {
+            p = skip_encoded_value(p, end);
+            if (p == nullptr) {
+                return false;
+            }
+        }
+        // a number is its tag, followed by the order-preserving encoding of its float value
+        if (end - p < 9 || *p != tuple_tags::NUM) {
+            return false;
+        }
+        uint64_t u = 0;
+        for (size_t i = 1; i < 9; ++i) {
+            u = (u << 8) | p[i];
+        }
+        const uint64_t sign_mark = 0x8000000000000000ULL;
+        u = (u & sign_mark) ? (u & ~sign_mark) : ~u;
+        double ts;
+        memcpy(&ts, &u, sizeof(ts));
+        return ts < it->second.before;
+    }
+
+public:
+    explicit TtlCompactionFilter(const map<uint64_t, TtlRule> &rules) : cutoffs() {
+        auto now = chrono::duration<double>(chrono::system_clock::now().time_since_epoch()).count();
+        for (const auto &[relation, rule]: rules) {
+            cutoffs[relation] = Cutoff{rule.column, now - static_cast<double>(rule.ttl_secs)};
+        }
+    }
+
+    [[nodiscard]] const char *Name() const override { return "cozo.TtlCompactionFilter"; }
+
+    bool Filter(int /*level*/, const Slice &key, const Slice & /*existing_value*/, string * /*new_value*/,
+                bool * /*value_changed*/) const override {
+        return expired(key);
+    }
+
+    bool FilterMergeOperand(int /*level*/, const Slice &key, const Slice & /*operand*/) const override {
+        return expired(key);
+    }
+};
+
+// Installed on every column family, so that a TTL can be set on any relation at any time.
+class TtlCompactionFilterFactory : public CompactionFilterFactory {
+    shared_ptr<TtlRules> rules;
+
+public:
+    explicit TtlCompactionFilterFactory(shared_ptr<TtlRules> rules_) : rules(std::move(rules_)) {}
+
+    [[nodiscard]] const char *Name() const override { return "cozo.TtlCompactionFilterFactory"; }
+
+    unique_ptr<CompactionFilter> CreateCompactionFilter(const CompactionFilter::Context & /*context*/) override {
+        auto current = rules->snapshot();
+        if (current.empty()) {
+            return nullptr;
+        }
+        return make_unique<TtlCompactionFilter>(current);
+    }
+};
+
+#endif //COZOROCKS_TTL_H
@@ -13,5 +13,91 @@ void TxBridge::start() {
         Transaction *txn = tdb->BeginTransaction(*w_opts, *p_tx_opts);
         tx.reset(txn);
     }
-    assert(tx);
-}
\ No newline at end of file
+    assert(tx || ro_db);
+}
+
+unique_ptr<vector<PinnableSlice>>
+TxBridge::multi_get(uint32_t cf, RustBytes keys, rust::Slice<const size_t> key_ends, bool for_update,
+                    rust::Vec<RocksDbStatus> &statuses) const {
+    const auto n = key_ends.size();
+    RocksDbStatus cf_status;
+    auto handle = get_cf(cf, cf_status);
+    if (handle == nullptr) {
+        for (size_t i = 0; i < n; ++i) {
+            statuses.push_back(cf_status);
+        }
+        return make_unique<vector<PinnableSlice>>(n);
+    }
+    const auto *data = reinterpret_cast<const char *>(keys.data());
+    vector<Slice> keys_;
+    keys_.reserve(n);
+    size_t start = 0;
+    for (auto end: key_ends) {
+        keys_.emplace_back(data + start, end - start);
+        start = end;
+    }
+    auto ret = make_unique<vector<PinnableSlice>>(n);
+    vector<Status> statuses_(n);
+    if (tx == nullptr) {
+        ro_db->MultiGet(*r_opts, handle, n, keys_.data(), ret->data(), statuses_.data(), true);
+    } else if (for_update) {
+        for (size_t i = 0; i < n; ++i) {
+            statuses_[i] = tx->GetForUpdate(*r_opts, handle, keys_[i], &(*ret)[i]);
+        }
+    } else {
+        // keys are sorted by the caller
+        tx->MultiGet(*r_opts, handle, n, keys_.data(), ret->data(), statuses_.data(), true);
+    }
+    statuses.reserve(n);
+    for (const auto &s: statuses_) {
+        statuses.push_back(convert_status(s));
+    }
+    return ret;
+}
+
+void TxBridge::estimate_range(uint32_t cf, RustBytes lower, RustBytes upper, RangeEstimate &estimate,
+                              RocksDbStatus &status) const {
+    auto handle = get_cf(cf, status);
+    if (handle == nullptr) {
+        return;
+    }
+    DB *db_ = get_db();
+    Range range(convert_slice(lower), convert_slice(upper));
+    SizeApproximationOptions opts;
+    opts.include_memtables = false;
+    opts.include_files = true;
+    uint64_t file_bytes = 0;
+    auto s = db_->GetApproximateSizes(opts, handle, &range, 1, &file_bytes);
+    if (!s.ok()) {
+        write_status(s, status);
+        return;
+    }
+    // the files only know their own number of entries: the bytes of the range are turned
+    // into rows at the rate of the files overlapping it
+    uint64_t file_rows = 0;
+    if (file_bytes > 0) {
+        TablePropertiesCollection props;
+        s = db_->GetPropertiesOfTablesInRange(handle, &range, 1, &props);
+        if (!s.ok()) {
+            write_status(s, status);
+            return;
+        }
+        uint64_t entries = 0;
+        uint64_t size = 0;
+        for (const auto &file: props) {
+            const auto &p = file.second;
+            entries += p->num_entries - std::min(p->num_entries, p->num_deletions);
+            size += p->data_size + p->index_size + p->filter_size;
+        }
+        if (size > 0) {
+            file_rows = static_cast<uint64_t>(static_cast<double>(file_bytes) * entries / size);
+        }
+    }
+    uint64_t memtable_rows = 0;
+    uint64_t memtable_bytes = 0;
+    db_->GetApproximateMemTableStats(handle, range, &memtable_rows, &memtable_bytes);
+    estimate.file_bytes = file_bytes;
+    estimate.file_rows = file_rows;
+    estimate.memtable_bytes = memtable_bytes;
+    estimate.memtable_rows = memtable_rows;
+}
@@ -5,10 +5,25 @@
 #ifndef COZOROCKS_TX_H
 #define COZOROCKS_TX_H
 
+#include <iostream>
+
 #include "common.h"
 #include "slice.h"
 #include "status.h"
 #include "iter.h"
+#include "cf.h"
+
+struct SnapshotBridge {
+    const Snapshot *snapshot;
+    DB *db;
+
+    explicit SnapshotBridge(const Snapshot *snapshot_, DB *db_) : snapshot(snapshot_), db(db_) {}
+
+    ~SnapshotBridge() {
+        db->ReleaseSnapshot(snapshot);
+//        printf("released snapshot\n");
+    }
+};
 
 struct TxBridge {
     OptimisticTransactionDB *odb;
@@ -19,8 +34,19 @@ struct TxBridge {
     unique_ptr<OptimisticTransactionOptions> o_tx_opts;
     unique_ptr<TransactionOptions> p_tx_opts;
     ColumnFamilyHandle * cf_handle;
+    shared_ptr<ColumnFamilies> column_families;
+    // set instead of `odb` and `tdb` for read-only transactions: they read from a snapshot of
+    // the base DB, and have no write set
+    DB *ro_db;
+    unique_ptr<SnapshotBridge> ro_snapshot;
+    // held by transactions of secondary instances, which have no snapshots: catching up
+    // with the primary waits until no transaction is reading
+    shared_lock<shared_timed_mutex> catch_up_lock;
+    // column families created by the transaction, dropped again unless it commits
+    vector<uint32_t> created_column_families;
 
-    explicit TxBridge(TransactionDB *tdb_, ColumnFamilyHandle * cf_handle_) :
+    explicit TxBridge(TransactionDB *tdb_, ColumnFamilyHandle * cf_handle_,
+                      shared_ptr<ColumnFamilies> column_families_) :
             odb(nullptr),
             tdb(tdb_),
             tx(),
@@ -28,10 +54,86 @@ struct TxBridge {
             r_opts(new ReadOptions),
             o_tx_opts(nullptr),
             p_tx_opts(new TransactionOptions),
-            cf_handle(cf_handle_) {
+            cf_handle(cf_handle_),
+            column_families(std::move(column_families_)),
+            ro_db(nullptr),
+            ro_snapshot(),
+            catch_up_lock(),
+            created_column_families() {
+        r_opts->ignore_range_deletions = true;
+    }
+
+    explicit TxBridge(OptimisticTransactionDB *odb_, ColumnFamilyHandle * cf_handle_,
+                      shared_ptr<ColumnFamilies> column_families_) :
+            odb(odb_),
+            tdb(nullptr),
+            tx(),
+            w_opts(new WriteOptions),
+            r_opts(new ReadOptions),
+            o_tx_opts(new OptimisticTransactionOptions),
+            p_tx_opts(nullptr),
+            cf_handle(cf_handle_),
+            column_families(std::move(column_families_)),
+            ro_db(nullptr),
+            ro_snapshot(),
+            catch_up_lock(),
+            created_column_families() {
+        r_opts->ignore_range_deletions = true;
+    }
+
+    explicit TxBridge(DB *ro_db_, ColumnFamilyHandle * cf_handle_,
+                      shared_ptr<ColumnFamilies> column_families_) :
+            odb(nullptr),
+            tdb(nullptr),
+            tx(),
+            w_opts(new WriteOptions),
+            r_opts(new ReadOptions),
+            o_tx_opts(nullptr),
+            p_tx_opts(nullptr),
+            cf_handle(cf_handle_),
+            column_families(std::move(column_families_)),
+            ro_db(ro_db_),
+            ro_snapshot(make_unique<SnapshotBridge>(ro_db_->GetSnapshot(), ro_db_)),
+            catch_up_lock(),
+            created_column_families() {
+        r_opts->ignore_range_deletions = true;
+        r_opts->snapshot = ro_snapshot->snapshot;
+    }
+
+    explicit TxBridge(DB *secondary_db, ColumnFamilyHandle * cf_handle_,
+                      shared_ptr<ColumnFamilies> column_families_, shared_lock<shared_timed_mutex> catch_up_lock_) :
+            odb(nullptr),
+            tdb(nullptr),
+            tx(),
+            w_opts(new WriteOptions),
+            r_opts(new ReadOptions),
+            o_tx_opts(nullptr),
+            p_tx_opts(nullptr),
+            cf_handle(cf_handle_),
+            column_families(std::move(column_families_)),
+            ro_db(secondary_db),
+            ro_snapshot(),
+            catch_up_lock(std::move(catch_up_lock_)),
+            created_column_families() {
         r_opts->ignore_range_deletions = true;
     }
 
+    // creating a column family takes effect immediately, so one created by a transaction
+    // that is rolled back or never committed would otherwise belong to no relation
+    ~TxBridge() {
+        tx.reset();
+        for (auto id: created_column_families) {
+            auto *handle = column_families->get(id);
+            if (handle == nullptr) {
+                continue;
+            }
+            auto s = column_families->db->DropColumnFamily(handle);
+            if (!s.ok()) {
+                cerr << "cannot drop column family " << id << ": " << s.ToString() << endl;
+            }
+        }
+    }
+
     inline WriteOptions &get_w_opts() {
         return *w_opts;
     }
@@ -48,10 +150,30 @@ struct TxBridge {
         r_opts->fill_cache = val;
     }
 
-    inline unique_ptr<IterBridge> iterator() const {
-        return make_unique<IterBridge>(&*tx);
+    [[nodiscard]] inline ColumnFamilyHandle *get_cf(uint32_t cf, RocksDbStatus &status) const {
+        return column_families->get_checked(cf, status);
+    }
+
+    inline unique_ptr<IterBridge> iterator(uint32_t cf) const {
+        if (tx == nullptr) {
+            auto *snapshot = ro_snapshot == nullptr ? nullptr : ro_snapshot->snapshot;
+            return make_unique<IterBridge>(ro_db, column_families->get(cf), snapshot);
+        }
+        return make_unique<IterBridge>(&*tx, column_families->get(cf));
     };
 
+    inline uint32_t create_column_family(rust::Str name, const CfOpts &opts, RocksDbStatus &status) {
+        if (!check_writable(status)) {
+            return 0;
+        }
+        auto id = column_families->create(name, opts, status);
+        // the default column family, with id 0, is never created
+        if (id != 0) {
+            created_column_families.push_back(id);
+        }
+        return id;
+    }
+
     inline void set_snapshot(bool val) {
         if (tx != nullptr) {
             if (val) {
@@ -65,70 +187,159 @@ struct TxBridge {
     }
 
     inline void clear_snapshot() {
-        tx->ClearSnapshot();
+        if (tx != nullptr) {
+            tx->ClearSnapshot();
+        }
     }
 
     [[nodiscard]] inline DB *get_db() const {
         if (tdb != nullptr) {
             return tdb;
-        } else {
+        } else if (odb != nullptr) {
             return odb;
+        } else {
+            return ro_db;
         }
     }
 
+    [[nodiscard]] inline bool is_read_only() const {
+        return tx == nullptr;
+    }
+
+    [[nodiscard]] inline bool check_writable(RocksDbStatus &status) const {
+        if (tx == nullptr) {
+            write_status(Status::NotSupported("write in read-only transaction"), status);
+            return false;
+        }
+        return true;
+    }
+
     void start();
 
-    inline unique_ptr<PinnableSlice> get(RustBytes key, bool for_update, RocksDbStatus &status) const {
+    inline unique_ptr<PinnableSlice>
+    get(uint32_t cf, RustBytes key, bool for_update, RocksDbStatus &status) const {
         Slice key_ = convert_slice(key);
         auto ret = make_unique<PinnableSlice>();
-        if (for_update) {
-            auto s = tx->GetForUpdate(*r_opts, cf_handle, key_, &*ret);
+        auto handle = get_cf(cf, status);
+        if (handle == nullptr) {
+            return ret;
+        }
+        if (tx == nullptr) {
+            write_status(ro_db->Get(*r_opts, handle, key_, &*ret), status);
+        } else if (for_update) {
+            auto s = tx->GetForUpdate(*r_opts, handle, key_, &*ret);
             write_status(s, status);
         } else {
-            auto s = tx->Get(*r_opts, key_, &*ret);
+            auto s = tx->Get(*r_opts, handle, key_, &*ret);
             write_status(s, status);
         }
         return ret;
     }
 
-    inline void exists(RustBytes key, bool for_update, RocksDbStatus &status) const {
+    // Estimates the rows in `[lower, upper)` from the metadata of the files and memtables,
+    // without reading any of them. Writes of this transaction are not counted.
+    void estimate_range(uint32_t cf, RustBytes lower, RustBytes upper, RangeEstimate &estimate,
+                        RocksDbStatus &status) const;
+
+    unique_ptr<vector<PinnableSlice>>
+    multi_get(uint32_t cf, RustBytes keys, rust::Slice<const size_t> key_ends, bool for_update,
+              rust::Vec<RocksDbStatus> &statuses) const;
+
+    inline void exists(uint32_t cf, RustBytes key, bool for_update, RocksDbStatus &status) const {
         Slice key_ = convert_slice(key);
         auto ret = PinnableSlice();
-        if (for_update) {
-            auto s = tx->GetForUpdate(*r_opts, cf_handle, key_, &ret);
+        auto handle = get_cf(cf, status);
+        if (handle == nullptr) {
+            return;
+        }
+        if (tx == nullptr) {
+            write_status(ro_db->Get(*r_opts, handle, key_, &ret), status);
+        } else if (for_update) {
+            auto s = tx->GetForUpdate(*r_opts, handle, key_, &ret);
             write_status(s, status);
         } else {
-            auto s = tx->Get(*r_opts, key_, &ret);
+            auto s = tx->Get(*r_opts, handle, key_, &ret);
             write_status(s, status);
         }
     }
 
-    inline void put(RustBytes key, RustBytes val, RocksDbStatus &status) {
-        write_status(tx->Put(convert_slice(key), convert_slice(val)), status);
+    inline void put(uint32_t cf, RustBytes key, RustBytes val, RocksDbStatus &status) {
+        if (!check_writable(status)) {
+            return;
+        }
+        auto handle = get_cf(cf, status);
+        if (handle != nullptr) {
+            write_status(tx->Put(handle, convert_slice(key), convert_slice(val)), status);
+        }
+    }
+
+    // for keys that no other transaction can see yet: no lock is taken, and no conflict checked
+    inline void put_untracked(uint32_t cf, RustBytes key, RustBytes val, RocksDbStatus &status) {
+        if (!check_writable(status)) {
+            return;
+        }
+        auto handle = get_cf(cf, status);
+        if (handle != nullptr) {
+            write_status(tx->PutUntracked(handle, convert_slice(key), convert_slice(val)), status);
+        }
+    }
+
+    // the value is combined with the one already there by the merge operator of the database.
+    // merges commute, so the key is neither locked nor checked for conflicts at commit
+    inline void merge(uint32_t cf, RustBytes key, RustBytes val, RocksDbStatus &status) {
+        if (!check_writable(status)) {
+            return;
+        }
+        auto handle = get_cf(cf, status);
+        if (handle != nullptr) {
+            write_status(tx->MergeUntracked(handle, convert_slice(key), convert_slice(val)), status);
+        }
     }
 
-    inline void del(RustBytes key, RocksDbStatus &status) {
-        write_status(tx->Delete(convert_slice(key)), status);
+    inline void del(uint32_t cf, RustBytes key, RocksDbStatus &status) {
+        if (!check_writable(status)) {
+            return;
+        }
+        auto handle = get_cf(cf, status);
+        if (handle != nullptr) {
+            write_status(tx->Delete(handle, convert_slice(key)), status);
+        }
     }
 
+    // there is nothing to commit or roll back in read-only transactions
+
     inline void commit(RocksDbStatus &status) {
-        write_status(tx->Commit(), status);
+        if (tx != nullptr) {
+            auto s = tx->Commit();
+            if (s.ok()) {
+                created_column_families.clear();
+            }
+            write_status(s, status);
+        }
     }
 
     inline void rollback(RocksDbStatus &status) {
-        write_status(tx->Rollback(), status);
+        if (tx != nullptr) {
+            write_status(tx->Rollback(), status);
+        }
     }
 
     inline void rollback_to_savepoint(RocksDbStatus &status) {
-        write_status(tx->RollbackToSavePoint(), status);
+        if (check_writable(status)) {
+            write_status(tx->RollbackToSavePoint(), status);
+        }
     }
 
     inline void pop_savepoint(RocksDbStatus &status) {
-        write_status(tx->PopSavePoint(), status);
+        if (check_writable(status)) {
+            write_status(tx->PopSavePoint(), status);
+        }
     }
 
     inline void set_savepoint() {
-        tx->SetSavePoint();
+        if (tx != nullptr) {
+            tx->SetSavePoint();
+        }
     }
 };
 
@@ -13,7 +13,7 @@ fn main() {
 
     let mut builder = cxx_build::bridge("src/bridge/mod.rs");
     builder
-        .files(["bridge/status.cpp", "bridge/db.cpp", "bridge/tx.cpp"])
+        .files(["bridge/status.cpp", "bridge/db.cpp", "bridge/tx.cpp", "bridge/merge.cpp"])
         .include(rocksdb_include_dir())
         .include("bridge");
     if target.contains("msvc") {
@@ -79,6 +79,15 @@ fn main() {
     println!("cargo:rerun-if-changed=bridge/iter.h");
     println!("cargo:rerun-if-changed=bridge/tx.h");
     println!("cargo:rerun-if-changed=bridge/tx.cpp");
+    println!("cargo:rerun-if-changed=bridge/cf.h");
+    println!("cargo:rerun-if-changed=bridge/batch.h");
+    println!("cargo:rerun-if-changed=bridge/perf.h");
+    println!("cargo:rerun-if-changed=bridge/compact.h");
+    println!("cargo:rerun-if-changed=bridge/prefix.h");
+    println!("cargo:rerun-if-changed=bridge/merge.h");
+    println!("cargo:rerun-if-changed=bridge/merge.cpp");
+    println!("cargo:rerun-if-changed=bridge/ttl.h");
+    println!("cargo:rerun-if-changed=bridge/secondary.h");
 
 
 
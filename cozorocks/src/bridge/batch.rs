@@ -0,0 +1,77 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+use cxx::*;
+
+use crate::bridge::ffi::*;
+
+/// Writes applied atomically on [`commit`](WriteBatch::commit) without row locks or
+/// conflict checks. Only safe for keys no transaction can be writing to at the same time.
+pub struct WriteBatch {
+    pub(crate) inner: UniquePtr<WriteBatchBridge>,
+}
+
+impl WriteBatch {
+    #[inline]
+    pub fn put_cf(&mut self, cf: u32, key: &[u8], val: &[u8]) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner.pin_mut().put(cf, key, val, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    #[inline]
+    pub fn del_cf(&mut self, cf: u32, key: &[u8]) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner.pin_mut().del(cf, key, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    #[inline]
+    pub fn del_range_cf(
+        &mut self,
+        cf: u32,
+        lower: &[u8],
+        upper: &[u8],
+    ) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner
+            .pin_mut()
+            .del_range(cf, lower, upper, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    /// Number of operations in the batch.
+    #[inline]
+    pub fn len(&self) -> usize {
+        self.inner.count()
+    }
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+    /// Size of the batch in bytes.
+    #[inline]
+    pub fn data_size(&self) -> usize {
+        self.inner.data_size()
+    }
+    /// Applies all writes atomically and leaves the batch empty.
+    pub fn commit(&mut self) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner.pin_mut().commit(&mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+}
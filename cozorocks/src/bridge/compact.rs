@@ -0,0 +1,49 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+use cxx::*;
+
+use crate::bridge::ffi::*;
+
+/// The defaults let the compaction run in the background of foreground work: automatic
+/// compactions are not blocked, writes are not stalled and only one thread is used.
+impl Default for CompactOpts {
+    fn default() -> Self {
+        Self {
+            exclusive: false,
+            force_bottommost: false,
+            allow_write_stall: false,
+            max_subcompactions: 1,
+        }
+    }
+}
+
+/// Handle to cancel a manual compaction started by
+/// [`RocksDb::compact_range_cf`](crate::RocksDb::compact_range_cf) from another thread.
+#[derive(Clone)]
+pub struct CompactionJob {
+    pub(crate) inner: SharedPtr<CompactionBridge>,
+}
+
+impl Default for CompactionJob {
+    fn default() -> Self {
+        Self {
+            inner: new_compaction(),
+        }
+    }
+}
+
+impl CompactionJob {
+    /// The compaction then fails with [`StatusSubCode::kManualCompactionPaused`].
+    pub fn cancel(&self) {
+        self.inner.cancel()
+    }
+    pub fn is_canceled(&self) -> bool {
+        self.inner.is_canceled()
+    }
+}
+
+unsafe impl Send for CompactionJob {}
+
+unsafe impl Sync for CompactionJob {}
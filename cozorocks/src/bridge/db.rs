@@ -4,8 +4,10 @@
 
 use cxx::*;
 
+use crate::bridge::batch::WriteBatch;
+use crate::bridge::compact::CompactionJob;
 use crate::bridge::ffi::*;
-use crate::bridge::tx::TxBuilder;
+use crate::bridge::tx::{TxBuilder, DEFAULT_COLUMN_FAMILY};
 
 #[derive(Default, Clone)]
 pub struct DbBuilder<'a> {
@@ -20,6 +22,7 @@ impl<'a> Default for DbOpts<'a> {
             increase_parallelism: 0,
             optimize_level_style_compaction: false,
             create_if_missing: false,
+            allow_ingest_behind: false,
             paranoid_checks: true,
             enable_blob_files: false,
             min_blob_size: 0,
@@ -28,11 +31,29 @@ impl<'a> Default for DbOpts<'a> {
             use_bloom_filter: false,
             bloom_filter_bits_per_key: 0.0,
             bloom_filter_whole_key_filtering: false,
+            use_ribbon_filter: false,
+            partition_index_and_filters: false,
             use_capped_prefix_extractor: false,
             capped_prefix_extractor_len: 0,
             use_fixed_prefix_extractor: false,
             fixed_prefix_extractor_len: 0,
             destroy_on_exit: false,
+            optimistic: false,
+            block_cache_capacity: 0,
+            block_cache_shard_bits: -1,
+            share_block_cache: false,
+            row_cache_capacity: 0,
+            memtable_budget: 0,
+            share_memtable_budget: false,
+            enable_statistics: false,
+            rate_limit_bytes_per_sec: 0,
+            rate_limit_auto_tune: false,
+            use_direct_reads: false,
+            use_direct_io_for_flush_and_compaction: false,
+            compaction_readahead_size: 0,
+            max_total_wal_size: 0,
+            secondary_path: "",
+            catch_up_interval_ms: 1000,
         }
     }
 }
@@ -58,6 +79,12 @@ impl<'a> DbBuilder<'a> {
         self.opts.create_if_missing = val;
         self
     }
+    /// Reserves the last level for files ingested behind existing data. Has to be set when
+    /// the database is created.
+    pub fn allow_ingest_behind(mut self, val: bool) -> Self {
+        self.opts.allow_ingest_behind = val;
+        self
+    }
     pub fn paranoid_checks(mut self, val: bool) -> Self {
         self.opts.paranoid_checks = val;
         self
@@ -86,6 +113,26 @@ impl<'a> DbBuilder<'a> {
         self.opts.bloom_filter_whole_key_filtering = whole_key_filtering;
         self
     }
+    /// Use a Ribbon filter instead of a Bloom filter when filtering is enabled. Ribbon
+    /// filters need about 30% less memory for the same false positive rate, but cost more
+    /// CPU to build.
+    pub fn use_ribbon_filter(mut self, enable: bool) -> Self {
+        self.opts.use_ribbon_filter = enable;
+        self
+    }
+    /// Partition indexes and filters into blocks that are loaded on demand, with only the
+    /// top level kept pinned in the cache.
+    pub fn partition_index_and_filters(mut self, enable: bool) -> Self {
+        self.opts.partition_index_and_filters = enable;
+        self
+    }
+    /// Open an `OptimisticTransactionDB` instead of a `TransactionDB`: transactions take no
+    /// locks, and instead fail at commit if another transaction wrote the keys they read
+    /// for update or wrote.
+    pub fn optimistic(mut self, val: bool) -> Self {
+        self.opts.optimistic = val;
+        self
+    }
     pub fn use_capped_prefix_extractor(mut self, enable: bool, len: usize) -> Self {
         self.opts.use_capped_prefix_extractor = enable;
         self.opts.capped_prefix_extractor_len = len;
@@ -96,6 +143,66 @@ impl<'a> DbBuilder<'a> {
         self.opts.fixed_prefix_extractor_len = len;
         self
     }
+    /// Sets the capacity of the LRU block cache in bytes. Zero keeps the RocksDB default.
+    /// A negative `shard_bits` lets RocksDB choose. If `shared` is set, all databases in the
+    /// process asking for a shared cache use the one created by the first of them.
+    pub fn block_cache(mut self, capacity: usize, shard_bits: i32, shared: bool) -> Self {
+        self.opts.block_cache_capacity = capacity;
+        self.opts.block_cache_shard_bits = shard_bits;
+        self.opts.share_block_cache = shared;
+        self
+    }
+    /// Sets the capacity of the row cache in bytes. Zero disables the row cache.
+    pub fn row_cache(mut self, capacity: usize) -> Self {
+        self.opts.row_cache_capacity = capacity;
+        self
+    }
+    /// Caps the total memtable memory in bytes, charged against the block cache if there is
+    /// one. Zero means no budget. `shared` works as in `block_cache`.
+    pub fn memtable_budget(mut self, budget: usize, shared: bool) -> Self {
+        self.opts.memtable_budget = budget;
+        self.opts.share_memtable_budget = shared;
+        self
+    }
+    /// Collects database wide statistics, at a cost of a few percent of throughput.
+    pub fn enable_statistics(mut self, val: bool) -> Self {
+        self.opts.enable_statistics = val;
+        self
+    }
+    /// Limits the bytes per second written by flushes and compactions, zero for no limit.
+    /// With `auto_tune` the limit is an upper bound, and the actual rate follows demand.
+    pub fn rate_limit(mut self, bytes_per_sec: usize, auto_tune: bool) -> Self {
+        self.opts.rate_limit_bytes_per_sec = bytes_per_sec;
+        self.opts.rate_limit_auto_tune = auto_tune;
+        self
+    }
+    /// Bypasses the page cache for user reads, and for the reads and writes of flushes
+    /// and compactions respectively.
+    pub fn direct_io(mut self, reads: bool, flush_and_compaction: bool) -> Self {
+        self.opts.use_direct_reads = reads;
+        self.opts.use_direct_io_for_flush_and_compaction = flush_and_compaction;
+        self
+    }
+    /// Zero keeps the RocksDB default, or 2MiB if direct I/O is used.
+    pub fn compaction_readahead_size(mut self, size: usize) -> Self {
+        self.opts.compaction_readahead_size = size;
+        self
+    }
+    /// Flushes the memtables holding back the oldest log once the logs grow beyond `size`
+    /// bytes. Zero keeps the RocksDB default.
+    pub fn max_total_wal_size(mut self, size: usize) -> Self {
+        self.opts.max_total_wal_size = size;
+        self
+    }
+    /// Opens the database read-only, as a secondary instance following the primary, which
+    /// may be another process. The secondary keeps its own files at `path`, and catches up
+    /// with the primary every `catch_up_interval_ms`. Column families created by the primary
+    /// after it is opened are not seen.
+    pub fn secondary(mut self, path: &'a str, catch_up_interval_ms: u64) -> Self {
+        self.opts.secondary_path = path;
+        self.opts.catch_up_interval_ms = catch_up_interval_ms;
+        self
+    }
     pub fn build(self) -> Result<RocksDb, RocksDbStatus> {
         let mut status = RocksDbStatus::default();
 
@@ -125,6 +232,37 @@ impl RocksDb {
             inner: self.inner.transact(),
         }
     }
+    pub fn is_secondary(&self) -> bool {
+        self.inner.is_secondary()
+    }
+    /// Number of times a secondary instance has caught up with the primary, zero for the
+    /// primary itself.
+    pub fn catch_up_count(&self) -> u64 {
+        self.inner.catch_up_count()
+    }
+    /// Catches up a secondary instance with the primary now, waiting for running
+    /// transactions for up to the catch up interval.
+    pub fn catch_up_with_primary(&self) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner.catch_up_with_primary(&mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    /// A transaction reading from a snapshot of the database, without the bookkeeping of
+    /// a read-write transaction. Writes into it fail.
+    pub fn transact_read_only(&self) -> TxBuilder {
+        TxBuilder {
+            inner: self.inner.transact_read_only(),
+        }
+    }
+    pub fn write_batch(&self) -> WriteBatch {
+        WriteBatch {
+            inner: self.inner.write_batch(),
+        }
+    }
     #[inline]
     pub fn range_del(&self, lower: &[u8], upper: &[u8]) -> Result<(), RocksDbStatus> {
         let mut status = RocksDbStatus::default();
@@ -145,15 +283,146 @@ impl RocksDb {
             Err(status)
         }
     }
+    /// Compacts the keys between `lower` and `upper` of a column family, blocking until
+    /// done or cancelled through `job`. Empty bounds are open.
+    pub fn compact_range_cf(
+        &self,
+        cf: u32,
+        lower: &[u8],
+        upper: &[u8],
+        opts: &CompactOpts,
+        job: &CompactionJob,
+    ) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner
+            .compact_range_cf(cf, lower, upper, opts, &job.inner, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    /// Compaction work of the whole database, manual or automatic.
+    pub fn compaction_progress(&self) -> CompactionProgress {
+        let mut progress = CompactionProgress::default();
+        self.inner.get_compaction_progress(&mut progress);
+        progress
+    }
+    /// Drops a column family created by [`Tx::create_column_family`](crate::Tx::create_column_family).
+    /// Its files are deleted once no transaction still uses it.
+    pub fn drop_column_family(&self, id: u32) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner.drop_column_family(id, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    /// Ids of the column families created by [`Tx::create_column_family`](crate::Tx::create_column_family),
+    /// including those dropped since the database was opened.
+    pub fn column_family_ids(&self) -> Vec<u32> {
+        self.inner.column_family_ids()
+    }
+    /// Lets compactions drop the rows of a relation whose key column at `column`, holding
+    /// seconds since the epoch, is older than `ttl_secs`. Rows past their time can still be
+    /// read until compacted. Not persisted: it must be set again whenever the database is opened.
+    pub fn set_ttl(&self, relation: u64, column: usize, ttl_secs: u64) {
+        self.inner.set_ttl(relation, column, ttl_secs)
+    }
+    pub fn remove_ttl(&self, relation: u64) {
+        self.inner.remove_ttl(relation)
+    }
+    /// Writes a consistent copy of the database to `path`, which must not exist yet, by hard
+    /// linking its files where possible. The copy can be opened as a database on its own.
+    pub fn create_checkpoint(&self, path: &str) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner.create_checkpoint(path, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    /// Adds a backup to `backup_dir` and returns its id. Only files not in earlier backups
+    /// there are copied, at no more than `rate_limit` bytes per second unless zero. Unless
+    /// `keep` is zero, only that many of the newest backups are kept.
+    pub fn create_backup(
+        &self,
+        backup_dir: &str,
+        rate_limit: u64,
+        keep: u32,
+    ) -> Result<u32, RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        let mut id = 0;
+        self.inner
+            .create_backup(backup_dir, rate_limit, keep, &mut id, &mut status);
+        if status.is_ok() {
+            Ok(id)
+        } else {
+            Err(status)
+        }
+    }
+    /// Restores the newest backup in `backup_dir` into `db_path`, where the database must
+    /// not be open.
+    pub fn restore_backup(backup_dir: &str, db_path: &str) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        restore_backup(backup_dir, db_path, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    pub fn cache_stats(&self) -> CacheStats {
+        let mut stats = CacheStats::default();
+        self.inner.get_cache_stats(&mut stats);
+        stats
+    }
+    pub fn stats(&self) -> DbStats {
+        let mut stats = DbStats::default();
+        self.inner.get_stats(&mut stats);
+        stats
+    }
     pub fn get_sst_writer(&self, path: &str) -> Result<SstWriter, RocksDbStatus> {
+        self.get_sst_writer_cf(path, DEFAULT_COLUMN_FAMILY)
+    }
+    /// Creates a writer for an SST file using the options of the given column family.
+    pub fn get_sst_writer_cf(&self, path: &str, cf: u32) -> Result<SstWriter, RocksDbStatus> {
         let mut status = RocksDbStatus::default();
-        let ret = self.inner.get_sst_writer(path, &mut status);
+        let ret = self.inner.get_sst_writer(path, cf, &mut status);
         if status.is_ok() {
             Ok(SstWriter { inner: ret })
         } else {
             Err(status)
         }
     }
+    /// Opens an SST file written by an [`SstWriter`] for reading, without ingesting it.
+    pub fn get_sst_reader(&self, path: &str) -> Result<SstReader, RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        let ret = self.inner.get_sst_reader(path, &mut status);
+        if status.is_ok() {
+            Ok(SstReader { inner: ret })
+        } else {
+            Err(status)
+        }
+    }
+    /// Ingests SST files with pairwise disjoint key ranges in a single operation.
+    pub fn ingest_sst_files(
+        &self,
+        cf: u32,
+        paths: &[std::string::String],
+        opts: IngestOptions,
+    ) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner
+            .ingest_sst_files(cf, paths, opts.move_files, opts.ingest_behind, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
     pub fn ingest_sst_file(&self, path: &str) -> Result<(), RocksDbStatus> {
         let mut status = RocksDbStatus::default();
         self.inner.ingest_sst(path, &mut status);
@@ -165,6 +434,16 @@ impl RocksDb {
     }
 }
 
+/// Settings for [`RocksDb::ingest_sst_files`].
+#[derive(Debug, Clone, Copy, Default)]
+pub struct IngestOptions {
+    /// Move (hard link) the files into the database instead of copying them.
+    pub move_files: bool,
+    /// Put the files below all existing data. Only used if the database was created with
+    /// [`DbBuilder::allow_ingest_behind`], and only correct if none of the keys exist yet.
+    pub ingest_behind: bool,
+}
+
 pub struct SstWriter {
     inner: UniquePtr<SstFileWriterBridge>,
 }
@@ -191,6 +470,58 @@ impl SstWriter {
     }
 }
 
+pub struct SstReader {
+    inner: UniquePtr<SstFileReaderBridge>,
+}
+
+impl SstReader {
+    /// The iterator keeps the file open, and can outlive the reader.
+    pub fn iterator(&self) -> SstIter {
+        SstIter {
+            inner: self.inner.iterator(),
+        }
+    }
+}
+
+pub struct SstIter {
+    inner: UniquePtr<SstIterBridge>,
+}
+
+impl SstIter {
+    #[inline]
+    pub fn seek_to_start(&mut self) {
+        self.inner.pin_mut().to_start()
+    }
+    #[inline]
+    pub fn seek(&mut self, key: &[u8]) {
+        self.inner.pin_mut().seek(key)
+    }
+    #[inline]
+    pub fn next(&mut self) {
+        self.inner.pin_mut().next()
+    }
+    #[inline]
+    pub fn key(&self) -> Result<Option<&[u8]>, RocksDbStatus> {
+        if self.inner.is_valid() {
+            Ok(Some(self.inner.key()))
+        } else {
+            let mut status = RocksDbStatus::default();
+            self.inner.status(&mut status);
+            if status.is_ok() {
+                Ok(None)
+            } else {
+                Err(status)
+            }
+        }
+    }
+}
+
+unsafe impl Send for SstReader {}
+
+unsafe impl Sync for SstReader {}
+
+unsafe impl Send for SstIter {}
+
 unsafe impl Send for RocksDb {}
 
 unsafe impl Sync for RocksDb {}
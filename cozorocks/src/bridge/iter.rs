@@ -15,6 +15,33 @@ pub struct DbIter {
     pub(crate) inner: UniquePtr<IterBridge>,
 }
 
+/// Rows copied out of the iterator by `DbIter::next_batch`.
+pub struct IterBatch<'a> {
+    data: &'a [u8],
+    ends: &'a [usize],
+}
+
+impl<'a> IterBatch<'a> {
+    #[inline]
+    pub fn len(&self) -> usize {
+        self.ends.len() / 2
+    }
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        self.ends.is_empty()
+    }
+    #[inline]
+    pub fn get(&self, idx: usize) -> (&'a [u8], &'a [u8]) {
+        let start = if idx == 0 { 0 } else { self.ends[2 * idx - 1] };
+        let key_end = self.ends[2 * idx];
+        let val_end = self.ends[2 * idx + 1];
+        (&self.data[start..key_end], &self.data[key_end..val_end])
+    }
+    pub fn iter(&self) -> impl Iterator<Item = (&'a [u8], &'a [u8])> + '_ {
+        (0..self.len()).map(|i| self.get(i))
+    }
+}
+
 impl IterBuilder {
     pub fn start(mut self) -> DbIter {
         self.inner.pin_mut().start();
@@ -138,6 +165,26 @@ impl DbIter {
             }
         }
     }
+    /// Copies up to `max_rows` rows, or roughly `max_bytes` of data, starting at the current
+    /// position into a buffer in one call, and moves the iterator past them. An empty batch
+    /// means the iterator is exhausted.
+    #[inline]
+    pub fn next_batch(
+        &mut self,
+        max_rows: usize,
+        max_bytes: usize,
+    ) -> Result<IterBatch<'_>, RocksDbStatus> {
+        self.inner.pin_mut().next_batch(max_rows, max_bytes);
+        let status = self.status();
+        if status.is_ok() {
+            Ok(IterBatch {
+                data: self.inner.batch_data(),
+                ends: self.inner.batch_ends(),
+            })
+        } else {
+            Err(status)
+        }
+    }
     #[inline]
     pub fn pair(&self) -> Result<Option<(&[u8], &[u8])>, RocksDbStatus> {
         if self.is_valid() {
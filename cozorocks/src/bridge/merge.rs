@@ -0,0 +1,47 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+use std::sync::OnceLock;
+
+/// Combines the value of a key, if there is one, with the operands merged into it, oldest
+/// first. Returns `None` if they cannot be combined, which RocksDB reports as corruption.
+pub type MergeFn = fn(Option<&[u8]>, &[&[u8]]) -> Option<Vec<u8>>;
+
+static MERGE_FN: OnceLock<MergeFn> = OnceLock::new();
+
+/// Sets the function the merge operator of all databases calls. Only the first call has an
+/// effect, and it must come before anything is merged.
+pub fn set_merge_fn(f: MergeFn) {
+    let _ = MERGE_FN.set(f);
+}
+
+pub(crate) fn merge_with_rust(
+    has_existing: bool,
+    existing: &[u8],
+    mut operands: &[u8],
+    merged: &mut Vec<u8>,
+) -> bool {
+    let f = match MERGE_FN.get() {
+        None => return false,
+        Some(f) => f,
+    };
+    let mut split = vec![];
+    while operands.len() >= 4 {
+        let len = u32::from_be_bytes([operands[0], operands[1], operands[2], operands[3]]) as usize;
+        if operands.len() < 4 + len {
+            return false;
+        }
+        split.push(&operands[4..4 + len]);
+        operands = &operands[4 + len..];
+    }
+    // a panic cannot unwind into RocksDB
+    let result = std::panic::catch_unwind(|| f(has_existing.then_some(existing), &split));
+    match result {
+        Ok(Some(val)) => {
+            *merged = val;
+            true
+        }
+        _ => false,
+    }
+}
@@ -8,9 +8,14 @@ use std::fmt::{Display, Formatter};
 use miette::{Diagnostic, Severity};
 
 use crate::StatusSeverity;
+use merge::merge_with_rust;
 
+pub(crate) mod batch;
+pub(crate) mod compact;
 pub(crate) mod db;
 pub(crate) mod iter;
+pub(crate) mod merge;
+pub(crate) mod perf;
 pub(crate) mod tx;
 
 #[cxx::bridge]
@@ -22,6 +27,7 @@ pub(crate) mod ffi {
         pub increase_parallelism: usize,
         pub optimize_level_style_compaction: bool,
         pub create_if_missing: bool,
+        pub allow_ingest_behind: bool,
         pub paranoid_checks: bool,
         pub enable_blob_files: bool,
         pub min_blob_size: usize,
@@ -30,11 +36,140 @@ pub(crate) mod ffi {
         pub use_bloom_filter: bool,
         pub bloom_filter_bits_per_key: f64,
         pub bloom_filter_whole_key_filtering: bool,
+        pub use_ribbon_filter: bool,
+        pub partition_index_and_filters: bool,
         pub use_capped_prefix_extractor: bool,
         pub capped_prefix_extractor_len: usize,
         pub use_fixed_prefix_extractor: bool,
         pub fixed_prefix_extractor_len: usize,
         pub destroy_on_exit: bool,
+        pub optimistic: bool,
+        pub block_cache_capacity: usize,
+        pub block_cache_shard_bits: i32,
+        pub share_block_cache: bool,
+        pub row_cache_capacity: usize,
+        pub memtable_budget: usize,
+        pub share_memtable_budget: bool,
+        pub enable_statistics: bool,
+        pub rate_limit_bytes_per_sec: usize,
+        pub rate_limit_auto_tune: bool,
+        pub use_direct_reads: bool,
+        pub use_direct_io_for_flush_and_compaction: bool,
+        pub compaction_readahead_size: usize,
+        pub max_total_wal_size: usize,
+        /// Opens a read-only secondary instance of the database at `db_path`, keeping its
+        /// own files here, unless empty.
+        pub secondary_path: &'a str,
+        /// How often a secondary instance catches up with the primary.
+        pub catch_up_interval_ms: u64,
+    }
+
+    /// Per column family overrides, negative (or zero) values mean "inherit from the database".
+    #[derive(Debug, Clone)]
+    pub struct CfOpts {
+        pub compression: i32,
+        pub compaction_style: i32,
+        pub block_size: usize,
+        pub bloom_bits_per_key: f64,
+        /// Number of leading key columns forming the prefix for prefix bloom filters.
+        pub prefix_columns: usize,
+    }
+
+    #[derive(Debug, Clone, Default)]
+    pub struct CacheStats {
+        pub block_cache_capacity: usize,
+        pub block_cache_usage: usize,
+        pub block_cache_pinned_usage: usize,
+        pub row_cache_capacity: usize,
+        pub row_cache_usage: usize,
+        pub memtable_budget: usize,
+        pub memtable_usage: usize,
+    }
+
+    /// How a manual compaction shares the database with the foreground.
+    #[derive(Debug, Clone)]
+    pub struct CompactOpts {
+        /// Keep automatic compactions from running at the same time.
+        pub exclusive: bool,
+        /// Rewrite the bottommost level even if nothing would be dropped from it.
+        pub force_bottommost: bool,
+        /// Go on compacting even if that stalls writes.
+        pub allow_write_stall: bool,
+        /// Zero uses the database default.
+        pub max_subcompactions: u32,
+    }
+
+    #[derive(Debug, Clone, Default)]
+    pub struct CompactionProgress {
+        pub running_compactions: u64,
+        pub pending_compaction_bytes: u64,
+        pub compaction_pending: bool,
+        pub delayed_write_rate: u64,
+        pub write_stopped: bool,
+    }
+
+    /// Of a range of keys, from the metadata of RocksDB only.
+    #[derive(Debug, Clone, Default)]
+    pub struct RangeEstimate {
+        pub file_bytes: u64,
+        pub file_rows: u64,
+        pub memtable_bytes: u64,
+        pub memtable_rows: u64,
+    }
+
+    #[derive(Debug, Clone, Default)]
+    pub struct TickerStat {
+        pub name: String,
+        pub count: u64,
+    }
+
+    #[derive(Debug, Clone, Default)]
+    pub struct HistogramStat {
+        pub name: String,
+        pub count: u64,
+        pub sum: u64,
+        pub median: f64,
+        pub p95: f64,
+        pub p99: f64,
+        pub max: f64,
+    }
+
+    /// Counters of the whole database since it was opened, empty unless it was opened
+    /// with statistics enabled.
+    #[derive(Debug, Clone, Default)]
+    pub struct DbStats {
+        pub enabled: bool,
+        pub tickers: Vec<TickerStat>,
+        pub histograms: Vec<HistogramStat>,
+    }
+
+    /// Counters of the work done by a single thread, see `PerfScope`.
+    /// Times are only collected if timing was requested.
+    #[derive(Debug, Clone, Default)]
+    pub struct PerfCounters {
+        pub user_key_comparison_count: u64,
+        pub block_cache_hit_count: u64,
+        pub block_read_count: u64,
+        pub block_read_byte: u64,
+        pub block_read_nanos: u64,
+        pub get_read_bytes: u64,
+        pub multiget_read_bytes: u64,
+        pub iter_read_bytes: u64,
+        pub internal_key_skipped_count: u64,
+        pub internal_delete_skipped_count: u64,
+        pub get_from_memtable_count: u64,
+        pub seek_on_memtable_count: u64,
+        pub next_on_memtable_count: u64,
+        pub bloom_memtable_hit_count: u64,
+        pub bloom_memtable_miss_count: u64,
+        pub bloom_sst_hit_count: u64,
+        pub bloom_sst_miss_count: u64,
+        pub get_from_output_files_nanos: u64,
+        pub seek_internal_seek_nanos: u64,
+        pub io_bytes_read: u64,
+        pub io_bytes_written: u64,
+        pub io_read_nanos: u64,
+        pub io_cpu_read_nanos: u64,
     }
 
     #[derive(Clone, Debug, Eq, PartialEq)]
@@ -96,6 +231,15 @@ pub(crate) mod ffi {
         kMaxSeverity,
     }
 
+    extern "Rust" {
+        fn merge_with_rust(
+            has_existing: bool,
+            existing: &[u8],
+            operands: &[u8],
+            merged: &mut Vec<u8>,
+        ) -> bool;
+    }
+
     unsafe extern "C++" {
         include!("bridge.h");
 
@@ -110,6 +254,10 @@ pub(crate) mod ffi {
         fn set_w_opts_disable_wal(o: Pin<&mut WriteOptions>, val: bool);
         fn set_w_opts_no_slowdown(o: Pin<&mut WriteOptions>, val: bool);
 
+        fn perf_start(timed: bool);
+        fn perf_stop();
+        fn perf_collect(counters: &mut PerfCounters);
+
         // type ReadOptions;
 
         pub type SnapshotBridge;
@@ -121,6 +269,11 @@ pub(crate) mod ffi {
             status: &mut RocksDbStatus,
         ) -> SharedPtr<RocksDbBridge>;
         fn transact(self: &RocksDbBridge) -> UniquePtr<TxBridge>;
+        fn transact_read_only(self: &RocksDbBridge) -> UniquePtr<TxBridge>;
+        fn is_secondary(self: &RocksDbBridge) -> bool;
+        fn catch_up_with_primary(self: &RocksDbBridge, status: &mut RocksDbStatus);
+        fn catch_up_count(self: &RocksDbBridge) -> u64;
+        fn write_batch(self: &RocksDbBridge) -> UniquePtr<WriteBatchBridge>;
         fn del_range(
             self: &RocksDbBridge,
             lower: &[u8],
@@ -136,9 +289,54 @@ pub(crate) mod ffi {
         fn get_sst_writer(
             self: &RocksDbBridge,
             path: &str,
+            cf: u32,
             status: &mut RocksDbStatus,
         ) -> UniquePtr<SstFileWriterBridge>;
+        fn get_sst_reader(
+            self: &RocksDbBridge,
+            path: &str,
+            status: &mut RocksDbStatus,
+        ) -> UniquePtr<SstFileReaderBridge>;
         fn ingest_sst(self: &RocksDbBridge, path: &str, status: &mut RocksDbStatus);
+        fn ingest_sst_files(
+            self: &RocksDbBridge,
+            cf: u32,
+            paths: &[String],
+            move_files: bool,
+            ingest_behind: bool,
+            status: &mut RocksDbStatus,
+        );
+        fn create_checkpoint(self: &RocksDbBridge, path: &str, status: &mut RocksDbStatus);
+        fn create_backup(
+            self: &RocksDbBridge,
+            backup_dir: &str,
+            rate_limit: u64,
+            keep: u32,
+            backup_id: &mut u32,
+            status: &mut RocksDbStatus,
+        );
+        fn restore_backup(backup_dir: &str, db_path: &str, status: &mut RocksDbStatus);
+        fn get_cache_stats(self: &RocksDbBridge, stats: &mut CacheStats);
+        fn get_stats(self: &RocksDbBridge, stats: &mut DbStats);
+        fn compact_range_cf(
+            self: &RocksDbBridge,
+            cf: u32,
+            lower: &[u8],
+            upper: &[u8],
+            opts: &CompactOpts,
+            job: &CompactionBridge,
+            status: &mut RocksDbStatus,
+        );
+        fn get_compaction_progress(self: &RocksDbBridge, progress: &mut CompactionProgress);
+
+        type CompactionBridge;
+        fn new_compaction() -> SharedPtr<CompactionBridge>;
+        fn cancel(self: &CompactionBridge);
+        fn is_canceled(self: &CompactionBridge) -> bool;
+        fn drop_column_family(self: &RocksDbBridge, id: u32, status: &mut RocksDbStatus);
+        fn column_family_ids(self: &RocksDbBridge) -> Vec<u32>;
+        fn set_ttl(self: &RocksDbBridge, relation: u64, column: usize, ttl_secs: u64);
+        fn remove_ttl(self: &RocksDbBridge, relation: u64);
 
         type SstFileWriterBridge;
         fn put(
@@ -149,6 +347,37 @@ pub(crate) mod ffi {
         );
         fn finish(self: Pin<&mut SstFileWriterBridge>, status: &mut RocksDbStatus);
 
+        type SstFileReaderBridge;
+        fn iterator(self: &SstFileReaderBridge) -> UniquePtr<SstIterBridge>;
+
+        type SstIterBridge;
+        fn to_start(self: Pin<&mut SstIterBridge>);
+        fn seek(self: Pin<&mut SstIterBridge>, key: &[u8]);
+        fn is_valid(self: &SstIterBridge) -> bool;
+        fn next(self: Pin<&mut SstIterBridge>);
+        fn key(self: &SstIterBridge) -> &[u8];
+        fn status(self: &SstIterBridge, status: &mut RocksDbStatus);
+
+        type WriteBatchBridge;
+        fn put(
+            self: Pin<&mut WriteBatchBridge>,
+            cf: u32,
+            key: &[u8],
+            val: &[u8],
+            status: &mut RocksDbStatus,
+        );
+        fn del(self: Pin<&mut WriteBatchBridge>, cf: u32, key: &[u8], status: &mut RocksDbStatus);
+        fn del_range(
+            self: Pin<&mut WriteBatchBridge>,
+            cf: u32,
+            lower: &[u8],
+            upper: &[u8],
+            status: &mut RocksDbStatus,
+        );
+        fn count(self: &WriteBatchBridge) -> usize;
+        fn data_size(self: &WriteBatchBridge) -> usize;
+        fn commit(self: Pin<&mut WriteBatchBridge>, status: &mut RocksDbStatus);
+
         type TxBridge;
         // fn get_r_opts(self: Pin<&mut TxBridge>) -> Pin<&mut ReadOptions>;
         fn verify_checksums(self: Pin<&mut TxBridge>, val: bool);
@@ -157,31 +386,71 @@ pub(crate) mod ffi {
         fn start(self: Pin<&mut TxBridge>);
         fn set_snapshot(self: Pin<&mut TxBridge>, val: bool);
         fn clear_snapshot(self: Pin<&mut TxBridge>);
+        fn is_read_only(self: &TxBridge) -> bool;
         fn get(
             self: &TxBridge,
+            cf: u32,
             key: &[u8],
             for_update: bool,
             status: &mut RocksDbStatus,
         ) -> UniquePtr<PinnableSlice>;
+        fn multi_get(
+            self: &TxBridge,
+            cf: u32,
+            keys: &[u8],
+            key_ends: &[usize],
+            for_update: bool,
+            statuses: &mut Vec<RocksDbStatus>,
+        ) -> UniquePtr<CxxVector<PinnableSlice>>;
         fn exists(
             self: &TxBridge,
+            cf: u32,
             key: &[u8],
             for_update: bool,
             status: &mut RocksDbStatus,
         );
         fn put(
             self: Pin<&mut TxBridge>,
+            cf: u32,
             key: &[u8],
             val: &[u8],
             status: &mut RocksDbStatus,
         );
-        fn del(self: Pin<&mut TxBridge>, key: &[u8], status: &mut RocksDbStatus);
+        fn put_untracked(
+            self: Pin<&mut TxBridge>,
+            cf: u32,
+            key: &[u8],
+            val: &[u8],
+            status: &mut RocksDbStatus,
+        );
+        fn merge(
+            self: Pin<&mut TxBridge>,
+            cf: u32,
+            key: &[u8],
+            val: &[u8],
+            status: &mut RocksDbStatus,
+        );
+        fn del(self: Pin<&mut TxBridge>, cf: u32, key: &[u8], status: &mut RocksDbStatus);
         fn commit(self: Pin<&mut TxBridge>, status: &mut RocksDbStatus);
         fn rollback(self: Pin<&mut TxBridge>, status: &mut RocksDbStatus);
         fn rollback_to_savepoint(self: Pin<&mut TxBridge>, status: &mut RocksDbStatus);
         fn pop_savepoint(self: Pin<&mut TxBridge>, status: &mut RocksDbStatus);
         fn set_savepoint(self: Pin<&mut TxBridge>);
-        fn iterator(self: &TxBridge) -> UniquePtr<IterBridge>;
+        fn iterator(self: &TxBridge, cf: u32) -> UniquePtr<IterBridge>;
+        fn estimate_range(
+            self: &TxBridge,
+            cf: u32,
+            lower: &[u8],
+            upper: &[u8],
+            estimate: &mut RangeEstimate,
+            status: &mut RocksDbStatus,
+        );
+        fn create_column_family(
+            self: Pin<&mut TxBridge>,
+            name: &str,
+            opts: &CfOpts,
+            status: &mut RocksDbStatus,
+        ) -> u32;
 
         type IterBridge;
         fn start(self: Pin<&mut IterBridge>);
@@ -208,6 +477,9 @@ pub(crate) mod ffi {
         fn status(self: &IterBridge, status: &mut RocksDbStatus);
         fn key(self: &IterBridge) -> &[u8];
         fn val(self: &IterBridge) -> &[u8];
+        fn next_batch(self: Pin<&mut IterBridge>, max_rows: usize, max_bytes: usize) -> usize;
+        fn batch_data(self: &IterBridge) -> &[u8];
+        fn batch_ends(self: &IterBridge) -> &[usize];
     }
 }
 
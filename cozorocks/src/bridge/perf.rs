@@ -0,0 +1,46 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under MIT/Apache-2.0/BSD-3-Clause.
+ */
+
+use std::cell::Cell;
+use std::marker::PhantomData;
+
+use crate::bridge::ffi::*;
+
+thread_local! {
+    static SCOPE_ACTIVE: Cell<bool> = Cell::new(false);
+}
+
+/// Counts the work RocksDB does on the current thread while alive.
+pub struct PerfScope {
+    // the counters live in thread local storage
+    _not_send: PhantomData<*const ()>,
+}
+
+impl PerfScope {
+    /// There is only one perf context per thread, so this returns `None` if a scope is
+    /// already active on the current thread: the work is then counted by the outer scope.
+    /// Timing every block read and seek is significantly more expensive than counting.
+    pub fn start(timed: bool) -> Option<Self> {
+        if SCOPE_ACTIVE.with(|active| active.replace(true)) {
+            return None;
+        }
+        perf_start(timed);
+        Some(Self {
+            _not_send: PhantomData,
+        })
+    }
+    /// The counters of the scope active on the current thread.
+    pub fn current() -> PerfCounters {
+        let mut counters = PerfCounters::default();
+        perf_collect(&mut counters);
+        counters
+    }
+}
+
+impl Drop for PerfScope {
+    fn drop(&mut self) {
+        perf_stop();
+        SCOPE_ACTIVE.with(|active| active.set(false));
+    }
+}
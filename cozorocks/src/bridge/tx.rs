@@ -10,6 +10,21 @@ use cxx::*;
 use crate::bridge::ffi::*;
 use crate::bridge::iter::IterBuilder;
 
+/// Id of the column family every database has.
+pub const DEFAULT_COLUMN_FAMILY: u32 = 0;
+
+impl Default for CfOpts {
+    fn default() -> Self {
+        Self {
+            compression: -1,
+            compaction_style: -1,
+            block_size: 0,
+            bloom_bits_per_key: -1.,
+            prefix_columns: 0,
+        }
+    }
+}
+
 pub struct TxBuilder {
     pub(crate) inner: UniquePtr<TxBridge>,
 }
@@ -32,6 +47,35 @@ impl Debug for PinSlice {
     }
 }
 
+pub struct MultiGetResult {
+    pub(crate) inner: UniquePtr<CxxVector<PinnableSlice>>,
+    pub(crate) statuses: Vec<RocksDbStatus>,
+    pub(crate) positions: Vec<usize>,
+}
+
+impl MultiGetResult {
+    #[inline]
+    pub fn len(&self) -> usize {
+        self.positions.len()
+    }
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        self.positions.is_empty()
+    }
+    /// Result for the `idx`-th key, in the order the keys were passed to `Tx::multi_get`.
+    #[inline]
+    pub fn get(&self, idx: usize) -> Option<&[u8]> {
+        let pos = self.positions[idx];
+        if self.statuses[pos].is_ok() {
+            self.inner
+                .get(pos)
+                .map(|slice| convert_pinnable_slice_back(slice))
+        } else {
+            None
+        }
+    }
+}
+
 impl TxBuilder {
     #[inline]
     pub fn start(mut self) -> Tx {
@@ -87,10 +131,53 @@ impl Tx {
     pub fn clear_snapshot(&mut self) {
         self.inner.pin_mut().clear_snapshot()
     }
+    /// Read-only transactions read from a snapshot of the database, and writes to them fail.
+    /// Unlike other transactions, they may be read from by several threads at once.
+    #[inline]
+    pub fn is_read_only(&self) -> bool {
+        self.inner.is_read_only()
+    }
     #[inline]
     pub fn put(&mut self, key: &[u8], val: &[u8]) -> Result<(), RocksDbStatus> {
+        self.put_cf(DEFAULT_COLUMN_FAMILY, key, val)
+    }
+    #[inline]
+    pub fn put_cf(&mut self, cf: u32, key: &[u8], val: &[u8]) -> Result<(), RocksDbStatus> {
         let mut status = RocksDbStatus::default();
-        self.inner.pin_mut().put(key, val, &mut status);
+        self.inner.pin_mut().put(cf, key, val, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    /// Like [`put_cf`](Self::put_cf), but neither locks the key nor checks it for conflicts
+    /// at commit. Only for keys that no other transaction can be writing to, such as those
+    /// of a relation created by this transaction.
+    #[inline]
+    pub fn put_untracked_cf(
+        &mut self,
+        cf: u32,
+        key: &[u8],
+        val: &[u8],
+    ) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner
+            .pin_mut()
+            .put_untracked(cf, key, val, &mut status);
+        if status.is_ok() {
+            Ok(())
+        } else {
+            Err(status)
+        }
+    }
+    /// Writes `val` to be combined with the value of the key by the function given to
+    /// [`set_merge_fn`](crate::set_merge_fn), when the key is next read or compacted.
+    /// The key is not locked, and concurrent merges into it never conflict.
+    #[inline]
+    pub fn merge_cf(&mut self, cf: u32, key: &[u8], val: &[u8]) -> Result<(), RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        self.inner.pin_mut().merge(cf, key, val, &mut status);
         if status.is_ok() {
             Ok(())
         } else {
@@ -99,8 +186,12 @@ impl Tx {
     }
     #[inline]
     pub fn del(&mut self, key: &[u8]) -> Result<(), RocksDbStatus> {
+        self.del_cf(DEFAULT_COLUMN_FAMILY, key)
+    }
+    #[inline]
+    pub fn del_cf(&mut self, cf: u32, key: &[u8]) -> Result<(), RocksDbStatus> {
         let mut status = RocksDbStatus::default();
-        self.inner.pin_mut().del(key, &mut status);
+        self.inner.pin_mut().del(cf, key, &mut status);
         if status.is_ok() {
             Ok(())
         } else {
@@ -109,18 +200,69 @@ impl Tx {
     }
     #[inline]
     pub fn get(&self, key: &[u8], for_update: bool) -> Result<Option<PinSlice>, RocksDbStatus> {
+        self.get_cf(DEFAULT_COLUMN_FAMILY, key, for_update)
+    }
+    #[inline]
+    pub fn get_cf(
+        &self,
+        cf: u32,
+        key: &[u8],
+        for_update: bool,
+    ) -> Result<Option<PinSlice>, RocksDbStatus> {
         let mut status = RocksDbStatus::default();
-        let ret = self.inner.get(key, for_update, &mut status);
+        let ret = self.inner.get(cf, key, for_update, &mut status);
         match status.code {
             StatusCode::kOk => Ok(Some(PinSlice { inner: ret })),
             StatusCode::kNotFound => Ok(None),
             _ => Err(status),
         }
     }
+    /// Looks up many keys with a single call into RocksDB. The keys are sorted before
+    /// being handed over, so that the lookups are done in key order.
+    pub fn multi_get<K: AsRef<[u8]>>(
+        &self,
+        keys: &[K],
+        for_update: bool,
+    ) -> Result<MultiGetResult, RocksDbStatus> {
+        self.multi_get_cf(DEFAULT_COLUMN_FAMILY, keys, for_update)
+    }
+    pub fn multi_get_cf<K: AsRef<[u8]>>(
+        &self,
+        cf: u32,
+        keys: &[K],
+        for_update: bool,
+    ) -> Result<MultiGetResult, RocksDbStatus> {
+        let mut order = (0..keys.len()).collect::<Vec<_>>();
+        order.sort_by(|a, b| keys[*a].as_ref().cmp(keys[*b].as_ref()));
+        let mut positions = vec![0; keys.len()];
+        let mut buffer = Vec::with_capacity(keys.iter().map(|k| k.as_ref().len()).sum());
+        let mut key_ends = Vec::with_capacity(keys.len());
+        for (pos, idx) in order.into_iter().enumerate() {
+            positions[idx] = pos;
+            buffer.extend_from_slice(keys[idx].as_ref());
+            key_ends.push(buffer.len());
+        }
+        let mut statuses = Vec::with_capacity(keys.len());
+        let inner = self
+            .inner
+            .multi_get(cf, &buffer, &key_ends, for_update, &mut statuses);
+        if let Some(status) = statuses.iter().find(|s| !s.is_ok_or_not_found()) {
+            return Err(status.clone());
+        }
+        Ok(MultiGetResult {
+            inner,
+            statuses,
+            positions,
+        })
+    }
     #[inline]
     pub fn exists(&self, key: &[u8], for_update: bool) -> Result<bool, RocksDbStatus> {
+        self.exists_cf(DEFAULT_COLUMN_FAMILY, key, for_update)
+    }
+    #[inline]
+    pub fn exists_cf(&self, cf: u32, key: &[u8], for_update: bool) -> Result<bool, RocksDbStatus> {
         let mut status = RocksDbStatus::default();
-        self.inner.exists(key, for_update, &mut status);
+        self.inner.exists(cf, key, for_update, &mut status);
         match status.code {
             StatusCode::kOk => Ok(true),
             StatusCode::kNotFound => Ok(false),
@@ -173,9 +315,50 @@ impl Tx {
     }
     #[inline]
     pub fn iterator(&self) -> IterBuilder {
+        self.iterator_cf(DEFAULT_COLUMN_FAMILY)
+    }
+    #[inline]
+    pub fn iterator_cf(&self, cf: u32) -> IterBuilder {
         IterBuilder {
-            inner: self.inner.iterator(),
+            inner: self.inner.iterator(cf),
         }
             .auto_prefix_mode(true)
     }
+    /// Estimates the size of the keys in `[lower, upper)` without reading them. The
+    /// writes of this transaction are not included.
+    pub fn estimate_range_cf(
+        &self,
+        cf: u32,
+        lower: &[u8],
+        upper: &[u8],
+    ) -> Result<RangeEstimate, RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        let mut estimate = RangeEstimate::default();
+        self.inner
+            .estimate_range(cf, lower, upper, &mut estimate, &mut status);
+        if status.is_ok() {
+            Ok(estimate)
+        } else {
+            Err(status)
+        }
+    }
+    /// Creates a column family and returns its id. Unlike everything else done through
+    /// a transaction, this takes effect immediately: the column family is dropped again
+    /// when the transaction is dropped without having committed.
+    pub fn create_column_family(
+        &mut self,
+        name: &str,
+        opts: &CfOpts,
+    ) -> Result<u32, RocksDbStatus> {
+        let mut status = RocksDbStatus::default();
+        let ret = self
+            .inner
+            .pin_mut()
+            .create_column_family(name, opts, &mut status);
+        if status.is_ok() {
+            Ok(ret)
+        } else {
+            Err(status)
+        }
+    }
 }
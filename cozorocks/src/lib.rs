@@ -5,15 +5,36 @@
 #![warn(rust_2018_idioms, future_incompatible)]
 #![allow(clippy::type_complexity)]
 
+pub use bridge::batch::WriteBatch;
+pub use bridge::compact::CompactionJob;
 pub use bridge::db::DbBuilder;
+pub use bridge::db::IngestOptions;
 pub use bridge::db::RocksDb;
+pub use bridge::db::SstIter;
+pub use bridge::db::SstReader;
+pub use bridge::db::SstWriter;
+pub use bridge::ffi::CacheStats;
+pub use bridge::ffi::CfOpts;
+pub use bridge::ffi::CompactOpts;
+pub use bridge::ffi::CompactionProgress;
+pub use bridge::ffi::DbStats;
+pub use bridge::ffi::HistogramStat;
+pub use bridge::ffi::PerfCounters;
+pub use bridge::ffi::RangeEstimate;
 pub use bridge::ffi::RocksDbStatus;
 pub use bridge::ffi::SnapshotBridge;
 pub use bridge::ffi::StatusCode;
 pub use bridge::ffi::StatusSeverity;
 pub use bridge::ffi::StatusSubCode;
+pub use bridge::ffi::TickerStat;
 pub use bridge::iter::DbIter;
+pub use bridge::iter::IterBatch;
 pub use bridge::iter::IterBuilder;
+pub use bridge::merge::set_merge_fn;
+pub use bridge::merge::MergeFn;
+pub use bridge::perf::PerfScope;
+pub use bridge::tx::MultiGetResult;
+pub use bridge::tx::DEFAULT_COLUMN_FAMILY;
 pub use bridge::tx::PinSlice;
 pub use bridge::tx::Tx;
 pub use bridge::tx::TxBuilder;
@@ -78,7 +78,7 @@ impl AlgoImpl for BetweennessCentrality {
 
         for (i, s) in centrality.into_iter().enumerate() {
             let node = indices[i].clone();
-            out.put(Tuple(vec![node, s.into()]), 0);
+            out.put(Tuple(vec![node, s.into()]), 0)?;
         }
 
         Ok(())
@@ -128,7 +128,7 @@ impl AlgoImpl for ClosenessCentrality {
             out.put(
                 Tuple(vec![indices[idx].clone(), DataValue::from(centrality)]),
                 0,
-            );
+            )?;
             poison.check()?;
         }
         Ok(())
@@ -64,7 +64,7 @@ impl AlgoImpl for ShortestPathAStar {
                         DataValue::List(path),
                     ]),
                     0,
-                );
+                )?;
             }
         }
 
@@ -100,7 +100,7 @@ impl AlgoImpl for Bfs {
             route.push(starting.clone());
             route.reverse();
             let tuple = Tuple(vec![starting, ending, DataValue::List(route)]);
-            out.put(tuple, 0);
+            out.put(tuple, 0)?;
         }
         Ok(())
     }
@@ -34,7 +34,7 @@ impl AlgoImpl for Constant {
         let data = data.get_const().unwrap().get_list().unwrap();
         for row in data {
             let tuple = Tuple(row.get_list().unwrap().into());
-            out.put(tuple, 0)
+            out.put(tuple, 0)?;
         }
         Ok(())
     }
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::collections::BTreeMap;
+use std::ops::Range;
+
+use miette::{bail, Diagnostic, Result};
+use rayon::prelude::*;
+use thiserror::Error;
+
+use crate::data::value::DataValue;
+use crate::parse::SourceSpan;
+
+/// A graph in compressed sparse row form: the edges from each node are contiguous in one
+/// array, in the order they were given, and nodes are numbered by `u32`.
+pub(crate) struct CsrGraph<E = u32> {
+    offsets: Vec<usize>,
+    edges: Vec<E>,
+}
+
+pub(crate) trait CsrEdge {
+    fn target(&self) -> u32;
+}
+
+impl CsrEdge for u32 {
+    fn target(&self) -> u32 {
+        *self
+    }
+}
+
+impl CsrEdge for (u32, f64) {
+    fn target(&self) -> u32 {
+        self.0
+    }
+}
+
+impl<E: Send> CsrGraph<E> {
+    /// Makes the graph from `(from, edge)` pairs, keeping the order of the edges of each node.
+    pub(crate) fn new(n_nodes: usize, mut edges: Vec<(u32, E)>) -> Self {
+        // stable, so that the order of the edges of each node is kept
+        edges.par_sort_by_key(|(from, _)| *from);
+        let mut offsets = vec![0; n_nodes + 1];
+        for (from, _) in &edges {
+            offsets[*from as usize + 1] += 1;
+        }
+        for i in 0..n_nodes {
+            offsets[i + 1] += offsets[i];
+        }
+        Self {
+            offsets,
+            edges: edges.into_iter().map(|(_, e)| e).collect(),
+        }
+    }
+}
+
+impl<E> CsrGraph<E> {
+    pub(crate) fn node_count(&self) -> usize {
+        self.offsets.len() - 1
+    }
+    pub(crate) fn nodes(&self) -> Range<usize> {
+        0..self.node_count()
+    }
+    pub(crate) fn edges(&self, node: usize) -> &[E] {
+        &self.edges[self.offsets[node]..self.offsets[node + 1]]
+    }
+}
+
+impl<E: CsrEdge + Send + Sync> CsrGraph<E> {
+    /// The graph with all edges reversed, without their weights and without duplicates.
+    pub(crate) fn transpose(&self) -> CsrGraph<u32> {
+        let reversed = self
+            .nodes()
+            .flat_map(|from| {
+                self.edges(from)
+                    .iter()
+                    .map(move |e| (e.target(), from as u32))
+            })
+            .collect();
+        let mut ret = CsrGraph::new(self.node_count(), reversed);
+        ret.dedup();
+        ret
+    }
+}
+
+impl CsrGraph<u32> {
+    /// Sorts the edges of each node by target and removes duplicates, so that they can
+    /// be searched and intersected.
+    pub(crate) fn dedup(&mut self) {
+        let nodes = self.node_count();
+        let mut lists: Vec<&mut [u32]> = Vec::with_capacity(nodes);
+        let mut rest = self.edges.as_mut_slice();
+        for node in 0..nodes {
+            let (list, r) = rest.split_at_mut(self.offsets[node + 1] - self.offsets[node]);
+            lists.push(list);
+            rest = r;
+        }
+        let lens: Vec<usize> = lists
+            .into_par_iter()
+            .map(|list| {
+                list.sort_unstable();
+                let mut len = 0;
+                for i in 0..list.len() {
+                    if i == 0 || list[i] != list[len - 1] {
+                        list[len] = list[i];
+                        len += 1;
+                    }
+                }
+                len
+            })
+            .collect();
+        let mut kept = 0;
+        for node in 0..nodes {
+            let start = self.offsets[node];
+            self.edges.copy_within(start..start + lens[node], kept);
+            self.offsets[node] = kept;
+            kept += lens[node];
+        }
+        self.offsets[nodes] = kept;
+        self.edges.truncate(kept);
+    }
+}
+
+#[derive(Debug, Error, Diagnostic)]
+#[error("The graph has more than {} nodes", u32::MAX)]
+#[diagnostic(code(algo::too_many_nodes))]
+struct TooManyNodesError(#[label] SourceSpan);
+
+/// Numbers the nodes of a graph as they are first seen.
+#[derive(Default)]
+pub(crate) struct NodeIndexer {
+    indices: Vec<DataValue>,
+    inv_indices: BTreeMap<DataValue, usize>,
+}
+
+impl NodeIndexer {
+    pub(crate) fn index(&mut self, node: DataValue, span: SourceSpan) -> Result<u32> {
+        if let Some(idx) = self.inv_indices.get(&node) {
+            return Ok(*idx as u32);
+        }
+        let idx = self.indices.len();
+        if idx > u32::MAX as usize {
+            bail!(TooManyNodesError(span))
+        }
+        self.inv_indices.insert(node.clone(), idx);
+        self.indices.push(node);
+        Ok(idx as u32)
+    }
+    pub(crate) fn into_parts(self) -> (Vec<DataValue>, BTreeMap<DataValue, usize>) {
+        (self.indices, self.inv_indices)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn edges_are_grouped_in_order() {
+        let mut g = CsrGraph::new(4, vec![(2, 1), (0, 3), (2, 0), (0, 1), (2, 1)]);
+        assert_eq!(g.node_count(), 4);
+        assert_eq!(g.edges(0), &[3, 1]);
+        assert_eq!(g.edges(1), &[] as &[u32]);
+        assert_eq!(g.edges(2), &[1, 0, 1]);
+        assert_eq!(g.edges(3), &[] as &[u32]);
+        let t = g.transpose();
+        assert_eq!(t.edges(0), &[2]);
+        assert_eq!(t.edges(1), &[0, 2]);
+        assert_eq!(t.edges(3), &[0]);
+        g.dedup();
+        assert_eq!(g.edges(0), &[1, 3]);
+        assert_eq!(g.edges(2), &[0, 1]);
+        assert_eq!(g.edges(3), &[] as &[u32]);
+    }
+}
@@ -144,7 +144,7 @@ impl AlgoImpl for CsvReader {
                     }
                 }
             }
-            out.put(out_tuple, 0);
+            out.put(out_tuple, 0)?;
             Ok(())
         };
 
@@ -63,7 +63,7 @@ impl AlgoImpl for DegreeCentrality {
                 DataValue::from(out_d as i64),
                 DataValue::from(in_d as i64),
             ]);
-            out.put(tuple, 0);
+            out.put(tuple, 0)?;
             poison.check()?;
         }
         Ok(())
@@ -102,7 +102,7 @@ impl AlgoImpl for Dfs {
             route.push(starting.clone());
             route.reverse();
             let tuple = Tuple(vec![starting, ending, DataValue::List(route)]);
-            out.put(tuple, 0);
+            out.put(tuple, 0)?;
             poison.check()?;
         }
         Ok(())
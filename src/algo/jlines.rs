@@ -80,7 +80,7 @@ impl AlgoImpl for JsonReader {
                 };
                 ret.push(val);
             }
-            out.put(Tuple(ret), 0);
+            out.put(Tuple(ret), 0)?;
             Ok(())
         };
         match url.strip_prefix("file://") {
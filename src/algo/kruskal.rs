@@ -48,7 +48,7 @@ impl AlgoImpl for MinimumSpanningForestKruskal {
                     DataValue::from(cost),
                 ]),
                 0,
-            );
+            )?;
         }
 
         Ok(())
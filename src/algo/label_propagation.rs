@@ -9,6 +9,7 @@ use miette::Result;
 use rand::prelude::*;
 use smartstring::{LazyCompact, SmartString};
 
+use crate::algo::csr::CsrGraph;
 use crate::algo::AlgoImpl;
 use crate::data::expr::Expr;
 use crate::data::program::{MagicAlgoApply, MagicSymbol};
@@ -35,11 +36,11 @@ impl AlgoImpl for LabelPropagation {
         let undirected = algo.bool_option("undirected", Some(false))?;
         let max_iter = algo.pos_integer_option("max_iter", Some(10))?;
         let (graph, indices, _inv_indices, _) =
-            edges.convert_edge_to_weighted_graph(undirected, true, tx, stores)?;
+            edges.convert_edge_to_weighted_csr(undirected, true, tx, stores)?;
         let labels = label_propagation(&graph, max_iter, poison)?;
         for (idx, label) in labels.into_iter().enumerate() {
             let node = indices[idx].clone();
-            out.put(Tuple(vec![DataValue::from(label as i64), node]), 0);
+            out.put(Tuple(vec![DataValue::from(label as i64), node]), 0)?;
         }
         Ok(())
     }
@@ -55,11 +56,11 @@ impl AlgoImpl for LabelPropagation {
 }
 
 fn label_propagation(
-    graph: &[Vec<(usize, f64)>],
+    graph: &CsrGraph<(u32, f64)>,
     max_iter: usize,
     poison: Poison,
 ) -> Result<Vec<usize>> {
-    let n_nodes = graph.len();
+    let n_nodes = graph.node_count();
     let mut labels = (0..n_nodes).collect_vec();
     let mut rng = thread_rng();
     let mut iter_order = (0..n_nodes).collect_vec();
@@ -68,12 +69,12 @@ fn label_propagation(
         let mut changed = false;
         for node in &iter_order {
             let mut labels_for_node: BTreeMap<usize, f64> = BTreeMap::new();
-            let neighbours = &graph[*node];
+            let neighbours = graph.edges(*node);
             if neighbours.is_empty() {
                 continue;
             }
             for (to_node, weight) in neighbours {
-                let label = labels[*to_node];
+                let label = labels[*to_node as usize];
                 *labels_for_node.entry(label).or_default() += *weight;
             }
             let mut labels_by_score = labels_for_node.into_iter().collect_vec();
@@ -12,6 +12,7 @@ use crate::algo::all_pairs_shortest_path::{BetweennessCentrality, ClosenessCentr
 use crate::algo::astar::ShortestPathAStar;
 use crate::algo::bfs::Bfs;
 use crate::algo::constant::Constant;
+use crate::algo::csr::{CsrGraph, NodeIndexer};
 use crate::algo::csv::CsvReader;
 use crate::algo::degree_centrality::DegreeCentrality;
 use crate::algo::dfs::Dfs;
@@ -42,6 +43,7 @@ pub(crate) mod all_pairs_shortest_path;
 pub(crate) mod astar;
 pub(crate) mod bfs;
 pub(crate) mod constant;
+pub(crate) mod csr;
 pub(crate) mod csv;
 pub(crate) mod degree_centrality;
 pub(crate) mod dfs;
@@ -59,7 +61,8 @@ pub(crate) mod top_sort;
 pub(crate) mod triangles;
 pub(crate) mod yen;
 
-pub(crate) trait AlgoImpl {
+/// Implementations are kept in programs, which prepared scripts share between threads.
+pub(crate) trait AlgoImpl: Send {
     fn run(
         &mut self,
         tx: &SessionTx,
@@ -212,45 +215,8 @@ impl MagicAlgoRuleArg {
             let mut tuple = tuple?.0.into_iter();
             let from = tuple.next().ok_or_else(|| NotAnEdgeError(self.span()))?;
             let to = tuple.next().ok_or_else(|| NotAnEdgeError(self.span()))?;
-            let weight = match tuple.next() {
-                None => 1.0,
-                Some(d) => match d.get_float() {
-                    Some(f) => {
-                        ensure!(
-                            f.is_finite(),
-                            BadEdgeWeightError(
-                                d,
-                                self.bindings()
-                                    .get(2)
-                                    .map(|s| s.span)
-                                    .unwrap_or_else(|| self.span())
-                            )
-                        );
-                        if f < 0. {
-                            if !allow_negative_edges {
-                                bail!(BadEdgeWeightError(
-                                    d,
-                                    self.bindings()
-                                        .get(2)
-                                        .map(|s| s.span)
-                                        .unwrap_or_else(|| self.span())
-                                ));
-                            }
-                            has_neg_edge = true;
-                        }
-                        f
-                    }
-                    None => {
-                        bail!(BadEdgeWeightError(
-                            d,
-                            self.bindings()
-                                .get(2)
-                                .map(|s| s.span)
-                                .unwrap_or_else(|| self.span())
-                        ))
-                    }
-                },
-            };
+            let weight = self.edge_weight(tuple.next(), allow_negative_edges)?;
+            has_neg_edge |= weight < 0.;
             let from_idx = if let Some(idx) = inv_indices.get(&from) {
                 *idx
             } else {
@@ -276,6 +242,61 @@ impl MagicAlgoRuleArg {
         }
         Ok((graph, indices, inv_indices, has_neg_edge))
     }
+    /// Like `convert_edge_to_weighted_graph`, but in compressed sparse row form.
+    pub(crate) fn convert_edge_to_weighted_csr(
+        &self,
+        undirected: bool,
+        allow_negative_edges: bool,
+        tx: &SessionTx,
+        stores: &BTreeMap<MagicSymbol, InMemRelation>,
+    ) -> Result<(
+        CsrGraph<(u32, f64)>,
+        Vec<DataValue>,
+        BTreeMap<DataValue, usize>,
+        bool,
+    )> {
+        let mut indexer = NodeIndexer::default();
+        let mut edges = vec![];
+        let mut has_neg_edge = false;
+
+        for tuple in self.iter(tx, stores)? {
+            let mut tuple = tuple?.0.into_iter();
+            let from = tuple.next().ok_or_else(|| NotAnEdgeError(self.span()))?;
+            let to = tuple.next().ok_or_else(|| NotAnEdgeError(self.span()))?;
+            let weight = self.edge_weight(tuple.next(), allow_negative_edges)?;
+            has_neg_edge |= weight < 0.;
+            let from_idx = indexer.index(from, self.span())?;
+            let to_idx = indexer.index(to, self.span())?;
+            edges.push((from_idx, (to_idx, weight)));
+            if undirected {
+                edges.push((to_idx, (from_idx, weight)));
+            }
+        }
+        let (indices, inv_indices) = indexer.into_parts();
+        let graph = CsrGraph::new(indices.len(), edges);
+        Ok((graph, indices, inv_indices, has_neg_edge))
+    }
+    fn edge_weight(&self, d: Option<DataValue>, allow_negative_edges: bool) -> Result<f64> {
+        let d = match d {
+            None => return Ok(1.0),
+            Some(d) => d,
+        };
+        let span = self
+            .bindings()
+            .get(2)
+            .map(|s| s.span)
+            .unwrap_or_else(|| self.span());
+        match d.get_float() {
+            Some(f) => {
+                ensure!(f.is_finite(), BadEdgeWeightError(d, span));
+                if f < 0. && !allow_negative_edges {
+                    bail!(BadEdgeWeightError(d, span));
+                }
+                Ok(f)
+            }
+            None => bail!(BadEdgeWeightError(d, span)),
+        }
+    }
     pub(crate) fn convert_edge_to_graph(
         &self,
         undirected: bool,
@@ -316,6 +337,32 @@ impl MagicAlgoRuleArg {
         Ok((graph, indices, inv_indices))
     }
 
+    /// Like `convert_edge_to_graph`, but in compressed sparse row form.
+    pub(crate) fn convert_edge_to_csr(
+        &self,
+        undirected: bool,
+        tx: &SessionTx,
+        stores: &BTreeMap<MagicSymbol, InMemRelation>,
+    ) -> Result<(CsrGraph, Vec<DataValue>, BTreeMap<DataValue, usize>)> {
+        let mut indexer = NodeIndexer::default();
+        let mut edges = vec![];
+
+        for tuple in self.iter(tx, stores)? {
+            let mut tuple = tuple?.0.into_iter();
+            let from = tuple.next().ok_or_else(|| NotAnEdgeError(self.span()))?;
+            let to = tuple.next().ok_or_else(|| NotAnEdgeError(self.span()))?;
+            let from_idx = indexer.index(from, self.span())?;
+            let to_idx = indexer.index(to, self.span())?;
+            edges.push((from_idx, to_idx));
+            if undirected {
+                edges.push((to_idx, from_idx));
+            }
+        }
+        let (indices, inv_indices) = indexer.into_parts();
+        let graph = CsrGraph::new(indices.len(), edges);
+        Ok((graph, indices, inv_indices))
+    }
+
     pub(crate) fn prefix_iter<'a>(
         &'a self,
         prefix: &DataValue,
@@ -3,13 +3,13 @@
  */
 
 use std::collections::BTreeMap;
-use std::mem;
 
 use approx::AbsDiffEq;
 use miette::Result;
-use nalgebra::{Dynamic, OMatrix, U1};
+use rayon::prelude::*;
 use smartstring::{LazyCompact, SmartString};
 
+use crate::algo::csr::CsrGraph;
 use crate::algo::AlgoImpl;
 use crate::data::expr::Expr;
 use crate::data::program::{MagicAlgoApply, MagicSymbol};
@@ -37,13 +37,13 @@ impl AlgoImpl for PageRank {
         let theta = algo.unit_interval_option("theta", Some(0.8))? as f32;
         let epsilon = algo.unit_interval_option("epsilon", Some(0.05))? as f32;
         let iterations = algo.pos_integer_option("iterations", Some(20))?;
-        let (graph, indices, _) = edges.convert_edge_to_graph(undirected, tx, stores)?;
+        let (graph, indices, _) = edges.convert_edge_to_csr(undirected, tx, stores)?;
         let res = pagerank(&graph, theta, epsilon, iterations, poison)?;
         for (idx, score) in res.iter().enumerate() {
             out.put(
                 Tuple(vec![indices[idx].clone(), DataValue::from(*score as f64)]),
                 0,
-            );
+            )?;
         }
         Ok(())
     }
@@ -58,41 +58,62 @@ impl AlgoImpl for PageRank {
     }
 }
 
+/// The scores are those of the power iteration over the matrix with `theta / n` for each
+/// edge, for every entry of the rows of nodes without edges, and `(1 - theta) / n` for all
+/// others. That matrix is dense, so each sweep adds up the part shared by all nodes once,
+/// and only goes over the edges into each node, in parallel.
 fn pagerank(
-    edges: &[Vec<usize>],
+    graph: &CsrGraph,
     theta: f32,
     epsilon: f32,
     iterations: usize,
     poison: Poison,
-) -> Result<OMatrix<f32, Dynamic, U1>> {
-    let init_val = (1. - theta) / edges.len() as f32;
-    let mut g_mat = OMatrix::<f32, Dynamic, Dynamic>::repeat(edges.len(), edges.len(), init_val);
-    let n = edges.len();
-    let empty_score = theta / n as f32;
-    for (node, to_nodes) in edges.iter().enumerate() {
-        let l = to_nodes.len();
-        if l == 0 {
-            for to_node in 0..n {
-                g_mat[(node, to_node)] = empty_score;
-            }
-        } else {
-            let score = theta / n as f32;
-            for to_node in to_nodes {
-                g_mat[(node, *to_node)] = score;
-            }
-        }
+) -> Result<Vec<f32>> {
+    let n = graph.node_count();
+    if n == 0 {
+        return Ok(vec![]);
     }
-    let mut pi_vec = OMatrix::<f32, Dynamic, U1>::repeat(edges.len(), 1.);
+    let init_val = (1. - theta) / n as f32;
+    let empty_score = theta / n as f32;
+    // duplicates removed, as an edge sets its entry in the matrix however many times it occurs
+    let in_edges = graph.transpose();
     let scale_target = (n as f32).sqrt();
-    let mut last_pi_vec = pi_vec.clone();
+    let mut pi_vec = vec![1.; n];
     for _ in 0..iterations {
-        mem::swap(&mut pi_vec, &mut last_pi_vec);
-        pi_vec = g_mat.tr_mul(&last_pi_vec);
-        pi_vec.normalize_mut();
-        let f = pi_vec.norm() / scale_target;
-        pi_vec.unscale_mut(f);
+        let (from_edges, from_empty) = graph
+            .nodes()
+            .into_par_iter()
+            .map(|node| {
+                if graph.edges(node).is_empty() {
+                    (0., pi_vec[node])
+                } else {
+                    (pi_vec[node], 0.)
+                }
+            })
+            .reduce(|| (0., 0.), |(a1, b1), (a2, b2)| (a1 + a2, b1 + b2));
+        let shared = init_val * from_edges + empty_score * from_empty;
+        let mut next: Vec<f32> = in_edges
+            .nodes()
+            .into_par_iter()
+            .map(|node| {
+                let along_edges: f32 = in_edges
+                    .edges(node)
+                    .iter()
+                    .map(|from| pi_vec[*from as usize])
+                    .sum();
+                shared + (empty_score - init_val) * along_edges
+            })
+            .collect();
+        let norm = next.par_iter().map(|v| v * v).sum::<f32>().sqrt();
+        let scale = scale_target / norm;
+        next.par_iter_mut().for_each(|v| *v *= scale);
 
-        if pi_vec.abs_diff_eq(&last_pi_vec, epsilon) {
+        let converged = next
+            .par_iter()
+            .zip(pi_vec.par_iter())
+            .all(|(a, b)| a.abs_diff_eq(b, epsilon));
+        pi_vec = next;
+        if converged {
             break;
         }
         poison.check()?;
@@ -71,7 +71,7 @@ impl AlgoImpl for MinimumSpanningTreePrim {
                     DataValue::from(cost),
                 ]),
                 0,
-            );
+            )?;
         }
         Ok(())
     }
@@ -122,7 +122,7 @@ impl AlgoImpl for RandomWalk {
                         DataValue::List(path),
                     ]),
                     0,
-                );
+                )?;
             }
         }
         Ok(())
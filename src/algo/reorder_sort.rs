@@ -113,7 +113,7 @@ impl AlgoImpl for ReorderSort {
             }
             let mut out_t = vec![DataValue::from(if break_ties { count } else { rank } as i64)];
             out_t.extend_from_slice(&val[0..val.len() - 1]);
-            out.put(Tuple(out_t), 0);
+            out.put(Tuple(out_t), 0)?;
             poison.check()?;
         }
         Ok(())
@@ -93,7 +93,7 @@ impl AlgoImpl for ShortestPathDijkstra {
                         DataValue::from(cost),
                         DataValue::List(path.into_iter().map(|u| indices[u].clone()).collect_vec()),
                     ];
-                    out.put(Tuple(t), 0)
+                    out.put(Tuple(t), 0)?;
                 }
             }
         } else {
@@ -136,7 +136,7 @@ impl AlgoImpl for ShortestPathDijkstra {
                         DataValue::from(cost),
                         DataValue::List(path.into_iter().map(|u| indices[u].clone()).collect_vec()),
                     ];
-                    out.put(Tuple(t), 0)
+                    out.put(Tuple(t), 0)?;
                 }
             }
         }
@@ -9,6 +9,7 @@ use itertools::Itertools;
 use miette::Result;
 use smartstring::{LazyCompact, SmartString};
 
+use crate::algo::csr::CsrGraph;
 use crate::algo::AlgoImpl;
 use crate::data::expr::Expr;
 use crate::data::program::{MagicAlgoApply, MagicSymbol};
@@ -42,14 +43,14 @@ impl AlgoImpl for StronglyConnectedComponent {
         let edges = algo.relation(0)?;
 
         let (graph, indices, mut inv_indices) =
-            edges.convert_edge_to_graph(!self.strong, tx, stores)?;
+            edges.convert_edge_to_csr(!self.strong, tx, stores)?;
 
         let tarjan = TarjanScc::new(&graph).run(poison)?;
         for (grp_id, cc) in tarjan.iter().enumerate() {
             for idx in cc {
                 let val = indices.get(*idx).unwrap();
                 let tuple = Tuple(vec![val.clone(), DataValue::from(grp_id as i64)]);
-                out.put(tuple, 0);
+                out.put(tuple, 0)?;
             }
         }
 
@@ -62,7 +63,7 @@ impl AlgoImpl for StronglyConnectedComponent {
                 if !inv_indices.contains_key(&node) {
                     inv_indices.insert(node.clone(), usize::MAX);
                     let tuple = Tuple(vec![node, DataValue::from(counter)]);
-                    out.put(tuple, 0);
+                    out.put(tuple, 0)?;
                     counter += 1;
                 }
             }
@@ -82,7 +83,7 @@ impl AlgoImpl for StronglyConnectedComponent {
 }
 
 pub(crate) struct TarjanScc<'a> {
-    graph: &'a [Vec<usize>],
+    graph: &'a CsrGraph,
     id: usize,
     ids: Vec<Option<usize>>,
     low: Vec<usize>,
@@ -91,18 +92,19 @@ pub(crate) struct TarjanScc<'a> {
 }
 
 impl<'a> TarjanScc<'a> {
-    pub(crate) fn new(graph: &'a [Vec<usize>]) -> Self {
+    pub(crate) fn new(graph: &'a CsrGraph) -> Self {
+        let n = graph.node_count();
         Self {
             graph,
             id: 0,
-            ids: vec![None; graph.len()],
-            low: vec![0; graph.len()],
-            on_stack: vec![false; graph.len()],
+            ids: vec![None; n],
+            low: vec![0; n],
+            on_stack: vec![false; n],
             stack: vec![],
         }
     }
     pub(crate) fn run(mut self, poison: Poison) -> Result<Vec<Vec<usize>>> {
-        for i in 0..self.graph.len() {
+        for i in self.graph.nodes() {
             if self.ids[i].is_none() {
                 self.dfs(i);
                 poison.check()?;
@@ -116,27 +118,41 @@ impl<'a> TarjanScc<'a> {
 
         Ok(low_map.into_iter().map(|(_, vs)| vs).collect_vec())
     }
-    fn dfs(&mut self, at: usize) {
+    fn visit(&mut self, at: usize) {
         self.stack.push(at);
         self.on_stack[at] = true;
         self.id += 1;
         self.ids[at] = Some(self.id);
         self.low[at] = self.id;
-        for to in &self.graph[at] {
-            let to = *to;
-            if self.ids[to].is_none() {
-                self.dfs(to);
-            }
-            if self.on_stack[to] {
-                self.low[at] = min(self.low[at], self.low[to]);
+    }
+    /// Depth first, with the frames on the heap, as large graphs have long paths.
+    fn dfs(&mut self, start: usize) {
+        let graph = self.graph;
+        // the node, and the position of the next of its edges to follow
+        let mut frames = vec![(start, 0)];
+        self.visit(start);
+        while let Some((at, pos)) = frames.pop() {
+            let edges = graph.edges(at);
+            if pos > 0 {
+                let to = edges[pos - 1] as usize;
+                if self.on_stack[to] {
+                    self.low[at] = min(self.low[at], self.low[to]);
+                }
             }
-        }
-        if self.ids[at].unwrap() == self.low[at] {
-            while let Some(node) = self.stack.pop() {
-                self.on_stack[node] = false;
-                self.low[node] = self.ids[at].unwrap();
-                if node == at {
-                    break;
+            if pos < edges.len() {
+                frames.push((at, pos + 1));
+                let to = edges[pos] as usize;
+                if self.ids[to].is_none() {
+                    self.visit(to);
+                    frames.push((to, 0));
+                }
+            } else if self.ids[at].unwrap() == self.low[at] {
+                while let Some(node) = self.stack.pop() {
+                    self.on_stack[node] = false;
+                    self.low[node] = self.ids[at].unwrap();
+                    if node == at {
+                        break;
+                    }
                 }
             }
         }
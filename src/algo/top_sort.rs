@@ -38,7 +38,7 @@ impl AlgoImpl for TopSort {
         for (idx, val_id) in sorted.iter().enumerate() {
             let val = indices.get(*val_id).unwrap();
             let tuple = Tuple(vec![DataValue::from(idx as i64), val.clone()]);
-            out.put(tuple, 0);
+            out.put(tuple, 0)?;
         }
 
         Ok(())
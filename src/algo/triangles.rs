@@ -2,12 +2,14 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
-use std::collections::{BTreeMap, BTreeSet};
+use std::cmp::Ordering;
+use std::collections::BTreeMap;
 
 use miette::Result;
 use rayon::prelude::*;
 use smartstring::{LazyCompact, SmartString};
 
+use crate::algo::csr::CsrGraph;
 use crate::algo::AlgoImpl;
 use crate::data::expr::Expr;
 use crate::data::program::{MagicAlgoApply, MagicSymbol};
@@ -31,9 +33,8 @@ impl AlgoImpl for ClusteringCoefficients {
         poison: Poison,
     ) -> Result<()> {
         let edges = algo.relation(0)?;
-        let (graph, indices, _) = edges.convert_edge_to_graph(true, tx, stores)?;
-        let graph: Vec<BTreeSet<usize>> =
-            graph.into_iter().map(|e| e.into_iter().collect()).collect();
+        let (mut graph, indices, _) = edges.convert_edge_to_csr(true, tx, stores)?;
+        graph.dedup();
         let coefficients = clustering_coefficients(&graph, poison)?;
         for (idx, (cc, n_triangles, degree)) in coefficients.into_iter().enumerate() {
             out.put(
@@ -44,7 +45,7 @@ impl AlgoImpl for ClusteringCoefficients {
                     DataValue::from(degree as i64),
                 ]),
                 0,
-            );
+            )?;
         }
 
         Ok(())
@@ -60,24 +61,23 @@ impl AlgoImpl for ClusteringCoefficients {
     }
 }
 
-fn clustering_coefficients(
-    graph: &[BTreeSet<usize>],
-    poison: Poison,
-) -> Result<Vec<(f64, usize, usize)>> {
+fn clustering_coefficients(graph: &CsrGraph, poison: Poison) -> Result<Vec<(f64, usize, usize)>> {
     graph
-        .par_iter()
-        .map(|edges| -> Result<(f64, usize, usize)> {
+        .nodes()
+        .into_par_iter()
+        .map(|node| -> Result<(f64, usize, usize)> {
+            let edges = graph.edges(node);
             let degree = edges.len();
             if degree < 2 {
                 Ok((0., 0, degree))
             } else {
+                // each edge to a neighbour closes a triangle with each common neighbour
+                // below it, counted for high degree nodes in parallel too
                 let n_triangles = edges
-                    .iter()
+                    .par_iter()
                     .map(|e_src| {
-                        edges
-                            .iter()
-                            .filter(|e_dst| e_src > e_dst && graph[*e_src].contains(*e_dst))
-                            .count()
+                        let below = &edges[..edges.partition_point(|e| e < e_src)];
+                        count_common(below, graph.edges(*e_src as usize))
                     })
                     .sum();
                 let cc = 2. * n_triangles as f64 / ((degree as f64) * ((degree as f64) - 1.));
@@ -87,3 +87,20 @@ fn clustering_coefficients(
         })
         .collect::<Result<_>>()
 }
+
+/// The number of elements in common of two sorted lists without duplicates.
+fn count_common(a: &[u32], b: &[u32]) -> usize {
+    let (mut i, mut j, mut count) = (0, 0, 0);
+    while i < a.len() && j < b.len() {
+        match a[i].cmp(&b[j]) {
+            Ordering::Less => i += 1,
+            Ordering::Greater => j += 1,
+            Ordering::Equal => {
+                count += 1;
+                i += 1;
+                j += 1;
+            }
+        }
+    }
+    count
+}
@@ -71,7 +71,7 @@ impl AlgoImpl for KShortestPathYen {
                                 path.into_iter().map(|u| indices[u].clone()).collect_vec(),
                             ),
                         ];
-                        out.put(Tuple(t), 0)
+                        out.put(Tuple(t), 0)?;
                     }
                 }
             }
@@ -98,7 +98,7 @@ impl AlgoImpl for KShortestPathYen {
                         DataValue::from(cost),
                         DataValue::List(path.into_iter().map(|u| indices[u].clone()).collect_vec()),
                     ];
-                    out.put(Tuple(t), 0)
+                    out.put(Tuple(t), 0)?;
                 }
             }
         }
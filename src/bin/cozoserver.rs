@@ -2,11 +2,14 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
+use std::collections::HashMap;
 use std::fmt::Debug;
 use std::fs;
-use std::net::Ipv6Addr;
+use std::net::{IpAddr, Ipv6Addr};
 use std::path::PathBuf;
 use std::str::FromStr;
+use std::sync::{Condvar, Mutex};
+use std::thread;
 
 use clap::Parser;
 use env_logger::Env;
@@ -14,7 +17,7 @@ use log::{error, info};
 use rand::Rng;
 use rouille::{router, try_or_400, Request, Response};
 
-use cozo::Db;
+use cozo::{Db, DbOptions};
 
 #[derive(Parser, Debug)]
 #[clap(version, about, long_about = None)]
@@ -30,6 +33,151 @@ struct Args {
     /// Port to use
     #[clap(short, long, default_value_t = 9070)]
     port: u16,
+
+    /// Size of the block cache in MiB, 0 for the storage engine default
+    #[clap(long, default_value_t = 0)]
+    block_cache_mb: usize,
+
+    /// Upper bound of memtable memory in MiB, 0 for no bound
+    #[clap(long, default_value_t = 0)]
+    memtable_budget_mb: usize,
+
+    /// Use optimistic instead of pessimistic (locking) transactions
+    #[clap(long)]
+    optimistic: bool,
+
+    /// Collect storage engine statistics and per query perf counters
+    #[clap(long)]
+    statistics: bool,
+
+    /// With `--statistics`, also time the reads of each query, which costs much more
+    #[clap(long)]
+    time_queries: bool,
+
+    /// Limit of the write rate of flushes and compactions in MiB per second, 0 for no limit
+    #[clap(long, default_value_t = 0)]
+    compaction_rate_mb: usize,
+
+    /// Use direct I/O for flushes and compactions
+    #[clap(long)]
+    direct_io: bool,
+
+    /// Limit of the copy rate of `::backup` in MiB per second, 0 for no limit
+    #[clap(long, default_value_t = 0)]
+    backup_rate_mb: u64,
+
+    /// Number of the newest backups `::backup` keeps, 0 to keep all
+    #[clap(long, default_value_t = 0)]
+    backups_to_keep: u32,
+
+    /// Directory below which scripts may write checkpoints and backups, given paths
+    /// relative to it. Scripts cannot write them unless given
+    #[clap(long)]
+    backup_root: Option<String>,
+
+    /// Serve read-only queries as a secondary of the database at `path`, which another
+    /// process writes to, keeping the files of this process in the directory given
+    #[clap(long)]
+    secondary: Option<String>,
+
+    /// How often a secondary catches up with the writes of the primary, in milliseconds
+    #[clap(long, default_value_t = 1000)]
+    catch_up_interval_ms: u64,
+
+    /// Number of queries run at once, 0 for the number of CPUs
+    #[clap(long, default_value_t = 0)]
+    workers: usize,
+
+    /// Number of queries waiting for a worker, beyond which requests are turned away
+    /// with 503
+    #[clap(long, default_value_t = 64)]
+    max_queued: usize,
+
+    /// Number of queries each client address may have running or waiting, beyond which
+    /// its requests are turned away with 429, 0 for no limit
+    #[clap(long, default_value_t = 0)]
+    max_per_client: usize,
+
+    /// Compress responses with gzip or brotli for clients accepting them
+    #[clap(long)]
+    compress: bool,
+
+    /// Seconds a query must take to be kept in the log shown by `::slow_queries`
+    #[clap(long, default_value_t = 0.1)]
+    slow_query_secs: f64,
+}
+
+/// Bounds the queries running at once, and the queries waiting for their turn, and how many
+/// of them each client may have. Requests are only taken in while there is room for them,
+/// so that bursts wait or are turned away instead of all running, and timing out, together.
+struct Admission {
+    workers: usize,
+    max_queued: usize,
+    max_per_client: usize,
+    state: Mutex<AdmissionState>,
+    turn: Condvar,
+}
+
+#[derive(Default)]
+struct AdmissionState {
+    running: usize,
+    queued: usize,
+    // running or queued
+    clients: HashMap<IpAddr, usize>,
+}
+
+enum Rejection {
+    QueueFull,
+    ClientLimit,
+}
+
+/// A turn to run a query, given up on drop.
+struct Permit<'a> {
+    admission: &'a Admission,
+    client: IpAddr,
+}
+
+impl Admission {
+    /// Waits for a worker to be free, unless the queue or the allowance of `client` is full.
+    fn admit(&self, client: IpAddr) -> Result<Permit<'_>, Rejection> {
+        let mut state = self.state.lock().unwrap();
+        let of_client = state.clients.get(&client).copied().unwrap_or(0);
+        if self.max_per_client > 0 && of_client >= self.max_per_client {
+            return Err(Rejection::ClientLimit);
+        }
+        let must_wait = state.running >= self.workers;
+        if must_wait && state.queued >= self.max_queued {
+            return Err(Rejection::QueueFull);
+        }
+        *state.clients.entry(client).or_default() += 1;
+        if must_wait {
+            state.queued += 1;
+            state = self
+                .turn
+                .wait_while(state, |s| s.running >= self.workers)
+                .unwrap();
+            state.queued -= 1;
+        }
+        state.running += 1;
+        Ok(Permit {
+            admission: self,
+            client,
+        })
+    }
+}
+
+impl Drop for Permit<'_> {
+    fn drop(&mut self) {
+        let mut state = self.admission.state.lock().unwrap();
+        state.running -= 1;
+        if let Some(n) = state.clients.get_mut(&self.client) {
+            *n -= 1;
+            if *n == 0 {
+                state.clients.remove(&self.client);
+            }
+        }
+        self.admission.turn.notify_one();
+    }
 }
 
 fn main() {
@@ -39,7 +187,27 @@ fn main() {
         eprintln!("{}", SECURITY_WARNING);
     }
 
-    let db = Db::new(args.path.as_str()).unwrap();
+    let db = Db::new_with_options(
+        args.path.as_str(),
+        DbOptions {
+            block_cache_capacity: args.block_cache_mb << 20,
+            memtable_budget: args.memtable_budget_mb << 20,
+            optimistic_transactions: args.optimistic,
+            enable_statistics: args.statistics,
+            time_queries: args.time_queries,
+            rate_limit_bytes_per_sec: args.compaction_rate_mb << 20,
+            rate_limit_auto_tune: true,
+            use_direct_io_for_flush_and_compaction: args.direct_io,
+            backup_rate_limit_bytes_per_sec: args.backup_rate_mb << 20,
+            backups_to_keep: args.backups_to_keep,
+            backup_root: args.backup_root.clone(),
+            secondary_path: args.secondary.clone(),
+            catch_up_interval_ms: args.catch_up_interval_ms,
+            slow_query_threshold_secs: args.slow_query_secs,
+            ..Default::default()
+        },
+    )
+    .unwrap();
 
     let mut path_buf = PathBuf::from(&args.path);
     path_buf.push("auth.txt");
@@ -61,8 +229,24 @@ fn main() {
     } else {
         format!("{}:{}", args.bind, args.port)
     };
+    let workers = if args.workers > 0 {
+        args.workers
+    } else {
+        thread::available_parallelism().map_or(4, |n| n.get())
+    };
+    let admission = Admission {
+        workers,
+        max_queued: args.max_queued,
+        max_per_client: args.max_per_client,
+        state: Default::default(),
+        turn: Default::default(),
+    };
+    // queued queries take a thread each while they wait, and some more threads are kept
+    // for turning requests away; connections are kept alive between requests
+    let threads = workers + args.max_queued + workers.max(4);
+    let compress = args.compress;
     println!("Database web API running at http://{}", addr);
-    rouille::start_server(addr, move |request| {
+    rouille::start_server_with_pool(addr, Some(threads), move |request| {
         let now = chrono::Utc::now().format("%Y-%m-%d %H:%M:%S%.6f");
         let log_ok = |req: &Request, _resp: &Response, elap: std::time::Duration| {
             info!("{} {} {} {:?}", now, req.method(), req.raw_url(), elap);
@@ -97,8 +281,25 @@ fn main() {
                     }
 
                     let payload: QueryPayload = try_or_400!(rouille::input::json_input(request));
+                    let _permit = match admission.admit(request.remote_addr().ip()) {
+                        Ok(permit) => permit,
+                        Err(Rejection::QueueFull) => {
+                            return Response::text("Too many queries waiting")
+                                .with_status_code(503)
+                                .with_additional_header("Retry-After", "1")
+                        }
+                        Err(Rejection::ClientLimit) => {
+                            return Response::text("Too many queries from this client")
+                                .with_status_code(429)
+                        }
+                    };
                     let result = db.run_script_fold_err(&payload.script, &payload.params);
                     let response = Response::json(&result);
+                    let response = if compress {
+                        rouille::content_encoding::apply(request, response)
+                    } else {
+                        response
+                    };
                     if let Some(serde_json::Value::Bool(true)) = result.get("ok") {
                         response
                     } else {
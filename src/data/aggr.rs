@@ -28,12 +28,12 @@ impl Clone for Aggregation {
     }
 }
 
-pub(crate) trait NormalAggrObj {
+pub(crate) trait NormalAggrObj: Send + Sync {
     fn set(&mut self, value: &DataValue) -> Result<()>;
     fn get(&self) -> Result<DataValue>;
 }
 
-pub(crate) trait MeetAggrObj {
+pub(crate) trait MeetAggrObj: Send + Sync {
     fn update(&self, left: &mut DataValue, right: &DataValue) -> Result<bool>;
 }
 
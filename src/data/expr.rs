@@ -11,7 +11,7 @@ use itertools::Itertools;
 use miette::{bail, Diagnostic, Result};
 use serde::de::{Error, Visitor};
 use serde::{Deserializer, Serializer};
-use smartstring::SmartString;
+use smartstring::{LazyCompact, SmartString};
 use thiserror::Error;
 
 use crate::data::functions::*;
@@ -47,6 +47,12 @@ pub(crate) enum Expr {
         #[serde(skip)]
         span: SourceSpan,
     },
+    /// A `$param` of a prepared script, replaced by its value before the script runs.
+    Param {
+        name: SmartString<LazyCompact>,
+        #[serde(skip)]
+        span: SourceSpan,
+    },
 }
 
 impl Debug for Expr {
@@ -87,6 +93,9 @@ impl Display for Expr {
                 }
                 writer.finish()
             }
+            Expr::Param { name, .. } => {
+                write!(f, "${}", name)
+            }
         }
     }
 }
@@ -107,6 +116,20 @@ struct BadEntityId(DataValue, #[label] SourceSpan);
 #[diagnostic(code(eval::throw))]
 struct EvalRaisedError(#[label] SourceSpan, #[help] String);
 
+#[derive(Error, Diagnostic, Debug)]
+#[error("Required parameter {0} not found")]
+#[diagnostic(code(parser::param_not_found))]
+pub(crate) struct ParamNotFoundError(pub(crate) String, #[label] pub(crate) SourceSpan);
+
+#[derive(Error, Diagnostic, Debug)]
+#[error("Parameter {0} cannot be used here in a prepared script")]
+#[diagnostic(code(eval::unfilled_param))]
+#[diagnostic(help(
+    "Params of prepared scripts are only filled in when the script runs, which is too late \
+    for query options, aggregation arguments and constant rules"
+))]
+struct UnfilledParamError(String, #[label] SourceSpan);
+
 impl Expr {
     pub(crate) fn span(&self) -> SourceSpan {
         match self {
@@ -114,7 +137,8 @@ impl Expr {
             Expr::Const { span, .. }
             | Expr::Apply { span, .. }
             | Expr::Cond { span, .. }
-            | Expr::Try { span, .. } => *span,
+            | Expr::Try { span, .. }
+            | Expr::Param { span, .. } => *span,
         }
     }
     pub(crate) fn get_binding(&self) -> Option<&Symbol> {
@@ -175,7 +199,7 @@ impl Expr {
                     .ok_or_else(|| BadBindingError(var.to_string(), var.span))?;
                 *tuple_pos = Some(found_idx)
             }
-            Expr::Const { .. } => {}
+            Expr::Const { .. } | Expr::Param { .. } => {}
             Expr::Apply { args, .. } => {
                 for arg in args.iter_mut() {
                     arg.fill_binding_indices(binding_map)?;
@@ -207,7 +231,7 @@ impl Expr {
                     coll.insert(*idx);
                 }
             }
-            Expr::Const { .. } => {}
+            Expr::Const { .. } | Expr::Param { .. } => {}
             Expr::Apply { args, .. } => {
                 for arg in args.iter() {
                     arg.do_binding_indices(coll);
@@ -235,9 +259,41 @@ impl Expr {
         self.partial_eval()?;
         match self {
             Expr::Const { val, .. } => Ok(val),
+            Expr::Param { name, span } => bail!(UnfilledParamError(format!("${}", name), span)),
             _ => bail!(NotConstError),
         }
     }
+    /// Replaces the placeholders of a prepared script with the values of its params.
+    pub(crate) fn fill_params(&mut self, params: &BTreeMap<String, DataValue>) -> Result<()> {
+        match self {
+            Expr::Param { name, span } => {
+                let span = *span;
+                let val = params
+                    .get(name.as_str())
+                    .ok_or_else(|| ParamNotFoundError(name.to_string(), span))?
+                    .clone();
+                *self = Expr::Const { val, span };
+            }
+            Expr::Binding { .. } | Expr::Const { .. } => {}
+            Expr::Apply { args, .. } => {
+                for arg in args.iter_mut() {
+                    arg.fill_params(params)?;
+                }
+            }
+            Expr::Cond { clauses, .. } => {
+                for (cond, val) in clauses {
+                    cond.fill_params(params)?;
+                    val.fill_params(params)?;
+                }
+            }
+            Expr::Try { clauses, .. } => {
+                for clause in clauses {
+                    clause.fill_params(params)?;
+                }
+            }
+        }
+        Ok(())
+    }
     pub(crate) fn partial_eval(&mut self) -> Result<()> {
         if let Expr::Apply { args, span, .. } = self {
             let span = *span;
@@ -284,7 +340,7 @@ impl Expr {
             Expr::Binding { var, .. } => {
                 coll.insert(var.clone());
             }
-            Expr::Const { .. } => {}
+            Expr::Const { .. } | Expr::Param { .. } => {}
             Expr::Apply { args, .. } => {
                 for arg in args.iter() {
                     arg.collect_bindings(coll)
@@ -331,6 +387,9 @@ impl Expr {
                 }
             },
             Expr::Const { val, .. } => Ok(val.clone()),
+            Expr::Param { name, span } => {
+                bail!(UnfilledParamError(format!("${}", name), *span))
+            }
             Expr::Apply { op, args, .. } => {
                 let args: Box<[DataValue]> = args.iter().map(|v| v.eval(bindings)).try_collect()?;
                 Ok((op.inner)(&args)
@@ -374,9 +433,11 @@ impl Expr {
     }
     pub(crate) fn extract_bound(&self, target: &Symbol) -> Result<ValueRange> {
         Ok(match self {
-            Expr::Binding { .. } | Expr::Const { .. } | Expr::Cond { .. } | Expr::Try { .. } => {
-                ValueRange::default()
-            }
+            Expr::Binding { .. }
+            | Expr::Const { .. }
+            | Expr::Cond { .. }
+            | Expr::Try { .. }
+            | Expr::Param { .. } => ValueRange::default(),
             Expr::Apply { op, args, .. } => match op.name {
                 n if n == OP_GE.name || n == OP_GT.name => {
                     if let Some(symb) = args[0].get_binding() {
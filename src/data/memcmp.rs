@@ -82,68 +82,62 @@ pub(crate) trait MemCmpEncoder: Write {
     fn encode_num(&mut self, v: Num) {
         let f = v.get_float();
         let u = order_encode_f64(f);
-        self.write_u64::<BigEndian>(u).unwrap();
         match v {
             Num::Int(i) => {
                 if i > -EXACT_INT_BOUND && i < EXACT_INT_BOUND {
-                    self.write_u8(IS_EXACT_INT).unwrap();
+                    // the common case, written in one go
+                    let mut buf = [IS_EXACT_INT; 9];
+                    buf[..8].copy_from_slice(&u.to_be_bytes());
+                    self.write_all(&buf).unwrap();
                 } else {
+                    self.write_u64::<BigEndian>(u).unwrap();
                     self.write_u8(IS_APPROX_INT).unwrap();
                     let en = order_encode_i64(i);
                     self.write_u64::<BigEndian>(en).unwrap();
                 }
             }
             Num::Float(_) => {
+                self.write_u64::<BigEndian>(u).unwrap();
                 self.write_u8(IS_FLOAT).unwrap();
             }
         }
     }
 
     fn encode_bytes(&mut self, key: &[u8]) {
-        let len = key.len();
-        let mut index = 0;
-        while index <= len {
-            let remain = len - index;
-            let mut pad: usize = 0;
-            if remain > ENC_GROUP_SIZE {
-                self.write_all(&key[index..index + ENC_GROUP_SIZE]).unwrap();
-            } else {
-                pad = ENC_GROUP_SIZE - remain;
-                self.write_all(&key[index..]).unwrap();
-                self.write_all(&ENC_ASC_PADDING[..pad]).unwrap();
-            }
-            self.write_all(&[ENC_MARKER - (pad as u8)]).unwrap();
-            index += ENC_GROUP_SIZE;
+        // each group of bytes is written together with its marker
+        let mut group = [ENC_MARKER; ENC_GROUP_SIZE + 1];
+        let mut chunks = key.chunks_exact(ENC_GROUP_SIZE);
+        for chunk in &mut chunks {
+            group[..ENC_GROUP_SIZE].copy_from_slice(chunk);
+            self.write_all(&group).unwrap();
         }
+        // the last group is always padded, even if it is all padding
+        let rest = chunks.remainder();
+        let pad = ENC_GROUP_SIZE - rest.len();
+        group[..rest.len()].copy_from_slice(rest);
+        group[rest.len()..ENC_GROUP_SIZE].copy_from_slice(&ENC_ASC_PADDING[..pad]);
+        group[ENC_GROUP_SIZE] = ENC_MARKER - (pad as u8);
+        self.write_all(&group).unwrap();
     }
 }
 
 pub fn decode_bytes(data: &[u8]) -> (Vec<u8>, &[u8]) {
-    let mut key = Vec::with_capacity(data.len() / (ENC_GROUP_SIZE + 1) * ENC_GROUP_SIZE);
-    let mut offset = 0;
     let chunk_len = ENC_GROUP_SIZE + 1;
-    loop {
-        let next_offset = offset + chunk_len;
-        debug_assert!(next_offset <= data.len());
-        let chunk = &data[offset..next_offset];
-        offset = next_offset;
-
-        let (&marker, bytes) = chunk.split_last().unwrap();
-        let pad_size = (ENC_MARKER - marker) as usize;
-
-        if pad_size == 0 {
-            key.write_all(bytes).unwrap();
-            continue;
-        }
-        debug_assert!(pad_size <= ENC_GROUP_SIZE);
-
-        let (bytes, padding) = bytes.split_at(ENC_GROUP_SIZE - pad_size);
-        key.write_all(bytes).unwrap();
-
-        debug_assert!(!padding.iter().any(|x| *x != 0));
-
-        return (key, &data[offset..]);
+    // finds the end first, so that the bytes are copied into an allocation of their size
+    let mut end = chunk_len;
+    while data[end - 1] == ENC_MARKER {
+        end += chunk_len;
+    }
+    let pad_size = (ENC_MARKER - data[end - 1]) as usize;
+    debug_assert!(pad_size <= ENC_GROUP_SIZE);
+    let len = end / chunk_len * ENC_GROUP_SIZE - pad_size;
+    let mut key = Vec::with_capacity(len);
+    for chunk in data[..end].chunks_exact(chunk_len) {
+        key.extend_from_slice(&chunk[..ENC_GROUP_SIZE]);
     }
+    key.truncate(len);
+    debug_assert!(!data[end - 1 - pad_size..end - 1].iter().any(|x| *x != 0));
+    (key, &data[end..])
 }
 
 const SIGN_MARK: u64 = 0x8000000000000000;
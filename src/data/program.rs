@@ -18,6 +18,7 @@ use crate::data::relation::StoredRelationMetadata;
 use crate::data::symb::{Symbol, PROG_ENTRY};
 use crate::data::value::DataValue;
 use crate::parse::SourceSpan;
+use crate::query::reorder::RelationEstimates;
 use crate::runtime::in_mem::InMemRelation;
 use crate::runtime::relation::InputRelationHandle;
 use crate::runtime::transact::SessionTx;
@@ -37,6 +38,10 @@ pub(crate) struct QueryOutOptions {
     pub(crate) sorters: Vec<(Symbol, SortDir)>,
     pub(crate) store_relation: Option<(InputRelationHandle, RelationOp)>,
     pub(crate) assertion: Option<QueryAssertion>,
+    /// Write the rows of a new relation as a write batch or SST files applied just before
+    /// the transaction commits, instead of through the transaction. The rows only appear at
+    /// commit, so later queries of the same script do not see them.
+    pub(crate) bulk_load: bool,
 }
 
 impl Debug for QueryOutOptions {
@@ -69,6 +74,7 @@ impl Display for QueryOutOptions {
                 metadata: StoredRelationMetadata { keys, non_keys },
                 key_bindings,
                 dep_bindings,
+                merge_ops,
                 ..
             },
             op,
@@ -93,6 +99,9 @@ impl Display for QueryOutOptions {
                 RelationOp::EnsureNot => {
                     write!(f, ":ensure_not ")?;
                 }
+                RelationOp::Merge => {
+                    write!(f, ":merge ")?;
+                }
             }
             write!(f, "{} {{", name)?;
             let mut is_first = true;
@@ -111,12 +120,16 @@ impl Display for QueryOutOptions {
             }
             write!(f, " => ")?;
             let mut is_first = true;
-            for (col, bind) in non_keys.iter().zip(dep_bindings) {
+            for (i, (col, bind)) in non_keys.iter().zip(dep_bindings).enumerate() {
                 if is_first {
                     is_first = false
                 } else {
                     write!(f, ", ")?;
                 }
+                if *op == RelationOp::Merge {
+                    write!(f, "{}: {} = {}", col.name, merge_ops[i], bind)?;
+                    continue;
+                }
                 write!(f, "{}: {}", col.name, col.typing)?;
                 if let Some(gen) = &col.default_gen {
                     write!(f, " default {}", gen)?;
@@ -127,6 +140,9 @@ impl Display for QueryOutOptions {
             writeln!(f, "}};")?;
         }
 
+        if self.bulk_load {
+            writeln!(f, ":bulk_load;")?;
+        }
         if let Some(a) = &self.assertion {
             match a {
                 QueryAssertion::AssertNone(_) => {
@@ -166,6 +182,7 @@ pub(crate) enum RelationOp {
     Rm,
     Ensure,
     EnsureNot,
+    Merge,
 }
 
 #[derive(Default)]
@@ -749,7 +766,15 @@ impl InputProgram {
         Err(NoEntryError.into())
     }
     pub(crate) fn to_normalized_program(&self, tx: &SessionTx) -> Result<NormalFormProgram> {
+        Ok(self.to_normalized_program_with_estimates(tx)?.0)
+    }
+    /// Also returns the estimates of the stored relations that the rules were ordered by.
+    pub(crate) fn to_normalized_program_with_estimates(
+        &self,
+        tx: &SessionTx,
+    ) -> Result<(NormalFormProgram, RelationEstimates)> {
         let mut prog: BTreeMap<Symbol, _> = Default::default();
+        let mut estimates = RelationEstimates::new();
         for (k, rules_or_algo) in &self.prog {
             match rules_or_algo {
                 InputInlineRulesOrAlgo::Rules { rules } => {
@@ -795,12 +820,25 @@ impl InputProgram {
                                     }))
                                 }
                             }
+                            for atom in &body {
+                                if let NormalFormAtom::Relation(v) = atom {
+                                    if estimates.contains_key(&v.name) {
+                                        continue;
+                                    }
+                                    // relations that do not exist are reported when compiled
+                                    if let Ok(handle) = tx.get_relation(&v.name, false) {
+                                        estimates
+                                            .insert(v.name.clone(), tx.relation_estimate(&handle)?);
+                                    }
+                                }
+                            }
                             let normalized_rule = NormalFormInlineRule {
                                 head: new_head.clone(),
                                 aggr: rule.aggr.clone(),
                                 body,
                             };
-                            collected_rules.push(normalized_rule.convert_to_well_ordered_rule()?);
+                            collected_rules
+                                .push(normalized_rule.convert_to_well_ordered_rule(&estimates)?);
                         }
                     }
                     prog.insert(
@@ -820,7 +858,7 @@ impl InputProgram {
                 }
             }
         }
-        Ok(NormalFormProgram { prog })
+        Ok((NormalFormProgram { prog }, estimates))
     }
 }
 
@@ -850,6 +888,42 @@ pub(crate) struct NormalFormProgram {
 #[derive(Debug, Clone)]
 pub(crate) struct StratifiedMagicProgram(pub(crate) Vec<MagicProgram>);
 
+impl StratifiedMagicProgram {
+    /// Fills in the params of a program rewritten from a prepared script.
+    pub(crate) fn fill_params(&mut self, params: &BTreeMap<String, DataValue>) -> Result<()> {
+        for prog in &mut self.0 {
+            for rules_or_algo in prog.prog.values_mut() {
+                match rules_or_algo {
+                    MagicRulesOrAlgo::Rules { rules } => {
+                        for rule in rules {
+                            for atom in &mut rule.body {
+                                match atom {
+                                    MagicAtom::Predicate(p) => {
+                                        p.fill_params(params)?;
+                                        // as done for other predicates during normalization
+                                        p.partial_eval()?;
+                                    }
+                                    MagicAtom::Unification(u) => u.expr.fill_params(params)?,
+                                    MagicAtom::Rule(_)
+                                    | MagicAtom::Relation(_)
+                                    | MagicAtom::NegatedRule(_)
+                                    | MagicAtom::NegatedRelation(_) => {}
+                                }
+                            }
+                        }
+                    }
+                    MagicRulesOrAlgo::Algo { algo } => {
+                        for option in algo.options.values_mut() {
+                            option.fill_params(params)?;
+                        }
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
 #[derive(Debug, Clone)]
 pub(crate) enum MagicRulesOrAlgo {
     Rules { rules: Vec<MagicInlineRule> },
@@ -1232,7 +1306,7 @@ pub(crate) struct Unification {
 
 impl Unification {
     pub(crate) fn is_const(&self) -> bool {
-        matches!(self.expr, Expr::Const { .. })
+        matches!(self.expr, Expr::Const { .. } | Expr::Param { .. })
     }
     pub(crate) fn bindings_in_expr(&self) -> BTreeSet<Symbol> {
         self.expr.bindings()
@@ -82,6 +82,38 @@ pub(crate) struct StoredRelationMetadata {
     pub(crate) non_keys: Vec<ColumnDef>,
 }
 
+/// Storage settings of a relation living in its own column family.
+/// Settings left as `None` are inherited from the database.
+#[derive(
+    Debug, Clone, Default, Eq, PartialEq, serde_derive::Deserialize, serde_derive::Serialize,
+)]
+pub(crate) struct ColumnFamilyConfig {
+    pub(crate) compression: Option<StorageCompression>,
+    pub(crate) compaction: Option<StorageCompaction>,
+    pub(crate) block_size: Option<usize>,
+    /// `Some(0)` turns the bloom filter off.
+    pub(crate) bloom_bits: Option<u32>,
+    /// Leading key columns making up the prefix checked against prefix bloom filters.
+    /// Without it, the prefix is the relation id and the type of the first column.
+    #[serde(default)]
+    pub(crate) prefix_columns: Option<usize>,
+}
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq, serde_derive::Deserialize, serde_derive::Serialize)]
+pub(crate) enum StorageCompression {
+    None,
+    Snappy,
+    Lz4,
+    Zstd,
+}
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq, serde_derive::Deserialize, serde_derive::Serialize)]
+pub(crate) enum StorageCompaction {
+    Level,
+    Universal,
+    Fifo,
+}
+
 impl StoredRelationMetadata {
     pub(crate) fn satisfied_by_required_col(&self, col: &ColumnDef, is_key: bool) -> Result<()> {
         let targets = if is_key { &self.keys } else { &self.non_keys };
@@ -4,7 +4,10 @@
 
 use std::fmt::{Debug, Formatter};
 
-use miette::Result;
+use miette::{ensure, Diagnostic, Result};
+use rmp_serde::Serializer;
+use serde::Serialize;
+use thiserror::Error;
 
 use crate::data::memcmp::MemCmpEncoder;
 use crate::data::value::DataValue;
@@ -35,8 +38,13 @@ impl Tuple {
         ret
     }
     pub(crate) fn decode_from_key(key: &[u8]) -> Self {
+        Self::decode_from_key_with_capacity(key, 0)
+    }
+    /// Decodes a key into a tuple with room for `capacity` values, so that the tuple is
+    /// allocated once when the arity of rows, values included, is known.
+    pub(crate) fn decode_from_key_with_capacity(key: &[u8], capacity: usize) -> Self {
         let mut remaining = &key[ENCODED_KEY_MIN_LEN..];
-        let mut ret = vec![];
+        let mut ret = Vec::with_capacity(capacity);
         while !remaining.is_empty() {
             let (val, next) = DataValue::decode_from_key(remaining);
             ret.push(val);
@@ -45,4 +53,186 @@ impl Tuple {
         Tuple(ret)
     }
 }
-pub(crate) const ENCODED_KEY_MIN_LEN: usize = 8;
\ No newline at end of file
+pub(crate) const ENCODED_KEY_MIN_LEN: usize = 8;
+
+/// Keys encoded one after another into a single buffer, which can be cleared and refilled,
+/// so that encoding a batch of keys does not allocate for each of them.
+#[derive(Default)]
+pub(crate) struct EncodedKeys {
+    buf: Vec<u8>,
+    ends: Vec<usize>,
+}
+
+impl EncodedKeys {
+    pub(crate) fn push(&mut self, prefix: RelationId, vals: &[DataValue]) {
+        self.buf.extend(prefix.0.to_be_bytes());
+        for val in vals {
+            self.buf.encode_datavalue(val);
+        }
+        self.ends.push(self.buf.len());
+    }
+    pub(crate) fn clear(&mut self) {
+        self.buf.clear();
+        self.ends.clear();
+    }
+    pub(crate) fn len(&self) -> usize {
+        self.ends.len()
+    }
+    pub(crate) fn get(&self, i: usize) -> &[u8] {
+        let start = if i == 0 { 0 } else { self.ends[i - 1] };
+        &self.buf[start..self.ends[i]]
+    }
+    pub(crate) fn iter(&self) -> impl Iterator<Item = &[u8]> {
+        (0..self.len()).map(|i| self.get(i))
+    }
+}
+
+/// Appends the non-key columns of a row in the form they are stored in: a directory made of
+/// the number of columns and the offset of each of them from the end of the directory, all
+/// big-endian `u32`s, followed by the columns in MessagePack. With the directory, a column
+/// can be decoded without decoding the others.
+pub(crate) fn encode_values(ret: &mut Vec<u8>, vals: &[DataValue]) {
+    let dir_start = ret.len();
+    ret.extend((vals.len() as u32).to_be_bytes());
+    ret.resize(dir_start + 4 * (vals.len() + 1), 0);
+    let data_start = ret.len();
+    for (i, val) in vals.iter().enumerate() {
+        let offset = ((ret.len() - data_start) as u32).to_be_bytes();
+        let pos = dir_start + 4 * (i + 1);
+        ret[pos..pos + 4].copy_from_slice(&offset);
+        val.serialize(&mut Serializer::new(&mut *ret)).unwrap();
+    }
+}
+
+#[derive(Debug, Error, Diagnostic)]
+#[error("Cannot decode the stored value {0:x?}")]
+#[diagnostic(code(deser::stored_value))]
+#[diagnostic(help("This could indicate a bug. Consider file a bug report."))]
+pub(crate) struct ValueDeserError(pub(crate) Vec<u8>);
+
+/// The non-key columns of a stored row, as written by [`encode_values`].
+pub(crate) struct EncodedValues<'a> {
+    dir: &'a [u8],
+    data: &'a [u8],
+}
+
+impl<'a> EncodedValues<'a> {
+    /// `stored` is the whole value stored for a row, starting with the relation prefix.
+    pub(crate) fn new(stored: &'a [u8]) -> Result<Self> {
+        ensure!(
+            stored.len() >= ENCODED_KEY_MIN_LEN,
+            ValueDeserError(stored.to_vec())
+        );
+        Self::from_columns(&stored[ENCODED_KEY_MIN_LEN..])
+    }
+    /// `bytes` starts with the directory, as written by [`encode_values`].
+    pub(crate) fn from_columns(bytes: &'a [u8]) -> Result<Self> {
+        let bad = || ValueDeserError(bytes.to_vec());
+        ensure!(bytes.len() >= 4, bad());
+        let n = u32::from_be_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]) as usize;
+        let dir_end = 4 * (n + 1);
+        ensure!(bytes.len() >= dir_end, bad());
+        Ok(Self {
+            dir: &bytes[4..dir_end],
+            data: &bytes[dir_end..],
+        })
+    }
+    /// Whether a stored value was written by storage version 1, which stored the columns as
+    /// one MessagePack array. Such an array never starts with a zero byte, and the first
+    /// byte of the directory is only nonzero for more than 2^24 columns.
+    pub(crate) fn is_legacy(stored: &[u8]) -> bool {
+        stored.len() > ENCODED_KEY_MIN_LEN && stored[ENCODED_KEY_MIN_LEN] != 0
+    }
+    pub(crate) fn len(&self) -> usize {
+        self.dir.len() / 4
+    }
+    fn offset(&self, i: usize) -> usize {
+        let d = &self.dir[4 * i..4 * i + 4];
+        u32::from_be_bytes([d[0], d[1], d[2], d[3]]) as usize
+    }
+    /// Decodes the `i`th column alone.
+    pub(crate) fn get(&self, i: usize) -> Result<DataValue> {
+        let start = self.offset(i);
+        let end = if i + 1 < self.len() {
+            self.offset(i + 1)
+        } else {
+            self.data.len()
+        };
+        ensure!(
+            start <= end && end <= self.data.len(),
+            ValueDeserError(self.data.to_vec())
+        );
+        rmp_serde::from_slice(&self.data[start..end])
+            .map_err(|_| ValueDeserError(self.data[start..end].to_vec()).into())
+    }
+    /// Decodes the columns for which `needed` is set, or all of them if it is `None`.
+    /// Columns not needed are left `Null`.
+    pub(crate) fn decode(&self, needed: Option<&[bool]>) -> Result<Vec<DataValue>> {
+        (0..self.len())
+            .map(|i| match needed {
+                Some(needed) if !needed.get(i).copied().unwrap_or(true) => Ok(DataValue::Null),
+                _ => self.get(i),
+            })
+            .collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn keys_encode_into_one_buffer() {
+        let tuples = [
+            Tuple(vec![DataValue::from(1), DataValue::from(-2)]),
+            Tuple(vec![]),
+            Tuple(vec![
+                DataValue::Str("a longer string".into()),
+                DataValue::from(1.5),
+            ]),
+        ];
+        let mut keys = EncodedKeys::default();
+        for _ in 0..2 {
+            keys.clear();
+            for tuple in &tuples {
+                keys.push(RelationId(3), &tuple.0);
+            }
+            assert_eq!(keys.len(), tuples.len());
+            for (key, tuple) in keys.iter().zip(tuples.iter()) {
+                assert_eq!(key, tuple.encode_as_key(RelationId(3)));
+                assert_eq!(&Tuple::decode_from_key_with_capacity(key, 4), tuple);
+            }
+        }
+    }
+
+    #[test]
+    fn values_decode_by_column() {
+        let vals = vec![
+            DataValue::from(1),
+            DataValue::Str("two".into()),
+            DataValue::List(vec![DataValue::Null, DataValue::from(3.5)]),
+        ];
+        let mut stored = RelationId(7).0.to_be_bytes().to_vec();
+        encode_values(&mut stored, &vals);
+        assert!(!EncodedValues::is_legacy(&stored));
+        let decoded = EncodedValues::new(&stored).unwrap();
+        assert_eq!(decoded.len(), 3);
+        assert_eq!(decoded.get(2).unwrap(), vals[2]);
+        assert_eq!(decoded.decode(None).unwrap(), vals);
+        assert_eq!(
+            decoded.decode(Some(&[false, true, false])).unwrap(),
+            vec![DataValue::Null, vals[1].clone(), DataValue::Null]
+        );
+
+        let mut empty = RelationId(7).0.to_be_bytes().to_vec();
+        encode_values(&mut empty, &[]);
+        assert_eq!(
+            EncodedValues::new(&empty).unwrap().decode(None).unwrap(),
+            vec![]
+        );
+
+        let mut legacy = RelationId(7).0.to_be_bytes().to_vec();
+        vals.serialize(&mut Serializer::new(&mut legacy)).unwrap();
+        assert!(EncodedValues::is_legacy(&legacy));
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+//! Internals made public for the benchmarks in `benches/` only. Nothing here is part of the
+//! API, and it may change in any release.
+
+use crate::data::json::JsonValue;
+use crate::data::tuple::{encode_values, EncodedKeys, EncodedValues, Tuple};
+use crate::data::value::DataValue;
+use crate::runtime::relation::RelationId;
+
+/// Rows to encode as stored keys and values, and their encodings to decode.
+pub struct EncodingBench {
+    rows: Vec<Vec<DataValue>>,
+    keys: EncodedKeys,
+    values: Vec<Vec<u8>>,
+}
+
+impl EncodingBench {
+    /// Each row must be a JSON array.
+    pub fn new(rows: &[JsonValue]) -> Self {
+        let rows: Vec<Vec<DataValue>> = rows
+            .iter()
+            .map(|row| {
+                row.as_array()
+                    .expect("rows must be arrays")
+                    .iter()
+                    .map(DataValue::from)
+                    .collect()
+            })
+            .collect();
+        let mut ret = Self {
+            rows,
+            keys: Default::default(),
+            values: vec![],
+        };
+        ret.encode_keys();
+        ret.encode_values();
+        ret
+    }
+    /// Encodes the rows as keys in memcmp order, and returns their total size.
+    pub fn encode_keys(&mut self) -> usize {
+        self.keys.clear();
+        for row in &self.rows {
+            self.keys.push(RelationId::new(1), row);
+        }
+        self.keys.iter().map(|key| key.len()).sum()
+    }
+    /// Decodes the keys last encoded, and returns the number of values decoded.
+    pub fn decode_keys(&self) -> usize {
+        self.keys
+            .iter()
+            .map(|key| Tuple::decode_from_key(key).0.len())
+            .sum()
+    }
+    /// Encodes the rows as stored non-key columns, and returns their total size.
+    pub fn encode_values(&mut self) -> usize {
+        self.values.clear();
+        for row in &self.rows {
+            let mut buf = RelationId::new(1).0.to_be_bytes().to_vec();
+            encode_values(&mut buf, row);
+            self.values.push(buf);
+        }
+        self.values.iter().map(|v| v.len()).sum()
+    }
+    /// Decodes the values last encoded, only the columns in `needed` if given, and returns
+    /// the number of values decoded.
+    pub fn decode_values(&self, needed: Option<&[bool]>) -> usize {
+        self.values
+            .iter()
+            .map(|v| EncodedValues::new(v).unwrap().decode(needed).unwrap().len())
+            .sum()
+    }
+}
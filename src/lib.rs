@@ -13,9 +13,14 @@
 pub use miette::Error;
 
 pub use runtime::db::Db;
+pub use runtime::db::DbOptions;
+pub use runtime::prepared::PreparedQuery;
+pub use runtime::stream::QueryStream;
 
 pub(crate) mod algo;
 pub(crate) mod data;
+#[doc(hidden)]
+pub mod internals;
 pub(crate) mod parse;
 pub(crate) mod query;
 pub(crate) mod runtime;
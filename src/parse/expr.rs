@@ -2,8 +2,6 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
-use std::collections::BTreeMap;
-
 use itertools::Itertools;
 use lazy_static::lazy_static;
 use miette::{bail, ensure, Diagnostic, Result};
@@ -11,14 +9,14 @@ use pest::pratt_parser::{Op, PrattParser};
 use smartstring::{LazyCompact, SmartString};
 use thiserror::Error;
 
-use crate::data::expr::{get_op, Expr};
+use crate::data::expr::{get_op, Expr, ParamNotFoundError};
 use crate::data::functions::{
     OP_ADD, OP_AND, OP_CONCAT, OP_DIV, OP_EQ, OP_GE, OP_GT, OP_LE, OP_LIST, OP_LT, OP_MINUS,
     OP_MOD, OP_MUL, OP_NEGATE, OP_NEQ, OP_OR, OP_POW, OP_SUB,
 };
 use crate::data::symb::Symbol;
 use crate::data::value::DataValue;
-use crate::parse::{ExtractSpan, Pair, Rule, SourceSpan};
+use crate::parse::{ExtractSpan, Pair, ParamPool, Rule, SourceSpan};
 
 lazy_static! {
     static ref PRATT_PARSER: PrattParser<Rule> = {
@@ -48,7 +46,7 @@ lazy_static! {
 #[diagnostic(code(parser::invalid_expression))]
 pub(crate) struct InvalidExpression(#[label] pub(crate) SourceSpan);
 
-pub(crate) fn build_expr(pair: Pair<'_>, param_pool: &BTreeMap<String, DataValue>) -> Result<Expr> {
+pub(crate) fn build_expr(pair: Pair<'_>, param_pool: &ParamPool<'_>) -> Result<Expr> {
     ensure!(
         pair.as_rule() == Rule::expr,
         InvalidExpression(pair.extract_span())
@@ -107,7 +105,7 @@ fn build_expr_infix(lhs: Result<Expr>, op: Pair<'_>, rhs: Result<Expr>) -> Resul
     })
 }
 
-fn build_term(pair: Pair<'_>, param_pool: &BTreeMap<String, DataValue>) -> Result<Expr> {
+fn build_term(pair: Pair<'_>, param_pool: &ParamPool<'_>) -> Result<Expr> {
     let span = pair.extract_span();
     let op = pair.as_rule();
     Ok(match op {
@@ -116,18 +114,19 @@ fn build_term(pair: Pair<'_>, param_pool: &BTreeMap<String, DataValue>) -> Resul
             tuple_pos: None,
         },
         Rule::param => {
-            #[derive(Error, Diagnostic, Debug)]
-            #[error("Required parameter {0} not found")]
-            #[diagnostic(code(parser::param_not_found))]
-            struct ParamNotFoundError(String, #[label] SourceSpan);
-
             let param_str = pair.as_str().strip_prefix('$').unwrap();
-            Expr::Const {
-                val: param_pool
-                    .get(param_str)
-                    .ok_or_else(|| ParamNotFoundError(param_str.to_string(), span))?
-                    .clone(),
-                span,
+            match param_pool {
+                ParamPool::Values(params) => Expr::Const {
+                    val: params
+                        .get(param_str)
+                        .ok_or_else(|| ParamNotFoundError(param_str.to_string(), span))?
+                        .clone(),
+                    span,
+                },
+                ParamPool::Placeholders => Expr::Param {
+                    name: SmartString::from(param_str),
+                    span,
+                },
             }
         }
         Rule::pos_int => {
@@ -97,10 +97,35 @@ pub(crate) fn parse_type(src: &str) -> Result<NullableColType> {
     parse_nullable_type(parsed.into_inner().next().unwrap())
 }
 
+/// The values of the `$params` of a script being parsed.
+pub(crate) enum ParamPool<'a> {
+    Values(&'a BTreeMap<String, DataValue>),
+    /// When preparing a script, params are kept as placeholders, to be filled in with
+    /// different values each time the script runs.
+    Placeholders,
+}
+
 pub(crate) fn parse_script(
     src: &str,
     param_pool: &BTreeMap<String, DataValue>,
 ) -> Result<CozoScript> {
+    do_parse_script(src, &ParamPool::Values(param_pool))
+}
+
+/// Parses a script to be run many times with different params.
+pub(crate) fn prepare_script(src: &str) -> Result<Vec<InputProgram>> {
+    #[derive(Debug, Error, Diagnostic)]
+    #[error("System ops cannot be prepared")]
+    #[diagnostic(code(parser::prepare_sys_op))]
+    struct PrepareSysOpError;
+
+    match do_parse_script(src, &ParamPool::Placeholders)? {
+        CozoScript::Multi(ps) => Ok(ps),
+        CozoScript::Sys(_) => bail!(PrepareSysOpError),
+    }
+}
+
+fn do_parse_script(src: &str, param_pool: &ParamPool<'_>) -> Result<CozoScript> {
     let parsed = CozoScriptParser::parse(Rule::script, src)
         .map_err(|err| {
             let span = match err.location {
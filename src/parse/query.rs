@@ -22,12 +22,15 @@ use crate::data::program::{
     InputNamedFieldRelationApplyAtom, InputProgram, InputRelationApplyAtom, InputRuleApplyAtom,
     QueryAssertion, QueryOutOptions, RelationOp, SortDir, Unification,
 };
-use crate::data::relation::{ColType, ColumnDef, NullableColType, StoredRelationMetadata};
+use crate::data::relation::{
+    ColType, ColumnDef, ColumnFamilyConfig, NullableColType, StorageCompaction, StorageCompression,
+    StoredRelationMetadata,
+};
 use crate::data::symb::{Symbol, PROG_ENTRY};
 use crate::data::value::DataValue;
 use crate::parse::expr::build_expr;
-use crate::parse::schema::parse_schema;
-use crate::parse::{ExtractSpan, Pair, Pairs, Rule, SourceSpan};
+use crate::parse::schema::{parse_merge_schema, parse_schema};
+use crate::parse::{ExtractSpan, Pair, Pairs, ParamPool, Rule, SourceSpan};
 use crate::runtime::relation::InputRelationHandle;
 
 #[derive(Error, Diagnostic, Debug)]
@@ -84,13 +87,12 @@ fn merge_spans(symbs: &[Symbol]) -> SourceSpan {
     fst
 }
 
-pub(crate) fn parse_query(
-    src: Pairs<'_>,
-    param_pool: &BTreeMap<String, DataValue>,
-) -> Result<InputProgram> {
+pub(crate) fn parse_query(src: Pairs<'_>, param_pool: &ParamPool<'_>) -> Result<InputProgram> {
     let mut progs: BTreeMap<Symbol, InputInlineRulesOrAlgo> = Default::default();
     let mut out_opts: QueryOutOptions = Default::default();
     let mut stored_relation = None;
+    let mut storage = None;
+    let mut bulk_load_span = None;
 
     for pair in src {
         match pair.as_rule() {
@@ -304,12 +306,42 @@ pub(crate) fn parse_query(
                                 key_bindings,
                                 dep_bindings,
                                 span,
+                                column_family: None,
+                                merge_ops: vec![],
                             },
                             op,
                         )))
                     }
                 }
             }
+            Rule::merge_option => {
+                let span = pair.extract_span();
+                let mut args = pair.into_inner();
+                let name_p = args.next().unwrap();
+                let name = Symbol::new(name_p.as_str(), name_p.extract_span());
+                let (metadata, key_bindings, dep_bindings, merge_ops) =
+                    parse_merge_schema(args.next().unwrap())?;
+                stored_relation = Some(Right((
+                    InputRelationHandle {
+                        name,
+                        metadata,
+                        key_bindings,
+                        dep_bindings,
+                        span,
+                        column_family: None,
+                        merge_ops,
+                    },
+                    RelationOp::Merge,
+                )))
+            }
+            Rule::storage_option => {
+                let span = pair.extract_span();
+                storage = Some((parse_storage_option(pair, param_pool)?, span));
+            }
+            Rule::bulk_load_option => {
+                bulk_load_span = Some(pair.extract_span());
+                out_opts.bulk_load = true;
+            }
             Rule::assert_none_option => {
                 ensure!(
                     out_opts.assertion.is_none(),
@@ -381,12 +413,43 @@ pub(crate) fn parse_query(
                 key_bindings: head,
                 dep_bindings: vec![],
                 span,
+                column_family: None,
+                merge_ops: vec![],
             };
             prog.out_opts.store_relation = Some((handle, op))
         }
         Some(Right(r)) => prog.out_opts.store_relation = Some(r),
     }
 
+    if let Some((config, span)) = storage {
+        #[derive(Debug, Error, Diagnostic)]
+        #[error("Storage options can only be given when creating or replacing a relation")]
+        #[diagnostic(code(parser::storage_without_create))]
+        struct StorageWithoutCreate(#[label] SourceSpan);
+
+        match &mut prog.out_opts.store_relation {
+            Some((handle, RelationOp::Create | RelationOp::Replace)) => {
+                handle.column_family = Some(config)
+            }
+            _ => bail!(StorageWithoutCreate(span)),
+        }
+    }
+
+    if let Some(span) = bulk_load_span {
+        #[derive(Debug, Error, Diagnostic)]
+        #[error("Bulk loading is only possible when creating or replacing a relation")]
+        #[diagnostic(code(parser::bulk_load_without_create))]
+        struct BulkLoadWithoutCreate(#[label] SourceSpan);
+
+        ensure!(
+            matches!(
+                prog.out_opts.store_relation,
+                Some((_, RelationOp::Create | RelationOp::Replace))
+            ),
+            BulkLoadWithoutCreate(span)
+        );
+    }
+
     if prog.prog.is_empty() {
         if let Some((handle, RelationOp::Create)) = &prog.out_opts.store_relation {
             let mut bindings = handle.dep_bindings.clone();
@@ -414,10 +477,77 @@ pub(crate) fn parse_query(
     Ok(prog)
 }
 
-fn parse_rule(
-    src: Pair<'_>,
-    param_pool: &BTreeMap<String, DataValue>,
-) -> Result<(Symbol, InputInlineRule)> {
+fn parse_storage_option(src: Pair<'_>, param_pool: &ParamPool<'_>) -> Result<ColumnFamilyConfig> {
+    #[derive(Debug, Error, Diagnostic)]
+    #[error("Invalid value for storage option {0}")]
+    #[diagnostic(code(parser::bad_storage_option))]
+    #[diagnostic(help("{2}"))]
+    struct BadStorageOption(String, #[label] SourceSpan, &'static str);
+
+    let mut config = ColumnFamilyConfig::default();
+    for pair in src.into_inner() {
+        let mut inner = pair.into_inner();
+        let name_p = inner.next().unwrap();
+        let name = name_p.as_str();
+        let val_p = inner.next().unwrap();
+        let span = val_p.extract_span();
+        let val = build_expr(val_p, param_pool)?
+            .eval_to_const()
+            .map_err(|err| OptionNotConstantError("storage", span, [err]))?;
+        match name {
+            "compression" => {
+                let help = "Use one of 'none', 'snappy', 'lz4' or 'zstd'";
+                config.compression = Some(match val.get_string() {
+                    Some("none") => StorageCompression::None,
+                    Some("snappy") => StorageCompression::Snappy,
+                    Some("lz4") => StorageCompression::Lz4,
+                    Some("zstd") => StorageCompression::Zstd,
+                    _ => bail!(BadStorageOption(name.to_string(), span, help)),
+                })
+            }
+            "compaction" => {
+                let help = "Use one of 'level', 'universal' or 'fifo'";
+                config.compaction = Some(match val.get_string() {
+                    Some("level") => StorageCompaction::Level,
+                    Some("universal") => StorageCompaction::Universal,
+                    Some("fifo") => StorageCompaction::Fifo,
+                    _ => bail!(BadStorageOption(name.to_string(), span, help)),
+                })
+            }
+            "block_size" => {
+                let block_size = val
+                    .get_non_neg_int()
+                    .filter(|n| *n > 0)
+                    .ok_or(OptionNotPosIntError("block_size", span))?;
+                config.block_size = Some(block_size as usize)
+            }
+            "bloom_bits" => {
+                let bits = val
+                    .get_non_neg_int()
+                    .ok_or(OptionNotNonNegIntError("bloom_bits", span))?;
+                config.bloom_bits = Some(bits as u32)
+            }
+            "prefix_columns" => {
+                let n = val
+                    .get_non_neg_int()
+                    .filter(|n| *n > 0)
+                    .ok_or(OptionNotPosIntError("prefix_columns", span))?;
+                config.prefix_columns = Some(n as usize)
+            }
+            _ => {
+                let help = "Available options are 'compression', 'compaction', 'block_size', 'bloom_bits' and 'prefix_columns'";
+                bail!(BadStorageOption(
+                    name.to_string(),
+                    name_p.extract_span(),
+                    help
+                ))
+            }
+        }
+    }
+    Ok(config)
+}
+
+fn parse_rule(src: Pair<'_>, param_pool: &ParamPool<'_>) -> Result<(Symbol, InputInlineRule)> {
     let span = src.extract_span();
     let mut src = src.into_inner();
     let head = src.next().unwrap();
@@ -447,10 +577,7 @@ fn parse_rule(
     ))
 }
 
-fn parse_disjunction(
-    pair: Pair<'_>,
-    param_pool: &BTreeMap<String, DataValue>,
-) -> Result<InputAtom> {
+fn parse_disjunction(pair: Pair<'_>, param_pool: &ParamPool<'_>) -> Result<InputAtom> {
     let span = pair.extract_span();
     let res: Vec<_> = pair
         .into_inner()
@@ -463,7 +590,7 @@ fn parse_disjunction(
     })
 }
 
-fn parse_atom(src: Pair<'_>, param_pool: &BTreeMap<String, DataValue>) -> Result<InputAtom> {
+fn parse_atom(src: Pair<'_>, param_pool: &ParamPool<'_>) -> Result<InputAtom> {
     Ok(match src.as_rule() {
         Rule::rule_body => {
             let span = src.extract_span();
@@ -586,7 +713,7 @@ fn parse_atom(src: Pair<'_>, param_pool: &BTreeMap<String, DataValue>) -> Result
 
 fn parse_rule_head(
     src: Pair<'_>,
-    param_pool: &BTreeMap<String, DataValue>,
+    param_pool: &ParamPool<'_>,
 ) -> Result<(
     Symbol,
     Vec<Symbol>,
@@ -611,7 +738,7 @@ struct AggrNotFound(String, #[label] SourceSpan);
 
 fn parse_rule_head_arg(
     src: Pair<'_>,
-    param_pool: &BTreeMap<String, DataValue>,
+    param_pool: &ParamPool<'_>,
 ) -> Result<(Symbol, Option<(Aggregation, Vec<DataValue>)>)> {
     let src = src.into_inner().next().unwrap();
     Ok(match src.as_rule() {
@@ -638,10 +765,7 @@ fn parse_rule_head_arg(
     })
 }
 
-fn parse_algo_rule(
-    src: Pair<'_>,
-    param_pool: &BTreeMap<String, DataValue>,
-) -> Result<(Symbol, AlgoApply)> {
+fn parse_algo_rule(src: Pair<'_>, param_pool: &ParamPool<'_>) -> Result<(Symbol, AlgoApply)> {
     let mut src = src.into_inner();
     let (out_symbol, head, aggr) = parse_rule_head(src.next().unwrap(), param_pool)?;
 
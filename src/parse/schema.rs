@@ -14,6 +14,7 @@ use crate::data::symb::Symbol;
 use crate::data::value::DataValue;
 use crate::parse::expr::build_expr;
 use crate::parse::{ExtractSpan, Pair, Rule, SourceSpan};
+use crate::runtime::merge::MergeOp;
 
 pub(crate) fn parse_schema(
     pair: Pair<'_>,
@@ -71,6 +72,85 @@ pub(crate) fn parse_schema(
     ))
 }
 
+/// Parses the schema of `:merge`, in which each non-key column is given with the
+/// aggregation merging it instead of with a type.
+pub(crate) fn parse_merge_schema(
+    pair: Pair<'_>,
+) -> Result<(
+    StoredRelationMetadata,
+    Vec<Symbol>,
+    Vec<Symbol>,
+    Vec<MergeOp>,
+)> {
+    let mut src = pair.into_inner();
+    let mut keys = vec![];
+    let mut key_bindings = vec![];
+    let mut seen_names = BTreeSet::new();
+
+    #[derive(Debug, Error, Diagnostic)]
+    #[error("Column {0} is defined multiple times")]
+    #[diagnostic(code(parser::dup_name_in_cols))]
+    struct DuplicateNameInCols(String, #[label] SourceSpan);
+    for p in src.next().unwrap().into_inner() {
+        let span = p.extract_span();
+        let (col, ident) = parse_col(p)?;
+        if !seen_names.insert(col.name.clone()) {
+            bail!(DuplicateNameInCols(col.name.to_string(), span));
+        }
+        keys.push(col);
+        key_bindings.push(ident)
+    }
+
+    #[derive(Debug, Error, Diagnostic)]
+    #[error("Aggregation '{0}' cannot be used for merging")]
+    #[diagnostic(code(parser::bad_merge_aggr))]
+    #[diagnostic(help(
+        "Use one of sum, count, min, max, union, intersection, and, or, \
+        choice, choice_last, bit_and and bit_or"
+    ))]
+    struct BadMergeAggr(String, #[label] SourceSpan);
+
+    let mut dependents = vec![];
+    let mut dep_bindings = vec![];
+    let mut ops = vec![];
+    for p in src.next().unwrap().into_inner() {
+        let span = p.extract_span();
+        let mut inner = p.into_inner();
+        let name_p = inner.next().unwrap();
+        let name = SmartString::from(name_p.as_str());
+        if !seen_names.insert(name.clone()) {
+            bail!(DuplicateNameInCols(name.to_string(), span));
+        }
+        let aggr_p = inner.next().unwrap();
+        let op = MergeOp::parse(aggr_p.as_str())
+            .ok_or_else(|| BadMergeAggr(aggr_p.as_str().to_string(), aggr_p.extract_span()))?;
+        let binding = match inner.next() {
+            Some(bind_p) => Symbol::new(bind_p.as_str(), bind_p.extract_span()),
+            None => Symbol::new(&name as &str, name_p.extract_span()),
+        };
+        dependents.push(ColumnDef {
+            name,
+            typing: NullableColType {
+                coltype: ColType::Any,
+                nullable: true,
+            },
+            default_gen: None,
+        });
+        dep_bindings.push(binding);
+        ops.push(op);
+    }
+
+    Ok((
+        StoredRelationMetadata {
+            keys,
+            non_keys: dependents,
+        },
+        key_bindings,
+        dep_bindings,
+        ops,
+    ))
+}
+
 fn parse_col(pair: Pair<'_>) -> Result<(ColumnDef, Symbol)> {
     let mut src = pair.into_inner();
     let name_p = src.next().unwrap();
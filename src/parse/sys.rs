@@ -2,31 +2,42 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
-use std::collections::BTreeMap;
-
 use itertools::Itertools;
 use miette::{Diagnostic, Result};
 use thiserror::Error;
 
 use crate::data::program::InputProgram;
 use crate::data::symb::Symbol;
-use crate::data::value::DataValue;
+use crate::parse::expr::parse_string;
 use crate::parse::query::parse_query;
-use crate::parse::{ExtractSpan, Pairs, Rule, SourceSpan};
+use crate::parse::{ExtractSpan, Pairs, ParamPool, Rule, SourceSpan};
 use crate::runtime::relation::AccessLevel;
 
 pub(crate) enum SysOp {
-    Compact,
+    Compact(Option<Symbol>),
+    Checkpoint(String),
+    /// Backs up to the directory given, with the rate limit and retention of the database
+    Backup(String),
+    ListCompactions,
+    CancelCompaction(u64),
     ListRelation(Symbol),
     ListRelations,
     ListRunning,
+    ListSlowQueries,
     KillRunning(u64),
+    Stats,
+    /// Collects statistics for the planner, of all relations if none is given
+    Analyze(Option<Symbol>),
     Explain(Box<InputProgram>),
     RemoveRelation(Vec<Symbol>),
     RenameRelation(Vec<(Symbol, Symbol)>),
     ShowTrigger(Symbol),
     SetTriggers(Symbol, Vec<String>, Vec<String>, Vec<String>),
     SetAccessLevel(Vec<Symbol>, AccessLevel),
+    /// The key column holding the time of the rows and how many seconds they live,
+    /// or `None` to keep them forever. Expired rows stay readable until a compaction
+    /// actually runs over them.
+    SetTtl(Symbol, Option<(Symbol, u64)>),
 }
 
 #[derive(Debug, Diagnostic, Error)]
@@ -34,14 +45,53 @@ pub(crate) enum SysOp {
 #[diagnostic(code(parser::not_proc_id))]
 struct ProcessIdError(String, #[label] SourceSpan);
 
-pub(crate) fn parse_sys(
-    mut src: Pairs<'_>,
-    param_pool: &BTreeMap<String, DataValue>,
-) -> Result<SysOp> {
+#[derive(Debug, Diagnostic, Error)]
+#[error("Cannot interpret {0} as a number of seconds")]
+#[diagnostic(code(parser::not_ttl_secs))]
+struct TtlSecsError(String, #[label] SourceSpan);
+
+#[derive(Debug, Diagnostic, Error)]
+#[error("Cannot interpret {0} as compaction ID")]
+#[diagnostic(code(parser::not_compaction_id))]
+struct CompactionIdError(String, #[label] SourceSpan);
+
+pub(crate) fn parse_sys(mut src: Pairs<'_>, param_pool: &ParamPool<'_>) -> Result<SysOp> {
     let inner = src.next().unwrap();
     Ok(match inner.as_rule() {
-        Rule::compact_op => SysOp::Compact,
+        Rule::compact_op => {
+            let rel = inner
+                .into_inner()
+                .next()
+                .map(|rel_p| Symbol::new(rel_p.as_str(), rel_p.extract_span()));
+            SysOp::Compact(rel)
+        }
+        Rule::checkpoint_op => {
+            let path = parse_string(inner.into_inner().next().unwrap())?;
+            SysOp::Checkpoint(path.to_string())
+        }
+        Rule::backup_op => {
+            let dir = parse_string(inner.into_inner().next().unwrap())?;
+            SysOp::Backup(dir.to_string())
+        }
+        Rule::compactions_op => SysOp::ListCompactions,
+        Rule::cancel_compaction_op => {
+            let i_str = inner.into_inner().next().unwrap();
+            let i = i_str
+                .as_str()
+                .parse::<u64>()
+                .map_err(|_| CompactionIdError(i_str.as_str().to_string(), i_str.extract_span()))?;
+            SysOp::CancelCompaction(i)
+        }
         Rule::running_op => SysOp::ListRunning,
+        Rule::slow_queries_op => SysOp::ListSlowQueries,
+        Rule::stats_op => SysOp::Stats,
+        Rule::analyze_op => {
+            let rel = inner
+                .into_inner()
+                .next()
+                .map(|rel_p| Symbol::new(rel_p.as_str(), rel_p.extract_span()));
+            SysOp::Analyze(rel)
+        }
         Rule::kill_op => {
             let i_str = inner.into_inner().next().unwrap();
             let i = i_str
@@ -125,6 +175,23 @@ pub(crate) fn parse_sys(
             }
             SysOp::SetTriggers(rel, puts, rms, replaces)
         }
+        Rule::ttl_op => {
+            let mut src = inner.into_inner();
+            let rels_p = src.next().unwrap();
+            let rel = Symbol::new(rels_p.as_str(), rels_p.extract_span());
+            let ttl = match src.next() {
+                None => None,
+                Some(col_p) => {
+                    let col = Symbol::new(col_p.as_str(), col_p.extract_span());
+                    let secs_p = src.next().unwrap();
+                    let secs = secs_p.as_str().parse::<u64>().map_err(|_| {
+                        TtlSecsError(secs_p.as_str().to_string(), secs_p.extract_span())
+                    })?;
+                    Some((col, secs))
+                }
+            };
+            SysOp::SetTtl(rel, ttl)
+        }
         rule => unreachable!("{:?}", rule),
     })
 }
@@ -18,6 +18,7 @@ use crate::data::symb::Symbol;
 use crate::data::value::DataValue;
 use crate::parse::SourceSpan;
 use crate::query::relation::RelAlgebra;
+use crate::query::reorder::plan_stored_join;
 use crate::runtime::in_mem::InMemRelation;
 use crate::runtime::relation::{AccessLevel, InsufficientAccessLevel};
 use crate::runtime::transact::SessionTx;
@@ -151,6 +152,8 @@ impl SessionTx {
     ) -> Result<RelAlgebra> {
         let mut ret = RelAlgebra::unit(rule_name.symbol().span);
         let mut seen_variables = BTreeSet::new();
+        // estimated rows joined so far, unknown once a rule is joined
+        let mut left_rows = Some(1.);
         let mut serial_id = 0;
         let mut gen_symb = |span| {
             let ret = Symbol::new(&format!("**{}", serial_id) as &str, span);
@@ -198,6 +201,7 @@ impl SessionTx {
                     let right = RelAlgebra::derived(right_vars, store, rule_app.span);
                     debug_assert_eq!(prev_joiner_vars.len(), right_joiner_vars.len());
                     ret = ret.join(right, prev_joiner_vars, right_joiner_vars, rule_app.span);
+                    left_rows = None;
                 }
                 MagicAtom::Relation(rel_app) => {
                     let store = self.get_relation(&rel_app.name, false)?;
@@ -217,6 +221,16 @@ impl SessionTx {
                             rel_app.span
                         )
                     );
+                    let plan = match left_rows {
+                        None => None,
+                        Some(rows) => Some(plan_stored_join(
+                            &self.relation_estimate(&store)?,
+                            &rel_app.args,
+                            &seen_variables,
+                            rows,
+                        )),
+                    };
+                    left_rows = plan.map(|plan| plan.rows);
                     let mut prev_joiner_vars = vec![];
                     let mut right_joiner_vars = vec![];
                     let mut right_vars = vec![];
@@ -235,7 +249,11 @@ impl SessionTx {
 
                     let right = RelAlgebra::relation(right_vars, store, rel_app.span);
                     debug_assert_eq!(prev_joiner_vars.len(), right_joiner_vars.len());
-                    ret = ret.join(right, prev_joiner_vars, right_joiner_vars, rel_app.span);
+                    ret = if plan.map_or(false, |plan| plan.scan) {
+                        ret.scan_join(right, prev_joiner_vars, right_joiner_vars, rel_app.span)
+                    } else {
+                        ret.join(right, prev_joiner_vars, right_joiner_vars, rel_app.span)
+                    };
                 }
                 MagicAtom::NegatedRule(rule_app) => {
                     let store = stores
@@ -342,6 +360,9 @@ impl SessionTx {
                         };
                         ret = ret.filter(expr);
                     } else {
+                        if u.one_many_unif {
+                            left_rows = None;
+                        }
                         seen_variables.insert(u.binding.clone());
                         ret = ret.unify(u.binding.clone(), u.expr.clone(), u.one_many_unif, u.span);
                     }
@@ -4,18 +4,22 @@
 
 use std::collections::{BTreeMap, BTreeSet};
 use std::mem;
+use std::sync::atomic::{AtomicBool, Ordering};
 
+use itertools::Itertools;
 use log::{debug, trace};
 use miette::Result;
+use rayon::prelude::*;
 
 use crate::data::program::{MagicAlgoApply, MagicSymbol, NoEntryError};
 use crate::data::symb::{Symbol, PROG_ENTRY};
 use crate::parse::SourceSpan;
 use crate::query::compile::{AggrKind, CompiledProgram, CompiledRule, CompiledRuleSet};
-use crate::runtime::db::Poison;
+use crate::runtime::db::{Poison, QueryPerf};
 use crate::runtime::in_mem::InMemRelation;
 use crate::runtime::transact::SessionTx;
 
+#[derive(Clone)]
 pub(crate) struct QueryLimiter {
     total: Option<usize>,
     skip: Option<usize>,
@@ -39,6 +43,24 @@ impl QueryLimiter {
     }
 }
 
+/// Runs `f` on each of the tasks and returns the results in the order of the tasks. They
+/// run on the threads of the rayon pool if `parallel` and `tx` is read-only, as only then
+/// may the threads share the transaction to read through.
+fn run_all<T: Send, R: Send>(
+    tx: &SessionTx,
+    parallel: bool,
+    tasks: Vec<T>,
+    f: impl Fn(&SessionTx, T) -> Result<R> + Sync + Send,
+) -> Result<Vec<R>> {
+    match tx.share() {
+        Some(shared) if parallel && tasks.len() > 1 => tasks
+            .into_par_iter()
+            .map(|task| f(shared.get(), task))
+            .collect(),
+        _ => tasks.into_iter().map(|task| f(tx, task)).collect(),
+    }
+}
+
 impl SessionTx {
     pub(crate) fn stratified_magic_evaluate(
         &self,
@@ -47,6 +69,7 @@ impl SessionTx {
         total_num_to_take: Option<usize>,
         num_to_skip: Option<usize>,
         poison: Poison,
+        perf: &QueryPerf,
     ) -> Result<(InMemRelation, bool)> {
         let ret_area = stores
             .get(&MagicSymbol::Muggle {
@@ -63,6 +86,7 @@ impl SessionTx {
                 total_num_to_take,
                 num_to_skip,
                 poison.clone(),
+                perf,
             )?;
         }
         Ok((ret_area, early_return))
@@ -74,71 +98,99 @@ impl SessionTx {
         total_num_to_take: Option<usize>,
         num_to_skip: Option<usize>,
         poison: Poison,
+        perf: &QueryPerf,
     ) -> Result<bool> {
-        let mut changed: BTreeMap<_, _> = prog.keys().map(|k| (k, false)).collect();
-        let mut prev_changed = changed.clone();
+        let mut changed: BTreeMap<_, _> =
+            prog.keys().map(|k| (k, AtomicBool::new(false))).collect();
+        let mut prev_changed: BTreeMap<_, _> =
+            prog.keys().map(|k| (k, AtomicBool::new(false))).collect();
         let mut limiter = QueryLimiter {
             total: total_num_to_take,
             skip: num_to_skip,
             counter: 0,
         };
+        // the counters of the work done are kept per thread, so collecting them means
+        // evaluating everything on this one. Transactions that write are never shared
+        // between threads either, see `run_all`.
+        let parallel = !perf.is_collecting();
 
         let mut used_limiter = false;
 
         for epoch in 0u32.. {
             debug!("epoch {}", epoch);
-            if epoch == 0 {
-                for (k, compiled_ruleset) in prog.iter() {
-                    match compiled_ruleset {
-                        CompiledRuleSet::Rules(ruleset) => {
-                            let aggr_kind = compiled_ruleset.aggr_kind();
-                            used_limiter = self.initial_rule_eval(
-                                k,
-                                ruleset,
-                                aggr_kind,
-                                stores,
-                                &mut changed,
-                                &mut limiter,
-                                poison.clone(),
-                            )? || used_limiter;
-                        }
-                        CompiledRuleSet::Algo(algo_apply) => {
-                            self.algo_application_eval(k, algo_apply, stores, poison.clone())?;
-                        }
-                    }
-                }
-            } else {
+            if epoch != 0 {
                 mem::swap(&mut changed, &mut prev_changed);
-                for (_k, v) in changed.iter_mut() {
-                    *v = false;
+                for v in changed.values() {
+                    v.store(false, Ordering::Relaxed);
                 }
+            }
 
-                for (k, compiled_ruleset) in prog.iter() {
-                    match compiled_ruleset {
-                        CompiledRuleSet::Rules(ruleset) => {
-                            let is_meet_aggr = match compiled_ruleset.aggr_kind() {
-                                AggrKind::None => false,
-                                AggrKind::Normal => false,
-                                AggrKind::Meet => true,
-                            };
-                            used_limiter = self.incremental_rule_eval(
-                                k,
-                                ruleset,
-                                epoch,
-                                is_meet_aggr,
-                                stores,
-                                &prev_changed,
-                                &mut changed,
-                                &mut limiter,
-                                poison.clone(),
-                            )? || used_limiter;
-                        }
-
-                        CompiledRuleSet::Algo(_) => unreachable!(),
+            // Rule sets with different heads are evaluated in parallel. Each writes only to
+            // the relation of its head, and whether it reads the others as they were at the
+            // end of the last epoch or as they are being added to, all tuples derived are
+            // valid, and those added in this epoch are in the deltas for the next one.
+            // Only the entry rule counts towards the limit, the others get copies.
+            let mut copies = vec![limiter.clone(); prog.len()];
+            let mut entry_limiter = Some(&mut limiter);
+            let tasks = prog
+                .iter()
+                .zip(copies.iter_mut())
+                .map(|((k, compiled_ruleset), copy)| {
+                    let limiter = if k.is_prog_entry() {
+                        entry_limiter.take().unwrap()
+                    } else {
+                        copy
+                    };
+                    (k, compiled_ruleset, limiter)
+                })
+                .collect_vec();
+            let used = run_all(
+                self,
+                parallel,
+                tasks,
+                |tx, (k, compiled_ruleset, limiter)| match compiled_ruleset {
+                    CompiledRuleSet::Rules(ruleset) if epoch == 0 => tx.initial_rule_eval(
+                        k,
+                        ruleset,
+                        compiled_ruleset.aggr_kind(),
+                        stores,
+                        &changed[k],
+                        limiter,
+                        parallel,
+                        poison.clone(),
+                    ),
+                    CompiledRuleSet::Rules(ruleset) => {
+                        let is_meet_aggr = match compiled_ruleset.aggr_kind() {
+                            AggrKind::None => false,
+                            AggrKind::Normal => false,
+                            AggrKind::Meet => true,
+                        };
+                        tx.incremental_rule_eval(
+                            k,
+                            ruleset,
+                            epoch,
+                            is_meet_aggr,
+                            stores,
+                            &prev_changed,
+                            &changed[k],
+                            limiter,
+                            parallel,
+                            poison.clone(),
+                        )
                     }
-                }
-            }
-            if changed.values().all(|rule_changed| !*rule_changed) {
+                    CompiledRuleSet::Algo(algo_apply) if epoch == 0 => {
+                        tx.algo_application_eval(k, algo_apply, stores, poison.clone())?;
+                        Ok(false)
+                    }
+                    CompiledRuleSet::Algo(_) => unreachable!(),
+                },
+            )?;
+            used_limiter = used.into_iter().any(|u| u) || used_limiter;
+            perf.publish();
+            if changed
+                .values()
+                .all(|rule_changed| !rule_changed.load(Ordering::Relaxed))
+            {
                 break;
             }
         }
@@ -161,61 +213,72 @@ impl SessionTx {
         ruleset: &[CompiledRule],
         aggr_kind: AggrKind,
         stores: &BTreeMap<MagicSymbol, InMemRelation>,
-        changed: &mut BTreeMap<&MagicSymbol, bool>,
+        changed: &AtomicBool,
         limiter: &mut QueryLimiter,
+        parallel: bool,
         poison: Poison,
     ) -> Result<bool> {
         let store = stores.get(rule_symb).unwrap();
-        let use_delta = BTreeSet::default();
         let should_check_limit =
             limiter.total.is_some() && rule_symb.is_prog_entry() && aggr_kind != AggrKind::Meet;
         match aggr_kind {
             AggrKind::None | AggrKind::Meet => {
                 let is_meet = aggr_kind == AggrKind::Meet;
-                for (rule_n, rule) in ruleset.iter().enumerate() {
-                    debug!("initial calculation for rule {:?}.{}", rule_symb, rule_n);
-                    let mut aggr = rule.aggr.clone();
-                    for (aggr, args) in aggr.iter_mut().flatten() {
-                        aggr.meet_init(args)?;
-                    }
-                    for item_res in rule.relation.iter(self, Some(0), &use_delta)? {
-                        let item = item_res?;
-                        trace!("item for {:?}.{}: {:?} at {}", rule_symb, rule_n, item, 0);
-                        if is_meet {
-                            store.aggr_meet_put(&item, &mut aggr, 0)?;
-                        } else if should_check_limit {
-                            if !store.exists(&item, 0) {
-                                store.put_with_skip(item, limiter.should_skip_next());
-                                if limiter.incr_and_should_stop() {
-                                    trace!("early stopping due to result count limit exceeded");
-                                    return Ok(true);
-                                }
-                            }
-                        } else {
-                            store.put(item, 0);
+                let tasks = ruleset.iter().enumerate().collect_vec();
+                if should_check_limit {
+                    // in order, so that exactly the tuples up to the limit are taken
+                    for (rule_n, rule) in tasks {
+                        if self.initial_single_rule_eval(
+                            rule_symb, rule_n, rule, store, is_meet, true, changed, limiter,
+                            &poison,
+                        )? {
+                            return Ok(true);
                         }
-                        *changed.get_mut(rule_symb).unwrap() = true;
-                        poison.check()?;
                     }
+                } else {
+                    let limiter = &*limiter;
+                    run_all(self, parallel, tasks, |tx, (rule_n, rule)| {
+                        tx.initial_single_rule_eval(
+                            rule_symb,
+                            rule_n,
+                            rule,
+                            store,
+                            is_meet,
+                            false,
+                            changed,
+                            &mut limiter.clone(),
+                            &poison,
+                        )
+                    })?;
                 }
             }
             AggrKind::Normal => {
                 let store_to_use = self.new_temp_store(rule_symb.symbol().span);
-                for (rule_n, rule) in ruleset.iter().enumerate() {
-                    debug!(
-                        "Calculation for normal aggr rule {:?}.{}",
-                        rule_symb, rule_n
-                    );
-                    for (serial, item_res) in
-                        rule.relation.iter(self, Some(0), &use_delta)?.enumerate()
-                    {
-                        let item = item_res?;
-                        trace!("item for {:?}.{}: {:?} at {}", rule_symb, rule_n, item, 0);
-                        store_to_use.normal_aggr_put(&item, &rule.aggr, serial);
-                        *changed.get_mut(rule_symb).unwrap() = true;
-                        poison.check()?;
-                    }
-                }
+                let use_delta = BTreeSet::default();
+                run_all(
+                    self,
+                    parallel,
+                    ruleset.iter().enumerate().collect_vec(),
+                    |tx, (rule_n, rule)| -> Result<()> {
+                        debug!(
+                            "Calculation for normal aggr rule {:?}.{}",
+                            rule_symb, rule_n
+                        );
+                        let mut produced = 0;
+                        for (serial, item_res) in
+                            rule.relation.iter(tx, Some(0), &use_delta)?.enumerate()
+                        {
+                            let item = item_res?;
+                            trace!("item for {:?}.{}: {:?} at {}", rule_symb, rule_n, item, 0);
+                            store_to_use.normal_aggr_put(&item, &rule.aggr, serial)?;
+                            produced += 1;
+                            changed.store(true, Ordering::Relaxed);
+                            poison.check()?;
+                        }
+                        tx.cost.add_produced(rule_symb, 0, produced);
+                        Ok(())
+                    },
+                )?;
                 if store_to_use.normal_aggr_scan_and_put(
                     &ruleset[0].aggr,
                     store,
@@ -232,6 +295,50 @@ impl SessionTx {
         }
         Ok(should_check_limit)
     }
+    /// Returns `true` if the limit is reached.
+    fn initial_single_rule_eval(
+        &self,
+        rule_symb: &MagicSymbol,
+        rule_n: usize,
+        rule: &CompiledRule,
+        store: &InMemRelation,
+        is_meet: bool,
+        should_check_limit: bool,
+        changed: &AtomicBool,
+        limiter: &mut QueryLimiter,
+        poison: &Poison,
+    ) -> Result<bool> {
+        debug!("initial calculation for rule {:?}.{}", rule_symb, rule_n);
+        let use_delta = BTreeSet::default();
+        let mut aggr = rule.aggr.clone();
+        for (aggr, args) in aggr.iter_mut().flatten() {
+            aggr.meet_init(args)?;
+        }
+        let mut produced = 0;
+        for item_res in rule.relation.iter(self, Some(0), &use_delta)? {
+            let item = item_res?;
+            trace!("item for {:?}.{}: {:?} at {}", rule_symb, rule_n, item, 0);
+            produced += 1;
+            if is_meet {
+                store.aggr_meet_put(&item, &mut aggr, 0)?;
+            } else if should_check_limit {
+                if !store.exists(&item, 0)? {
+                    store.put_with_skip(item, limiter.should_skip_next())?;
+                    if limiter.incr_and_should_stop() {
+                        trace!("early stopping due to result count limit exceeded");
+                        self.cost.add_produced(rule_symb, 0, produced);
+                        return Ok(true);
+                    }
+                }
+            } else {
+                store.put(item, 0)?;
+            }
+            changed.store(true, Ordering::Relaxed);
+            poison.check()?;
+        }
+        self.cost.add_produced(rule_symb, 0, produced);
+        Ok(false)
+    }
     fn incremental_rule_eval(
         &self,
         rule_symb: &MagicSymbol,
@@ -239,19 +346,22 @@ impl SessionTx {
         epoch: u32,
         is_meet_aggr: bool,
         stores: &BTreeMap<MagicSymbol, InMemRelation>,
-        prev_changed: &BTreeMap<&MagicSymbol, bool>,
-        changed: &mut BTreeMap<&MagicSymbol, bool>,
+        prev_changed: &BTreeMap<&MagicSymbol, AtomicBool>,
+        changed: &AtomicBool,
         limiter: &mut QueryLimiter,
+        parallel: bool,
         poison: Poison,
     ) -> Result<bool> {
         let store = stores.get(rule_symb).unwrap();
         let should_check_limit =
             limiter.total.is_some() && rule_symb.is_prog_entry() && !is_meet_aggr;
+        // each rule is evaluated once for each of the deltas of the rules it contains
+        let mut tasks = vec![];
         for (rule_n, rule) in ruleset.iter().enumerate() {
             let mut should_do_calculation = false;
             for d_rule in &rule.contained_rules {
                 if let Some(changed) = prev_changed.get(d_rule) {
-                    if *changed {
+                    if changed.load(Ordering::Relaxed) {
                         should_do_calculation = true;
                         break;
                     }
@@ -260,57 +370,121 @@ impl SessionTx {
             if !should_do_calculation {
                 continue;
             }
-
-            let mut aggr = rule.aggr.clone();
-            for (aggr, args) in aggr.iter_mut().flatten() {
-                aggr.meet_init(args)?;
-            }
-
             for (delta_key, delta_store) in stores.iter() {
-                if !rule.contained_rules.contains(delta_key) {
-                    continue;
+                if rule.contained_rules.contains(delta_key) {
+                    tasks.push((rule_n, rule, delta_key, delta_store));
                 }
-                debug!(
-                    "with delta {:?} for rule {:?}.{}",
-                    delta_key, rule_symb, rule_n
-                );
-                let use_delta = BTreeSet::from([delta_store.id]);
-                for item_res in rule.relation.iter(self, Some(epoch), &use_delta)? {
-                    let item = item_res?;
-                    // improvement: the clauses can actually be evaluated in parallel
-                    if is_meet_aggr {
-                        let aggr_changed = store.aggr_meet_put(&item, &mut aggr, epoch)?;
-                        if aggr_changed {
-                            *changed.get_mut(rule_symb).unwrap() = true;
-                        }
-                    } else if store.exists(&item, 0) {
-                        trace!(
-                            "item for {:?}.{}: {:?} at {}, rederived",
-                            rule_symb,
-                            rule_n,
-                            item,
-                            epoch
-                        );
-                    } else {
-                        trace!(
-                            "item for {:?}.{}: {:?} at {}",
-                            rule_symb,
-                            rule_n,
-                            item,
-                            epoch
-                        );
-                        *changed.get_mut(rule_symb).unwrap() = true;
-                        store.put(item.clone(), epoch);
-                        store.put_with_skip(item, limiter.should_skip_next());
-                        if should_check_limit && limiter.incr_and_should_stop() {
-                            trace!("early stopping due to result count limit exceeded");
-                            return Ok(true);
-                        }
-                    }
-                    poison.check()?;
+            }
+        }
+        if should_check_limit {
+            // in order, so that exactly the tuples up to the limit are taken
+            for (rule_n, rule, delta_key, delta_store) in tasks {
+                if self.delta_rule_eval(
+                    rule_symb,
+                    rule_n,
+                    rule,
+                    epoch,
+                    is_meet_aggr,
+                    store,
+                    delta_key,
+                    delta_store,
+                    true,
+                    changed,
+                    limiter,
+                    &poison,
+                )? {
+                    return Ok(true);
                 }
             }
+        } else {
+            let limiter = &*limiter;
+            run_all(
+                self,
+                parallel,
+                tasks,
+                |tx, (rule_n, rule, delta_key, delta_store)| {
+                    tx.delta_rule_eval(
+                        rule_symb,
+                        rule_n,
+                        rule,
+                        epoch,
+                        is_meet_aggr,
+                        store,
+                        delta_key,
+                        delta_store,
+                        false,
+                        changed,
+                        &mut limiter.clone(),
+                        &poison,
+                    )
+                },
+            )?;
         }
         Ok(should_check_limit)
     }
+    /// Returns `true` if the limit is reached.
+    fn delta_rule_eval(
+        &self,
+        rule_symb: &MagicSymbol,
+        rule_n: usize,
+        rule: &CompiledRule,
+        epoch: u32,
+        is_meet_aggr: bool,
+        store: &InMemRelation,
+        delta_key: &MagicSymbol,
+        delta_store: &InMemRelation,
+        should_check_limit: bool,
+        changed: &AtomicBool,
+        limiter: &mut QueryLimiter,
+        poison: &Poison,
+    ) -> Result<bool> {
+        debug!(
+            "with delta {:?} for rule {:?}.{}",
+            delta_key, rule_symb, rule_n
+        );
+        let mut aggr = rule.aggr.clone();
+        for (aggr, args) in aggr.iter_mut().flatten() {
+            aggr.meet_init(args)?;
+        }
+        let use_delta = BTreeSet::from([delta_store.id]);
+        let mut produced = 0;
+        for item_res in rule.relation.iter(self, Some(epoch), &use_delta)? {
+            let item = item_res?;
+            // rederived tuples are counted too, as deriving them is the work done
+            produced += 1;
+            if is_meet_aggr {
+                let aggr_changed = store.aggr_meet_put(&item, &mut aggr, epoch)?;
+                if aggr_changed {
+                    changed.store(true, Ordering::Relaxed);
+                }
+            } else if store.exists(&item, 0)? {
+                trace!(
+                    "item for {:?}.{}: {:?} at {}, rederived",
+                    rule_symb,
+                    rule_n,
+                    item,
+                    epoch
+                );
+            } else {
+                trace!(
+                    "item for {:?}.{}: {:?} at {}",
+                    rule_symb,
+                    rule_n,
+                    item,
+                    epoch
+                );
+                changed.store(true, Ordering::Relaxed);
+                store.put(item.clone(), epoch)?;
+                store.put_with_skip(item, limiter.should_skip_next())?;
+                if should_check_limit && limiter.incr_and_should_stop() {
+                    trace!("early stopping due to result count limit exceeded");
+                    self.cost.add_produced(rule_symb, epoch, produced);
+                    return Ok(true);
+                }
+            }
+            poison.check()?;
+        }
+        self.cost.add_produced(rule_symb, epoch, produced);
+        Ok(false)
+    }
 }
@@ -8,6 +8,7 @@ use std::fmt::Debug;
 use miette::Result;
 use itertools::Itertools;
 
+use crate::algo::csr::CsrGraph;
 use crate::algo::strongly_connected_components::TarjanScc;
 use crate::runtime::db::Poison;
 
@@ -23,14 +24,19 @@ where
         .enumerate()
         .map(|(idx, k)| (*k, idx))
         .collect();
-    let idx_graph = graph
+    let invert_indices = &invert_indices;
+    let edges = graph
         .values()
-        .map(|vs| -> Vec<usize> {
-            vs.iter()
-                .filter_map(|v| invert_indices.get(v).cloned())
-                .collect_vec()
+        .enumerate()
+        .flat_map(|(from, vs)| {
+            vs.iter().filter_map(move |v| {
+                invert_indices
+                    .get(v)
+                    .map(|to| (from as u32, *to as u32))
+            })
         })
         .collect_vec();
+    let idx_graph = CsrGraph::new(indices.len(), edges);
     Ok(TarjanScc::new(&idx_graph)
         .run(Poison::default())?
         .into_iter()
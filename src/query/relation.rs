@@ -18,7 +18,7 @@ use crate::data::tuple::{Tuple, TupleIter};
 use crate::data::value::DataValue;
 use crate::parse::SourceSpan;
 use crate::runtime::in_mem::{InMemRelation, StoredRelationId};
-use crate::runtime::relation::RelationHandle;
+use crate::runtime::relation::{RelationHandle, ValueProjection};
 use crate::runtime::transact::SessionTx;
 use crate::utils::swap_option_result;
 
@@ -445,6 +445,7 @@ impl RelAlgebra {
                     mut right,
                     joiner,
                     to_eliminate,
+                    materialize,
                     span,
                 } = *inner;
                 for filter in filters {
@@ -462,6 +463,7 @@ impl RelAlgebra {
                     right,
                     joiner,
                     to_eliminate,
+                    materialize,
                     span,
                 }));
                 if !remaining.is_empty() {
@@ -507,9 +509,27 @@ impl RelAlgebra {
                 right_keys,
             },
             to_eliminate: Default::default(),
+            materialize: false,
             span,
         }))
     }
+    /// Like `join`, but a stored relation on the right is scanned once into memory even
+    /// if it could be looked up by prefix for every row on the left.
+    pub(crate) fn scan_join(
+        self,
+        right: RelAlgebra,
+        left_keys: Vec<Symbol>,
+        right_keys: Vec<Symbol>,
+        span: SourceSpan,
+    ) -> Self {
+        match self.join(right, left_keys, right_keys, span) {
+            RelAlgebra::Join(mut inner) => {
+                inner.materialize = true;
+                RelAlgebra::Join(inner)
+            }
+            _ => unreachable!(),
+        }
+    }
     pub(crate) fn neg_join(
         self,
         right: RelAlgebra,
@@ -746,13 +766,39 @@ impl StoredRA {
         Ok(())
     }
 
+    /// The projection decoding only the non-key columns used by the filters, and those at
+    /// the positions in the bindings for which `is_used` holds.
+    fn value_projection(&self, is_used: impl Fn(usize) -> bool) -> ValueProjection {
+        let n_keys = self.storage.metadata.keys.len();
+        if self.bindings.len() != self.storage.arity() {
+            return None;
+        }
+        let mut in_filters = BTreeSet::new();
+        for f in &self.filters {
+            f.collect_bindings(&mut in_filters);
+        }
+        let needed = self.bindings[n_keys..]
+            .iter()
+            .enumerate()
+            .map(|(i, b)| is_used(n_keys + i) || in_filters.contains(b))
+            .collect_vec();
+        if needed.iter().all(|n| *n) {
+            None
+        } else {
+            Some(needed.into())
+        }
+    }
+
     fn prefix_join<'a>(
         &'a self,
         tx: &'a SessionTx,
         left_iter: TupleIter<'a>,
+        left_len: usize,
         (left_join_indices, right_join_indices): (Vec<usize>, Vec<usize>),
         eliminate_indices: BTreeSet<usize>,
     ) -> Result<TupleIter<'a>> {
+        // columns eliminated right after the join are never decoded
+        let projection = self.value_projection(|i| !eliminate_indices.contains(&(left_len + i)));
         let mut right_invert_indices = right_join_indices.iter().enumerate().collect_vec();
         right_invert_indices.sort_by_key(|(_, b)| **b);
         let left_to_prefix_indices = right_invert_indices
@@ -770,6 +816,7 @@ impl StoredRA {
                         .collect_vec(),
                 );
                 let filters = self.filters.clone();
+                let projection = projection.clone();
 
                 if !skip_range_check && !self.filters.is_empty() {
                     let other_bindings = &self.bindings[right_join_indices.len()..];
@@ -782,7 +829,9 @@ impl StoredRA {
                     {
                         return Left(
                             self.storage
-                                .scan_bounded_prefix(tx, &prefix, &l_bound, &u_bound)
+                                .scan_bounded_prefix_projected(
+                                    tx, &prefix, &l_bound, &u_bound, projection,
+                                )
                                 .map(move |res_found| -> Result<Option<Tuple>> {
                                     let found = res_found?;
                                     for p in filters.iter() {
@@ -801,7 +850,7 @@ impl StoredRA {
                 skip_range_check = true;
                 Right(
                     self.storage
-                        .scan_prefix(tx, &prefix)
+                        .scan_prefix_projected(tx, &prefix, projection)
                         .map(move |res_found| -> Result<Option<Tuple>> {
                             let found = res_found?;
                             for p in filters.iter() {
@@ -833,6 +882,8 @@ impl StoredRA {
         eliminate_indices: BTreeSet<usize>,
     ) -> Result<TupleIter<'a>> {
         debug_assert!(!right_join_indices.is_empty());
+        // only the joined columns are looked at
+        let projection = self.value_projection(|i| right_join_indices.contains(&i));
         let mut right_invert_indices = right_join_indices.iter().enumerate().collect_vec();
         right_invert_indices.sort_by_key(|(_, b)| **b);
         let mut left_to_prefix_indices = vec![];
@@ -854,7 +905,10 @@ impl StoredRA {
                                 .collect_vec(),
                         );
 
-                        'outer: for found in self.storage.scan_prefix(tx, &prefix) {
+                        'outer: for found in
+                            self.storage
+                                .scan_prefix_projected(tx, &prefix, projection.clone())
+                        {
                             let found = found?;
                             for (left_idx, right_idx) in
                                 left_join_indices.iter().zip(right_join_indices.iter())
@@ -891,7 +945,7 @@ impl StoredRA {
         } else {
             let mut right_join_vals = BTreeSet::new();
 
-            for tuple in self.storage.scan_all(tx) {
+            for tuple in self.storage.scan_all_projected(tx, projection) {
                 let tuple = tuple?;
                 let to_join: Box<[DataValue]> = right_join_indices
                     .iter()
@@ -1435,6 +1489,9 @@ pub(crate) struct InnerJoin {
     pub(crate) right: RelAlgebra,
     pub(crate) joiner: Joiner,
     pub(crate) to_eliminate: BTreeSet<Symbol>,
+    /// Set by the planner if scanning a stored relation is estimated to be cheaper than
+    /// looking it up once for each row.
+    pub(crate) materialize: bool,
     pub(crate) span: SourceSpan,
 }
 
@@ -1493,7 +1550,7 @@ impl InnerJoin {
                         &self.right.bindings_after_eliminate(),
                     )
                     .unwrap();
-                if join_is_prefix(&join_indices.1) {
+                if join_is_prefix(&join_indices.1) && !self.materialize {
                     "stored_prefix_join"
                 } else {
                     "stored_mat_join"
@@ -1561,10 +1618,11 @@ impl InnerJoin {
                         &self.right.bindings_after_eliminate(),
                     )
                     .unwrap();
-                if join_is_prefix(&join_indices.1) {
+                if join_is_prefix(&join_indices.1) && !self.materialize {
                     r.prefix_join(
                         tx,
                         self.left.iter(tx, epoch, use_delta)?,
+                        self.left.bindings_after_eliminate().len(),
                         join_indices,
                         eliminate_indices,
                     )
@@ -1618,7 +1676,7 @@ impl InnerJoin {
                             .map(|i| tuple.0[*i].clone())
                             .collect_vec(),
                     );
-                    throwaway.put(stored_tuple, 0);
+                    throwaway.put(stored_tuple, 0)?;
                 }
                 Err(e) => return Ok(Box::new([Err(e)].into_iter())),
             }
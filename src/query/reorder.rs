@@ -2,14 +2,20 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
-use std::collections::BTreeSet;
+use std::cmp::Ordering;
+use std::collections::{BTreeMap, BTreeSet};
 use std::mem;
 
+use itertools::Itertools;
 use miette::{bail, Diagnostic, Result};
 use thiserror::Error;
 
-use crate::data::program::{NormalFormAtom, NormalFormInlineRule};
+use crate::data::program::{
+    NormalFormAtom, NormalFormInlineRule, NormalFormRelationApplyAtom, Unification,
+};
+use crate::data::symb::Symbol;
 use crate::parse::SourceSpan;
+use crate::runtime::stats::RelationEstimate;
 
 #[derive(Diagnostic, Debug, Error)]
 #[error("Encountered unsafe negation, or empty rule definition")]
@@ -27,7 +33,12 @@ pub(crate) struct UnsafeNegation(#[label] pub(crate) SourceSpan);
 pub(crate) struct UnboundVariable(#[label] pub(crate) SourceSpan);
 
 impl NormalFormInlineRule {
-    pub(crate) fn convert_to_well_ordered_rule(self) -> Result<Self> {
+    /// Orders the atoms of the body so that every variable is bound before it is needed,
+    /// joining the stored relations in the order estimated to be cheapest.
+    pub(crate) fn convert_to_well_ordered_rule(
+        self,
+        estimates: &RelationEstimates,
+    ) -> Result<Self> {
         let mut seen_variables = BTreeSet::default();
         let mut round_1_collected = vec![];
         let mut pending = vec![];
@@ -70,6 +81,8 @@ impl NormalFormInlineRule {
             }
         }
 
+        let round_1_collected = order_by_cost(round_1_collected, estimates);
+
         let mut collected = vec![];
         seen_variables.clear();
         let mut last_pending = vec![];
@@ -165,3 +178,324 @@ impl NormalFormInlineRule {
         })
     }
 }
+
+/// Of the stored relations applied in a rule body, by name.
+pub(crate) type RelationEstimates = BTreeMap<Symbol, RelationEstimate>;
+
+// costs are counted in rows read from a stored relation
+/// Of seeking to a prefix of the keys of a stored relation.
+const SEEK_COST: f64 = 10.;
+/// Of putting a row of a stored relation into memory to join it, on top of reading it.
+const MATERIALIZE_COST: f64 = 1.;
+/// Fraction of the rows kept by each bound column that is not part of the prefix looked up.
+const FILTER_SELECTIVITY: f64 = 0.1;
+/// Rows of a rule for each row joined with it, unless all its arguments are bound. Rules
+/// are only evaluated after planning.
+const RULE_ROWS: f64 = 1000.;
+/// Segments with more stored relations are ordered greedily instead of trying every order.
+const MAX_EXHAUSTIVE_RELATIONS: usize = 6;
+
+/// How a stored relation is best joined with the rows to its left.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub(crate) struct StoredJoinPlan {
+    /// Scan the relation into memory once, instead of looking up its keys for every row.
+    pub(crate) scan: bool,
+    pub(crate) cost: f64,
+    /// Produced by the join.
+    pub(crate) rows: f64,
+}
+
+/// `args` are those of the atom applying the relation, of which the ones in `bound` are
+/// bound by the `left_rows` rows to its left.
+pub(crate) fn plan_stored_join(
+    est: &RelationEstimate,
+    args: &[Symbol],
+    bound: &BTreeSet<Symbol>,
+    left_rows: f64,
+) -> StoredJoinPlan {
+    let is_bound = args.iter().map(|arg| bound.contains(arg)).collect_vec();
+    let prefix = is_bound
+        .iter()
+        .take(est.n_keys())
+        .take_while(|b| **b)
+        .count();
+    let filtered = is_bound[prefix..].iter().filter(|b| **b).count();
+    let found = left_rows * est.rows_per_prefix(prefix);
+    let rows = found * FILTER_SELECTIVITY.powi(filtered as i32);
+    let scan_cost = SEEK_COST + est.rows * (1. + MATERIALIZE_COST) + rows;
+    // keys are only looked up if the columns bound are exactly a prefix of them
+    if filtered == 0 {
+        let lookup_cost = left_rows * SEEK_COST + found;
+        if lookup_cost <= scan_cost {
+            return StoredJoinPlan {
+                scan: false,
+                cost: lookup_cost,
+                rows,
+            };
+        }
+    }
+    StoredJoinPlan {
+        scan: true,
+        cost: scan_cost,
+        rows,
+    }
+}
+
+/// Reorders the rule applications, stored relations and unifications left after the first
+/// round of `convert_to_well_ordered_rule`, if every stored relation has an estimate.
+///
+/// Rule applications stay where they are: moving them would change which of their
+/// arguments are bound, and so their rewriting with magic sets. Only the stored relations
+/// between them are reordered, each run of them on its own.
+fn order_by_cost(atoms: Vec<NormalFormAtom>, estimates: &RelationEstimates) -> Vec<NormalFormAtom> {
+    let all_estimated = atoms.iter().all(|atom| match atom {
+        NormalFormAtom::Relation(v) => estimates
+            .get(&v.name)
+            .map_or(false, |est| est.n_keys() <= v.args.len()),
+        _ => true,
+    });
+    if !all_estimated {
+        return atoms;
+    }
+    let mut segment = Segment {
+        estimates,
+        bound: Default::default(),
+        left_rows: 1.,
+        relations: vec![],
+        unifications: vec![],
+    };
+    let mut ordered = Vec::with_capacity(atoms.len());
+    for atom in atoms {
+        match atom {
+            NormalFormAtom::Rule(r) => {
+                segment.place_into(&mut ordered);
+                if !r.args.iter().all(|arg| segment.bound.contains(arg)) {
+                    segment.left_rows *= RULE_ROWS;
+                }
+                segment.bound.extend(r.args.iter().cloned());
+                ordered.push(NormalFormAtom::Rule(r));
+            }
+            NormalFormAtom::Relation(v) => segment.relations.push(v),
+            NormalFormAtom::Unification(u) => {
+                let after = segment.relations.len();
+                segment.unifications.push((u, after));
+            }
+            NormalFormAtom::NegatedRule(_)
+            | NormalFormAtom::NegatedRelation(_)
+            | NormalFormAtom::Predicate(_) => unreachable!(),
+        }
+    }
+    segment.place_into(&mut ordered);
+    ordered
+}
+
+/// The stored relations and unifications between two rule applications.
+struct Segment<'a> {
+    estimates: &'a RelationEstimates,
+    /// By the atoms placed before the segment.
+    bound: BTreeSet<Symbol>,
+    left_rows: f64,
+    relations: Vec<NormalFormRelationApplyAtom>,
+    /// With the number of relations before them in the segment, which they stay after
+    /// unless constant: functions that are not pure would give other results if evaluated
+    /// fewer times.
+    unifications: Vec<(Unification, usize)>,
+}
+
+/// Indices into the relations and the unifications of a segment.
+enum Step {
+    Relation(usize),
+    Unification(usize),
+}
+
+struct Placement {
+    steps: Vec<Step>,
+    bound: BTreeSet<Symbol>,
+    left_rows: f64,
+    cost: f64,
+}
+
+impl Segment<'_> {
+    /// Joins the relations in `order`, with every unification as early as possible.
+    fn place(&self, order: &[usize]) -> Placement {
+        let mut placement = Placement {
+            steps: vec![],
+            bound: self.bound.clone(),
+            left_rows: self.left_rows,
+            cost: 0.,
+        };
+        let mut unified = vec![false; self.unifications.len()];
+        let mut placed = vec![false; self.relations.len()];
+        self.unify_ready(&mut placement, &mut unified, &placed);
+        for &i in order {
+            let v = &self.relations[i];
+            let plan = plan_stored_join(
+                &self.estimates[&v.name],
+                &v.args,
+                &placement.bound,
+                placement.left_rows,
+            );
+            placement.cost += plan.cost + plan.rows;
+            placement.left_rows = plan.rows;
+            placement.bound.extend(v.args.iter().cloned());
+            placement.steps.push(Step::Relation(i));
+            placed[i] = true;
+            self.unify_ready(&mut placement, &mut unified, &placed);
+        }
+        for (i, done) in unified.into_iter().enumerate() {
+            if !done {
+                placement.steps.push(Step::Unification(i));
+            }
+        }
+        placement
+    }
+    fn unify_ready(&self, placement: &mut Placement, unified: &mut [bool], placed: &[bool]) {
+        // unifications may bind variables of the ones after them
+        let mut progressed = true;
+        while progressed {
+            progressed = false;
+            for (i, (u, after)) in self.unifications.iter().enumerate() {
+                if !unified[i]
+                    && (u.is_const() || placed[..*after].iter().all(|p| *p))
+                    && u.bindings_in_expr().is_subset(&placement.bound)
+                {
+                    unified[i] = true;
+                    placement.bound.insert(u.binding.clone());
+                    placement.steps.push(Step::Unification(i));
+                    progressed = true;
+                }
+            }
+        }
+    }
+    /// Ties are broken in favour of the order written.
+    fn cheapest_order(&self) -> Vec<usize> {
+        let n = self.relations.len();
+        if n <= MAX_EXHAUSTIVE_RELATIONS {
+            let mut best: Option<(f64, Vec<usize>)> = None;
+            for order in (0..n).permutations(n) {
+                let cost = self.place(&order).cost;
+                if best.as_ref().map_or(true, |(c, _)| cost < *c) {
+                    best = Some((cost, order));
+                }
+            }
+            best.map(|(_, order)| order).unwrap_or_default()
+        } else {
+            let mut order = vec![];
+            let mut remaining = (0..n).collect_vec();
+            while !remaining.is_empty() {
+                let (pos, _) = remaining
+                    .iter()
+                    .enumerate()
+                    .map(|(pos, i)| {
+                        let mut tried = order.clone();
+                        tried.push(*i);
+                        (pos, self.place(&tried).cost)
+                    })
+                    .min_by(|(_, a), (_, b)| a.partial_cmp(b).unwrap_or(Ordering::Equal))
+                    .unwrap();
+                order.push(remaining.remove(pos));
+            }
+            order
+        }
+    }
+    /// Appends the atoms of the segment to `ordered`, and starts the next segment.
+    fn place_into(&mut self, ordered: &mut Vec<NormalFormAtom>) {
+        let placement = self.place(&self.cheapest_order());
+        let mut relations = mem::take(&mut self.relations)
+            .into_iter()
+            .map(Some)
+            .collect_vec();
+        let mut unifications = mem::take(&mut self.unifications)
+            .into_iter()
+            .map(|(u, _)| Some(u))
+            .collect_vec();
+        for step in placement.steps {
+            ordered.push(match step {
+                Step::Relation(i) => NormalFormAtom::Relation(relations[i].take().unwrap()),
+                Step::Unification(i) => {
+                    NormalFormAtom::Unification(unifications[i].take().unwrap())
+                }
+            });
+        }
+        self.bound = placement.bound;
+        self.left_rows = placement.left_rows;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::data::expr::Expr;
+    use crate::data::value::DataValue;
+
+    fn symb(name: &str) -> Symbol {
+        Symbol::new(name, SourceSpan(0, 0))
+    }
+
+    fn relation(name: &str, args: &[&str]) -> NormalFormAtom {
+        NormalFormAtom::Relation(NormalFormRelationApplyAtom {
+            name: symb(name),
+            args: args.iter().map(|a| symb(a)).collect(),
+            span: SourceSpan(0, 0),
+        })
+    }
+
+    fn order_of(body: Vec<NormalFormAtom>, estimates: &RelationEstimates) -> Vec<String> {
+        let rule = NormalFormInlineRule {
+            head: vec![symb("a")],
+            aggr: vec![None],
+            body,
+        };
+        rule.convert_to_well_ordered_rule(estimates)
+            .unwrap()
+            .body
+            .into_iter()
+            .map(|atom| match atom {
+                NormalFormAtom::Relation(v) => v.name.to_string(),
+                NormalFormAtom::Unification(u) => format!("{}=", u.binding),
+                _ => unreachable!(),
+            })
+            .collect()
+    }
+
+    #[test]
+    fn selective_relations_are_joined_first() {
+        let mut estimates = RelationEstimates::new();
+        estimates.insert(symb("big"), RelationEstimate::new(1_000_000., 2, None));
+        estimates.insert(symb("small"), RelationEstimate::new(10., 1, None));
+        // `big` is looked up by the key bound by `small`, instead of being scanned
+        let body = vec![relation("big", &["a", "b"]), relation("small", &["a"])];
+        assert_eq!(order_of(body, &estimates), vec!["small", "big"]);
+
+        // constants are bound first, however late they are written
+        let body = vec![
+            relation("small", &["b"]),
+            NormalFormAtom::Unification(Unification {
+                binding: symb("k"),
+                expr: Expr::Const {
+                    val: DataValue::from(1i64),
+                    span: SourceSpan(0, 0),
+                },
+                one_many_unif: false,
+                span: SourceSpan(0, 0),
+            }),
+            relation("big", &["k", "a"]),
+        ];
+        assert_eq!(order_of(body, &estimates), vec!["k=", "small", "big"]);
+
+        // without estimates, the order written is kept
+        let body = vec![relation("big", &["a", "b"]), relation("other", &["a"])];
+        assert_eq!(order_of(body, &estimates), vec!["big", "other"]);
+    }
+
+    #[test]
+    fn large_relations_are_scanned_instead_of_looked_up() {
+        let est = RelationEstimate::new(100., 1, None);
+        let bound = BTreeSet::from([symb("a")]);
+        assert!(!plan_stored_join(&est, &[symb("a")], &bound, 1.).scan);
+        assert!(plan_stored_join(&est, &[symb("a")], &bound, 1000.).scan);
+        // not a prefix of the keys
+        let est = RelationEstimate::new(100., 2, None);
+        assert!(plan_stored_join(&est, &[symb("b"), symb("a")], &bound, 1.).scan);
+    }
+}
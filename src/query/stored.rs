@@ -2,10 +2,10 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
-use std::collections::BTreeMap;
+use std::collections::{BTreeMap, BTreeSet};
 
 use itertools::Itertools;
-use miette::{bail, Diagnostic, Result, WrapErr};
+use miette::{bail, ensure, Diagnostic, Result, WrapErr};
 use smartstring::SmartString;
 use thiserror::Error;
 
@@ -13,12 +13,15 @@ use crate::algo::constant::Constant;
 use crate::algo::AlgoHandle;
 use crate::data::expr::Expr;
 use crate::data::program::{AlgoApply, InputInlineRulesOrAlgo, InputProgram, RelationOp};
-use crate::data::relation::{ColumnDef, NullableColType};
+use crate::data::relation::{ColType, ColumnDef, NullableColType};
 use crate::data::symb::Symbol;
-use crate::data::tuple::{Tuple, ENCODED_KEY_MIN_LEN};
+use crate::data::tuple::{EncodedKeys, EncodedValues, Tuple};
 use crate::data::value::DataValue;
-use crate::parse::parse_script;
-use crate::runtime::relation::{AccessLevel, InputRelationHandle, InsufficientAccessLevel};
+use crate::parse::{parse_script, SourceSpan};
+use crate::runtime::merge::MergeOp;
+use crate::runtime::relation::{
+    AccessLevel, InputRelationHandle, InsufficientAccessLevel, RelationCleanup, RelationTtl,
+};
 use crate::runtime::transact::SessionTx;
 use crate::Db;
 
@@ -27,6 +30,9 @@ use crate::Db;
 #[diagnostic(code(eval::relation_arity_mismatch))]
 struct RelationArityMismatch(String, usize, usize);
 
+/// Number of keys looked up together with `Tx::multi_get` when writing into relations.
+const MULTI_GET_BATCH_SIZE: usize = 1024;
+
 impl SessionTx {
     pub(crate) fn execute_relation<'a>(
         &'a mut self,
@@ -35,9 +41,12 @@ impl SessionTx {
         op: RelationOp,
         meta: &InputRelationHandle,
         headers: &[Symbol],
-    ) -> Result<Vec<(Vec<u8>, Vec<u8>)>> {
+        bulk_load: bool,
+    ) -> Result<Vec<RelationCleanup>> {
         let mut to_clear = vec![];
         let mut replaced_old_triggers = None;
+        let mut replaced_old_storage = None;
+        let mut replaced_old_ttl = None;
         if op == RelationOp::Replace {
             if let Ok(old_handle) = self.get_relation(&meta.name, true) {
                 if old_handle.access_level < AccessLevel::Normal {
@@ -50,11 +59,17 @@ impl SessionTx {
                 if old_handle.has_triggers() {
                     replaced_old_triggers = Some((old_handle.put_triggers, old_handle.rm_triggers))
                 }
+                replaced_old_storage = old_handle.column_family;
+                if let Some(ttl) = old_handle.ttl {
+                    let column = old_handle.metadata.keys[ttl.column].name.clone();
+                    replaced_old_ttl = Some((column, ttl.secs));
+                    to_clear.push(RelationCleanup::Ttl(old_handle.id, None));
+                }
                 for trigger in &old_handle.replace_triggers {
                     let program =
                         parse_script(trigger, &Default::default())?.get_single_program()?;
 
-                    let (_, cleanups) = db.run_query(self, program).map_err(|err| {
+                    let (_, cleanups) = db.run_query(self, program, None).map_err(|err| {
                         if err.source_code().is_some() {
                             err
                         } else {
@@ -69,14 +84,35 @@ impl SessionTx {
             }
         }
         let mut relation_store = if op == RelationOp::Replace || op == RelationOp::Create {
-            self.create_relation(meta.clone())?
+            let mut input_meta = meta.clone();
+            // a replaced relation keeps its storage settings unless new ones are given
+            if input_meta.column_family.is_none() {
+                input_meta.column_family = replaced_old_storage;
+            }
+            self.create_relation(input_meta)?
         } else {
-            self.get_relation(&meta.name, true)?
+            // merges commute, so they need not lock the relation against each other
+            self.get_relation(&meta.name, op != RelationOp::Merge)?
         };
         if let Some((old_put, old_retract)) = replaced_old_triggers {
             relation_store.put_triggers = old_put;
             relation_store.rm_triggers = old_retract;
         }
+        if let Some((column, secs)) = replaced_old_ttl {
+            // the TTL is kept if the new relation still has its column as a number
+            relation_store.ttl = relation_store
+                .metadata
+                .keys
+                .iter()
+                .position(|k| {
+                    k.name == column && matches!(k.typing.coltype, ColType::Int | ColType::Float)
+                })
+                .map(|column| RelationTtl { column, secs });
+            if relation_store.ttl.is_some() {
+                self.put_relation_handle(&relation_store)?;
+                to_clear.push(RelationCleanup::Ttl(relation_store.id, relation_store.ttl));
+            }
+        }
         let InputRelationHandle {
             metadata,
             key_bindings,
@@ -105,31 +141,48 @@ impl SessionTx {
                 let mut new_tuples: Vec<DataValue> = vec![];
                 let mut old_tuples: Vec<DataValue> = vec![];
 
-                for tuple in res_iter {
-                    let tuple = tuple?;
-                    let extracted = Tuple(
-                        key_extractors
-                            .iter()
-                            .map(|ex| ex.extract_data(&tuple))
-                            .try_collect()?,
-                    );
-                    let key = relation_store.adhoc_encode_key(&extracted, *span)?;
+                let mut keys = EncodedKeys::default();
+                for chunk in &res_iter.chunks(MULTI_GET_BATCH_SIZE) {
+                    let mut extracted_tuples = vec![];
+                    keys.clear();
+                    for tuple in chunk {
+                        let tuple = tuple?;
+                        let extracted = Tuple(
+                            key_extractors
+                                .iter()
+                                .map(|ex| ex.extract_data(&tuple))
+                                .try_collect()?,
+                        );
+                        relation_store.adhoc_encode_key_into(&extracted, &mut keys, *span)?;
+                        extracted_tuples.push(extracted);
+                    }
                     if has_triggers {
-                        if let Some(existing) = self.tx.get(&key, false)? {
-                            let mut tup = extracted.clone();
-                            if !existing.is_empty() {
-                                let mut remaining = &existing[ENCODED_KEY_MIN_LEN..];
-                                while !remaining.is_empty() {
-                                    let (val, nxt) = DataValue::decode_from_key(remaining);
-                                    tup.0.push(val);
-                                    remaining = nxt;
+                        let existing = self.tx.multi_get_cf(
+                            relation_store.cf_id,
+                            &keys.iter().collect_vec(),
+                            false,
+                        )?;
+                        // the keys are all looked up before any is removed, so a key that
+                        // came earlier in the chunk is already gone
+                        let mut removed = BTreeSet::new();
+                        for (i, (key, extracted)) in
+                            keys.iter().zip(extracted_tuples.into_iter()).enumerate()
+                        {
+                            if removed.insert(key) {
+                                if let Some(existing) = existing.get(i) {
+                                    let mut tup = extracted.clone();
+                                    if !existing.is_empty() {
+                                        tup.0.extend(EncodedValues::new(existing)?.decode(None)?);
+                                    }
+                                    old_tuples.push(DataValue::List(tup.0));
                                 }
                             }
-                            old_tuples.push(DataValue::List(tup.0));
+                            new_tuples.push(DataValue::List(extracted.0));
                         }
-                        new_tuples.push(DataValue::List(extracted.0.clone()));
                     }
-                    self.tx.del(&key)?;
+                    for key in keys.iter() {
+                        self.tx.del_cf(relation_store.cf_id, key)?;
+                    }
                 }
 
                 if has_triggers && !new_tuples.is_empty() {
@@ -155,7 +208,7 @@ impl SessionTx {
 
                         make_const_rule(&mut program, "_old", bindings, old_tuples.clone());
 
-                        let (_, cleanups) = db.run_query(self, program).map_err(|err| {
+                        let (_, cleanups) = db.run_query(self, program, None).map_err(|err| {
                             if err.source_code().is_some() {
                                 err
                             } else {
@@ -190,37 +243,50 @@ impl SessionTx {
                 )?;
                 key_extractors.extend(val_extractors);
 
-                for tuple in res_iter {
-                    let tuple = tuple?;
-
-                    let extracted = Tuple(
-                        key_extractors
-                            .iter()
-                            .map(|ex| ex.extract_data(&tuple))
-                            .try_collect()?,
-                    );
-
-                    let key = relation_store.adhoc_encode_key(&extracted, *span)?;
-                    let val = relation_store.adhoc_encode_val(&extracted, *span)?;
+                let mut keys = EncodedKeys::default();
+                for chunk in &res_iter.chunks(MULTI_GET_BATCH_SIZE) {
+                    let mut extracted_tuples = vec![];
+                    keys.clear();
+                    let mut vals = vec![];
+                    for tuple in chunk {
+                        let tuple = tuple?;
+                        let extracted = Tuple(
+                            key_extractors
+                                .iter()
+                                .map(|ex| ex.extract_data(&tuple))
+                                .try_collect()?,
+                        );
+                        relation_store.adhoc_encode_key_into(&extracted, &mut keys, *span)?;
+                        vals.push(relation_store.adhoc_encode_val(&extracted, *span)?);
+                        extracted_tuples.push(extracted);
+                    }
 
-                    let existing = self.tx.get(&key, true)?;
-                    match existing {
-                        None => {
-                            bail!(TransactAssertionFailure {
-                                relation: relation_store.name.to_string(),
-                                key: extracted.0,
-                                notice: "key does not exist in database".to_string()
-                            })
-                        }
-                        Some(v) => {
-                            if &v as &[u8] != &val as &[u8] {
+                    let existing = self.tx.multi_get_cf(
+                        relation_store.cf_id,
+                        &keys.iter().collect_vec(),
+                        true,
+                    )?;
+                    for (i, (extracted, val)) in
+                        extracted_tuples.into_iter().zip(vals.iter()).enumerate()
+                    {
+                        match existing.get(i) {
+                            None => {
                                 bail!(TransactAssertionFailure {
                                     relation: relation_store.name.to_string(),
                                     key: extracted.0,
-                                    notice: "key exists in database, but value does not match"
-                                        .to_string()
+                                    notice: "key does not exist in database".to_string()
                                 })
                             }
+                            Some(v) => {
+                                if v != val as &[u8] {
+                                    bail!(TransactAssertionFailure {
+                                        relation: relation_store.name.to_string(),
+                                        key: extracted.0,
+                                        notice: "key exists in database, but value does not match"
+                                            .to_string()
+                                    })
+                                }
+                            }
                         }
                     }
                 }
@@ -241,23 +307,135 @@ impl SessionTx {
                     headers,
                 )?;
 
+                let mut keys = EncodedKeys::default();
+                for chunk in &res_iter.chunks(MULTI_GET_BATCH_SIZE) {
+                    let mut extracted_tuples = vec![];
+                    keys.clear();
+                    for tuple in chunk {
+                        let tuple = tuple?;
+                        let extracted = Tuple(
+                            key_extractors
+                                .iter()
+                                .map(|ex| ex.extract_data(&tuple))
+                                .try_collect()?,
+                        );
+                        relation_store.adhoc_encode_key_into(&extracted, &mut keys, *span)?;
+                        extracted_tuples.push(extracted);
+                    }
+                    let existing = self.tx.multi_get_cf(
+                        relation_store.cf_id,
+                        &keys.iter().collect_vec(),
+                        true,
+                    )?;
+                    for (i, extracted) in extracted_tuples.into_iter().enumerate() {
+                        if existing.get(i).is_some() {
+                            bail!(TransactAssertionFailure {
+                                relation: relation_store.name.to_string(),
+                                key: extracted.0,
+                                notice: "key exists in database".to_string()
+                            })
+                        }
+                    }
+                }
+            }
+            RelationOp::Merge => {
+                if relation_store.access_level < AccessLevel::Protected {
+                    bail!(InsufficientAccessLevel(
+                        relation_store.name.to_string(),
+                        "row merging".to_string(),
+                        relation_store.access_level
+                    ));
+                }
+
+                #[derive(Debug, Error, Diagnostic)]
+                #[error("Cannot merge into relation {0}, which has put triggers")]
+                #[diagnostic(code(eval::merge_with_triggers))]
+                #[diagnostic(help(
+                    "Merging never reads the rows it changes, so triggers cannot see them"
+                ))]
+                struct MergeWithTriggers(String, #[label] SourceSpan);
+
+                ensure!(
+                    relation_store.put_triggers.is_empty(),
+                    MergeWithTriggers(relation_store.name.to_string(), *span)
+                );
+
+                #[derive(Debug, Error, Diagnostic)]
+                #[error("No aggregation is given for merging column {0}")]
+                #[diagnostic(code(eval::merge_aggr_missing))]
+                struct MergeAggrMissing(String, #[label] SourceSpan);
+
+                let ops: Vec<_> = relation_store
+                    .metadata
+                    .non_keys
+                    .iter()
+                    .map(|col| {
+                        metadata
+                            .non_keys
+                            .iter()
+                            .position(|c| c.name == col.name)
+                            .map(|i| meta.merge_ops[i])
+                            .ok_or_else(|| MergeAggrMissing(col.name.to_string(), *span))
+                    })
+                    .try_collect()?;
+
+                #[derive(Debug, Error, Diagnostic)]
+                #[error("Column {0} of type {1} cannot be merged with '{2}'")]
+                #[diagnostic(code(eval::merge_aggr_type_mismatch))]
+                struct MergeAggrTypeMismatch(String, String, MergeOp, #[label] SourceSpan);
+
+                for (col, op) in relation_store.metadata.non_keys.iter().zip(&ops) {
+                    ensure!(
+                        op.accepts_column(&col.typing),
+                        MergeAggrTypeMismatch(
+                            col.name.to_string(),
+                            col.typing.to_string(),
+                            *op,
+                            *span
+                        )
+                    );
+                }
+
+                #[derive(Debug, Error, Diagnostic)]
+                #[error("Value {0:?} cannot be merged into column {1} with '{2}'")]
+                #[diagnostic(code(eval::bad_merge_operand))]
+                struct BadMergeOperand(DataValue, String, MergeOp, #[label] SourceSpan);
+
+                let n_keys = relation_store.metadata.keys.len();
+                let mut extractors = make_extractors(
+                    &relation_store.metadata.keys,
+                    &metadata.keys,
+                    key_bindings,
+                    headers,
+                )?;
+                extractors.extend(make_extractors(
+                    &relation_store.metadata.non_keys,
+                    &metadata.non_keys,
+                    dep_bindings,
+                    headers,
+                )?);
+
                 for tuple in res_iter {
                     let tuple = tuple?;
                     let extracted = Tuple(
-                        key_extractors
+                        extractors
                             .iter()
                             .map(|ex| ex.extract_data(&tuple))
                             .try_collect()?,
                     );
-                    let key = relation_store.adhoc_encode_key(&extracted, *span)?;
-                    let existing = self.tx.get(&key, true)?;
-                    if existing.is_some() {
-                        bail!(TransactAssertionFailure {
-                            relation: relation_store.name.to_string(),
-                            key: extracted.0,
-                            notice: "key exists in database".to_string()
-                        })
+                    for ((val, col), op) in extracted.0[n_keys..]
+                        .iter()
+                        .zip(&relation_store.metadata.non_keys)
+                        .zip(&ops)
+                    {
+                        ensure!(
+                            op.accepts_operand(val),
+                            BadMergeOperand(val.clone(), col.name.to_string(), *op, *span)
+                        );
                     }
+                    let key = relation_store.adhoc_encode_key(&extracted, *span)?;
+                    let operand = relation_store.adhoc_encode_merge_operand(&extracted, &ops);
+                    self.tx.merge_cf(relation_store.cf_id, &key, &operand)?;
                 }
             }
             RelationOp::Create | RelationOp::Replace | RelationOp::Put => {
@@ -277,6 +455,9 @@ impl SessionTx {
                 )?;
 
                 let has_triggers = !relation_store.put_triggers.is_empty();
+                // no other transaction can see a relation created by this one, so there is
+                // nothing to lock its rows against
+                let is_new = op != RelationOp::Put;
                 let mut new_tuples: Vec<DataValue> = vec![];
                 let mut old_tuples: Vec<DataValue> = vec![];
 
@@ -288,35 +469,83 @@ impl SessionTx {
                 )?;
                 key_extractors.extend(val_extractors);
 
-                for tuple in res_iter {
-                    let tuple = tuple?;
-
-                    let extracted = Tuple(
-                        key_extractors
-                            .iter()
-                            .map(|ex| ex.extract_data(&tuple))
-                            .try_collect()?,
-                    );
+                // the relation is new, so only triggers inherited by `:replace` could
+                // observe the rows as they are written
+                if bulk_load && !has_triggers {
+                    let mut loader = db.bulk_loader(relation_store.cf_id, relation_store.id);
+                    for tuple in res_iter {
+                        let tuple = tuple?;
+                        let extracted = Tuple(
+                            key_extractors
+                                .iter()
+                                .map(|ex| ex.extract_data(&tuple))
+                                .try_collect()?,
+                        );
+                        loader.push(
+                            relation_store.adhoc_encode_key(&extracted, *span)?,
+                            relation_store.adhoc_encode_val(&extracted, *span)?,
+                        )?;
+                    }
+                    to_clear.extend(loader.finish()?.map(RelationCleanup::BulkLoad));
+                    return Ok(to_clear);
+                }
 
-                    let key = relation_store.adhoc_encode_key(&extracted, *span)?;
-                    let val = relation_store.adhoc_encode_val(&extracted, *span)?;
+                let mut keys = EncodedKeys::default();
+                for chunk in &res_iter.chunks(MULTI_GET_BATCH_SIZE) {
+                    let mut extracted_tuples = vec![];
+                    keys.clear();
+                    let mut vals = vec![];
+                    for tuple in chunk {
+                        let tuple = tuple?;
+
+                        let extracted = Tuple(
+                            key_extractors
+                                .iter()
+                                .map(|ex| ex.extract_data(&tuple))
+                                .try_collect()?,
+                        );
+
+                        relation_store.adhoc_encode_key_into(&extracted, &mut keys, *span)?;
+                        vals.push(relation_store.adhoc_encode_val(&extracted, *span)?);
+                        extracted_tuples.push(extracted);
+                    }
 
                     if has_triggers {
-                        if let Some(existing) = self.tx.get(&key, false)? {
-                            let mut tup = extracted.clone();
-                            let mut remaining = &existing[ENCODED_KEY_MIN_LEN..];
-                            while !remaining.is_empty() {
-                                let (val, nxt) = DataValue::decode_from_key(remaining);
-                                tup.0.push(val);
-                                remaining = nxt;
+                        let existing = self.tx.multi_get_cf(
+                            relation_store.cf_id,
+                            &keys.iter().collect_vec(),
+                            false,
+                        )?;
+                        // the keys are all looked up before any is written, so a key that
+                        // came earlier in the chunk has the row written for it then
+                        let mut written: BTreeMap<&[u8], usize> = BTreeMap::new();
+                        for (i, key) in keys.iter().enumerate() {
+                            if let Some(j) = written.insert(key, i) {
+                                old_tuples.push(DataValue::List(extracted_tuples[j].0.clone()));
+                            } else if let Some(existing) = existing.get(i) {
+                                // the keys, with the values they had
+                                let n_keys = relation_store.metadata.keys.len();
+                                let mut tup = Tuple(extracted_tuples[i].0[..n_keys].to_vec());
+                                if !existing.is_empty() {
+                                    tup.0.extend(EncodedValues::new(existing)?.decode(None)?);
+                                }
+                                old_tuples.push(DataValue::List(tup.0));
                             }
-                            old_tuples.push(DataValue::List(tup.0));
                         }
-
-                        new_tuples.push(DataValue::List(extracted.0));
+                        new_tuples.extend(
+                            extracted_tuples
+                                .into_iter()
+                                .map(|extracted| DataValue::List(extracted.0)),
+                        );
                     }
 
-                    self.tx.put(&key, &val)?;
+                    for (key, val) in keys.iter().zip(vals.iter()) {
+                        if is_new {
+                            self.tx.put_untracked_cf(relation_store.cf_id, key, val)?;
+                        } else {
+                            self.tx.put_cf(relation_store.cf_id, key, val)?;
+                        }
+                    }
                 }
 
                 if has_triggers && !new_tuples.is_empty() {
@@ -340,7 +569,7 @@ impl SessionTx {
                         make_const_rule(&mut program, "_new", bindings.clone(), new_tuples.clone());
                         make_const_rule(&mut program, "_old", bindings, old_tuples.clone());
 
-                        let (_, cleanups) = db.run_query(self, program).map_err(|err| {
+                        let (_, cleanups) = db.run_query(self, program, None).map_err(|err| {
                             if err.source_code().is_some() {
                                 err
                             } else {
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::fs;
+use std::mem;
+use std::path::{Path, PathBuf};
+
+use log::error;
+use miette::{IntoDiagnostic, Result};
+use rayon::prelude::*;
+
+use cozorocks::{CompactOpts, CompactionJob, IngestOptions, RocksDb, WriteBatch};
+
+use crate::data::tuple::Tuple;
+use crate::runtime::relation::RelationId;
+
+/// Smaller loads are cheaper to apply as a write batch than through SST files.
+const MIN_ROWS_FOR_FILES: usize = 1 << 14;
+/// Chunks smaller than this are written to a single file.
+const MIN_ROWS_PER_FILE: usize = 1 << 16;
+/// Rows are sorted and written out in chunks of about this many bytes, so that a load
+/// never holds all of its input in memory.
+const CHUNK_BYTES: usize = 1 << 26;
+const DIR_PREFIX: &str = "bulk_load_";
+
+/// Collects the rows of a relation created with `:bulk_load`, writing them to SST files
+/// one chunk at a time as they come.
+pub(crate) struct BulkLoader<'a> {
+    db: &'a RocksDb,
+    cf: u32,
+    relation: RelationId,
+    rows: Vec<(Vec<u8>, Vec<u8>)>,
+    rows_bytes: usize,
+    files: Option<BulkLoadFiles>,
+}
+
+impl<'a> BulkLoader<'a> {
+    pub(crate) fn new(db: &'a RocksDb, cf: u32, relation: RelationId) -> Self {
+        Self {
+            db,
+            cf,
+            relation,
+            rows: vec![],
+            rows_bytes: 0,
+            files: None,
+        }
+    }
+    pub(crate) fn push(&mut self, key: Vec<u8>, val: Vec<u8>) -> Result<()> {
+        self.rows_bytes += key.len() + val.len();
+        self.rows.push((key, val));
+        if self.rows_bytes >= CHUNK_BYTES {
+            self.write_chunk()?;
+        }
+        Ok(())
+    }
+    fn write_chunk(&mut self) -> Result<()> {
+        let rows = mem::take(&mut self.rows);
+        self.rows_bytes = 0;
+        if self.files.is_none() {
+            self.files = Some(BulkLoadFiles::new(self.db, self.cf)?);
+        }
+        self.files.as_mut().unwrap().write_chunk(self.db, rows)
+    }
+    /// The rows are applied by [`BulkLoad::apply`].
+    pub(crate) fn finish(mut self) -> Result<Option<BulkLoad>> {
+        let rows = if self.files.is_none() && self.rows.len() < MIN_ROWS_FOR_FILES {
+            if self.rows.is_empty() {
+                return Ok(None);
+            }
+            let mut batch = self.db.write_batch();
+            for (key, val) in &self.rows {
+                batch.put_cf(self.cf, key, val)?;
+            }
+            LoadedRows::Batch(batch)
+        } else {
+            if !self.rows.is_empty() {
+                self.write_chunk()?;
+            }
+            LoadedRows::Files(self.files.take().unwrap())
+        };
+        Ok(Some(BulkLoad {
+            cf: self.cf,
+            lower: Tuple::default().encode_as_key(self.relation),
+            upper: Tuple::default().encode_as_key(self.relation.next()),
+            rows,
+        }))
+    }
+}
+
+/// The rows of a relation created with `:bulk_load`, which are written outside of the
+/// transaction creating it. No one else can see the relation before the transaction
+/// commits, so they are applied just before, and removed again if the commit fails. Nor can
+/// later queries of the same script see them. Rows applied before a crash prevented the
+/// commit are removed when the database is opened again.
+pub(crate) struct BulkLoad {
+    cf: u32,
+    lower: Vec<u8>,
+    upper: Vec<u8>,
+    rows: LoadedRows,
+}
+
+enum LoadedRows {
+    Batch(WriteBatch),
+    Files(BulkLoadFiles),
+}
+
+impl BulkLoad {
+    pub(crate) fn apply(&mut self, db: &RocksDb) -> Result<()> {
+        match &mut self.rows {
+            LoadedRows::Batch(batch) => batch.commit()?,
+            LoadedRows::Files(files) => files.ingest(db)?,
+        }
+        Ok(())
+    }
+    /// Reads do not look at range deletions, so the rows are compacted away at once.
+    pub(crate) fn undo(&self, db: &RocksDb) -> Result<()> {
+        let mut batch = db.write_batch();
+        batch.del_range_cf(self.cf, &self.lower, &self.upper)?;
+        batch.commit()?;
+        db.compact_range_cf(
+            self.cf,
+            &self.lower,
+            &self.upper,
+            &CompactOpts::default(),
+            &CompactionJob::default(),
+        )?;
+        Ok(())
+    }
+}
+
+/// SST files written for a `:bulk_load`. The directory holding them is removed on drop,
+/// whether they were ingested or not.
+struct BulkLoadFiles {
+    cf: u32,
+    dir: PathBuf,
+    /// The files of each chunk, in the order written, with their smallest and largest keys.
+    chunks: Vec<Vec<(String, Vec<u8>, Vec<u8>)>>,
+}
+
+impl BulkLoadFiles {
+    fn new(db: &RocksDb, cf: u32) -> Result<Self> {
+        let mut dir = PathBuf::from(db.db_path());
+        dir.set_file_name(format!("{}{}", DIR_PREFIX, uuid::Uuid::new_v4()));
+        fs::create_dir_all(&dir).into_diagnostic()?;
+        Ok(Self {
+            cf,
+            dir,
+            chunks: vec![],
+        })
+    }
+
+    /// Sorts the rows by key and writes them to as many disjoint files as there are
+    /// cores. Of rows with the same key the last one wins, as with `:put`.
+    fn write_chunk(&mut self, db: &RocksDb, mut rows: Vec<(Vec<u8>, Vec<u8>)>) -> Result<()> {
+        // stable, so that rows with the same key stay in input order
+        rows.par_sort_by(|a, b| a.0.cmp(&b.0));
+        let mut deduped: Vec<(Vec<u8>, Vec<u8>)> = Vec::with_capacity(rows.len());
+        for row in rows {
+            match deduped.last_mut() {
+                Some(last) if last.0 == row.0 => *last = row,
+                _ => deduped.push(row),
+            }
+        }
+
+        let n_files = (deduped.len() / MIN_ROWS_PER_FILE).clamp(1, rayon::current_num_threads());
+        let rows_per_file = (deduped.len() + n_files - 1) / n_files;
+
+        let dir = &self.dir;
+        let chunk_idx = self.chunks.len();
+        let files = deduped
+            .par_chunks(rows_per_file)
+            .enumerate()
+            .map(|(i, rows)| -> Result<(String, Vec<u8>, Vec<u8>)> {
+                let path = dir.join(format!("{:04}_{:04}.sst", chunk_idx, i));
+                let path = path.to_string_lossy().to_string();
+                let mut writer = db.get_sst_writer_cf(&path, self.cf)?;
+                for (key, val) in rows {
+                    writer.put(key, val)?;
+                }
+                writer.finish()?;
+                Ok((path, rows[0].0.clone(), rows[rows.len() - 1].0.clone()))
+            })
+            .collect::<Result<Vec<_>>>()?;
+        self.chunks.push(files);
+        Ok(())
+    }
+
+    /// The relation must not have had any data before. Files that are all disjoint, as
+    /// for input that is already sorted, are ingested at once and behind all other data.
+    /// Otherwise the files of each chunk are ingested in turn, so that rows of later chunks
+    /// win over those of earlier ones.
+    fn ingest(&self, db: &RocksDb) -> Result<()> {
+        let mut all_files = self.chunks.iter().flatten().collect::<Vec<_>>();
+        all_files.sort_by(|a, b| a.1.cmp(&b.1));
+        if all_files.windows(2).all(|w| w[0].2 < w[1].1) {
+            let paths = all_files
+                .into_iter()
+                .map(|f| f.0.clone())
+                .collect::<Vec<_>>();
+            db.ingest_sst_files(
+                self.cf,
+                &paths,
+                IngestOptions {
+                    move_files: true,
+                    ingest_behind: true,
+                },
+            )?;
+            return Ok(());
+        }
+        for chunk in &self.chunks {
+            let paths = chunk.iter().map(|f| f.0.clone()).collect::<Vec<_>>();
+            db.ingest_sst_files(
+                self.cf,
+                &paths,
+                IngestOptions {
+                    move_files: true,
+                    ingest_behind: false,
+                },
+            )?;
+        }
+        Ok(())
+    }
+}
+
+impl Drop for BulkLoadFiles {
+    fn drop(&mut self) {
+        if let Err(err) = fs::remove_dir_all(&self.dir) {
+            error!("cannot remove bulk load directory {:?}: {}", self.dir, err);
+        }
+    }
+}
+
+/// Removes files left behind by bulk loads interrupted by a crash.
+pub(crate) fn remove_stale_bulk_loads(db_root: &Path) -> Result<()> {
+    for entry in fs::read_dir(db_root).into_diagnostic()? {
+        let entry = entry.into_diagnostic()?;
+        if entry.file_name().to_string_lossy().starts_with(DIR_PREFIX) {
+            fs::remove_dir_all(entry.path()).into_diagnostic()?;
+        }
+    }
+    Ok(())
+}
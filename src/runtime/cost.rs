@@ -0,0 +1,131 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::collections::{BTreeMap, VecDeque};
+use std::sync::{Arc, Mutex};
+
+use serde_json::json;
+use smartstring::{LazyCompact, SmartString};
+
+use crate::data::json::JsonValue;
+use crate::data::program::MagicSymbol;
+use crate::runtime::spill::MemoryBudget;
+
+/// What a query has cost so far, shown by `::running` while it runs and kept in the slow
+/// query log afterwards. Unlike the perf counters of RocksDB, it is always collected: the
+/// counts are added once per scan and once per rule evaluated, not once per row.
+#[derive(Clone, Default)]
+pub(crate) struct QueryCost(Arc<CostInner>);
+
+#[derive(Default)]
+struct CostInner {
+    /// Rows and bytes of keys and values read, by stored relation.
+    scanned: Mutex<BTreeMap<SmartString<LazyCompact>, (u64, u64)>>,
+    /// Tuples derived, by rule and then by epoch.
+    produced: Mutex<BTreeMap<String, Vec<u64>>>,
+    /// Shared by the queries of a transaction, which run one at a time.
+    memory: Option<MemoryBudget>,
+}
+
+impl QueryCost {
+    pub(crate) fn new(memory: Option<MemoryBudget>) -> Self {
+        Self(Arc::new(CostInner {
+            scanned: Default::default(),
+            produced: Default::default(),
+            memory,
+        }))
+    }
+    pub(crate) fn add_scanned(&self, relation: &str, rows: u64, bytes: u64) {
+        let mut scanned = self.0.scanned.lock().unwrap();
+        // looked up by `&str` first, so that the name is only copied once
+        if let Some(counts) = scanned.get_mut(relation) {
+            counts.0 += rows;
+            counts.1 += bytes;
+        } else {
+            scanned.insert(SmartString::from(relation), (rows, bytes));
+        }
+    }
+    pub(crate) fn add_produced(&self, rule: &MagicSymbol, epoch: u32, tuples: u64) {
+        let mut produced = self.0.produced.lock().unwrap();
+        let by_epoch = produced.entry(rule.to_string()).or_default();
+        let epoch = epoch as usize;
+        if by_epoch.len() <= epoch {
+            by_epoch.resize(epoch + 1, 0);
+        }
+        by_epoch[epoch] += tuples;
+    }
+    pub(crate) fn to_json(&self) -> JsonValue {
+        let scanned = self.0.scanned.lock().unwrap();
+        let bytes_read: u64 = scanned.values().map(|(_, bytes)| bytes).sum();
+        let rows_scanned: serde_json::Map<_, _> = scanned
+            .iter()
+            .map(|(relation, (rows, _))| (relation.to_string(), json!(rows)))
+            .collect();
+        let produced: serde_json::Map<_, _> = self
+            .0
+            .produced
+            .lock()
+            .unwrap()
+            .iter()
+            .map(|(rule, by_epoch)| (rule.clone(), json!(by_epoch)))
+            .collect();
+        json!({
+            "rows_scanned": rows_scanned,
+            "bytes_read": bytes_read,
+            "tuples_produced": produced,
+            "peak_memory": self.0.memory.as_ref().map(|memory| memory.peak()),
+        })
+    }
+}
+
+/// The last `capacity` queries that took at least `threshold` seconds, oldest first.
+pub(crate) struct SlowQueryLog {
+    capacity: usize,
+    threshold: f64,
+    entries: Mutex<VecDeque<JsonValue>>,
+}
+
+impl SlowQueryLog {
+    pub(crate) fn new(capacity: usize, threshold: f64) -> Self {
+        Self {
+            capacity,
+            threshold,
+            entries: Mutex::new(VecDeque::with_capacity(capacity)),
+        }
+    }
+    /// `entry` is only made for queries that are kept.
+    pub(crate) fn record(&self, elapsed: f64, entry: impl FnOnce() -> JsonValue) {
+        if self.capacity == 0 || elapsed < self.threshold {
+            return;
+        }
+        let entry = entry();
+        let mut entries = self.entries.lock().unwrap();
+        if entries.len() >= self.capacity {
+            entries.pop_front();
+        }
+        entries.push_back(entry);
+    }
+    pub(crate) fn entries(&self) -> Vec<JsonValue> {
+        self.entries.lock().unwrap().iter().cloned().collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn only_the_last_slow_queries_are_kept() {
+        let log = SlowQueryLog::new(2, 1.0);
+        for i in 0..4 {
+            log.record(1.5, || json!(i));
+            log.record(0.5, || unreachable!());
+        }
+        assert_eq!(log.entries(), vec![json!(2), json!(3)]);
+
+        let none = SlowQueryLog::new(0, 0.0);
+        none.record(1.0, || unreachable!());
+        assert!(none.entries().is_empty());
+    }
+}
@@ -2,17 +2,18 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
-use std::collections::BTreeMap;
+use std::collections::{BTreeMap, BTreeSet};
 use std::fmt::{Debug, Formatter};
-use std::path::PathBuf;
+use std::path::{Component, Path, PathBuf};
 use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::sync::{Arc, Mutex};
 use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
-use std::{fs, thread};
+use std::{fs, mem, thread};
 
 use either::{Left, Right};
 use itertools::Itertools;
 use lazy_static::lazy_static;
+use log::error;
 use miette::{
     bail, ensure, miette, Diagnostic, GraphicalReportHandler, GraphicalTheme, IntoDiagnostic,
     JSONReportHandler, Result, WrapErr,
@@ -21,12 +22,17 @@ use serde_json::{json, Map};
 use smartstring::SmartString;
 use thiserror::Error;
 
-use cozorocks::{DbBuilder, RocksDb};
+use cozorocks::{
+    CompactOpts, CompactionJob, DbBuilder, PerfCounters, PerfScope, RocksDb, StatusSubCode,
+    DEFAULT_COLUMN_FAMILY,
+};
 
 use crate::data::json::JsonValue;
-use crate::data::program::{InputProgram, QueryAssertion, RelationOp};
+use crate::data::program::{InputProgram, QueryAssertion, RelationOp, StratifiedMagicProgram};
 use crate::data::symb::Symbol;
-use crate::data::tuple::{Tuple, KEY_PREFIX_LEN};
+use crate::data::tuple::{
+    encode_values, EncodedValues, Tuple, ENCODED_KEY_MIN_LEN, KEY_PREFIX_LEN,
+};
 use crate::data::value::{DataValue, LARGEST_UTF_CHAR};
 use crate::parse::sys::SysOp;
 use crate::parse::{parse_script, CozoScript, SourceSpan};
@@ -34,34 +40,202 @@ use crate::query::compile::{CompiledProgram, CompiledRule, CompiledRuleSet};
 use crate::query::relation::{
     FilteredRA, InMemRelationRA, InnerJoin, NegJoin, RelAlgebra, ReorderRA, StoredRA, UnificationRA,
 };
-use crate::runtime::relation::{RelationHandle, RelationId};
-use crate::runtime::transact::SessionTx;
+use crate::runtime::bulk_load::{remove_stale_bulk_loads, BulkLoad, BulkLoader};
+use crate::runtime::cost::{QueryCost, SlowQueryLog};
+use crate::runtime::merge::merge_stored_values;
+use crate::runtime::prepared::PreparedCache;
+use crate::runtime::relation::{AccessLevel, RelationCleanup, RelationHandle, RelationId};
+use crate::runtime::spill::{remove_stale_spills, MemoryBudget};
+use crate::runtime::stream::RowSink;
+use crate::runtime::transact::{last_bulk_load_id_key, SessionTx};
 
 struct RunningQueryHandle {
     started_at: f64,
+    timer: Instant,
+    script: Arc<str>,
     poison: Poison,
+    perf: QueryPerf,
+    cost: QueryCost,
+}
+
+/// Headers of the rows of `::running` and `::slow_queries`.
+const QUERY_HEADERS: [&str; 6] = ["id", "started_at", "elapsed", "script", "cost", "perf"];
+
+impl RunningQueryHandle {
+    fn to_row(&self, id: u64) -> JsonValue {
+        json!([
+            id,
+            format!("{:?}", self.started_at),
+            self.timer.elapsed().as_secs_f64(),
+            &*self.script,
+            self.cost.to_json(),
+            self.perf.to_json()
+        ])
+    }
 }
 
 struct RunningQueryCleanup {
     id: u64,
     running_queries: Arc<Mutex<BTreeMap<u64, RunningQueryHandle>>>,
+    slow_queries: Arc<SlowQueryLog>,
 }
 
 impl Drop for RunningQueryCleanup {
     fn drop(&mut self) {
-        let mut map = self.running_queries.lock().unwrap();
-        if let Some(handle) = map.remove(&self.id) {
+        let handle = self.running_queries.lock().unwrap().remove(&self.id);
+        if let Some(handle) = handle {
             handle.poison.0.store(true, Ordering::Relaxed);
+            handle.perf.publish();
+            let elapsed = handle.timer.elapsed().as_secs_f64();
+            self.slow_queries.record(elapsed, || handle.to_row(self.id));
         }
     }
 }
 
+struct CompactionHandle {
+    // `None` for all relations
+    relation: Option<String>,
+    started_at: f64,
+    finished_at: Option<f64>,
+    // `None` while running
+    result: Option<String>,
+    job: CompactionJob,
+}
+
+/// Finished compactions kept for `::compactions`.
+const MAX_FINISHED_COMPACTIONS: usize = 64;
+
 #[derive(serde_derive::Serialize, serde_derive::Deserialize)]
 pub(crate) struct DbManifest {
     storage_version: u64,
 }
 
-const CURRENT_STORAGE_VERSION: u64 = 1;
+/// Version 1 stored the non-key columns of a row as one MessagePack array, version 2 with
+/// a directory of column offsets in front. Older databases are upgraded when opened.
+const CURRENT_STORAGE_VERSION: u64 = 2;
+
+/// Size in bytes at which the writes of a storage upgrade are committed.
+const UPGRADE_BATCH_BYTES: usize = 16 << 20;
+
+fn write_manifest(manifest_path: &Path) -> Result<()> {
+    fs::write(
+        manifest_path,
+        rmp_serde::to_vec_named(&DbManifest {
+            storage_version: CURRENT_STORAGE_VERSION,
+        })
+        .into_diagnostic()
+        .wrap_err_with(|| "when serializing manifest")?,
+    )
+    .into_diagnostic()
+    .wrap_err_with(|| "when serializing manifest")
+}
+
+/// Storage engine options for [`Db::new_with_options`].
+#[derive(Debug, Clone)]
+pub struct DbOptions {
+    /// Capacity of the block cache in bytes. Zero keeps the small RocksDB default.
+    pub block_cache_capacity: usize,
+    /// Number of shard bits of the block cache. A negative value lets RocksDB choose.
+    pub block_cache_shard_bits: i32,
+    /// Capacity of the row cache in bytes. Zero disables the row cache.
+    pub row_cache_capacity: usize,
+    /// Upper bound in bytes for the memory of all memtables. Zero means no bound.
+    pub memtable_budget: usize,
+    /// Use Ribbon filters instead of Bloom filters, trading CPU for less filter memory.
+    pub use_ribbon_filter: bool,
+    /// Partition indexes and filters, so that only their top level has to stay in memory.
+    pub partition_index_and_filters: bool,
+    /// Share the block cache and the memtable budget with all other databases in the process
+    /// that also set this option. The first such database determines the sizes.
+    pub share_caches: bool,
+    /// Reserve the last level for `:bulk_load`, which then never has to rewrite existing
+    /// data. Must be the same every time the database is opened.
+    pub allow_ingest_behind: bool,
+    /// Use optimistic concurrency control: transactions take no locks, and a transaction
+    /// fails at commit if another one has written the keys it has written or read for update
+    /// in the meantime. Works best with low write contention.
+    pub optimistic_transactions: bool,
+    /// Collect storage engine statistics, shown by `::stats`, and per query perf counters,
+    /// shown by `::running`. Costs a few percent of throughput.
+    pub enable_statistics: bool,
+    /// With `enable_statistics`, also time the block reads and seeks of each query into its
+    /// perf counters, shown by `::running` and `::slow_queries`. Costs much more than
+    /// counting them.
+    pub time_queries: bool,
+    /// Bytes per second flushes and compactions may write, zero for no limit.
+    pub rate_limit_bytes_per_sec: usize,
+    /// Let the actual rate limit follow demand, with `rate_limit_bytes_per_sec` as the
+    /// upper bound.
+    pub rate_limit_auto_tune: bool,
+    /// Read with direct I/O, bypassing the page cache.
+    pub use_direct_reads: bool,
+    /// Read and write with direct I/O in flushes and compactions, so that they do not
+    /// evict the pages of foreground reads.
+    pub use_direct_io_for_flush_and_compaction: bool,
+    /// Readahead of compaction inputs in bytes. Zero keeps the default, which is 2MiB
+    /// with direct I/O.
+    pub compaction_readahead_size: usize,
+    /// Upper bound of the write ahead log in bytes. Zero keeps the default.
+    pub max_total_wal_size: usize,
+    /// Number of scripts kept compiled by [`Db::prepare`]. Zero disables the cache.
+    pub prepared_cache_capacity: usize,
+    /// Bytes of memory the rules of each script run may take for their derived tuples.
+    /// Beyond that, they are written to temporary files instead, so that the script runs
+    /// slower but takes no more memory. Zero means no bound.
+    pub query_memory_budget: usize,
+    /// Bytes per second that `::backup` may copy. Zero means no limit.
+    pub backup_rate_limit_bytes_per_sec: u64,
+    /// Number of the newest backups `::backup` keeps in its directory. Zero keeps all.
+    pub backups_to_keep: u32,
+    /// Directory below which scripts may write checkpoints and backups with `::checkpoint`
+    /// and `::backup`, given paths relative to it. Scripts cannot write them unless set.
+    /// [`Db::checkpoint`] and [`Db::backup`] are not restricted by it.
+    pub backup_root: Option<String>,
+    /// Opens the database read-only, as a secondary instance following the primary that
+    /// writes to it, which may be another process. The secondary keeps files of its own in
+    /// this directory. Scripts writing to the database fail, and relations created in their
+    /// own column family after the secondary is opened are not seen until it is reopened.
+    pub secondary_path: Option<String>,
+    /// How often a secondary instance catches up with the writes of the primary.
+    pub catch_up_interval_ms: u64,
+    /// Number of the last slow queries kept for `::slow_queries`. Zero keeps none.
+    pub slow_query_log_capacity: usize,
+    /// Seconds a query must take to be kept for `::slow_queries`.
+    pub slow_query_threshold_secs: f64,
+}
+
+impl Default for DbOptions {
+    fn default() -> Self {
+        Self {
+            block_cache_capacity: 0,
+            block_cache_shard_bits: -1,
+            row_cache_capacity: 0,
+            memtable_budget: 0,
+            use_ribbon_filter: false,
+            partition_index_and_filters: false,
+            share_caches: false,
+            allow_ingest_behind: false,
+            optimistic_transactions: false,
+            enable_statistics: false,
+            time_queries: false,
+            rate_limit_bytes_per_sec: 0,
+            rate_limit_auto_tune: false,
+            use_direct_reads: false,
+            use_direct_io_for_flush_and_compaction: false,
+            compaction_readahead_size: 0,
+            max_total_wal_size: 0,
+            prepared_cache_capacity: 256,
+            query_memory_budget: 0,
+            backup_rate_limit_bytes_per_sec: 0,
+            backups_to_keep: 0,
+            backup_root: None,
+            secondary_path: None,
+            catch_up_interval_ms: 1000,
+            slow_query_log_capacity: 64,
+            slow_query_threshold_secs: 0.1,
+        }
+    }
+}
 
 /// The database object of Cozo.
 #[derive(Clone)]
@@ -70,6 +244,20 @@ pub struct Db {
     relation_store_id: Arc<AtomicU64>,
     queries_count: Arc<AtomicU64>,
     running_queries: Arc<Mutex<BTreeMap<u64, RunningQueryHandle>>>,
+    slow_queries: Arc<SlowQueryLog>,
+    collect_perf: bool,
+    time_perf: bool,
+    compactions_count: Arc<AtomicU64>,
+    compactions: Arc<Mutex<BTreeMap<u64, CompactionHandle>>>,
+    /// Incremented on every change to the schema of relations.
+    pub(crate) schema_epoch: Arc<AtomicU64>,
+    pub(crate) prepared: Arc<Mutex<PreparedCache>>,
+    query_memory_budget: usize,
+    backup_rate_limit: u64,
+    backups_to_keep: u32,
+    backup_root: Option<PathBuf>,
+    /// Held while writing the last relation id handed out to bulk loads.
+    bulk_load_ids: Arc<Mutex<()>>,
 }
 
 impl Debug for Db {
@@ -83,111 +271,516 @@ impl Debug for Db {
 #[diagnostic(code(db::init))]
 struct BadDbInit(#[help] String);
 
+#[derive(Debug, Diagnostic, Error)]
+#[error("Cannot write a copy of the database there")]
+#[diagnostic(code(db::bad_backup_target))]
+struct BadBackupTarget(#[help] String);
+
 lazy_static! {
     static ref TEXT_ERR_HANDLER: GraphicalReportHandler =
         miette::GraphicalReportHandler::new().with_theme(GraphicalTheme::unicode());
     static ref JSON_ERR_HANDLER: JSONReportHandler = miette::JSONReportHandler::new();
+    /// Backup engines must not work on the same directory at the same time.
+    static ref BACKUP_DIR_LOCKS: Mutex<BTreeMap<PathBuf, Arc<Mutex<()>>>> = Default::default();
+}
+
+fn backup_dir_lock(backup_dir: &Path) -> Result<Arc<Mutex<()>>> {
+    let backup_dir = backup_dir.canonicalize().into_diagnostic()?;
+    Ok(BACKUP_DIR_LOCKS
+        .lock()
+        .unwrap()
+        .entry(backup_dir)
+        .or_default()
+        .clone())
 }
 
 impl Db {
     /// Creates a database object.
     pub fn new(path: impl AsRef<str>) -> Result<Self> {
+        Self::new_with_options(path, DbOptions::default())
+    }
+    /// Creates a database object with the given storage engine options.
+    pub fn new_with_options(path: impl AsRef<str>, options: DbOptions) -> Result<Self> {
         let builder = DbBuilder::default().path(path.as_ref());
         let path = builder.opts.db_path;
         fs::create_dir_all(path)
             .map_err(|err| BadDbInit(format!("cannot create directory {}: {}", path, err)))?;
         let path_buf = PathBuf::from(path);
 
-        let is_new = {
-            let mut manifest_path = path_buf.clone();
-            manifest_path.push("manifest");
-
-            if manifest_path.exists() {
-                let existing: DbManifest = rmp_serde::from_slice(
-                    &fs::read(manifest_path)
-                        .into_diagnostic()
-                        .wrap_err_with(|| "when reading manifest")?,
-                )
-                .into_diagnostic()
-                .wrap_err_with(|| "when reading manifest")?;
-                assert_eq!(
-                    existing.storage_version, CURRENT_STORAGE_VERSION,
-                    "Unknown storage version {}",
-                    existing.storage_version
-                );
-                false
-            } else {
-                fs::write(
-                    manifest_path,
-                    rmp_serde::to_vec_named(&DbManifest {
-                        storage_version: CURRENT_STORAGE_VERSION,
-                    })
+        let mut manifest_path = path_buf.clone();
+        manifest_path.push("manifest");
+        if options.secondary_path.is_some() && !manifest_path.exists() {
+            bail!(BadDbInit(format!(
+                "secondary instances need an existing database at {}",
+                path
+            )))
+        }
+        let (is_new, storage_version) = if manifest_path.exists() {
+            let existing: DbManifest = rmp_serde::from_slice(
+                &fs::read(&manifest_path)
                     .into_diagnostic()
-                    .wrap_err_with(|| "when serializing manifest")?,
-                )
-                .into_diagnostic()
-                .wrap_err_with(|| "when serializing manifest")?;
-                true
+                    .wrap_err_with(|| "when reading manifest")?,
+            )
+            .into_diagnostic()
+            .wrap_err_with(|| "when reading manifest")?;
+            assert!(
+                existing.storage_version <= CURRENT_STORAGE_VERSION,
+                "Unknown storage version {}",
+                existing.storage_version
+            );
+            (false, existing.storage_version)
+        } else {
+            write_manifest(&manifest_path)?;
+            (true, CURRENT_STORAGE_VERSION)
+        };
+
+        let secondary_store_path = match &options.secondary_path {
+            None => None,
+            Some(secondary_path) => {
+                if storage_version < CURRENT_STORAGE_VERSION {
+                    bail!(BadDbInit(
+                        "the primary must be opened once to upgrade the storage first".to_string()
+                    ))
+                }
+                let secondary_root = PathBuf::from(secondary_path);
+                fs::create_dir_all(&secondary_root).map_err(|err| {
+                    BadDbInit(format!(
+                        "cannot create directory {}: {}",
+                        secondary_path, err
+                    ))
+                })?;
+                Some(secondary_root.join("data"))
             }
         };
 
-        let mut store_path = path_buf;
+        let mut store_path = path_buf.clone();
         store_path.push("data");
-        let db_builder = builder
+        let mut db_builder = builder
             .create_if_missing(is_new)
             .use_capped_prefix_extractor(true, KEY_PREFIX_LEN)
             .use_bloom_filter(true, 9.9, true)
+            .use_ribbon_filter(options.use_ribbon_filter)
+            .partition_index_and_filters(options.partition_index_and_filters)
+            .block_cache(
+                options.block_cache_capacity,
+                options.block_cache_shard_bits,
+                options.share_caches,
+            )
+            .row_cache(options.row_cache_capacity)
+            .memtable_budget(options.memtable_budget, options.share_caches)
+            .allow_ingest_behind(options.allow_ingest_behind)
+            .optimistic(options.optimistic_transactions)
+            .enable_statistics(options.enable_statistics)
+            .rate_limit(
+                options.rate_limit_bytes_per_sec,
+                options.rate_limit_auto_tune,
+            )
+            .direct_io(
+                options.use_direct_reads,
+                options.use_direct_io_for_flush_and_compaction,
+            )
+            .compaction_readahead_size(options.compaction_readahead_size)
+            .max_total_wal_size(options.max_total_wal_size)
             .path(
                 store_path
                     .to_str()
                     .ok_or_else(|| miette!("bad path name"))?,
             );
 
+        if let Some(secondary_store_path) = &secondary_store_path {
+            db_builder = db_builder.secondary(
+                secondary_store_path
+                    .to_str()
+                    .ok_or_else(|| miette!("bad path name"))?,
+                options.catch_up_interval_ms,
+            );
+        }
+
+        // rows written by `:merge` are combined when read or compacted
+        cozorocks::set_merge_fn(merge_stored_values);
         let db = db_builder.build()?;
+        // stale files are only removed once the database is locked, so that those of an
+        // instance open in another process are left alone; the files in the directory of
+        // the primary are none of the business of secondaries
+        match &secondary_store_path {
+            None => {
+                remove_stale_bulk_loads(&path_buf)?;
+                remove_stale_spills(&path_buf)?;
+            }
+            Some(secondary_store_path) => {
+                remove_stale_spills(secondary_store_path.parent().unwrap())?
+            }
+        }
 
         let ret = Self {
             db,
             relation_store_id: Arc::new(Default::default()),
             queries_count: Arc::new(Default::default()),
             running_queries: Arc::new(Mutex::new(Default::default())),
+            slow_queries: Arc::new(SlowQueryLog::new(
+                options.slow_query_log_capacity,
+                options.slow_query_threshold_secs,
+            )),
+            collect_perf: options.enable_statistics,
+            time_perf: options.time_queries,
+            compactions_count: Arc::new(Default::default()),
+            compactions: Arc::new(Mutex::new(Default::default())),
+            schema_epoch: Arc::new(Default::default()),
+            prepared: Arc::new(Mutex::new(PreparedCache::new(
+                options.prepared_cache_capacity,
+            ))),
+            query_memory_budget: options.query_memory_budget,
+            backup_rate_limit: options.backup_rate_limit_bytes_per_sec,
+            backups_to_keep: options.backups_to_keep,
+            backup_root: options.backup_root.as_ref().map(PathBuf::from),
+            bulk_load_ids: Default::default(),
         };
         ret.load_last_ids()?;
+        if ret.db.is_secondary() {
+            return Ok(ret);
+        }
+        if storage_version < CURRENT_STORAGE_VERSION {
+            ret.upgrade_storage()?;
+            write_manifest(&manifest_path)?;
+        }
+        let handles = ret.relation_handles()?;
+        ret.remove_uncommitted_bulk_loads(&handles)?;
+        // the compaction filter only knows about the TTLs set since the database was opened
+        for handle in &handles {
+            if let Some(ttl) = &handle.ttl {
+                ret.db.set_ttl(handle.id.0, ttl.column, ttl.secs);
+            }
+        }
+        // column families left behind by a crash, before the relations created in them
+        // were committed or after those dropped with them were
+        let used_cfs: BTreeSet<_> = handles.iter().map(|handle| handle.cf_id).collect();
+        for cf_id in ret.db.column_family_ids() {
+            if !used_cfs.contains(&cf_id) {
+                ret.db.drop_column_family(cf_id)?;
+            }
+        }
         Ok(ret)
     }
 
-    fn compact_relation(&self) -> Result<()> {
-        let l = Tuple::default().encode_as_key(RelationId(0));
-        let u = Tuple(vec![DataValue::Bot]).encode_as_key(RelationId(u64::MAX));
-        self.db.range_compact(&l, &u)?;
+    /// Writes a consistent copy of the database to the directory `path`, which must not
+    /// exist yet, while it keeps running. Files are hard linked where possible, so this is
+    /// cheap, and the copy can be opened as a database as it is.
+    pub fn checkpoint(&self, path: impl AsRef<str>) -> Result<()> {
+        self.ensure_primary()?;
+        let path = PathBuf::from(path.as_ref());
+        if path.exists() {
+            bail!(BadBackupTarget(format!(
+                "{} already exists",
+                path.display()
+            )))
+        }
+        fs::create_dir_all(&path).into_diagnostic()?;
+        // without the manifest, the directory is not taken for a database
+        if let Err(err) = self
+            .db
+            .create_checkpoint(&path.join("data").to_string_lossy())
+        {
+            let _ = fs::remove_dir_all(&path);
+            return Err(err.into());
+        }
+        write_manifest(&path.join("manifest"))
+    }
+    /// Adds a backup of the database to the directory `backup_dir` while it keeps running,
+    /// and returns its id. Backups in the same directory share their files, so only the
+    /// files written since the last backup are copied. At most `rate_limit` bytes are copied
+    /// per second unless zero, and only the newest `keep` backups are kept unless zero.
+    pub fn backup(&self, backup_dir: impl AsRef<str>, rate_limit: u64, keep: u32) -> Result<u32> {
+        self.ensure_primary()?;
+        let backup_dir = backup_dir.as_ref();
+        fs::create_dir_all(backup_dir).into_diagnostic()?;
+        let lock = backup_dir_lock(Path::new(backup_dir))?;
+        let _guard = lock.lock().unwrap();
+        Ok(self.db.create_backup(backup_dir, rate_limit, keep)?)
+    }
+    /// Restores the newest backup in `backup_dir`, made by [`Db::backup`], as the database
+    /// at `path`, which must not be open, in this process or any other.
+    pub fn restore_backup(backup_dir: impl AsRef<str>, path: impl AsRef<str>) -> Result<()> {
+        let backup_dir = backup_dir.as_ref();
+        let path = PathBuf::from(path.as_ref());
+        let data_path = path.join("data");
+        fs::create_dir_all(&data_path).into_diagnostic()?;
+        {
+            let lock = backup_dir_lock(Path::new(backup_dir))?;
+            let _guard = lock.lock().unwrap();
+            RocksDb::restore_backup(backup_dir, &data_path.to_string_lossy())?;
+        }
+        // backups are only taken of opened databases, which are already upgraded
+        write_manifest(&path.join("manifest"))
+    }
+    /// Scripts only write checkpoints and backups below the backup root.
+    fn script_backup_path(&self, path: &str) -> Result<String> {
+        #[derive(Debug, Diagnostic, Error)]
+        #[error("Scripts cannot write checkpoints or backups to {0}")]
+        #[diagnostic(code(db::backup_path_not_allowed))]
+        #[diagnostic(help(
+            "Open the database with a backup root, and give a path relative to it without '..'"
+        ))]
+        struct BackupPathNotAllowed(String);
+
+        let not_allowed = || BackupPathNotAllowed(path.to_string());
+        let root = self.backup_root.as_ref().ok_or_else(not_allowed)?;
+        let relative = Path::new(path);
+        ensure!(
+            relative.components().next().is_some()
+                && relative
+                    .components()
+                    .all(|c| matches!(c, Component::Normal(_))),
+            not_allowed()
+        );
+        Ok(root.join(relative).to_string_lossy().to_string())
+    }
+    /// Rows of bulk loads are written just before the transaction creating their relation
+    /// commits, so a crash in between leaves rows behind that belong to no relation, under
+    /// ids above those of all relations. Those in column families of their own go with the
+    /// column families. Reads do not look at range deletions, so the rows are compacted
+    /// away at once, and are not found again the next time.
+    fn remove_uncommitted_bulk_loads(&self, handles: &[RelationHandle]) -> Result<()> {
+        let last_id = handles
+            .iter()
+            .map(|handle| handle.id)
+            .max()
+            .unwrap_or(RelationId::SYSTEM);
+        let lower = Tuple::default().encode_as_key(last_id.next());
+        let upper = Tuple::default().encode_as_key(RelationId(u64::MAX));
+        let tx = self.db.transact_read_only().start();
+        let mut it = tx.iterator().upper_bound(&upper).start();
+        it.seek(&lower);
+        if it.pair()?.is_some() {
+            let mut batch = self.db.write_batch();
+            batch.del_range_cf(DEFAULT_COLUMN_FAMILY, &lower, &upper)?;
+            batch.commit()?;
+            self.db.compact_range_cf(
+                DEFAULT_COLUMN_FAMILY,
+                &lower,
+                &upper,
+                &CompactOpts::default(),
+                &CompactionJob::default(),
+            )?;
+        }
+        Ok(())
+    }
+    /// Rewrites the values of all relations stored before the column directory was
+    /// introduced. Values already rewritten are skipped, so an upgrade interrupted by a crash
+    /// is finished the next time the database is opened.
+    fn upgrade_storage(&self) -> Result<()> {
+        for handle in self.relation_handles()? {
+            let lower = Tuple::default().encode_as_key(handle.id);
+            let upper = Tuple::default().encode_as_key(handle.id.next());
+            let tx = self.db.transact_read_only().start();
+            let mut it = tx.iterator_cf(handle.cf_id).upper_bound(&upper).start();
+            it.seek(&lower);
+            let mut batch = self.db.write_batch();
+            while let Some((k_slice, v_slice)) = it.pair()? {
+                if upper.as_slice() <= k_slice {
+                    break;
+                }
+                if EncodedValues::is_legacy(v_slice) {
+                    let vals: Vec<DataValue> =
+                        rmp_serde::from_slice(&v_slice[ENCODED_KEY_MIN_LEN..]).into_diagnostic()?;
+                    let mut upgraded = v_slice[..ENCODED_KEY_MIN_LEN].to_vec();
+                    encode_values(&mut upgraded, &vals);
+                    batch.put_cf(handle.cf_id, k_slice, &upgraded)?;
+                    if batch.data_size() >= UPGRADE_BATCH_BYTES {
+                        batch.commit()?;
+                    }
+                }
+                it.next();
+            }
+            batch.commit()?;
+        }
         Ok(())
     }
 
+    /// Drops the expired rows of a relation with a single range deletion, if its TTL is kept
+    /// in the first key column, so that they make up the start of its key range. Otherwise
+    /// they are left to the compaction filter, which drops them one by one. Reads do not look
+    /// at range deletions, so the rows stay readable until the compaction reaches them.
+    fn drop_expired(&self, handle: &RelationHandle) -> Result<()> {
+        match handle.ttl {
+            Some(ttl) if ttl.column == 0 => {
+                let cutoff = seconds_since_the_epoch()?.floor() as i64 - ttl.secs as i64;
+                // nulls and booleans sort before all numbers and never expire
+                let lower =
+                    Tuple(vec![DataValue::from(f64::NEG_INFINITY)]).encode_as_key(handle.id);
+                let upper = Tuple(vec![DataValue::from(cutoff)]).encode_as_key(handle.id);
+                let mut batch = self.db.write_batch();
+                batch.del_range_cf(handle.cf_id, &lower, &upper)?;
+                batch.commit()?;
+            }
+            _ => {}
+        }
+        Ok(())
+    }
+    /// Starts compacting the key range of a relation, or all relations in every column
+    /// family, in the background. Automatic compactions go on alongside it, and writes are
+    /// never stalled for it. Expired rows are dropped first.
+    fn start_compaction(&self, relation: Option<&Symbol>) -> Result<u64> {
+        self.ensure_primary()?;
+        let ranges = match relation {
+            None => {
+                let handles = self.relation_handles()?;
+                for handle in &handles {
+                    self.drop_expired(handle)?;
+                }
+                let mut ranges = vec![(
+                    DEFAULT_COLUMN_FAMILY,
+                    Tuple::default().encode_as_key(RelationId(0)),
+                    Tuple(vec![DataValue::Bot]).encode_as_key(RelationId(u64::MAX)),
+                )];
+                // relations of their own column families have them to themselves
+                let cfs: BTreeSet<_> = handles
+                    .iter()
+                    .map(|handle| handle.cf_id)
+                    .filter(|cf| *cf != DEFAULT_COLUMN_FAMILY)
+                    .collect();
+                ranges.extend(cfs.into_iter().map(|cf| (cf, vec![], vec![])));
+                ranges
+            }
+            Some(name) => {
+                let tx = self.transact()?;
+                let handle = tx.get_relation(name, false)?;
+                self.drop_expired(&handle)?;
+                vec![(
+                    handle.cf_id,
+                    Tuple::default().encode_as_key(handle.id),
+                    Tuple::default().encode_as_key(handle.id.next()),
+                )]
+            }
+        };
+        let id = self.compactions_count.fetch_add(1, Ordering::AcqRel);
+        let job = CompactionJob::default();
+        {
+            let mut compactions = self.compactions.lock().unwrap();
+            let finished = compactions
+                .iter()
+                .filter(|(_, c)| c.finished_at.is_some())
+                .map(|(k, _)| *k)
+                .collect_vec();
+            if finished.len() >= MAX_FINISHED_COMPACTIONS {
+                for k in &finished[..=finished.len() - MAX_FINISHED_COMPACTIONS] {
+                    compactions.remove(k);
+                }
+            }
+            compactions.insert(
+                id,
+                CompactionHandle {
+                    relation: relation.map(|name| name.to_string()),
+                    started_at: seconds_since_the_epoch()?,
+                    finished_at: None,
+                    result: None,
+                    job: job.clone(),
+                },
+            );
+        }
+        let db = self.db.clone();
+        let compactions = self.compactions.clone();
+        thread::spawn(move || {
+            let res = ranges.iter().try_for_each(|(cf, lower, upper)| {
+                db.compact_range_cf(*cf, lower, upper, &CompactOpts::default(), &job)
+            });
+            let result = match res {
+                Ok(()) => "OK".to_string(),
+                Err(status) if status.subcode == StatusSubCode::kManualCompactionPaused => {
+                    "CANCELLED".to_string()
+                }
+                Err(status) => format!("FAILED: {}", status),
+            };
+            if let Some(handle) = compactions.lock().unwrap().get_mut(&id) {
+                handle.finished_at = seconds_since_the_epoch().ok();
+                handle.result = Some(result);
+            }
+        });
+        Ok(id)
+    }
+    fn list_compactions(&self) -> Result<JsonValue> {
+        let rows = self
+            .compactions
+            .lock()
+            .unwrap()
+            .iter()
+            .map(|(k, v)| {
+                json!([
+                    k,
+                    v.relation,
+                    v.started_at,
+                    v.finished_at,
+                    v.result.as_deref().unwrap_or("RUNNING")
+                ])
+            })
+            .collect_vec();
+        Ok(json!({
+            "rows": rows,
+            "headers": ["id", "relation", "started_at", "finished_at", "status"]
+        }))
+    }
+
     fn load_last_ids(&self) -> Result<()> {
         let tx = self.transact()?;
         self.relation_store_id
             .store(tx.load_last_relation_store_id()?.0, Ordering::Release);
         Ok(())
     }
+    /// Without a bound, the budget still keeps track of the memory taken, for `::running`.
+    fn memory_budget(&self) -> MemoryBudget {
+        if self.query_memory_budget == 0 {
+            MemoryBudget::new(&self.db, usize::MAX)
+        } else {
+            MemoryBudget::new(&self.db, self.query_memory_budget)
+        }
+    }
+    fn ensure_primary(&self) -> Result<()> {
+        #[derive(Debug, Error, Diagnostic)]
+        #[error("Cannot write to a read-only secondary instance")]
+        #[diagnostic(code(db::secondary_write))]
+        #[diagnostic(help("Run the script against the primary instead"))]
+        struct SecondaryWriteError;
+
+        ensure!(!self.db.is_secondary(), SecondaryWriteError);
+        Ok(())
+    }
+    /// Pure reads only need a snapshot, not a transaction: writes into it fail.
     fn transact(&self) -> Result<SessionTx> {
         let ret = SessionTx {
-            tx: self.db.transact().set_snapshot(true).start(),
+            tx: self.db.transact_read_only().start(),
             mem_store_id: Default::default(),
             relation_store_id: self.relation_store_id.clone(),
+            memory_budget: Some(self.memory_budget()),
+            script: Arc::from(""),
+            cost: Default::default(),
+            estimates: Default::default(),
         };
         Ok(ret)
     }
     fn transact_write(&self) -> Result<SessionTx> {
+        self.ensure_primary()?;
         let ret = SessionTx {
             tx: self.db.transact().set_snapshot(true).start(),
             mem_store_id: Default::default(),
             relation_store_id: self.relation_store_id.clone(),
+            memory_budget: Some(self.memory_budget()),
+            script: Arc::from(""),
+            cost: Default::default(),
+            estimates: Default::default(),
         };
         Ok(ret)
     }
     /// Run the CozoScript passed in. The `params` argument is a map of parameters.
     pub fn run_script(&self, payload: &str, params: &Map<String, JsonValue>) -> Result<JsonValue> {
+        self.run_script_with_sink(payload, params, None)
+    }
+    pub(crate) fn run_script_with_sink(
+        &self,
+        payload: &str,
+        params: &Map<String, JsonValue>,
+        sink: Option<&mut RowSink>,
+    ) -> Result<JsonValue> {
         let start = Instant::now();
-        match self.do_run_script(payload, params) {
+        match self.do_run_script(payload, params, sink) {
             Ok(mut json) => {
                 let took = start.elapsed().as_secs_f64();
                 let map = json.as_object_mut().unwrap();
@@ -203,82 +796,131 @@ impl Db {
     pub fn run_script_fold_err(&self, payload: &str, params: &Map<String, JsonValue>) -> JsonValue {
         match self.run_script(payload, params) {
             Ok(json) => json,
-            Err(mut err) => {
-                if err.source_code().is_none() {
-                    err = err.with_source_code(payload.to_string());
-                }
-                let mut text_err = String::new();
-                let mut json_err = String::new();
-                TEXT_ERR_HANDLER
-                    .render_report(&mut text_err, err.as_ref())
-                    .expect("render text error failed");
-                JSON_ERR_HANDLER
-                    .render_report(&mut json_err, err.as_ref())
-                    .expect("render json error failed");
-                let mut json: serde_json::Value =
-                    serde_json::from_str(&json_err).expect("parse rendered json error failed");
-                let map = json.as_object_mut().unwrap();
-                map.insert("ok".to_string(), json!(false));
-                map.insert("display".to_string(), json!(text_err));
-                json
-            }
+            Err(err) => fold_err(payload, err),
         }
     }
     /// Run the CozoScript passed in. The `params` argument is a map of parameters formatted as JSON.
     pub fn run_script_str(&self, payload: &str, params: &str) -> String {
-        let params_json = if params.is_empty() {
-            Map::default()
+        match parse_params_str(params) {
+            Ok(params_json) => self.run_script_fold_err(payload, &params_json).to_string(),
+            Err(err) => err.to_string(),
+        }
+    }
+    /// Run the CozoScript passed in. The `params` argument is a map of parameters encoded
+    /// as MessagePack, and may be empty if there are none. The result, which has the same
+    /// structure as that of [`Db::run_script_fold_err`], is also encoded as MessagePack,
+    /// sparing both sides the formatting and parsing of JSON text.
+    pub fn run_script_msgpack(&self, payload: &str, params: &[u8]) -> Vec<u8> {
+        let result = if params.is_empty() {
+            self.run_script_fold_err(payload, &Map::default())
         } else {
-            match serde_json::from_str::<serde_json::Value>(params) {
-                Ok(serde_json::Value::Object(map)) => map,
-                Ok(_) => {
-                    return json!({"ok": false, "message": "params argument is not valid JSON"})
-                        .to_string()
-                }
+            match rmp_serde::from_slice::<Map<String, JsonValue>>(params) {
+                Ok(params) => self.run_script_fold_err(payload, &params),
                 Err(_) => {
-                    return json!({"ok": false, "message": "params argument is not a JSON map"})
-                        .to_string()
+                    json!({"ok": false, "message": "params argument is not a MessagePack map"})
                 }
             }
         };
-        self.run_script_fold_err(payload, &params_json).to_string()
+        rmp_serde::to_vec_named(&result).expect("serializing JSON to MessagePack failed")
     }
-    fn do_run_script(&self, payload: &str, params: &Map<String, JsonValue>) -> Result<JsonValue> {
+    fn do_run_script(
+        &self,
+        payload: &str,
+        params: &Map<String, JsonValue>,
+        sink: Option<&mut RowSink>,
+    ) -> Result<JsonValue> {
         let param_pool = params
             .iter()
             .map(|(k, v)| (k.clone(), DataValue::from(v)))
             .collect();
         match parse_script(payload, &param_pool)? {
-            CozoScript::Multi(ps) => {
-                let is_write = ps.iter().any(|p| p.out_opts.store_relation.is_some());
-                let mut tx = if is_write {
-                    self.transact_write()?
-                } else {
-                    self.transact()?
-                };
-                let mut res = json!(null);
-                let mut cleanups = vec![];
-                for p in ps {
-                    let sleep_opt = p.out_opts.sleep;
-                    let (q_res, q_cleanups) = self.run_query(&mut tx, p)?;
-                    res = q_res;
-                    cleanups.extend(q_cleanups);
-                    if let Some(secs) = sleep_opt {
-                        thread::sleep(Duration::from_micros((secs * 1000000.) as u64));
-                    }
-                }
-                if is_write {
-                    tx.commit_tx()?;
-                } else {
-                    assert!(cleanups.is_empty(), "non-empty cleanups on read-only tx");
+            CozoScript::Multi(ps) => self.run_queries(payload, ps, sink, |tx, _, p, sink| {
+                self.run_query(tx, p, sink)
+            }),
+            CozoScript::Sys(op) => self.run_sys_op(op),
+        }
+    }
+    /// Runs the queries of a script one after another in a single transaction, `run`
+    /// running the `i`th of them. Only the result of the last query is returned.
+    pub(crate) fn run_queries(
+        &self,
+        script: &str,
+        ps: Vec<InputProgram>,
+        mut sink: Option<&mut RowSink>,
+        mut run: impl FnMut(
+            &mut SessionTx,
+            usize,
+            InputProgram,
+            Option<&mut RowSink>,
+        ) -> Result<(JsonValue, Vec<RelationCleanup>)>,
+    ) -> Result<JsonValue> {
+        let is_write = ps.iter().any(|p| p.out_opts.store_relation.is_some());
+        let changes_schema = ps.iter().any(|p| {
+            matches!(
+                p.out_opts.store_relation,
+                Some((_, RelationOp::Create | RelationOp::Replace))
+            )
+        });
+        let mut tx = if is_write {
+            self.transact_write()?
+        } else {
+            self.transact()?
+        };
+        tx.script = Arc::from(script);
+        let mut res = json!(null);
+        let mut cleanups = vec![];
+        let n_queries = ps.len();
+        for (i, p) in ps.into_iter().enumerate() {
+            let sleep_opt = p.out_opts.sleep;
+            // only the result of the last query is returned
+            let q_sink = if i + 1 == n_queries {
+                sink.take()
+            } else {
+                None
+            };
+            let (q_res, q_cleanups) = run(&mut tx, i, p, q_sink)?;
+            res = q_res;
+            cleanups.extend(q_cleanups);
+            if let Some(secs) = sleep_opt {
+                thread::sleep(Duration::from_micros((secs * 1000000.) as u64));
+            }
+        }
+        if is_write {
+            let mut loads = vec![];
+            let mut after_commit = vec![];
+            for cleanup in cleanups {
+                match cleanup {
+                    RelationCleanup::BulkLoad(load) => loads.push(load),
+                    cleanup => after_commit.push(cleanup),
                 }
-                for (lower, upper) in cleanups {
-                    self.db.range_del(&lower, &upper)?;
+            }
+            // the rows of bulk loaded relations must be there once the relations are
+            if let Err(err) = self.commit_with_bulk_loads(&mut tx, &mut loads) {
+                for load in &loads {
+                    if let Err(err) = load.undo(&self.db) {
+                        error!("cannot remove rows of failed bulk load: {:?}", err);
+                    }
                 }
-                Ok(res)
+                return Err(err);
             }
-            CozoScript::Sys(op) => self.run_sys_op(op),
+            if changes_schema {
+                self.schema_changed();
+            }
+            self.clean_up(after_commit)?;
+        } else {
+            assert!(cleanups.is_empty(), "non-empty cleanups on read-only tx");
         }
+        Ok(res)
+    }
+    /// Must be called after committing any change to the schema of relations, so that
+    /// prepared scripts compiled against the old schema are compiled again.
+    fn schema_changed(&self) {
+        self.schema_epoch.fetch_add(1, Ordering::AcqRel);
+    }
+    /// Secondary instances learn about changes to the schema only by catching up with the
+    /// primary, so every catch up starts a new epoch.
+    pub(crate) fn current_schema_epoch(&self) -> u64 {
+        self.schema_epoch.load(Ordering::Acquire) + self.db.catch_up_count()
     }
     fn explain_compiled(&self, strata: &[CompiledProgram]) -> Result<JsonValue> {
         let mut ret: Vec<JsonValue> = vec![];
@@ -468,17 +1110,47 @@ impl Db {
 
                 self.explain_compiled(&compiled)
             }
-            SysOp::Compact => {
-                self.compact_relation()?;
+            SysOp::Compact(rel) => {
+                let id = self.start_compaction(rel.as_ref())?;
+                Ok(json!({"headers": ["status", "id"], "rows": [["STARTED", id]]}))
+            }
+            SysOp::Checkpoint(path) => {
+                self.checkpoint(self.script_backup_path(&path)?)?;
                 Ok(json!({"headers": ["status"], "rows": [["OK"]]}))
             }
+            SysOp::Backup(dir) => {
+                let dir = self.script_backup_path(&dir)?;
+                let id = self.backup(dir, self.backup_rate_limit, self.backups_to_keep)?;
+                Ok(json!({"headers": ["status", "id"], "rows": [["OK", id]]}))
+            }
+            SysOp::ListCompactions => self.list_compactions(),
+            SysOp::CancelCompaction(id) => {
+                let compactions = self.compactions.lock().unwrap();
+                Ok(match compactions.get(&id) {
+                    None => {
+                        json!({"headers": ["status"], "rows": [["NOT_FOUND"]]})
+                    }
+                    Some(handle) => {
+                        handle.job.cancel();
+                        json!({"headers": ["status"], "rows": [["CANCELLING"]]})
+                    }
+                })
+            }
             SysOp::ListRelations => self.list_relations(),
             SysOp::RemoveRelation(rel_names) => {
                 let mut tx = self.transact_write()?;
+                let mut cleanups = vec![];
+                let mut ids = vec![];
                 for rs in rel_names {
-                    self.remove_relation(&rs, &mut tx)?;
+                    ids.push(tx.get_relation(&rs, false)?.id);
+                    cleanups.push(self.remove_relation(&rs, &mut tx)?);
                 }
                 tx.commit_tx()?;
+                self.schema_changed();
+                for id in ids {
+                    self.db.remove_ttl(id.0);
+                }
+                self.clean_up(cleanups)?;
                 Ok(json!({"headers": ["status"], "rows": [["OK"]]}))
             }
             SysOp::ListRelation(rs) => self.list_relation(&rs),
@@ -488,9 +1160,36 @@ impl Db {
                     tx.rename_relation(old, new)?;
                 }
                 tx.commit_tx()?;
+                self.schema_changed();
                 Ok(json!({"headers": ["status"], "rows": [["OK"]]}))
             }
             SysOp::ListRunning => self.list_running(),
+            SysOp::ListSlowQueries => Ok(json!({
+                "rows": self.slow_queries.entries(),
+                "headers": QUERY_HEADERS
+            })),
+            SysOp::Stats => self.stats(),
+            SysOp::Analyze(rel) => {
+                let names = match rel {
+                    Some(rel) => vec![rel.name],
+                    None => self
+                        .relation_handles()?
+                        .into_iter()
+                        .filter(|handle| handle.access_level >= AccessLevel::ReadOnly)
+                        .map(|handle| handle.name)
+                        .collect_vec(),
+                };
+                let mut tx = self.transact_write()?;
+                let mut rows = vec![];
+                for name in names {
+                    let stats = tx.set_relation_stats(&name)?;
+                    rows.push(json!([name, stats.rows, stats.sampled, stats.distinct]));
+                }
+                tx.commit_tx()?;
+                // prepared scripts are planned again with the new statistics
+                self.schema_changed();
+                Ok(json!({"headers": ["relation", "rows", "sampled", "distinct"], "rows": rows}))
+            }
             SysOp::KillRunning(id) => {
                 let queries = self.running_queries.lock().unwrap();
                 Ok(match queries.get(&id) {
@@ -522,6 +1221,18 @@ impl Db {
                 let mut tx = self.transact_write()?;
                 tx.set_relation_triggers(name, puts, rms, replaces)?;
                 tx.commit_tx()?;
+                self.schema_changed();
+                Ok(json!({"headers": ["status"], "rows": [["OK"]]}))
+            }
+            SysOp::SetTtl(name, ttl) => {
+                let mut tx = self.transact_write()?;
+                let handle = tx.set_relation_ttl(name, ttl)?;
+                tx.commit_tx()?;
+                self.schema_changed();
+                match handle.ttl {
+                    None => self.db.remove_ttl(handle.id.0),
+                    Some(ttl) => self.db.set_ttl(handle.id.0, ttl.column, ttl.secs),
+                }
                 Ok(json!({"headers": ["status"], "rows": [["OK"]]}))
             }
             SysOp::SetAccessLevel(names, level) => {
@@ -530,48 +1241,56 @@ impl Db {
                     tx.set_access_level(name, level)?;
                 }
                 tx.commit_tx()?;
+                self.schema_changed();
                 Ok(json!({"headers": ["status"], "rows": [["OK"]]}))
             }
         }
     }
+    /// With a `sink`, the rows of the result are passed to it instead of being returned.
     pub(crate) fn run_query(
         &self,
         tx: &mut SessionTx,
         input_program: InputProgram,
-    ) -> Result<(JsonValue, Vec<(Vec<u8>, Vec<u8>)>)> {
-        let mut clean_ups = vec![];
-        if let Some((meta, op)) = &input_program.out_opts.store_relation {
-            if *op == RelationOp::Create {
-                #[derive(Debug, Error, Diagnostic)]
-                #[error("Stored relation {0} conflicts with an existing one")]
-                #[diagnostic(code(eval::stored_relation_conflict))]
-                struct StoreRelationConflict(String);
-
-                ensure!(
-                    !tx.relation_exists(&meta.name)?,
-                    StoreRelationConflict(meta.name.to_string())
-                )
-            } else if *op != RelationOp::Replace {
-                #[derive(Debug, Error, Diagnostic)]
-                #[error("Stored relation {0} not found")]
-                #[diagnostic(code(eval::stored_relation_not_found))]
-                struct StoreRelationNotFoundError(String);
-
-                let existing = tx.get_relation(&meta.name, true)?;
-
-                ensure!(
-                    tx.relation_exists(&meta.name)?,
-                    StoreRelationNotFoundError(meta.name.to_string())
-                );
-
-                existing.ensure_compatible(meta)?;
-            }
-        };
+        sink: Option<&mut RowSink>,
+    ) -> Result<(JsonValue, Vec<RelationCleanup>)> {
+        check_store_relation(tx, &input_program)?;
         let program = input_program
             .to_normalized_program(tx)?
             .stratify()?
             .magic_sets_rewrite(tx)?;
-        let (compiled, stores) = tx.stratified_magic_compile(&program)?;
+        self.run_rewritten_query(tx, input_program, &program, sink)
+    }
+    /// Runs a query whose `program` has already been normalized, stratified and rewritten
+    /// with magic sets.
+    pub(crate) fn run_rewritten_query(
+        &self,
+        tx: &mut SessionTx,
+        input_program: InputProgram,
+        program: &StratifiedMagicProgram,
+        sink: Option<&mut RowSink>,
+    ) -> Result<(JsonValue, Vec<RelationCleanup>)> {
+        // queries run by triggers are costed on their own, and the memory they take counts
+        // towards the peak of the query triggering them as well
+        let cost = QueryCost::new(tx.memory_budget.clone());
+        let outer_cost = mem::replace(&mut tx.cost, cost.clone());
+        let outer_peak = tx.memory_budget.as_ref().map(|budget| budget.reset_peak());
+        let ret = self.run_costed_query(tx, input_program, program, sink, cost);
+        if let (Some(budget), Some(peak)) = (&tx.memory_budget, outer_peak) {
+            budget.raise_peak(peak);
+        }
+        tx.cost = outer_cost;
+        ret
+    }
+    fn run_costed_query(
+        &self,
+        tx: &mut SessionTx,
+        input_program: InputProgram,
+        program: &StratifiedMagicProgram,
+        sink: Option<&mut RowSink>,
+        cost: QueryCost,
+    ) -> Result<(JsonValue, Vec<RelationCleanup>)> {
+        let mut clean_ups = vec![];
+        let (compiled, stores) = tx.stratified_magic_compile(program)?;
 
         let poison = Poison::default();
         if let Some(secs) = input_program.out_opts.timeout {
@@ -579,20 +1298,28 @@ impl Db {
         }
         let id = self.queries_count.fetch_add(1, Ordering::AcqRel);
 
-        let now = SystemTime::now();
-        let since_the_epoch = now
-            .duration_since(UNIX_EPOCH)
-            .into_diagnostic()?
-            .as_secs_f64();
+        let since_the_epoch = seconds_since_the_epoch()?;
 
+        // queries run by triggers are counted as part of the query triggering them
+        let perf_scope = if self.collect_perf {
+            PerfScope::start(self.time_perf)
+        } else {
+            None
+        };
+        let perf = QueryPerf(perf_scope.as_ref().map(|_| Default::default()));
         let handle = RunningQueryHandle {
             started_at: since_the_epoch,
+            timer: Instant::now(),
+            script: tx.script.clone(),
             poison: poison.clone(),
+            perf: perf.clone(),
+            cost,
         };
         self.running_queries.lock().unwrap().insert(id, handle);
         let _guard = RunningQueryCleanup {
             id,
             running_queries: self.running_queries.clone(),
+            slow_queries: self.slow_queries.clone(),
         };
 
         let (result, early_return) = tx.stratified_magic_evaluate(
@@ -609,6 +1336,7 @@ impl Db {
                 None
             },
             poison,
+            &perf,
         )?;
         if let Some(assertion) = &input_program.out_opts.assertion {
             match assertion {
@@ -665,18 +1393,13 @@ impl Db {
                         *relation_op,
                         meta,
                         &input_program.get_entry_out_head_or_default()?,
+                        input_program.out_opts.bulk_load,
                     )
                     .wrap_err_with(|| format!("when executing against relation '{}'", meta.name))?;
                 clean_ups.extend(to_clear);
                 Ok((json!({"headers": ["status"], "rows": [["OK"]]}), clean_ups))
             } else {
-                let ret: Vec<Vec<JsonValue>> = sorted_iter
-                    .map_ok(|tuple| -> Vec<JsonValue> {
-                        tuple.0.into_iter().map(JsonValue::from).collect()
-                    })
-                    .try_collect()?;
-
-                Ok((json!({ "rows": ret, "headers": json_headers }), clean_ups))
+                Ok((collect_rows(sorted_iter, json_headers, sink)?, clean_ups))
             }
         } else {
             let scan = if early_return {
@@ -699,24 +1422,62 @@ impl Db {
                         *relation_op,
                         meta,
                         &input_program.get_entry_out_head_or_default()?,
+                        input_program.out_opts.bulk_load,
                     )
                     .wrap_err_with(|| format!("when executing against relation '{}'", meta.name))?;
                 clean_ups.extend(to_clear);
                 Ok((json!({"headers": ["status"], "rows": [["OK"]]}), clean_ups))
             } else {
-                let ret: Vec<Vec<JsonValue>> = scan
-                    .map_ok(|tuple| -> Vec<JsonValue> {
-                        tuple.0.into_iter().map(JsonValue::from).collect()
-                    })
-                    .try_collect()?;
-
-                Ok((json!({ "rows": ret, "headers": json_headers }), clean_ups))
+                Ok((collect_rows(scan, json_headers, sink)?, clean_ups))
             }
         }
     }
-    pub(crate) fn remove_relation(&self, name: &Symbol, tx: &mut SessionTx) -> Result<()> {
-        let (lower, upper) = tx.destroy_relation(name)?;
-        self.db.range_del(&lower, &upper)?;
+    /// The returned cleanup must be done after `tx` has committed.
+    pub(crate) fn remove_relation(
+        &self,
+        name: &Symbol,
+        tx: &mut SessionTx,
+    ) -> Result<RelationCleanup> {
+        tx.destroy_relation(name)
+    }
+    pub(crate) fn bulk_loader(&self, cf: u32, relation: RelationId) -> BulkLoader<'_> {
+        BulkLoader::new(&self.db, cf, relation)
+    }
+    fn commit_with_bulk_loads(&self, tx: &mut SessionTx, loads: &mut [BulkLoad]) -> Result<()> {
+        if !loads.is_empty() {
+            // under the lock, so that the ids written only ever grow
+            let _guard = self.bulk_load_ids.lock().unwrap();
+            let last_id = RelationId(self.relation_store_id.load(Ordering::Acquire));
+            let mut batch = self.db.write_batch();
+            batch.put_cf(
+                DEFAULT_COLUMN_FAMILY,
+                &last_bulk_load_id_key(),
+                &last_id.raw_encode(),
+            )?;
+            batch.commit()?;
+        }
+        for load in loads {
+            load.apply(&self.db)?;
+        }
+        tx.commit_tx()
+    }
+    /// Range deletions are applied together in a single write batch.
+    fn clean_up(&self, cleanups: Vec<RelationCleanup>) -> Result<()> {
+        let mut ranges = self.db.write_batch();
+        for cleanup in cleanups {
+            match cleanup {
+                RelationCleanup::Range(lower, upper) => {
+                    ranges.del_range_cf(DEFAULT_COLUMN_FAMILY, &lower, &upper)?
+                }
+                RelationCleanup::ColumnFamily(id) => self.db.drop_column_family(id)?,
+                RelationCleanup::BulkLoad(_) => unreachable!("bulk loads are applied at commit"),
+                RelationCleanup::Ttl(id, None) => self.db.remove_ttl(id.0),
+                RelationCleanup::Ttl(id, Some(ttl)) => self.db.set_ttl(id.0, ttl.column, ttl.secs),
+            }
+        }
+        if !ranges.is_empty() {
+            ranges.commit()?;
+        }
         Ok(())
     }
     pub(crate) fn list_running(&self) -> Result<JsonValue> {
@@ -725,9 +1486,46 @@ impl Db {
             .lock()
             .unwrap()
             .iter()
-            .map(|(k, v)| json!([k, format!("{:?}", v.started_at)]))
+            .map(|(k, v)| v.to_row(*k))
             .collect_vec();
-        Ok(json!({"rows": res, "headers": ["id", "started_at"]}))
+        Ok(json!({"rows": res, "headers": QUERY_HEADERS}))
+    }
+    fn stats(&self) -> Result<JsonValue> {
+        let cache = self.db.cache_stats();
+        let mut rows = vec![
+            json!(["block_cache.capacity", cache.block_cache_capacity]),
+            json!(["block_cache.usage", cache.block_cache_usage]),
+            json!(["block_cache.pinned_usage", cache.block_cache_pinned_usage]),
+            json!(["row_cache.capacity", cache.row_cache_capacity]),
+            json!(["row_cache.usage", cache.row_cache_usage]),
+            json!(["memtable.budget", cache.memtable_budget]),
+            json!(["memtable.usage", cache.memtable_usage]),
+        ];
+        let compaction = self.db.compaction_progress();
+        rows.extend([
+            json!(["compaction.running", compaction.running_compactions]),
+            json!(["compaction.pending", compaction.compaction_pending]),
+            json!([
+                "compaction.pending_bytes",
+                compaction.pending_compaction_bytes
+            ]),
+            json!(["write.delayed_rate", compaction.delayed_write_rate]),
+            json!(["write.stopped", compaction.write_stopped]),
+        ]);
+        // empty unless the database is opened with statistics
+        let stats = self.db.stats();
+        for ticker in stats.tickers {
+            rows.push(json!([ticker.name, ticker.count]));
+        }
+        for hist in stats.histograms {
+            rows.push(json!([format!("{}.count", hist.name), hist.count]));
+            rows.push(json!([format!("{}.sum", hist.name), hist.sum]));
+            rows.push(json!([format!("{}.p50", hist.name), hist.median]));
+            rows.push(json!([format!("{}.p95", hist.name), hist.p95]));
+            rows.push(json!([format!("{}.p99", hist.name), hist.p99]));
+            rows.push(json!([format!("{}.max", hist.name), hist.max]));
+        }
+        Ok(json!({"rows": rows, "headers": ["stat", "value"]}))
     }
     fn list_relation(&self, name: &str) -> Result<JsonValue> {
         let tx = self.transact()?;
@@ -756,20 +1554,16 @@ impl Db {
         }
         Ok(json!({"rows": ret, "headers": ["column", "is_key", "index", "type", "has_default"]}))
     }
-    fn list_relations(&self) -> Result<JsonValue> {
+    fn relation_handles(&self) -> Result<Vec<RelationHandle>> {
         let lower =
             Tuple(vec![DataValue::Str(SmartString::from(""))]).encode_as_key(RelationId::SYSTEM);
         let upper = Tuple(vec![DataValue::Str(SmartString::from(String::from(
             LARGEST_UTF_CHAR,
         )))])
         .encode_as_key(RelationId::SYSTEM);
-        let mut it = self
-            .db
-            .transact()
-            .start()
-            .iterator()
-            .upper_bound(&upper)
-            .start();
+        // the iterator reads from the snapshot of the transaction, which must outlive it
+        let tx = self.db.transact_read_only().start();
+        let mut it = tx.iterator().upper_bound(&upper).start();
         it.seek(&lower);
         let mut collected = vec![];
         while let Some((k_slice, v_slice)) = it.pair()? {
@@ -779,24 +1573,31 @@ impl Db {
             // if compare_tuple_keys(&upper, k_slice) != Greater {
             //     break;
             // }
-            let meta = RelationHandle::decode(v_slice)?;
-            let n_keys = meta.metadata.keys.len();
-            let n_dependents = meta.metadata.non_keys.len();
-            let arity = n_keys + n_dependents;
-            let name = meta.name;
-            let access_level = meta.access_level.to_string();
-            collected.push(json!([
-                name,
-                arity,
-                access_level,
-                n_keys,
-                n_dependents,
-                meta.put_triggers.len(),
-                meta.rm_triggers.len(),
-                meta.replace_triggers.len(),
-            ]));
+            collected.push(RelationHandle::decode(v_slice)?);
             it.next();
         }
+        Ok(collected)
+    }
+    fn list_relations(&self) -> Result<JsonValue> {
+        let collected = self
+            .relation_handles()?
+            .into_iter()
+            .map(|meta| {
+                let n_keys = meta.metadata.keys.len();
+                let n_dependents = meta.metadata.non_keys.len();
+                let arity = n_keys + n_dependents;
+                json!([
+                    meta.name,
+                    arity,
+                    meta.access_level.to_string(),
+                    n_keys,
+                    n_dependents,
+                    meta.put_triggers.len(),
+                    meta.rm_triggers.len(),
+                    meta.replace_triggers.len(),
+                ])
+            })
+            .collect_vec();
         Ok(json!({"rows": collected, "headers":
                 ["name", "arity", "access_level", "n_keys", "n_non_keys", "n_put_triggers", "n_rm_triggers", "n_replace_triggers"]}))
     }
@@ -805,6 +1606,151 @@ impl Db {
 #[derive(Clone, Default)]
 pub(crate) struct Poison(pub(crate) Arc<AtomicBool>);
 
+fn collect_rows(
+    tuples: impl Iterator<Item = Result<Tuple>>,
+    headers: JsonValue,
+    sink: Option<&mut RowSink>,
+) -> Result<JsonValue> {
+    let rows = tuples
+        .map_ok(|tuple| -> Vec<JsonValue> { tuple.0.into_iter().map(JsonValue::from).collect() });
+    match sink {
+        None => {
+            let ret: Vec<Vec<JsonValue>> = rows.try_collect()?;
+            Ok(json!({ "rows": ret, "headers": headers }))
+        }
+        Some(sink) => {
+            sink.set_headers(headers.clone());
+            for row in rows {
+                sink.push(row?)?;
+            }
+            Ok(json!({ "rows": [], "headers": headers }))
+        }
+    }
+}
+
+/// Turns an error into the JSON returned to clients.
+pub(crate) fn fold_err(payload: &str, mut err: miette::Report) -> JsonValue {
+    if err.source_code().is_none() {
+        err = err.with_source_code(payload.to_string());
+    }
+    let mut text_err = String::new();
+    let mut json_err = String::new();
+    TEXT_ERR_HANDLER
+        .render_report(&mut text_err, err.as_ref())
+        .expect("render text error failed");
+    JSON_ERR_HANDLER
+        .render_report(&mut json_err, err.as_ref())
+        .expect("render json error failed");
+    let mut json: serde_json::Value =
+        serde_json::from_str(&json_err).expect("parse rendered json error failed");
+    let map = json.as_object_mut().unwrap();
+    map.insert("ok".to_string(), json!(false));
+    map.insert("display".to_string(), json!(text_err));
+    json
+}
+
+/// Checks that the relation a query stores its result into can be written as requested.
+pub(crate) fn check_store_relation(tx: &SessionTx, input_program: &InputProgram) -> Result<()> {
+    if let Some((meta, op)) = &input_program.out_opts.store_relation {
+        if *op == RelationOp::Create {
+            #[derive(Debug, Error, Diagnostic)]
+            #[error("Stored relation {0} conflicts with an existing one")]
+            #[diagnostic(code(eval::stored_relation_conflict))]
+            struct StoreRelationConflict(String);
+
+            ensure!(
+                !tx.relation_exists(&meta.name)?,
+                StoreRelationConflict(meta.name.to_string())
+            )
+        } else if *op != RelationOp::Replace {
+            #[derive(Debug, Error, Diagnostic)]
+            #[error("Stored relation {0} not found")]
+            #[diagnostic(code(eval::stored_relation_not_found))]
+            struct StoreRelationNotFoundError(String);
+
+            let existing = tx.get_relation(&meta.name, *op != RelationOp::Merge)?;
+
+            ensure!(
+                tx.relation_exists(&meta.name)?,
+                StoreRelationNotFoundError(meta.name.to_string())
+            );
+
+            existing.ensure_compatible(meta)?;
+        }
+    };
+    Ok(())
+}
+
+/// Parses the params of a script formatted as JSON, returning the error to give to the
+/// client on failure.
+pub(crate) fn parse_params_str(
+    params: &str,
+) -> std::result::Result<Map<String, JsonValue>, JsonValue> {
+    if params.is_empty() {
+        return Ok(Map::default());
+    }
+    match serde_json::from_str::<serde_json::Value>(params) {
+        Ok(serde_json::Value::Object(map)) => Ok(map),
+        Ok(_) => Err(json!({"ok": false, "message": "params argument is not valid JSON"})),
+        Err(_) => Err(json!({"ok": false, "message": "params argument is not a JSON map"})),
+    }
+}
+
+fn seconds_since_the_epoch() -> Result<f64> {
+    let now = SystemTime::now();
+    Ok(now
+        .duration_since(UNIX_EPOCH)
+        .into_diagnostic()?
+        .as_secs_f64())
+}
+
+/// Perf counters of a running query. RocksDB keeps them in thread local storage,
+/// so the evaluator copies them here after every epoch for other threads to see.
+#[derive(Clone, Default)]
+pub(crate) struct QueryPerf(Option<Arc<Mutex<PerfCounters>>>);
+
+impl QueryPerf {
+    pub(crate) fn is_collecting(&self) -> bool {
+        self.0.is_some()
+    }
+    pub(crate) fn publish(&self) {
+        if let Some(counters) = &self.0 {
+            *counters.lock().unwrap() = PerfScope::current();
+        }
+    }
+    fn to_json(&self) -> JsonValue {
+        let c = match &self.0 {
+            None => return JsonValue::Null,
+            Some(counters) => counters.lock().unwrap().clone(),
+        };
+        json!({
+            "user_key_comparison_count": c.user_key_comparison_count,
+            "block_cache_hit_count": c.block_cache_hit_count,
+            "block_read_count": c.block_read_count,
+            "block_read_byte": c.block_read_byte,
+            "block_read_nanos": c.block_read_nanos,
+            "get_read_bytes": c.get_read_bytes,
+            "multiget_read_bytes": c.multiget_read_bytes,
+            "iter_read_bytes": c.iter_read_bytes,
+            "internal_key_skipped_count": c.internal_key_skipped_count,
+            "internal_delete_skipped_count": c.internal_delete_skipped_count,
+            "get_from_memtable_count": c.get_from_memtable_count,
+            "seek_on_memtable_count": c.seek_on_memtable_count,
+            "next_on_memtable_count": c.next_on_memtable_count,
+            "bloom_memtable_hit_count": c.bloom_memtable_hit_count,
+            "bloom_memtable_miss_count": c.bloom_memtable_miss_count,
+            "bloom_sst_hit_count": c.bloom_sst_hit_count,
+            "bloom_sst_miss_count": c.bloom_sst_miss_count,
+            "get_from_output_files_nanos": c.get_from_output_files_nanos,
+            "seek_internal_seek_nanos": c.seek_internal_seek_nanos,
+            "io_bytes_read": c.io_bytes_read,
+            "io_bytes_written": c.io_bytes_written,
+            "io_read_nanos": c.io_read_nanos,
+            "io_cpu_read_nanos": c.io_cpu_read_nanos,
+        })
+    }
+}
+
 impl Poison {
     #[inline(always)]
     pub(crate) fn check(&self) -> Result<()> {
@@ -11,7 +11,7 @@ use std::sync::atomic::{AtomicU32, Ordering};
 use std::sync::{Arc, RwLock};
 
 use either::{Left, Right};
-use itertools::Itertools;
+use itertools::{EitherOrBoth, Itertools};
 use miette::Result;
 
 use crate::data::aggr::Aggregation;
@@ -20,6 +20,8 @@ use crate::data::tuple::Tuple;
 use crate::data::value::DataValue;
 use crate::query::eval::QueryLimiter;
 use crate::runtime::db::Poison;
+use crate::runtime::sorted_runs::{encode_tuple, encode_tuple_into, SortedRuns};
+use crate::runtime::spill::MemoryBudget;
 
 #[derive(Copy, Clone, Ord, PartialOrd, Eq, PartialEq)]
 pub(crate) struct StoredRelationId(pub(crate) u32);
@@ -30,13 +32,25 @@ impl Debug for StoredRelationId {
     }
 }
 
+/// The tuples of a rule derived in one epoch, or all of them for epoch 0.
+struct EpochStore {
+    /// Tuples stored without values, the usual case.
+    plain: SortedRuns,
+    /// Tuples stored with values: those of meet aggregations, whose keys have guards in
+    /// the place of aggregated values, and those skipped over because of an offset.
+    with_vals: BTreeMap<Tuple, Tuple>,
+    /// Reused for encoding the tuples put.
+    key_buf: Vec<u8>,
+}
+
 #[derive(Clone)]
 pub(crate) struct InMemRelation {
-    mem_db: Arc<RwLock<Vec<Arc<RwLock<BTreeMap<Tuple, Tuple>>>>>>,
+    mem_db: Arc<RwLock<Vec<Arc<RwLock<EpochStore>>>>>,
     epoch_size: Arc<AtomicU32>,
     pub(crate) id: StoredRelationId,
     pub(crate) rule_name: MagicSymbol,
     pub(crate) arity: usize,
+    budget: Option<MemoryBudget>,
 }
 
 impl Debug for InMemRelation {
@@ -46,29 +60,38 @@ impl Debug for InMemRelation {
 }
 
 impl InMemRelation {
-    pub(crate) fn new(id: StoredRelationId, rule_name: MagicSymbol, arity: usize) -> InMemRelation {
+    pub(crate) fn new(
+        id: StoredRelationId,
+        rule_name: MagicSymbol,
+        arity: usize,
+        budget: Option<MemoryBudget>,
+    ) -> InMemRelation {
         Self {
             epoch_size: Default::default(),
             mem_db: Default::default(),
             id,
             rule_name,
             arity,
+            budget,
         }
     }
     fn ensure_mem_db_for_epoch(&self, epoch: u32) {
-        if self.epoch_size.load(Ordering::Relaxed) > epoch {
+        if self.epoch_size.load(Ordering::Acquire) > epoch {
             return;
         }
-        let l = self.mem_db.try_read().unwrap().len() as i32;
-        let want = (epoch + 1) as i32;
-        let diff = want - l;
-        if diff > 0 {
-            let mut db = self.mem_db.try_write().unwrap();
-            for _ in 0..diff {
-                db.push(Default::default());
+        let want = epoch as usize + 1;
+        if self.mem_db.read().unwrap().len() < want {
+            let mut db = self.mem_db.write().unwrap();
+            // looked at again, as rules run in parallel may have added epochs meanwhile
+            while db.len() < want {
+                db.push(Arc::new(RwLock::new(EpochStore {
+                    plain: SortedRuns::new(self.budget.clone()),
+                    with_vals: Default::default(),
+                    key_buf: vec![],
+                })));
             }
         }
-        self.epoch_size.store(epoch, Ordering::Relaxed);
+        self.epoch_size.fetch_max(epoch, Ordering::Release);
     }
     pub(crate) fn aggr_meet_put(
         &self,
@@ -77,8 +100,9 @@ impl InMemRelation {
         epoch: u32,
     ) -> Result<bool> {
         self.ensure_mem_db_for_epoch(epoch);
-        let db_target = self.mem_db.try_read().unwrap();
-        let mut zero_target = db_target.get(0).unwrap().try_write().unwrap();
+        let db_target = self.mem_db.read().unwrap();
+        let mut zero_target = db_target.get(0).unwrap().write().unwrap();
+        let zero_target = &mut zero_target.with_vals;
         let key = Tuple(
             aggrs
                 .iter()
@@ -103,8 +127,8 @@ impl InMemRelation {
                 }
             }
             if changed && epoch != 0 {
-                let mut epoch_target = db_target.get(epoch as usize).unwrap().try_write().unwrap();
-                epoch_target.insert(key, prev_aggr.clone());
+                let mut epoch_target = db_target.get(epoch as usize).unwrap().write().unwrap();
+                epoch_target.with_vals.insert(key, prev_aggr.clone());
             }
             Ok(changed)
         } else {
@@ -123,26 +147,29 @@ impl InMemRelation {
             );
             zero_target.insert(key.clone(), tuple_to_store.clone());
             if epoch != 0 {
-                let mut zero = db_target.get(epoch as usize).unwrap().try_write().unwrap();
-                zero.insert(key, tuple_to_store);
+                let mut zero = db_target.get(epoch as usize).unwrap().write().unwrap();
+                zero.with_vals.insert(key, tuple_to_store);
             }
             Ok(true)
         }
     }
-    pub(crate) fn put(&self, tuple: Tuple, epoch: u32) {
+    pub(crate) fn put(&self, tuple: Tuple, epoch: u32) -> Result<()> {
         self.ensure_mem_db_for_epoch(epoch);
-        let db = self.mem_db.try_read().unwrap();
-        let mut target = db.get(epoch as usize).unwrap().try_write().unwrap();
-        target.insert(tuple, Tuple::default());
+        let db = self.mem_db.read().unwrap();
+        let mut target = db.get(epoch as usize).unwrap().write().unwrap();
+        target.put(&tuple)
     }
-    pub(crate) fn put_with_skip(&self, tuple: Tuple, should_skip: bool) {
+    pub(crate) fn put_with_skip(&self, tuple: Tuple, should_skip: bool) -> Result<()> {
         self.ensure_mem_db_for_epoch(0);
-        let db = self.mem_db.try_read().unwrap();
-        let mut target = db.get(0).unwrap().try_write().unwrap();
+        let db = self.mem_db.read().unwrap();
+        let mut target = db.get(0).unwrap().write().unwrap();
         if should_skip {
-            target.insert(tuple, Tuple(vec![DataValue::Guard]));
+            target
+                .with_vals
+                .insert(tuple, Tuple(vec![DataValue::Guard]));
+            Ok(())
         } else {
-            target.insert(tuple, Tuple::default());
+            target.put(&tuple)
         }
     }
     pub(crate) fn normal_aggr_put(
@@ -150,7 +177,7 @@ impl InMemRelation {
         tuple: &Tuple,
         aggrs: &[Option<(Aggregation, Vec<DataValue>)>],
         serial: usize,
-    ) {
+    ) -> Result<()> {
         self.ensure_mem_db_for_epoch(0);
         let mut vals = vec![];
         for (idx, agg) in aggrs.iter().enumerate() {
@@ -165,15 +192,15 @@ impl InMemRelation {
         }
         vals.push(DataValue::from(serial as i64));
 
-        let target = self.mem_db.try_read().unwrap();
-        let mut target = target.get(0).unwrap().try_write().unwrap();
-        target.insert(Tuple(vals), Tuple::default());
+        let target = self.mem_db.read().unwrap();
+        let mut target = target.get(0).unwrap().write().unwrap();
+        target.put(&Tuple(vals))
     }
-    pub(crate) fn exists(&self, tuple: &Tuple, epoch: u32) -> bool {
+    pub(crate) fn exists(&self, tuple: &Tuple, epoch: u32) -> Result<bool> {
         self.ensure_mem_db_for_epoch(epoch);
-        let target = self.mem_db.try_read().unwrap();
-        let target = target.get(epoch as usize).unwrap().try_read().unwrap();
-        target.contains_key(tuple)
+        let target = self.mem_db.read().unwrap();
+        let target = target.get(epoch as usize).unwrap().read().unwrap();
+        Ok(target.with_vals.contains_key(tuple) || target.plain.contains(&encode_tuple(tuple))?)
     }
 
     pub(crate) fn normal_aggr_scan_and_put(
@@ -183,36 +210,13 @@ impl InMemRelation {
         mut limiter: Option<&mut QueryLimiter>,
         poison: Poison,
     ) -> Result<bool> {
-        let db_target = self.mem_db.try_read().unwrap();
-        let target = db_target.get(0);
-        let it = match target {
-            None => Left(iter::empty()),
-            Some(target) => {
-                let target = target.try_read().unwrap();
-                Right(target.clone().into_iter().map(|(k, v)| {
-                    if v.0.is_empty() {
-                        k
-                    } else {
-                        let combined =
-                            k.0.into_iter()
-                                .zip(v.0.into_iter())
-                                .map(|(kel, vel)| {
-                                    if matches!(kel, DataValue::Guard) {
-                                        vel
-                                    } else {
-                                        kel
-                                    }
-                                })
-                                .collect_vec();
-                        Tuple(combined)
-                    }
-                }))
-            }
-        };
+        let it = self.scan_epoch(0).map_ok(|(k, v)| combine(k, v));
 
         let mut aggrs = aggrs.to_vec();
         let n_keys = aggrs.iter().filter(|aggr| aggr.is_none()).count();
-        let grouped = it.group_by(move |tuple| tuple.0[..n_keys].to_vec());
+        // errors are put in groups of their own, to be raised when come upon
+        let grouped =
+            it.group_by(move |tuple| tuple.as_ref().ok().map(|tuple| tuple.0[..n_keys].to_vec()));
         let mut invert_indices = vec![];
         for (idx, aggr) in aggrs.iter().enumerate() {
             if aggr.is_none() {
@@ -235,7 +239,7 @@ impl InMemRelation {
                 aggr.normal_init(args)?;
             }
             let mut aggr_res = vec![DataValue::Guard; aggrs.len()];
-            let first_tuple = group_iter.next().unwrap();
+            let first_tuple = group_iter.next().unwrap()?;
             for (idx, aggr) in aggrs.iter_mut().enumerate() {
                 let val = &first_tuple.0[invert_indices[idx]];
                 if let Some((aggr_op, _aggr_args)) = aggr {
@@ -246,6 +250,7 @@ impl InMemRelation {
                 }
             }
             for tuple in group_iter {
+                let tuple = tuple?;
                 for (idx, aggr) in aggrs.iter_mut().enumerate() {
                     let val = &tuple.0[invert_indices[idx]];
                     if let Some((aggr_op, _aggr_args)) = aggr {
@@ -263,84 +268,48 @@ impl InMemRelation {
             }
             let res_tpl = Tuple(aggr_res);
             if let Some(lmt) = limiter.borrow_mut() {
-                if !store.exists(&res_tpl, 0) {
-                    store.put_with_skip(res_tpl, lmt.should_skip_next());
+                if !store.exists(&res_tpl, 0)? {
+                    store.put_with_skip(res_tpl, lmt.should_skip_next())?;
                     if lmt.incr_and_should_stop() {
                         return Ok(true);
                     }
                 }
             } else {
-                store.put(res_tpl, 0);
+                store.put(res_tpl, 0)?;
             }
         }
         Ok(false)
     }
 
-    pub(crate) fn scan_all_for_epoch(&self, epoch: u32) -> impl Iterator<Item = Result<Tuple>> {
+    /// The tuples of an epoch in order, with their values. Tuples put afterwards are not seen.
+    fn scan_epoch(&self, epoch: u32) -> impl Iterator<Item = Result<(Tuple, Tuple)>> {
         self.ensure_mem_db_for_epoch(epoch);
-        let db = self
-            .mem_db
-            .try_read()
-            .unwrap()
-            .get(epoch as usize)
-            .unwrap()
-            .clone()
-            .try_read()
-            .unwrap()
-            .clone();
-        db.into_iter().map(|(k, v)| {
-            if v.0.is_empty() {
-                Ok(k)
-            } else {
-                let combined =
-                    k.0.into_iter()
-                        .zip(v.0.into_iter())
-                        .map(|(kel, vel)| {
-                            if matches!(kel, DataValue::Guard) {
-                                vel
-                            } else {
-                                kel
-                            }
-                        })
-                        .collect_vec();
-                Ok(Tuple(combined))
+        let db = self.mem_db.read().unwrap();
+        let mut target = db.get(epoch as usize).unwrap().write().unwrap();
+        match target.plain.snapshot() {
+            Ok(plain) => {
+                let with_vals = target.with_vals.clone();
+                Left(merge_with_vals(plain, with_vals.into_iter()))
             }
-        })
+            Err(err) => Right(iter::once(Err(err))),
+        }
+    }
+    pub(crate) fn scan_all_for_epoch(&self, epoch: u32) -> impl Iterator<Item = Result<Tuple>> {
+        self.scan_epoch(epoch).map_ok(|(k, v)| combine(k, v))
     }
     pub(crate) fn scan_all(&self) -> impl Iterator<Item = Result<Tuple>> {
         self.scan_all_for_epoch(0)
     }
     pub(crate) fn scan_early_returned(&self) -> impl Iterator<Item = Result<Tuple>> {
-        self.ensure_mem_db_for_epoch(0);
-        let db = self
-            .mem_db
-            .try_read()
-            .unwrap()
-            .get(0)
-            .unwrap()
-            .clone()
-            .try_read()
-            .unwrap()
-            .clone();
-        db.into_iter().filter_map(|(k, v)| {
-            if v.0.is_empty() {
-                Some(Ok(k))
-            } else if v.0.last() == Some(&DataValue::Guard) {
-                None
-            } else {
-                let combined =
-                    k.0.iter()
-                        .zip(v.0.iter())
-                        .map(|(kel, vel)| {
-                            if matches!(kel, DataValue::Guard) {
-                                vel.clone()
-                            } else {
-                                kel.clone()
-                            }
-                        })
-                        .collect_vec();
-                Some(Ok(Tuple(combined)))
+        self.scan_epoch(0).filter_map(|res| match res {
+            Ok((k, v)) => {
+                if v.0.last() == Some(&DataValue::Guard) {
+                    None
+                } else {
+                    Some(Ok(combine(k, v)))
+                }
             }
+            Err(err) => Some(Err(err)),
         })
     }
     pub(crate) fn scan_prefix(&self, prefix: &Tuple) -> impl Iterator<Item = Result<Tuple>> {
@@ -355,29 +324,29 @@ impl InMemRelation {
         upper.push(DataValue::Bot);
         let upper = Tuple(upper);
         self.ensure_mem_db_for_epoch(epoch);
-        let target = self.mem_db.try_read().unwrap();
-        let target = target.get(epoch as usize).unwrap().try_read().unwrap();
-        let res = target
-            .range((Included(prefix), Included(&upper)))
-            .map(|(k, v)| {
-                if v.0.is_empty() {
-                    Ok(k.clone())
-                } else {
-                    let combined =
-                        k.0.iter()
-                            .zip(v.0.iter())
-                            .map(|(kel, vel)| {
-                                if matches!(kel, DataValue::Guard) {
-                                    vel.clone()
-                                } else {
-                                    kel.clone()
-                                }
-                            })
-                            .collect_vec();
-                    Ok(Tuple(combined))
-                }
-            })
-            .collect_vec();
+        let target = self.mem_db.read().unwrap();
+        let target = target.get(epoch as usize).unwrap().read().unwrap();
+        // the encoding of each value is never a prefix of another's, so tuples starting
+        // with the prefix are exactly those whose encodings start with its encoding
+        let encoded = encode_tuple(prefix);
+        let plain = match target
+            .plain
+            .range(&encoded, |key| key.starts_with(&encoded))
+        {
+            Ok(plain) => plain,
+            Err(err) => return vec![Err(err)].into_iter(),
+        };
+        let res = if target.with_vals.is_empty() {
+            plain.into_iter().map(Ok).collect_vec()
+        } else {
+            let with_vals = target
+                .with_vals
+                .range((Included(prefix), Included(&upper)))
+                .map(|(k, v)| (k.clone(), v.clone()));
+            merge_with_vals(plain.into_iter().map(Ok), with_vals)
+                .map_ok(|(k, v)| combine(k, v))
+                .collect_vec()
+        };
         res.into_iter()
     }
     pub(crate) fn scan_bounded_prefix_for_epoch(
@@ -392,12 +361,75 @@ impl InMemRelation {
         prefix_bound.0.extend_from_slice(lower);
         let mut upper_bound = prefix.clone();
         upper_bound.0.extend_from_slice(upper);
-        let target = self.mem_db.try_read().unwrap();
-        let target = target.get(epoch as usize).unwrap().try_read().unwrap();
-        let res = target
-            .range((Included(&prefix_bound), Included(&upper_bound)))
-            .map(|(k, _v)| Ok(k.clone()))
-            .collect_vec();
+        let target = self.mem_db.read().unwrap();
+        let target = target.get(epoch as usize).unwrap().read().unwrap();
+        let encoded_upper = encode_tuple(&upper_bound);
+        let plain = match target.plain.range(&encode_tuple(&prefix_bound), |key| {
+            key <= encoded_upper.as_slice()
+        }) {
+            Ok(plain) => plain,
+            Err(err) => return vec![Err(err)].into_iter(),
+        };
+        let res = if target.with_vals.is_empty() {
+            plain.into_iter().map(Ok).collect_vec()
+        } else {
+            let with_vals = target
+                .with_vals
+                .range((Included(&prefix_bound), Included(&upper_bound)))
+                .map(|(k, v)| (k.clone(), v.clone()));
+            merge_with_vals(plain.into_iter().map(Ok), with_vals)
+                .map_ok(|(k, _v)| k)
+                .collect_vec()
+        };
         res.into_iter()
     }
 }
+
+impl EpochStore {
+    fn put(&mut self, tuple: &Tuple) -> Result<()> {
+        if !self.with_vals.is_empty() {
+            self.with_vals.remove(tuple);
+        }
+        encode_tuple_into(tuple, &mut self.key_buf);
+        self.plain.insert(&self.key_buf)?;
+        Ok(())
+    }
+}
+
+/// Merges tuples stored without values with those stored with them, both in order.
+/// A tuple stored both ways is taken with its values.
+fn merge_with_vals(
+    plain: impl Iterator<Item = Result<Tuple>>,
+    with_vals: impl Iterator<Item = (Tuple, Tuple)>,
+) -> impl Iterator<Item = Result<(Tuple, Tuple)>> {
+    plain
+        // errors come out as soon as they are come upon
+        .merge_join_by(with_vals, |p, (k, _v)| match p {
+            Ok(p) => p.cmp(k),
+            Err(_) => std::cmp::Ordering::Less,
+        })
+        .map(|either| match either {
+            EitherOrBoth::Left(res) => res.map(|k| (k, Tuple::default())),
+            EitherOrBoth::Right(kv) | EitherOrBoth::Both(_, kv) => Ok(kv),
+        })
+}
+
+/// Puts the values of a tuple stored with them in the place of the guards in its key.
+fn combine(k: Tuple, v: Tuple) -> Tuple {
+    if v.0.is_empty() {
+        k
+    } else {
+        let combined =
+            k.0.into_iter()
+                .zip(v.0.into_iter())
+                .map(|(kel, vel)| {
+                    if matches!(kel, DataValue::Guard) {
+                        vel
+                    } else {
+                        kel
+                    }
+                })
+                .collect_vec();
+        Tuple(combined)
+    }
+}
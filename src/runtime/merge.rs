@@ -0,0 +1,279 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::fmt::{Display, Formatter};
+
+use log::error;
+use miette::{bail, miette, Result};
+
+use crate::data::aggr::parse_aggr;
+use crate::data::relation::{ColType, NullableColType};
+use crate::data::tuple::{encode_values, EncodedValues, ValueDeserError, ENCODED_KEY_MIN_LEN};
+use crate::data::value::{DataValue, Num};
+
+/// The aggregations that `:merge` can combine non-key columns with. Operands refer to them
+/// by their position here, so new ones can only be added at the end.
+const MERGE_AGGRS: [&str; 12] = [
+    "sum",
+    "count",
+    "min",
+    "max",
+    "union",
+    "intersection",
+    "and",
+    "or",
+    "choice",
+    "choice_last",
+    "bit_and",
+    "bit_or",
+];
+
+/// How a non-key column of a row merged into a stored relation is combined with the value
+/// already stored: `count` adds one for each row merged, `sum` adds the value merged, and
+/// the others are the meet aggregations of the same names.
+#[derive(Debug, Copy, Clone, Eq, PartialEq, serde_derive::Serialize, serde_derive::Deserialize)]
+pub(crate) struct MergeOp(u8);
+
+impl MergeOp {
+    pub(crate) fn parse(name: &str) -> Option<Self> {
+        MERGE_AGGRS
+            .iter()
+            .position(|n| *n == name)
+            .map(|i| Self(i as u8))
+    }
+    fn name(self) -> &'static str {
+        MERGE_AGGRS[self.0 as usize]
+    }
+    /// The value of the column when nothing is stored yet.
+    fn first(self, val: DataValue) -> DataValue {
+        match self.name() {
+            "count" => DataValue::from(1),
+            _ => val,
+        }
+    }
+    /// Whether values of a column typed `typing` can be merged, such that combining them
+    /// gives a value of the same type.
+    pub(crate) fn accepts_column(self, typing: &NullableColType) -> bool {
+        match (self.name(), &typing.coltype) {
+            (_, ColType::Any) => true,
+            ("sum", ColType::Int | ColType::Float) => true,
+            ("count", ColType::Int) => true,
+            ("union" | "intersection", ColType::List { len: None, .. }) => true,
+            ("bit_and" | "bit_or", ColType::Bytes) => true,
+            ("min" | "max" | "choice" | "choice_last", _) => true,
+            _ => false,
+        }
+    }
+    /// Whether a value can be merged into a column.
+    pub(crate) fn accepts_operand(self, val: &DataValue) -> bool {
+        match self.name() {
+            "sum" => matches!(val, DataValue::Num(_)),
+            "union" | "intersection" => matches!(val, DataValue::List(_) | DataValue::Set(_)),
+            "and" | "or" => matches!(val, DataValue::Bool(_)),
+            "bit_and" | "bit_or" => matches!(val, DataValue::Bytes(_)),
+            _ => true,
+        }
+    }
+    /// Combines the value stored with one merged into it. The sum of integers is an
+    /// integer, and a list stays a list.
+    fn combine(self, stored: &DataValue, merged: &DataValue) -> Result<DataValue> {
+        Ok(match self.name() {
+            "sum" => match (stored, merged) {
+                (DataValue::Num(Num::Int(a)), DataValue::Num(Num::Int(b))) => DataValue::from(
+                    a.checked_add(*b)
+                        .ok_or_else(|| miette!("integer overflow in sum"))?,
+                ),
+                (DataValue::Num(a), DataValue::Num(b)) => {
+                    DataValue::from(a.get_float() + b.get_float())
+                }
+                _ => bail!("cannot sum {:?} and {:?}", stored, merged),
+            },
+            "count" => {
+                let n = stored
+                    .get_int()
+                    .ok_or_else(|| miette!("cannot count on {:?}", stored))?;
+                DataValue::from(n + 1)
+            }
+            name => {
+                let mut aggr = parse_aggr(name).unwrap().clone();
+                aggr.meet_init(&[])?;
+                let mut combined = stored.clone();
+                aggr.meet_op
+                    .as_ref()
+                    .unwrap()
+                    .update(&mut combined, merged)?;
+                match (stored, combined) {
+                    (DataValue::List(_), DataValue::Set(s)) => {
+                        DataValue::List(s.into_iter().collect())
+                    }
+                    (_, combined) => combined,
+                }
+            }
+        })
+    }
+}
+
+impl Display for MergeOp {
+    fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}", self.name())
+    }
+}
+
+/// Appends the operand of a row merged into a relation, after the relation prefix: the
+/// number of non-key columns as a big-endian `u32`, the code of the op of each, and the
+/// columns as written by [`encode_values`].
+pub(crate) fn encode_merge_operand(ret: &mut Vec<u8>, ops: &[MergeOp], vals: &[DataValue]) {
+    ret.extend((ops.len() as u32).to_be_bytes());
+    ret.extend(ops.iter().map(|op| op.0));
+    encode_values(ret, vals);
+}
+
+fn decode_merge_operand(operand: &[u8]) -> Result<(&[u8], Vec<MergeOp>, Vec<DataValue>)> {
+    let bad = || ValueDeserError(operand.to_vec());
+    let ops_start = ENCODED_KEY_MIN_LEN + 4;
+    if operand.len() < ops_start {
+        return Err(bad().into());
+    }
+    let n = u32::from_be_bytes(operand[ENCODED_KEY_MIN_LEN..ops_start].try_into().unwrap());
+    let ops_end = ops_start + n as usize;
+    if operand.len() < ops_end {
+        return Err(bad().into());
+    }
+    let ops = operand[ops_start..ops_end]
+        .iter()
+        .map(|code| {
+            if (*code as usize) < MERGE_AGGRS.len() {
+                Ok(MergeOp(*code))
+            } else {
+                Err(bad())
+            }
+        })
+        .collect::<std::result::Result<Vec<_>, _>>()?;
+    let vals = EncodedValues::from_columns(&operand[ops_end..])?.decode(None)?;
+    if vals.len() != ops.len() {
+        return Err(bad().into());
+    }
+    Ok((&operand[..ENCODED_KEY_MIN_LEN], ops, vals))
+}
+
+/// Combines the value stored for a key with the operands merged into it, oldest first.
+/// This is the function called by the merge operator of RocksDB. On failure the key cannot
+/// be read, so a column that still cannot be combined, although operands are checked when
+/// they are written, keeps the value stored and drops the operand.
+pub(crate) fn merge_stored_values(existing: Option<&[u8]>, operands: &[&[u8]]) -> Option<Vec<u8>> {
+    match merge_values(existing, operands) {
+        Ok(merged) => Some(merged),
+        Err(err) => {
+            error!("cannot merge into stored row: {:?}", err);
+            None
+        }
+    }
+}
+
+fn merge_values(existing: Option<&[u8]>, operands: &[&[u8]]) -> Result<Vec<u8>> {
+    let mut prefix = None;
+    let mut row = match existing {
+        None => None,
+        Some(stored) => {
+            prefix = Some(&stored[..ENCODED_KEY_MIN_LEN.min(stored.len())]);
+            Some(EncodedValues::new(stored)?.decode(None)?)
+        }
+    };
+    for operand in operands {
+        let (operand_prefix, ops, vals) = decode_merge_operand(operand)?;
+        prefix.get_or_insert(operand_prefix);
+        row = Some(match row {
+            Some(mut row) if row.len() == vals.len() => {
+                for ((stored, merged), op) in row.iter_mut().zip(vals).zip(ops) {
+                    match op.combine(stored, &merged) {
+                        Ok(combined) => *stored = combined,
+                        Err(err) => {
+                            error!("cannot merge {:?} with '{}': {:?}", merged, op, err);
+                        }
+                    }
+                }
+                row
+            }
+            _ => vals
+                .into_iter()
+                .zip(ops)
+                .map(|(val, op)| op.first(val))
+                .collect(),
+        });
+    }
+    let mut ret = prefix.unwrap_or_default().to_vec();
+    encode_values(&mut ret, &row.unwrap_or_default());
+    Ok(ret)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn operand(ops: &[&str], vals: Vec<DataValue>) -> Vec<u8> {
+        let ops: Vec<_> = ops.iter().map(|n| MergeOp::parse(n).unwrap()).collect();
+        let mut ret = 7u64.to_be_bytes().to_vec();
+        encode_merge_operand(&mut ret, &ops, &vals);
+        ret
+    }
+
+    #[test]
+    fn operands_are_combined_in_order() {
+        let ops = ["count", "union", "choice_last"];
+        let first = operand(
+            &ops,
+            vec![
+                DataValue::Null,
+                DataValue::List(vec![DataValue::from(1)]),
+                DataValue::Str("a".into()),
+            ],
+        );
+        let second = operand(
+            &ops,
+            vec![
+                DataValue::Null,
+                DataValue::List(vec![DataValue::from(2), DataValue::from(1)]),
+                DataValue::Str("b".into()),
+            ],
+        );
+        let merged = merge_stored_values(None, &[&first, &second]).unwrap();
+        assert_eq!(&merged[..ENCODED_KEY_MIN_LEN], &7u64.to_be_bytes());
+        let row = EncodedValues::new(&merged).unwrap().decode(None).unwrap();
+        assert_eq!(row[0], DataValue::from(2));
+        assert_eq!(
+            row[1],
+            DataValue::List(vec![DataValue::from(1), DataValue::from(2)])
+        );
+        assert_eq!(row[2], DataValue::Str("b".into()));
+
+        let again = merge_stored_values(Some(&merged), &[&first]).unwrap();
+        let row = EncodedValues::new(&again).unwrap().decode(None).unwrap();
+        assert_eq!(row[0], DataValue::from(3));
+        assert_eq!(row[2], DataValue::Str("a".into()));
+
+        let sum = operand(&["sum"], vec![DataValue::from(2)]);
+        let merged = merge_stored_values(None, &[&sum, &sum, &sum]).unwrap();
+        let row = EncodedValues::new(&merged).unwrap().decode(None).unwrap();
+        assert_eq!(row[0], DataValue::from(6));
+
+        let half = operand(&["sum"], vec![DataValue::from(0.5)]);
+        let merged = merge_stored_values(None, &[&sum, &half]).unwrap();
+        let row = EncodedValues::new(&merged).unwrap().decode(None).unwrap();
+        assert_eq!(row[0], DataValue::from(2.5));
+    }
+
+    #[test]
+    fn failed_combination_keeps_stored_value() {
+        let stored = operand(&["sum"], vec![DataValue::from(i64::MAX)]);
+        let bad = operand(&["sum"], vec![DataValue::Str("a".into())]);
+        let merged = merge_stored_values(None, &[&stored, &bad, &bad]).unwrap();
+        let row = EncodedValues::new(&merged).unwrap().decode(None).unwrap();
+        assert_eq!(row[0], DataValue::from(i64::MAX));
+
+        let one = operand(&["sum"], vec![DataValue::from(1)]);
+        let merged = merge_stored_values(Some(&merged), &[&one]).unwrap();
+        let row = EncodedValues::new(&merged).unwrap().decode(None).unwrap();
+        assert_eq!(row[0], DataValue::from(i64::MAX));
+    }
+}
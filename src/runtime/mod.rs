@@ -2,7 +2,15 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
+pub(crate) mod bulk_load;
+pub(crate) mod cost;
 pub(crate) mod db;
 pub(crate) mod transact;
 pub(crate) mod in_mem;
+pub(crate) mod merge;
+pub(crate) mod prepared;
 pub(crate) mod relation;
+pub(crate) mod sorted_runs;
+pub(crate) mod spill;
+pub(crate) mod stats;
+pub(crate) mod stream;
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::collections::BTreeMap;
+use std::sync::{Arc, Mutex};
+use std::time::Instant;
+
+use itertools::Itertools;
+use miette::Result;
+use serde_json::{json, Map};
+
+use crate::data::json::JsonValue;
+use crate::data::program::{InputProgram, RelationOp, StratifiedMagicProgram};
+use crate::data::symb::Symbol;
+use crate::data::value::DataValue;
+use crate::parse::prepare_script;
+use crate::runtime::db::{check_store_relation, fold_err, parse_params_str, Db};
+use crate::runtime::transact::SessionTx;
+
+/// A script parsed once by [`Db::prepare`], to be run many times with different params.
+#[derive(Clone)]
+pub struct PreparedQuery(Arc<PreparedScript>);
+
+pub(crate) struct PreparedScript {
+    payload: String,
+    programs: Mutex<Vec<PreparedProgram>>,
+    /// Queries after one creating or replacing a relation are rewritten against a schema
+    /// that only exists in their own transaction, so they are never kept.
+    keep_rewritten: bool,
+}
+
+/// Kept programs are planned again once a relation they read has grown or shrunk by this
+/// factor since they were planned.
+const REPLAN_DRIFT: f64 = 2.;
+
+struct PreparedProgram {
+    input: InputProgram,
+    rewritten: Option<RewrittenProgram>,
+}
+
+/// A program rewritten with magic sets, with the schema epoch it was rewritten at and the
+/// estimated rows of the stored relations its joins were ordered by.
+#[derive(Clone)]
+struct RewrittenProgram {
+    epoch: u64,
+    program: StratifiedMagicProgram,
+    rows: Vec<(Symbol, f64)>,
+}
+
+impl RewrittenProgram {
+    fn is_current(&self, epoch: u64, tx: &SessionTx) -> Result<bool> {
+        if self.epoch != epoch {
+            return Ok(false);
+        }
+        for (name, rows) in &self.rows {
+            let handle = match tx.get_relation(name, false) {
+                Ok(handle) => handle,
+                Err(_) => return Ok(false),
+            };
+            let now = tx.relation_estimate(&handle)?.rows;
+            if now > rows * REPLAN_DRIFT || now * REPLAN_DRIFT < *rows {
+                return Ok(false);
+            }
+        }
+        Ok(true)
+    }
+}
+
+impl PreparedScript {
+    /// The `i`th program rewritten with magic sets, with its params still to be filled in.
+    fn rewritten(
+        &self,
+        i: usize,
+        input: &InputProgram,
+        epoch: u64,
+        tx: &SessionTx,
+    ) -> Result<StratifiedMagicProgram> {
+        let kept = self.programs.lock().unwrap()[i].rewritten.clone();
+        if let Some(kept) = kept {
+            if kept.is_current(epoch, tx)? {
+                return Ok(kept.program);
+            }
+        }
+        let (normalized, estimates) = input.to_normalized_program_with_estimates(tx)?;
+        let program = normalized.stratify()?.magic_sets_rewrite(tx)?;
+        if self.keep_rewritten {
+            let mut programs = self.programs.lock().unwrap();
+            let kept = &mut programs[i].rewritten;
+            if !matches!(kept, Some(kept) if kept.epoch > epoch) {
+                *kept = Some(RewrittenProgram {
+                    epoch,
+                    program: program.clone(),
+                    rows: estimates
+                        .into_iter()
+                        .map(|(name, estimate)| (name, estimate.rows))
+                        .collect(),
+                });
+            }
+        }
+        Ok(program)
+    }
+}
+
+/// The scripts last prepared, by their text.
+pub(crate) struct PreparedCache {
+    capacity: usize,
+    tick: u64,
+    // the values are the tick at which the script was last prepared, and the script
+    scripts: BTreeMap<String, (u64, Arc<PreparedScript>)>,
+}
+
+impl PreparedCache {
+    pub(crate) fn new(capacity: usize) -> Self {
+        Self {
+            capacity,
+            tick: 0,
+            scripts: Default::default(),
+        }
+    }
+    fn get(&mut self, payload: &str) -> Option<Arc<PreparedScript>> {
+        self.tick += 1;
+        let tick = self.tick;
+        self.scripts.get_mut(payload).map(|(used, script)| {
+            *used = tick;
+            script.clone()
+        })
+    }
+    fn insert(&mut self, payload: &str, script: Arc<PreparedScript>) {
+        if self.capacity == 0 {
+            return;
+        }
+        if self.scripts.len() >= self.capacity && !self.scripts.contains_key(payload) {
+            // linear, but only done when preparing a script not among the recent ones
+            let least_recent = self
+                .scripts
+                .iter()
+                .min_by_key(|(_, (used, _))| *used)
+                .map(|(k, _)| k.clone());
+            if let Some(k) = least_recent {
+                self.scripts.remove(&k);
+            }
+        }
+        self.tick += 1;
+        self.scripts
+            .insert(payload.to_string(), (self.tick, script));
+    }
+}
+
+impl Db {
+    /// Prepares the CozoScript passed in to be run many times with different params.
+    /// Running it then skips parsing, and normalizing and rewriting its queries as long as
+    /// the schema of relations stays the same and the relations they read keep about their
+    /// size. The most recently prepared scripts are
+    /// cached by their text, so preparing the same script again is cheap.
+    ///
+    /// Params can be used wherever an expression is evaluated when the query runs, but not
+    /// in query options, aggregation arguments or constant rules. System ops cannot be
+    /// prepared.
+    pub fn prepare(&self, payload: &str) -> Result<PreparedQuery> {
+        if let Some(script) = self.prepared.lock().unwrap().get(payload) {
+            return Ok(PreparedQuery(script));
+        }
+        let programs = prepare_script(payload)?;
+        let keep_rewritten = !programs.iter().any(|p| {
+            matches!(
+                p.out_opts.store_relation,
+                Some((_, RelationOp::Create | RelationOp::Replace))
+            )
+        });
+        let script = Arc::new(PreparedScript {
+            payload: payload.to_string(),
+            programs: Mutex::new(
+                programs
+                    .into_iter()
+                    .map(|input| PreparedProgram {
+                        input,
+                        rewritten: None,
+                    })
+                    .collect(),
+            ),
+            keep_rewritten,
+        });
+        self.prepared
+            .lock()
+            .unwrap()
+            .insert(payload, script.clone());
+        Ok(PreparedQuery(script))
+    }
+    /// Run a script returned by [`Db::prepare`]. The `params` argument is a map of parameters.
+    pub fn run_prepared(
+        &self,
+        query: &PreparedQuery,
+        params: &Map<String, JsonValue>,
+    ) -> Result<JsonValue> {
+        let start = Instant::now();
+        let mut json = self.do_run_prepared(&query.0, params)?;
+        let took = start.elapsed().as_secs_f64();
+        let map = json.as_object_mut().unwrap();
+        map.insert("ok".to_string(), json!(true));
+        map.insert("took".to_string(), json!(took));
+        Ok(json)
+    }
+    /// Run a script returned by [`Db::prepare`]. The `params` argument is a map of parameters.
+    /// Fold any error into the return JSON itself.
+    pub fn run_prepared_fold_err(
+        &self,
+        query: &PreparedQuery,
+        params: &Map<String, JsonValue>,
+    ) -> JsonValue {
+        match self.run_prepared(query, params) {
+            Ok(json) => json,
+            Err(err) => fold_err(&query.0.payload, err),
+        }
+    }
+    /// Run a script returned by [`Db::prepare`]. The `params` argument is a map of parameters
+    /// formatted as JSON.
+    pub fn run_prepared_str(&self, query: &PreparedQuery, params: &str) -> String {
+        match parse_params_str(params) {
+            Ok(params_json) => self.run_prepared_fold_err(query, &params_json).to_string(),
+            Err(err) => err.to_string(),
+        }
+    }
+    fn do_run_prepared(
+        &self,
+        script: &PreparedScript,
+        params: &Map<String, JsonValue>,
+    ) -> Result<JsonValue> {
+        let params: BTreeMap<String, DataValue> = params
+            .iter()
+            .map(|(k, v)| (k.clone(), DataValue::from(v)))
+            .collect();
+        // read before the transaction starts, so that a program rewritten against an older
+        // schema is never taken to be current
+        let epoch = self.current_schema_epoch();
+        let inputs = script
+            .programs
+            .lock()
+            .unwrap()
+            .iter()
+            .map(|p| p.input.clone())
+            .collect_vec();
+        self.run_queries(&script.payload, inputs, None, |tx, i, input, sink| {
+            check_store_relation(tx, &input)?;
+            let mut program = script.rewritten(i, &input, epoch, tx)?;
+            program.fill_params(&params)?;
+            self.run_rewritten_query(tx, input, &program, sink)
+        })
+    }
+}
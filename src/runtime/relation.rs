@@ -4,6 +4,7 @@
 
 use std::fmt::{Debug, Display, Formatter};
 use std::sync::atomic::Ordering;
+use std::sync::Arc;
 
 use log::error;
 use miette::{bail, ensure, Diagnostic, Result};
@@ -12,14 +13,20 @@ use serde::Serialize;
 use smartstring::{LazyCompact, SmartString};
 use thiserror::Error;
 
-use cozorocks::DbIter;
+use cozorocks::{CfOpts, DbIter};
 
 use crate::data::memcmp::MemCmpEncoder;
-use crate::data::relation::StoredRelationMetadata;
+use crate::data::relation::{
+    ColType, ColumnFamilyConfig, StorageCompaction, StorageCompression, StoredRelationMetadata,
+};
 use crate::data::symb::Symbol;
-use crate::data::tuple::{ENCODED_KEY_MIN_LEN, Tuple};
+use crate::data::tuple::{encode_values, EncodedKeys, EncodedValues, Tuple};
 use crate::data::value::DataValue;
 use crate::parse::SourceSpan;
+use crate::runtime::bulk_load::BulkLoad;
+use crate::runtime::cost::QueryCost;
+use crate::runtime::merge::{encode_merge_operand, MergeOp};
+use crate::runtime::stats::RelationStats;
 use crate::runtime::transact::SessionTx;
 use crate::utils::swap_option_result;
 
@@ -68,6 +75,66 @@ pub(crate) struct RelationHandle {
     pub(crate) rm_triggers: Vec<String>,
     pub(crate) replace_triggers: Vec<String>,
     pub(crate) access_level: AccessLevel,
+    /// Set if the relation lives in its own column family instead of the default one.
+    #[serde(default)]
+    pub(crate) column_family: Option<ColumnFamilyConfig>,
+    #[serde(default)]
+    pub(crate) cf_id: u32,
+    #[serde(default)]
+    pub(crate) ttl: Option<RelationTtl>,
+    /// Collected by `::analyze`, for planning queries.
+    #[serde(default)]
+    pub(crate) stats: Option<RelationStats>,
+}
+
+/// Rows of the relation expire `secs` seconds after the time held by the key column at
+/// `column`, in seconds since the epoch, and are dropped by compactions from then on.
+#[derive(Debug, Copy, Clone, Eq, PartialEq, serde_derive::Serialize, serde_derive::Deserialize)]
+pub(crate) struct RelationTtl {
+    pub(crate) column: usize,
+    pub(crate) secs: u64,
+}
+
+/// Storage work done outside of the transaction requesting it: reclaiming the space of
+/// dropped relations and updating the TTL rules of the compaction filter once it has
+/// committed, and writing bulk loads just before.
+pub(crate) enum RelationCleanup {
+    Range(Vec<u8>, Vec<u8>),
+    ColumnFamily(u32),
+    BulkLoad(BulkLoad),
+    Ttl(RelationId, Option<RelationTtl>),
+}
+
+impl ColumnFamilyConfig {
+    fn to_cf_opts(&self) -> CfOpts {
+        // the numbers are RocksDB's `CompressionType` and `CompactionStyle`
+        let mut opts = CfOpts::default();
+        if let Some(compression) = self.compression {
+            opts.compression = match compression {
+                StorageCompression::None => 0,
+                StorageCompression::Snappy => 1,
+                StorageCompression::Lz4 => 4,
+                StorageCompression::Zstd => 7,
+            };
+        }
+        if let Some(compaction) = self.compaction {
+            opts.compaction_style = match compaction {
+                StorageCompaction::Level => 0,
+                StorageCompaction::Universal => 1,
+                StorageCompaction::Fifo => 2,
+            };
+        }
+        if let Some(block_size) = self.block_size {
+            opts.block_size = block_size;
+        }
+        if let Some(bits) = self.bloom_bits {
+            opts.bloom_bits_per_key = bits as f64;
+        }
+        if let Some(n) = self.prefix_columns {
+            opts.prefix_columns = n;
+        }
+        opts
+    }
 }
 
 #[derive(
@@ -131,10 +198,9 @@ impl RelationHandle {
     //     }
     //     val.serialize(&mut Serializer::new(ret)).unwrap();
     // }
-    pub(crate) fn adhoc_encode_key(&self, tuple: &Tuple, span: SourceSpan) -> Result<Vec<u8>> {
-        let len = self.metadata.keys.len();
+    fn check_key_arity(&self, tuple: &Tuple, span: SourceSpan) -> Result<()> {
         ensure!(
-            tuple.0.len() >= len,
+            tuple.0.len() >= self.metadata.keys.len(),
             StoredRelArityMismatch {
                 name: self.name.to_string(),
                 expect_arity: self.arity(),
@@ -142,6 +208,11 @@ impl RelationHandle {
                 span
             }
         );
+        Ok(())
+    }
+    pub(crate) fn adhoc_encode_key(&self, tuple: &Tuple, span: SourceSpan) -> Result<Vec<u8>> {
+        self.check_key_arity(tuple, span)?;
+        let len = self.metadata.keys.len();
         let mut ret = self.encode_key_prefix(len);
         for val in &tuple.0[0..len] {
             ret.encode_datavalue(val);
@@ -151,6 +222,17 @@ impl RelationHandle {
         // }
         Ok(ret)
     }
+    /// As [`RelationHandle::adhoc_encode_key`], but adds the key to a batch.
+    pub(crate) fn adhoc_encode_key_into(
+        &self,
+        tuple: &Tuple,
+        keys: &mut EncodedKeys,
+        span: SourceSpan,
+    ) -> Result<()> {
+        self.check_key_arity(tuple, span)?;
+        keys.push(self.id, &tuple.0[0..self.metadata.keys.len()]);
+        Ok(())
+    }
     pub(crate) fn adhoc_encode_val(&self, tuple: &Tuple, _span: SourceSpan) -> Result<Vec<u8>> {
         let start = self.metadata.keys.len();
         let len = self.metadata.non_keys.len();
@@ -158,11 +240,17 @@ impl RelationHandle {
         // for i in 0..len {
         //     self.encode_key_element(&mut ret, i, &tuple.0[i + start])
         // }
-        tuple.0[start..]
-            .serialize(&mut Serializer::new(&mut ret))
-            .unwrap();
+        encode_values(&mut ret, &tuple.0[start..]);
         Ok(ret)
     }
+    /// The operand merging the non-key columns of a row into the one stored, see
+    /// [`encode_merge_operand`].
+    pub(crate) fn adhoc_encode_merge_operand(&self, tuple: &Tuple, ops: &[MergeOp]) -> Vec<u8> {
+        let start = self.metadata.keys.len();
+        let mut ret = self.encode_key_prefix(self.metadata.non_keys.len());
+        encode_merge_operand(&mut ret, ops, &tuple.0[start..]);
+        ret
+    }
     pub(crate) fn ensure_compatible(&self, inp: &InputRelationHandle) -> Result<()> {
         let InputRelationHandle { metadata, .. } = inp;
         // check that every given key is found and compatible
@@ -190,6 +278,10 @@ pub(crate) struct InputRelationHandle {
     pub(crate) key_bindings: Vec<Symbol>,
     pub(crate) dep_bindings: Vec<Symbol>,
     pub(crate) span: SourceSpan,
+    pub(crate) column_family: Option<ColumnFamilyConfig>,
+    /// For `:merge`, how each of the non-key columns in `metadata` is merged.
+    #[serde(default)]
+    pub(crate) merge_ops: Vec<MergeOp>,
 }
 
 impl Debug for RelationHandle {
@@ -218,15 +310,38 @@ impl RelationHandle {
         })?)
     }
     pub(crate) fn scan_all(&self, tx: &SessionTx) -> impl Iterator<Item = Result<Tuple>> {
+        self.scan_all_projected(tx, None)
+    }
+    pub(crate) fn scan_all_projected(
+        &self,
+        tx: &SessionTx,
+        projection: ValueProjection,
+    ) -> impl Iterator<Item = Result<Tuple>> {
         let lower = Tuple::default().encode_as_key(self.id);
         let upper = Tuple::default().encode_as_key(self.id.next());
-        RelationIterator::new(tx, &lower, &upper)
+        RelationIterator::new(
+            tx,
+            &self.name,
+            self.cf_id,
+            &lower,
+            &upper,
+            self.arity(),
+            projection,
+        )
     }
 
     pub(crate) fn scan_prefix(
         &self,
         tx: &SessionTx,
         prefix: &Tuple,
+    ) -> impl Iterator<Item = Result<Tuple>> {
+        self.scan_prefix_projected(tx, prefix, None)
+    }
+    pub(crate) fn scan_prefix_projected(
+        &self,
+        tx: &SessionTx,
+        prefix: &Tuple,
+        projection: ValueProjection,
     ) -> impl Iterator<Item = Result<Tuple>> {
         let mut lower = prefix.0.clone();
         lower.truncate(self.metadata.keys.len());
@@ -234,14 +349,23 @@ impl RelationHandle {
         upper.push(DataValue::Bot);
         let prefix_encoded = Tuple(lower).encode_as_key(self.id);
         let upper_encoded = Tuple(upper).encode_as_key(self.id);
-        RelationIterator::new(tx, &prefix_encoded, &upper_encoded)
+        RelationIterator::new(
+            tx,
+            &self.name,
+            self.cf_id,
+            &prefix_encoded,
+            &upper_encoded,
+            self.arity(),
+            projection,
+        )
     }
-    pub(crate) fn scan_bounded_prefix(
+    pub(crate) fn scan_bounded_prefix_projected(
         &self,
         tx: &SessionTx,
         prefix: &Tuple,
         lower: &[DataValue],
         upper: &[DataValue],
+        projection: ValueProjection,
     ) -> impl Iterator<Item = Result<Tuple>> {
         let mut lower_t = prefix.clone();
         lower_t.0.extend_from_slice(lower);
@@ -250,56 +374,111 @@ impl RelationHandle {
         upper_t.0.push(DataValue::Bot);
         let lower_encoded = lower_t.encode_as_key(self.id);
         let upper_encoded = upper_t.encode_as_key(self.id);
-        RelationIterator::new(tx, &lower_encoded, &upper_encoded)
+        RelationIterator::new(
+            tx,
+            &self.name,
+            self.cf_id,
+            &lower_encoded,
+            &upper_encoded,
+            self.arity(),
+            projection,
+        )
     }
 }
 
+/// Which of the non-key columns of a relation a scan decodes, by their position among the
+/// non-key columns. The others are left `Null`. `None` decodes all of them.
+pub(crate) type ValueProjection = Option<Arc<[bool]>>;
+
+/// Rows fetched by the first batch of a scan. Later batches double in size up to
+/// `ITER_BATCH_MAX_ROWS`, so that short scans and early-terminated scans stay cheap.
+const ITER_BATCH_MIN_ROWS: usize = 32;
+const ITER_BATCH_MAX_ROWS: usize = 1024;
+const ITER_BATCH_MAX_BYTES: usize = 1 << 20;
+
 struct RelationIterator {
     inner: DbIter,
-    started: bool,
+    batch: std::vec::IntoIter<Tuple>,
+    batch_rows: usize,
+    exhausted: bool,
     upper_bound: Vec<u8>,
+    arity: usize,
+    projection: ValueProjection,
+    // added to the cost of the query when the scan is dropped
+    cost: QueryCost,
+    relation: SmartString<LazyCompact>,
+    rows_scanned: u64,
+    bytes_read: u64,
 }
 
 impl RelationIterator {
-    fn new(sess: &SessionTx, lower: &[u8], upper: &[u8]) -> Self {
-        let mut inner = sess.tx.iterator().upper_bound(upper).start();
+    fn new(
+        sess: &SessionTx,
+        relation: &SmartString<LazyCompact>,
+        cf: u32,
+        lower: &[u8],
+        upper: &[u8],
+        arity: usize,
+        projection: ValueProjection,
+    ) -> Self {
+        // with both bounds, RocksDB checks prefix bloom filters for scans within a prefix
+        let mut inner = sess
+            .tx
+            .iterator_cf(cf)
+            .lower_bound(lower)
+            .upper_bound(upper)
+            .start();
         inner.seek(lower);
         Self {
             inner,
-            started: false,
+            batch: vec![].into_iter(),
+            batch_rows: ITER_BATCH_MIN_ROWS,
+            exhausted: false,
             upper_bound: upper.to_vec(),
+            arity,
+            projection,
+            cost: sess.cost.clone(),
+            relation: relation.clone(),
+            rows_scanned: 0,
+            bytes_read: 0,
         }
     }
-    fn next_inner(&mut self) -> Result<Option<Tuple>> {
-        if self.started {
-            self.inner.next()
-        } else {
-            self.started = true;
+    fn fill_batch(&mut self) -> Result<()> {
+        let rows = self
+            .inner
+            .next_batch(self.batch_rows, ITER_BATCH_MAX_BYTES)?;
+        if rows.is_empty() {
+            self.exhausted = true;
         }
-        Ok(match self.inner.pair()? {
-            None => None,
-            Some((k_slice, v_slice)) => {
-                if self.upper_bound.as_slice() <= k_slice {
-                    //
-                    // }
-                    // if compare_tuple_keys(&self.upper_bound, k_slice) != Greater {
-                    None
-                } else {
-                    let mut tup = Tuple::decode_from_key(k_slice);
-                    if !v_slice.is_empty() {
-                        let vals: Vec<DataValue> = rmp_serde::from_slice(&v_slice[ENCODED_KEY_MIN_LEN..]).unwrap();
-                        tup.0.extend(vals);
-                    }
-                    // if !v_slice.is_empty() {
-                    //     let v_tup = EncodedTuple(v_slice);
-                    //     if v_tup.arity() > 0 {
-                    //         tup.0.extend(v_tup.decode().0);
-                    //     }
-                    // }
-                    Some(tup)
-                }
+        let mut decoded = Vec::with_capacity(rows.len());
+        for (k_slice, v_slice) in rows.iter() {
+            if self.upper_bound.as_slice() <= k_slice {
+                self.exhausted = true;
+                break;
             }
-        })
+            self.rows_scanned += 1;
+            self.bytes_read += (k_slice.len() + v_slice.len()) as u64;
+            let mut tup = Tuple::decode_from_key_with_capacity(k_slice, self.arity);
+            if !v_slice.is_empty() {
+                let vals = EncodedValues::new(v_slice)?.decode(self.projection.as_deref())?;
+                tup.0.extend(vals);
+            }
+            decoded.push(tup);
+        }
+        self.batch = decoded.into_iter();
+        self.batch_rows = (self.batch_rows * 2).min(ITER_BATCH_MAX_ROWS);
+        Ok(())
+    }
+    fn next_inner(&mut self) -> Result<Option<Tuple>> {
+        loop {
+            if let Some(tup) = self.batch.next() {
+                return Ok(Some(tup));
+            }
+            if self.exhausted {
+                return Ok(None);
+            }
+            self.fill_batch()?;
+        }
     }
 }
 
@@ -310,6 +489,13 @@ impl Iterator for RelationIterator {
     }
 }
 
+impl Drop for RelationIterator {
+    fn drop(&mut self) {
+        self.cost
+            .add_scanned(&self.relation, self.rows_scanned, self.bytes_read);
+    }
+}
+
 #[derive(Debug, Diagnostic, Error)]
 #[error("Cannot create relation {0} as one with the same name already exists")]
 #[diagnostic(code(eval::rel_name_conflict))]
@@ -321,6 +507,18 @@ impl SessionTx {
         let encoded = Tuple(vec![key]).encode_as_key(RelationId::SYSTEM);
         Ok(self.tx.exists(&encoded, false)?)
     }
+    /// Writes the metadata of a relation back after changing it.
+    pub(crate) fn put_relation_handle(&mut self, handle: &RelationHandle) -> Result<()> {
+        let name_key =
+            Tuple(vec![DataValue::Str(handle.name.clone())]).encode_as_key(RelationId::SYSTEM);
+
+        let mut meta_val = vec![];
+        handle
+            .serialize(&mut Serializer::new(&mut meta_val).with_struct_map())
+            .unwrap();
+        self.tx.put(&name_key, &meta_val)?;
+        Ok(())
+    }
     pub(crate) fn set_relation_triggers(
         &mut self,
         name: Symbol,
@@ -351,6 +549,76 @@ impl SessionTx {
 
         Ok(())
     }
+    /// Sets or removes the TTL of a relation, keyed by a numeric key column.
+    pub(crate) fn set_relation_ttl(
+        &mut self,
+        name: Symbol,
+        ttl: Option<(Symbol, u64)>,
+    ) -> Result<RelationHandle> {
+        let mut original = self.get_relation(&name, true)?;
+        if original.access_level < AccessLevel::Protected {
+            bail!(InsufficientAccessLevel(
+                original.name.to_string(),
+                "set TTL".to_string(),
+                original.access_level
+            ))
+        }
+        original.ttl = match ttl {
+            None => None,
+            Some((col, secs)) => {
+                #[derive(Debug, Error, Diagnostic)]
+                #[error("The TTL of relation {0} needs a key column of type Int or Float")]
+                #[diagnostic(code(eval::bad_ttl_column))]
+                struct BadTtlColumn(String, #[label] SourceSpan);
+
+                let column = original
+                    .metadata
+                    .keys
+                    .iter()
+                    .position(|k| {
+                        k.name == col.name
+                            && matches!(k.typing.coltype, ColType::Int | ColType::Float)
+                    })
+                    .ok_or_else(|| BadTtlColumn(original.name.to_string(), col.span))?;
+                Some(RelationTtl { column, secs })
+            }
+        };
+
+        let name_key =
+            Tuple(vec![DataValue::Str(original.name.clone())]).encode_as_key(RelationId::SYSTEM);
+
+        let mut meta_val = vec![];
+        original
+            .serialize(&mut Serializer::new(&mut meta_val).with_struct_map())
+            .unwrap();
+        self.tx.put(&name_key, &meta_val)?;
+
+        Ok(original)
+    }
+    /// Collects the statistics of a relation for the planner, and keeps them with it.
+    pub(crate) fn set_relation_stats(&mut self, name: &str) -> Result<RelationStats> {
+        let mut original = self.get_relation(name, true)?;
+        if original.access_level < AccessLevel::ReadOnly {
+            bail!(InsufficientAccessLevel(
+                original.name.to_string(),
+                "analyze".to_string(),
+                original.access_level
+            ))
+        }
+        let stats = self.analyze_relation(&original)?;
+        original.stats = Some(stats.clone());
+
+        let name_key =
+            Tuple(vec![DataValue::Str(original.name.clone())]).encode_as_key(RelationId::SYSTEM);
+
+        let mut meta_val = vec![];
+        original
+            .serialize(&mut Serializer::new(&mut meta_val).with_struct_map())
+            .unwrap();
+        self.tx.put(&name_key, &meta_val)?;
+
+        Ok(stats)
+    }
     pub(crate) fn create_relation(
         &mut self,
         input_meta: InputRelationHandle,
@@ -364,14 +632,40 @@ impl SessionTx {
 
         let metadata = input_meta.metadata.clone();
         let last_id = self.relation_store_id.fetch_add(1, Ordering::SeqCst);
+        let id = RelationId::new(last_id + 1);
+        let cf_id = match &input_meta.column_family {
+            None => 0,
+            Some(config) => {
+                if let Some(n) = config.prefix_columns {
+                    #[derive(Debug, Error, Diagnostic)]
+                    #[error("Relation {0} has {1} key columns, too few for {2} prefix columns")]
+                    #[diagnostic(code(eval::too_many_prefix_columns))]
+                    struct TooManyPrefixColumns(String, usize, usize);
+
+                    ensure!(
+                        n <= metadata.keys.len(),
+                        TooManyPrefixColumns(input_meta.name.to_string(), metadata.keys.len(), n)
+                    );
+                }
+                // column families are created outside of the transaction, which drops them
+                // again unless it commits: the name must not collide with one of those
+                let cf_name = format!("relation_{}_{}", id.0, uuid::Uuid::new_v4());
+                self.tx
+                    .create_column_family(&cf_name, &config.to_cf_opts())?
+            }
+        };
         let meta = RelationHandle {
             name: input_meta.name.name,
-            id: RelationId::new(last_id + 1),
+            id,
             metadata,
             put_triggers: vec![],
             rm_triggers: vec![],
             replace_triggers: vec![],
             access_level: AccessLevel::Normal,
+            column_family: input_meta.column_family,
+            cf_id,
+            ttl: None,
+            stats: None,
         };
 
         self.tx.put(&encoded, &meta.id.raw_encode())?;
@@ -404,7 +698,7 @@ impl SessionTx {
         let metadata = RelationHandle::decode(&found)?;
         Ok(metadata)
     }
-    pub(crate) fn destroy_relation(&mut self, name: &str) -> Result<(Vec<u8>, Vec<u8>)> {
+    pub(crate) fn destroy_relation(&mut self, name: &str) -> Result<RelationCleanup> {
         let store = self.get_relation(name, true)?;
         if store.access_level < AccessLevel::Normal {
             bail!(InsufficientAccessLevel(
@@ -416,9 +710,12 @@ impl SessionTx {
         let key = DataValue::Str(SmartString::from(name as &str));
         let encoded = Tuple(vec![key]).encode_as_key(RelationId::SYSTEM);
         self.tx.del(&encoded)?;
+        if store.column_family.is_some() {
+            return Ok(RelationCleanup::ColumnFamily(store.cf_id));
+        }
         let lower_bound = Tuple::default().encode_as_key(store.id);
         let upper_bound = Tuple::default().encode_as_key(store.id.next());
-        Ok((lower_bound, upper_bound))
+        Ok(RelationCleanup::Range(lower_bound, upper_bound))
     }
     pub(crate) fn set_access_level(&mut self, rel: Symbol, level: AccessLevel) -> Result<()> {
         let mut meta = self.get_relation(&rel, true)?;
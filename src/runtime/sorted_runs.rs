@@ -0,0 +1,456 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::mem::size_of;
+use std::sync::Arc;
+
+use itertools::Itertools;
+use miette::Result;
+
+use cozorocks::SstIter;
+
+use crate::data::memcmp::MemCmpEncoder;
+use crate::data::tuple::Tuple;
+use crate::data::value::DataValue;
+use crate::runtime::spill::{Charge, MemoryBudget, SpilledFile};
+
+/// Tuples added to a [`SortedRuns`] are buffered until there are this many of them.
+const BUFFER_CAPACITY: usize = 512;
+
+/// A set of tuples, memcmp-encoded so that their bytes sort as the tuples do. New tuples go
+/// to a small sorted buffer, and a full buffer becomes an immutable run, its tuples laid out
+/// one after another in a single allocation. Runs are merged LSM-style, each being kept
+/// more than twice as large as the next, so that a lookup only searches logarithmically
+/// many of them. Runs that do not fit in the memory budget, if there is one, are spilled
+/// to disk.
+#[derive(Default)]
+pub(crate) struct SortedRuns {
+    buffer: Buffer,
+    runs: Vec<Run>,
+    budget: Option<MemoryBudget>,
+}
+
+pub(crate) fn encode_tuple(tuple: &Tuple) -> Vec<u8> {
+    let mut ret = Vec::with_capacity(10 * tuple.0.len());
+    encode_tuple_into(tuple, &mut ret);
+    ret
+}
+
+/// Encodes into a buffer that is cleared first, so that it can be reused for many tuples.
+pub(crate) fn encode_tuple_into(tuple: &Tuple, buf: &mut Vec<u8>) {
+    buf.clear();
+    for val in tuple.0.iter() {
+        buf.encode_datavalue(val);
+    }
+}
+
+fn decode_tuple(mut key: &[u8]) -> Tuple {
+    let mut ret = vec![];
+    while !key.is_empty() {
+        let (val, next) = DataValue::decode_from_key(key);
+        ret.push(val);
+        key = next;
+    }
+    Tuple(ret)
+}
+
+impl SortedRuns {
+    pub(crate) fn new(budget: Option<MemoryBudget>) -> Self {
+        Self {
+            buffer: Default::default(),
+            runs: vec![],
+            budget,
+        }
+    }
+    /// Returns `false` if the encoded tuple was already there.
+    pub(crate) fn insert(&mut self, key: &[u8]) -> Result<bool> {
+        let pos = match self.buffer.position(key) {
+            Ok(_) => return Ok(false),
+            Err(pos) => pos,
+        };
+        for run in self.runs.iter() {
+            if run.contains(key)? {
+                return Ok(false);
+            }
+        }
+        self.buffer.insert(pos, key);
+        if self.buffer.spans.len() >= BUFFER_CAPACITY {
+            self.flush()?;
+        }
+        Ok(true)
+    }
+    pub(crate) fn contains(&self, key: &[u8]) -> Result<bool> {
+        if self.buffer.position(key).is_ok() {
+            return Ok(true);
+        }
+        for run in self.runs.iter() {
+            if run.contains(key)? {
+                return Ok(true);
+            }
+        }
+        Ok(false)
+    }
+    /// All tuples in order. Tuples added afterwards are not seen.
+    pub(crate) fn snapshot(&mut self) -> Result<RunsIter> {
+        self.flush()?;
+        Ok(RunsIter {
+            cursors: self.runs.iter().map(Cursor::new).collect_vec(),
+        })
+    }
+    /// Tuples in order, starting from the first whose encoding is not less than `lower`,
+    /// and for as long as `within` holds for the encoding.
+    pub(crate) fn range(&self, lower: &[u8], within: impl Fn(&[u8]) -> bool) -> Result<Vec<Tuple>> {
+        let mut sorted = Vec::with_capacity(self.runs.len() + 1);
+        sorted.push(
+            self.buffer
+                .iter_from(lower)
+                .take_while(|key| within(key))
+                .map(decode_tuple)
+                .collect_vec(),
+        );
+        for run in self.runs.iter() {
+            sorted.push(run.range(lower, &within)?);
+        }
+        sorted.retain(|tuples| !tuples.is_empty());
+        Ok(if sorted.len() == 1 {
+            sorted.pop().unwrap()
+        } else {
+            sorted.into_iter().kmerge().collect_vec()
+        })
+    }
+    fn flush(&mut self) -> Result<()> {
+        if self.buffer.spans.is_empty() {
+            return Ok(());
+        }
+        let buffered = self.buffer.take_run();
+        let mut len = buffered.len();
+        let mut to_merge = vec![];
+        while let Some(last) = self.runs.last() {
+            if last.len() > 2 * len {
+                break;
+            }
+            len += last.len();
+            to_merge.push(self.runs.pop().unwrap());
+        }
+        let run = if to_merge.is_empty() {
+            self.keep(buffered)?
+        } else {
+            to_merge.push(Run::Mem(Arc::new(buffered)));
+            self.merge(to_merge)?
+        };
+        self.runs.push(run);
+        Ok(())
+    }
+    /// Keeps the run in memory if the budget allows, and spills it otherwise.
+    fn keep(&self, mut run: MemRun) -> Result<Run> {
+        if let Some(budget) = &self.budget {
+            match budget.charge(run.size()) {
+                Some(charge) => run.charge = Some(charge),
+                None => return self.merge(vec![Run::Mem(Arc::new(run))]),
+            }
+        }
+        Ok(Run::Mem(Arc::new(run)))
+    }
+    /// Merges the runs into one, kept in memory if the budget allows. The runs must not
+    /// have tuples in common, which holds as tuples already in some run are never added
+    /// again.
+    fn merge(&self, runs: Vec<Run>) -> Result<Run> {
+        let len: usize = runs.iter().map(|run| run.len()).sum();
+        let bytes: usize = runs.iter().map(|run| run.bytes()).sum();
+        let mut cursors = runs.iter().map(Cursor::new).collect_vec();
+        let mut run = MemRun {
+            data: vec![],
+            ends: vec![],
+            charge: None,
+        };
+        if let Some(budget) = &self.budget {
+            // the runs merged still take their memory while merging, and are counted
+            match budget.charge(MemRun::size_for(len, bytes)) {
+                Some(charge) => run.charge = Some(charge),
+                None => {
+                    let mut writer = budget.spill_writer()?;
+                    while let Some(i) = least(&cursors)? {
+                        writer.put(cursors[i].head()?.unwrap())?;
+                        cursors[i].advance();
+                    }
+                    return Ok(Run::Spilled(Arc::new(SpilledRun {
+                        file: writer.finish()?,
+                        len,
+                        bytes,
+                    })));
+                }
+            }
+        }
+        run.data.reserve_exact(bytes);
+        run.ends.reserve_exact(len);
+        while let Some(i) = least(&cursors)? {
+            run.push(cursors[i].head()?.unwrap());
+            cursors[i].advance();
+        }
+        Ok(Run::Mem(Arc::new(run)))
+    }
+}
+
+#[derive(Clone)]
+enum Run {
+    Mem(Arc<MemRun>),
+    Spilled(Arc<SpilledRun>),
+}
+
+impl Run {
+    fn len(&self) -> usize {
+        match self {
+            Run::Mem(run) => run.len(),
+            Run::Spilled(run) => run.len,
+        }
+    }
+    fn bytes(&self) -> usize {
+        match self {
+            Run::Mem(run) => run.data.len(),
+            Run::Spilled(run) => run.bytes,
+        }
+    }
+    fn contains(&self, key: &[u8]) -> Result<bool> {
+        match self {
+            Run::Mem(run) => Ok(run.contains(key)),
+            Run::Spilled(run) => run.file.with_lookup(|iter| -> Result<bool> {
+                iter.seek(key);
+                Ok(iter.key()? == Some(key))
+            }),
+        }
+    }
+    fn range(&self, lower: &[u8], within: &impl Fn(&[u8]) -> bool) -> Result<Vec<Tuple>> {
+        match self {
+            Run::Mem(run) => Ok(run
+                .iter_from(lower)
+                .take_while(|key| within(key))
+                .map(decode_tuple)
+                .collect_vec()),
+            Run::Spilled(run) => run.file.with_lookup(|iter| -> Result<Vec<Tuple>> {
+                iter.seek(lower);
+                let mut ret = vec![];
+                while let Some(key) = iter.key()? {
+                    if !within(key) {
+                        break;
+                    }
+                    ret.push(decode_tuple(key));
+                    iter.next();
+                }
+                Ok(ret)
+            }),
+        }
+    }
+}
+
+/// Encoded tuples in order, laid out one after another.
+#[derive(Default)]
+struct MemRun {
+    data: Vec<u8>,
+    /// Where each tuple ends in `data`.
+    ends: Vec<usize>,
+    charge: Option<Charge>,
+}
+
+impl MemRun {
+    fn size_for(len: usize, bytes: usize) -> usize {
+        bytes + len * size_of::<usize>()
+    }
+    fn size(&self) -> usize {
+        Self::size_for(self.len(), self.data.len())
+    }
+    fn len(&self) -> usize {
+        self.ends.len()
+    }
+    fn get(&self, i: usize) -> &[u8] {
+        let start = if i == 0 { 0 } else { self.ends[i - 1] };
+        &self.data[start..self.ends[i]]
+    }
+    fn push(&mut self, key: &[u8]) {
+        self.data.extend_from_slice(key);
+        self.ends.push(self.data.len());
+    }
+    /// The index of the first tuple not less than `key`.
+    fn lower_bound(&self, key: &[u8]) -> usize {
+        let (mut lo, mut hi) = (0, self.len());
+        while lo < hi {
+            let mid = lo + (hi - lo) / 2;
+            if self.get(mid) < key {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        lo
+    }
+    fn contains(&self, key: &[u8]) -> bool {
+        let i = self.lower_bound(key);
+        i < self.len() && self.get(i) == key
+    }
+    fn iter_from<'a>(&'a self, lower: &[u8]) -> impl Iterator<Item = &'a [u8]> {
+        (self.lower_bound(lower)..self.len()).map(|i| self.get(i))
+    }
+}
+
+/// A run that did not fit in the memory budget, written to disk.
+struct SpilledRun {
+    file: SpilledFile,
+    len: usize,
+    bytes: usize,
+}
+
+/// Tuples not yet in a run, in the order they were added, with their spans kept sorted.
+#[derive(Default)]
+struct Buffer {
+    data: Vec<u8>,
+    spans: Vec<(usize, usize)>,
+}
+
+impl Buffer {
+    fn position(&self, key: &[u8]) -> std::result::Result<usize, usize> {
+        self.spans
+            .binary_search_by(|(start, end)| self.data[*start..*end].cmp(key))
+    }
+    fn insert(&mut self, pos: usize, key: &[u8]) {
+        let start = self.data.len();
+        self.data.extend_from_slice(key);
+        self.spans.insert(pos, (start, self.data.len()));
+    }
+    fn iter_from<'a>(&'a self, lower: &[u8]) -> impl Iterator<Item = &'a [u8]> {
+        let (Ok(pos) | Err(pos)) = self.position(lower);
+        self.spans[pos..]
+            .iter()
+            .map(|(start, end)| &self.data[*start..*end])
+    }
+    fn take_run(&mut self) -> MemRun {
+        let mut run = MemRun {
+            data: Vec::with_capacity(self.data.len()),
+            ends: Vec::with_capacity(self.spans.len()),
+            charge: None,
+        };
+        for (start, end) in self.spans.iter() {
+            run.push(&self.data[*start..*end]);
+        }
+        self.data.clear();
+        self.spans.clear();
+        run
+    }
+}
+
+/// Reads the tuples of a run in order, keeping the run alive.
+enum Cursor {
+    Mem(Arc<MemRun>, usize),
+    Spilled(Arc<SpilledRun>, SstIter),
+}
+
+impl Cursor {
+    fn new(run: &Run) -> Self {
+        match run {
+            Run::Mem(run) => Cursor::Mem(run.clone(), 0),
+            Run::Spilled(run) => {
+                let mut iter = run.file.iterator();
+                iter.seek_to_start();
+                Cursor::Spilled(run.clone(), iter)
+            }
+        }
+    }
+    fn head(&self) -> Result<Option<&[u8]>> {
+        match self {
+            Cursor::Mem(run, pos) => Ok((*pos < run.len()).then(|| run.get(*pos))),
+            Cursor::Spilled(_, iter) => Ok(iter.key()?),
+        }
+    }
+    fn advance(&mut self) {
+        match self {
+            Cursor::Mem(_, pos) => *pos += 1,
+            Cursor::Spilled(_, iter) => iter.next(),
+        }
+    }
+}
+
+/// The cursor at the least tuple, if any are left.
+fn least(cursors: &[Cursor]) -> Result<Option<usize>> {
+    // there are only logarithmically many runs, so a linear search is fine
+    let mut least: Option<(usize, &[u8])> = None;
+    for (i, cursor) in cursors.iter().enumerate() {
+        if let Some(key) = cursor.head()? {
+            if !matches!(least, Some((_, l)) if l <= key) {
+                least = Some((i, key));
+            }
+        }
+    }
+    Ok(least.map(|(i, _)| i))
+}
+
+/// Decodes the tuples of some runs in order, keeping the runs alive while tuples are added
+/// to the store they were taken from.
+pub(crate) struct RunsIter {
+    cursors: Vec<Cursor>,
+}
+
+impl RunsIter {
+    fn next_tuple(&mut self) -> Result<Option<Tuple>> {
+        let i = match least(&self.cursors)? {
+            None => return Ok(None),
+            Some(i) => i,
+        };
+        let tuple = decode_tuple(self.cursors[i].head()?.unwrap());
+        self.cursors[i].advance();
+        Ok(Some(tuple))
+    }
+}
+
+impl Iterator for RunsIter {
+    type Item = Result<Tuple>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let ret = self.next_tuple().transpose();
+        if matches!(ret, Some(Err(_))) {
+            self.cursors.clear();
+        }
+        ret
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::BTreeSet;
+
+    use itertools::Itertools;
+    use rand::prelude::*;
+
+    use crate::data::tuple::Tuple;
+    use crate::data::value::DataValue;
+    use crate::runtime::sorted_runs::{encode_tuple, SortedRuns};
+
+    #[test]
+    fn same_as_btree_set() {
+        let mut rng = StdRng::seed_from_u64(0);
+        let mut runs = SortedRuns::default();
+        let mut expected = BTreeSet::new();
+        for _ in 0..5000 {
+            let tuple = Tuple(vec![
+                DataValue::from(rng.gen_range(0..50i64)),
+                DataValue::from(rng.gen_range(-5.0..5.0f64).round()),
+                DataValue::Str(rng.gen_range(0..10).to_string().into()),
+            ]);
+            let key = encode_tuple(&tuple);
+            assert_eq!(runs.contains(&key).unwrap(), expected.contains(&tuple));
+            assert_eq!(runs.insert(&key).unwrap(), expected.insert(tuple));
+        }
+        let prefix = encode_tuple(&Tuple(vec![DataValue::from(7)]));
+        assert_eq!(
+            runs.range(&prefix, |key| key.starts_with(&prefix)).unwrap(),
+            expected
+                .iter()
+                .filter(|t| t.0[0] == DataValue::from(7))
+                .cloned()
+                .collect_vec()
+        );
+        assert!(runs
+            .snapshot()
+            .unwrap()
+            .map(|t| t.unwrap())
+            .eq(expected.into_iter()));
+    }
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+
+use log::error;
+use miette::{IntoDiagnostic, Result};
+
+use cozorocks::{RocksDb, SstIter, SstReader, SstWriter};
+
+const DIR_PREFIX: &str = "spill_";
+
+/// Memory that the rule stores of a transaction may take for their sorted runs. Runs that
+/// would overrun it are written to SST files next to the database instead, and read back
+/// from there. These files are removed as soon as their runs are dropped. A budget without
+/// a bound still keeps track of the memory taken.
+#[derive(Clone)]
+pub(crate) struct MemoryBudget(Arc<BudgetInner>);
+
+struct BudgetInner {
+    db: RocksDb,
+    limit: usize,
+    used: AtomicUsize,
+    peak: AtomicUsize,
+    files_count: AtomicU64,
+    dir: PathBuf,
+}
+
+impl MemoryBudget {
+    pub(crate) fn new(db: &RocksDb, limit: usize) -> Self {
+        let mut dir = PathBuf::from(db.db_path());
+        dir.set_file_name(format!("{}{}", DIR_PREFIX, uuid::Uuid::new_v4()));
+        Self(Arc::new(BudgetInner {
+            db: db.clone(),
+            limit,
+            used: Default::default(),
+            peak: Default::default(),
+            files_count: Default::default(),
+            dir,
+        }))
+    }
+    /// Takes `bytes` from the budget, or returns `None` if there is not that much left.
+    pub(crate) fn charge(&self, bytes: usize) -> Option<Charge> {
+        let mut used = self.0.used.load(Ordering::Relaxed);
+        loop {
+            if used.saturating_add(bytes) > self.0.limit {
+                return None;
+            }
+            match self.0.used.compare_exchange_weak(
+                used,
+                used + bytes,
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => {
+                    self.0.peak.fetch_max(used + bytes, Ordering::Relaxed);
+                    return Some(Charge {
+                        budget: self.clone(),
+                        bytes,
+                    });
+                }
+                Err(current) => used = current,
+            }
+        }
+    }
+    /// The most memory taken at once since the last [`MemoryBudget::reset_peak`].
+    pub(crate) fn peak(&self) -> usize {
+        self.0.peak.load(Ordering::Relaxed)
+    }
+    /// Keeps track of the peak afresh, starting from the memory taken now, and returns
+    /// the peak so far.
+    pub(crate) fn reset_peak(&self) -> usize {
+        let used = self.0.used.load(Ordering::Relaxed);
+        self.0.peak.swap(used, Ordering::Relaxed)
+    }
+    pub(crate) fn raise_peak(&self, peak: usize) {
+        self.0.peak.fetch_max(peak, Ordering::Relaxed);
+    }
+    pub(crate) fn spill_writer(&self) -> Result<SpillWriter> {
+        fs::create_dir_all(&self.0.dir).into_diagnostic()?;
+        let n = self.0.files_count.fetch_add(1, Ordering::Relaxed);
+        let file = SpilledFile {
+            path: self.0.dir.join(format!("{:06}.sst", n)),
+            reader: None,
+            lookup: None,
+        };
+        let writer = self.0.db.get_sst_writer(&file.path.to_string_lossy())?;
+        Ok(SpillWriter {
+            db: self.0.db.clone(),
+            writer,
+            file,
+        })
+    }
+}
+
+/// Writes keys, which must come sorted and distinct, to a new [`SpilledFile`]. The file is
+/// removed if the writer is dropped before it is finished.
+pub(crate) struct SpillWriter {
+    db: RocksDb,
+    // dropped before the file, which is then removed
+    writer: SstWriter,
+    file: SpilledFile,
+}
+
+impl SpillWriter {
+    pub(crate) fn put(&mut self, key: &[u8]) -> Result<()> {
+        self.writer.put(key, &[])?;
+        Ok(())
+    }
+    pub(crate) fn finish(self) -> Result<SpilledFile> {
+        let Self {
+            db,
+            mut writer,
+            mut file,
+        } = self;
+        writer.finish()?;
+        let reader = db.get_sst_reader(&file.path.to_string_lossy())?;
+        file.lookup = Some(Mutex::new(reader.iterator()));
+        file.reader = Some(reader);
+        Ok(file)
+    }
+}
+
+impl Drop for BudgetInner {
+    fn drop(&mut self) {
+        if self.dir.exists() {
+            if let Err(err) = fs::remove_dir_all(&self.dir) {
+                error!("cannot remove spill directory {:?}: {}", self.dir, err);
+            }
+        }
+    }
+}
+
+/// Memory taken from a [`MemoryBudget`], given back on drop.
+pub(crate) struct Charge {
+    budget: MemoryBudget,
+    bytes: usize,
+}
+
+impl Drop for Charge {
+    fn drop(&mut self) {
+        self.budget.0.used.fetch_sub(self.bytes, Ordering::Relaxed);
+    }
+}
+
+/// An SST file holding spilled keys, removed on drop.
+pub(crate) struct SpilledFile {
+    path: PathBuf,
+    // only `None` while the file is being written
+    reader: Option<SstReader>,
+    // kept for point lookups, which would otherwise each need a new iterator
+    lookup: Option<Mutex<SstIter>>,
+}
+
+impl SpilledFile {
+    pub(crate) fn iterator(&self) -> SstIter {
+        self.reader.as_ref().unwrap().iterator()
+    }
+    /// Runs `f` with an iterator shared by all callers, which may be positioned anywhere.
+    pub(crate) fn with_lookup<T>(&self, f: impl FnOnce(&mut SstIter) -> T) -> T {
+        f(&mut self.lookup.as_ref().unwrap().lock().unwrap())
+    }
+}
+
+impl Drop for SpilledFile {
+    fn drop(&mut self) {
+        // close the file first, so that removing it works everywhere
+        self.lookup = None;
+        self.reader = None;
+        if let Err(err) = fs::remove_file(&self.path) {
+            if err.kind() != std::io::ErrorKind::NotFound {
+                error!("cannot remove spill file {:?}: {}", self.path, err);
+            }
+        }
+    }
+}
+
+/// Removes files left behind by queries interrupted by a crash.
+pub(crate) fn remove_stale_spills(db_root: &Path) -> Result<()> {
+    for entry in fs::read_dir(db_root).into_diagnostic()? {
+        let entry = entry.into_diagnostic()?;
+        if entry.file_name().to_string_lossy().starts_with(DIR_PREFIX) {
+            fs::remove_dir_all(entry.path()).into_diagnostic()?;
+        }
+    }
+    Ok(())
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+//! Statistics of stored relations, from which the planner estimates how many rows the
+//! atoms of rule bodies produce.
+
+use miette::Result;
+
+use crate::data::tuple::Tuple;
+use crate::runtime::relation::RelationHandle;
+use crate::runtime::transact::SessionTx;
+
+/// Rows read by `::analyze`, from the start of the relation. Relations whose leading key
+/// columns are distributed unevenly along the keys are estimated less well.
+const SAMPLE_ROWS: usize = 10_000;
+
+/// Collected by `::analyze` and kept with the metadata of the relation.
+#[derive(Clone, Debug, Eq, PartialEq, serde_derive::Serialize, serde_derive::Deserialize)]
+pub(crate) struct RelationStats {
+    /// Rows of the relation when it was analyzed.
+    pub(crate) rows: u64,
+    /// Rows the distinct counts were taken from, all of them if fewer than `SAMPLE_ROWS`.
+    pub(crate) sampled: u64,
+    /// Distinct values of the first `i + 1` key columns at `i`.
+    pub(crate) distinct: Vec<u64>,
+}
+
+/// What the planner assumes of a stored relation it joins.
+#[derive(Clone, Debug, PartialEq)]
+pub(crate) struct RelationEstimate {
+    pub(crate) rows: f64,
+    /// Distinct values of the first `i + 1` key columns at `i`. The last is `rows`, since
+    /// the keys are unique.
+    pub(crate) distinct: Vec<f64>,
+}
+
+impl RelationEstimate {
+    /// `rows` is the current size of the relation, and `stats` what was found when it was
+    /// last analyzed. The rows sharing a prefix of the keys are assumed to have stayed as
+    /// many since then. Without statistics, every key column is assumed to narrow the rows
+    /// down by as much as every other.
+    pub(crate) fn new(rows: f64, n_keys: usize, stats: Option<&RelationStats>) -> Self {
+        let rows = rows.max(1.);
+        let distinct = (0..n_keys)
+            .map(|i| {
+                if i + 1 == n_keys {
+                    return rows;
+                }
+                let d = match stats {
+                    Some(stats) if stats.rows > 0 && i < stats.distinct.len() => {
+                        rows * stats.distinct[i] as f64 / stats.rows as f64
+                    }
+                    _ => rows.powf((i + 1) as f64 / n_keys as f64),
+                };
+                d.clamp(1., rows)
+            })
+            .collect();
+        Self { rows, distinct }
+    }
+    pub(crate) fn n_keys(&self) -> usize {
+        self.distinct.len()
+    }
+    /// Rows found by looking up the first `n` key columns.
+    pub(crate) fn rows_per_prefix(&self, n: usize) -> f64 {
+        if n == 0 {
+            self.rows
+        } else {
+            self.rows / self.distinct[n - 1]
+        }
+    }
+}
+
+impl SessionTx {
+    /// From the metadata of the storage, without reading any rows. Rows written by this
+    /// transaction are not counted.
+    pub(crate) fn estimate_rows(&self, handle: &RelationHandle) -> Result<u64> {
+        let lower = Tuple::default().encode_as_key(handle.id);
+        let upper = Tuple::default().encode_as_key(handle.id.next());
+        let estimate = self.tx.estimate_range_cf(handle.cf_id, &lower, &upper)?;
+        Ok(estimate.file_rows + estimate.memtable_rows)
+    }
+    /// Taken once in a transaction, which does not count its own writes anyway.
+    pub(crate) fn relation_estimate(&self, handle: &RelationHandle) -> Result<RelationEstimate> {
+        if let Some(estimate) = self.estimates.lock().unwrap().get(&handle.id) {
+            return Ok(estimate.clone());
+        }
+        let rows = self.estimate_rows(handle)?;
+        let estimate = RelationEstimate::new(
+            rows as f64,
+            handle.metadata.keys.len(),
+            handle.stats.as_ref(),
+        );
+        self.estimates
+            .lock()
+            .unwrap()
+            .insert(handle.id, estimate.clone());
+        Ok(estimate)
+    }
+    /// Counts the distinct prefixes of the keys of the first `SAMPLE_ROWS` rows, and
+    /// extrapolates them to the whole relation if there are more.
+    pub(crate) fn analyze_relation(&self, handle: &RelationHandle) -> Result<RelationStats> {
+        let n_keys = handle.metadata.keys.len();
+        let n_non_keys = handle.metadata.non_keys.len();
+        // only the keys are looked at
+        let projection = if n_non_keys == 0 {
+            None
+        } else {
+            Some(vec![false; n_non_keys].into())
+        };
+        let mut distinct = vec![0u64; n_keys];
+        let mut sampled = 0u64;
+        let mut prev: Option<Tuple> = None;
+        for tuple in handle
+            .scan_all_projected(self, projection)
+            .take(SAMPLE_ROWS)
+        {
+            let tuple = tuple?;
+            // rows come in key order, so a prefix is new if it differs from the last one
+            let first_new = match &prev {
+                None => 0,
+                Some(prev) => (0..n_keys)
+                    .find(|i| prev.0[*i] != tuple.0[*i])
+                    .unwrap_or(n_keys),
+            };
+            for d in &mut distinct[first_new..] {
+                *d += 1;
+            }
+            sampled += 1;
+            prev = Some(tuple);
+        }
+        if sampled < SAMPLE_ROWS as u64 {
+            return Ok(RelationStats {
+                rows: sampled,
+                sampled,
+                distinct,
+            });
+        }
+        let rows = self.estimate_rows(handle)?.max(sampled);
+        // the prefixes not sampled are assumed to have as many rows as those sampled
+        for d in &mut distinct {
+            *d = ((*d as f64) * rows as f64 / sampled as f64).min(rows as f64) as u64;
+        }
+        Ok(RelationStats {
+            rows,
+            sampled,
+            distinct,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn estimates_follow_the_size_of_the_relation() {
+        let stats = RelationStats {
+            rows: 1000,
+            sampled: 1000,
+            distinct: vec![10, 1000],
+        };
+        let est = RelationEstimate::new(2000., 2, Some(&stats));
+        assert_eq!(est.distinct, vec![20., 2000.]);
+        assert_eq!(est.rows_per_prefix(0), 2000.);
+        assert_eq!(est.rows_per_prefix(1), 100.);
+        assert_eq!(est.rows_per_prefix(2), 1.);
+
+        let est = RelationEstimate::new(10000., 2, None);
+        assert!((est.distinct[0] - 100.).abs() < 1e-6);
+        assert_eq!(est.distinct[1], 10000.);
+        let est = RelationEstimate::new(0., 1, None);
+        assert_eq!(est.rows_per_prefix(1), 1.);
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use std::mem;
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender};
+use std::thread;
+
+use miette::{Diagnostic, Result};
+use serde_json::{json, Map};
+use thiserror::Error;
+
+use crate::data::json::JsonValue;
+use crate::runtime::db::{fold_err, parse_params_str, Db};
+
+/// Batches in flight between a query and its reader. The query blocks when the reader
+/// falls behind, so this bounds the memory held by a stream.
+const BUFFERED_BATCHES: usize = 2;
+
+#[derive(Debug, Error, Diagnostic)]
+#[error("The reader of the streamed result went away")]
+#[diagnostic(code(eval::stream_closed))]
+struct StreamClosed;
+
+/// Sends the rows of a result to a [`QueryStream`] in batches as they are produced.
+pub(crate) struct RowSink {
+    batch_size: usize,
+    sender: SyncSender<JsonValue>,
+    headers: Option<JsonValue>,
+    headers_sent: bool,
+    rows: Vec<JsonValue>,
+}
+
+impl RowSink {
+    pub(crate) fn set_headers(&mut self, headers: JsonValue) {
+        self.headers = Some(headers);
+    }
+    pub(crate) fn push(&mut self, row: Vec<JsonValue>) -> Result<()> {
+        self.rows.push(JsonValue::from(row));
+        if self.rows.len() >= self.batch_size {
+            let batch = self.make_batch();
+            self.sender.send(batch).map_err(|_| StreamClosed)?;
+        }
+        Ok(())
+    }
+    fn make_batch(&mut self) -> JsonValue {
+        let rows = mem::replace(&mut self.rows, Vec::with_capacity(self.batch_size));
+        let mut batch = json!({"ok": true, "done": false, "rows": rows});
+        if !self.headers_sent {
+            if let Some(headers) = self.headers.take() {
+                batch["headers"] = headers;
+                self.headers_sent = true;
+            }
+        }
+        batch
+    }
+    /// Sends what is left of the rows, together with the rest of the `result` of the script:
+    /// status, timing, and the rows of results that were not streamed, such as those of
+    /// system ops. The last batch has `"done": true`.
+    fn finish(mut self, mut result: JsonValue) {
+        if result.get("ok") == Some(&json!(true)) {
+            if self.headers.is_none() {
+                self.headers = result.get("headers").cloned();
+            }
+            if let Some(JsonValue::Array(rows)) = result.get_mut("rows").map(mem::take) {
+                for row in rows {
+                    self.rows.push(row);
+                    if self.rows.len() >= self.batch_size {
+                        let batch = self.make_batch();
+                        if self.sender.send(batch).is_err() {
+                            return;
+                        }
+                    }
+                }
+            }
+            let last = self.make_batch();
+            if let (JsonValue::Object(result_map), JsonValue::Object(last)) = (&mut result, last) {
+                result_map.extend(last);
+            }
+        }
+        result["done"] = json!(true);
+        let _ = self.sender.send(result);
+    }
+}
+
+/// A result delivered in batches while the script producing it runs. Each batch is an
+/// object with `ok`, `done` and `rows` keys, and the first one with rows also has the
+/// `headers`. The last batch has `"done": true` and carries everything else the result of
+/// [`Db::run_script`] has, or is the error if the script failed. Dropping the stream
+/// stops the script at its next row.
+pub struct QueryStream {
+    receiver: Receiver<JsonValue>,
+    done: bool,
+}
+
+impl QueryStream {
+    /// Blocks until the next batch is ready. Returns `None` after the last batch.
+    pub fn next_batch(&mut self) -> Option<JsonValue> {
+        if self.done {
+            return None;
+        }
+        match self.receiver.recv() {
+            Ok(batch) => {
+                self.done = batch.get("done") == Some(&json!(true));
+                Some(batch)
+            }
+            Err(_) => {
+                self.done = true;
+                None
+            }
+        }
+    }
+}
+
+impl Iterator for QueryStream {
+    type Item = JsonValue;
+    fn next(&mut self) -> Option<Self::Item> {
+        self.next_batch()
+    }
+}
+
+impl Db {
+    /// Runs the CozoScript passed in on a background thread, streaming the result of its
+    /// last query in batches of `batch_size` rows. The `params` argument is a map of
+    /// parameters.
+    pub fn run_script_streaming(
+        &self,
+        payload: &str,
+        params: Map<String, JsonValue>,
+        batch_size: usize,
+    ) -> QueryStream {
+        let (sender, receiver) = sync_channel(BUFFERED_BATCHES);
+        let db = self.clone();
+        let payload = payload.to_string();
+        thread::spawn(move || {
+            let mut sink = RowSink {
+                batch_size: batch_size.max(1),
+                sender,
+                headers: None,
+                headers_sent: false,
+                rows: vec![],
+            };
+            let result = match db.run_script_with_sink(&payload, &params, Some(&mut sink)) {
+                Ok(json) => json,
+                Err(err) => fold_err(&payload, err),
+            };
+            sink.finish(result);
+        });
+        QueryStream {
+            receiver,
+            done: false,
+        }
+    }
+    /// Like [`Db::run_script_streaming`], with the params formatted as JSON.
+    pub fn run_script_streaming_str(
+        &self,
+        payload: &str,
+        params: &str,
+        batch_size: usize,
+    ) -> QueryStream {
+        match parse_params_str(params) {
+            Ok(params) => self.run_script_streaming(payload, params, batch_size),
+            Err(mut err) => {
+                let (sender, receiver) = sync_channel(1);
+                err["done"] = json!(true);
+                let _ = sender.send(err);
+                QueryStream {
+                    receiver,
+                    done: false,
+                }
+            }
+        }
+    }
+}
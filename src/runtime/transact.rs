@@ -2,7 +2,8 @@
  * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
  */
 
-use std::sync::Arc;
+use std::collections::BTreeMap;
+use std::sync::{Arc, Mutex};
 use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
 
 use miette::Result;
@@ -14,20 +15,70 @@ use crate::data::symb::Symbol;
 use crate::data::tuple::Tuple;
 use crate::data::value::DataValue;
 use crate::parse::SourceSpan;
+use crate::runtime::cost::QueryCost;
 use crate::runtime::in_mem::{InMemRelation, StoredRelationId};
 use crate::runtime::relation::RelationId;
+use crate::runtime::spill::MemoryBudget;
+use crate::runtime::stats::RelationEstimate;
 
 pub struct SessionTx {
     pub(crate) tx: Tx,
     pub(crate) relation_store_id: Arc<AtomicU64>,
     pub(crate) mem_store_id: Arc<AtomicU32>,
+    /// Shared by all rule stores of the transaction. `None` if their memory is not even
+    /// kept track of.
+    pub(crate) memory_budget: Option<MemoryBudget>,
+    /// The script the transaction runs, for `::running`.
+    pub(crate) script: Arc<str>,
+    /// Of the query running, to which scans and rule evaluations add what they cost.
+    pub(crate) cost: QueryCost,
+    /// Of the stored relations planned against so far. Each takes several calls into the
+    /// storage, so they are only taken once in a transaction.
+    pub(crate) estimates: Mutex<BTreeMap<RelationId, RelationEstimate>>,
+}
+
+/// Bulk loads write their rows before the transaction creating their relation commits, so
+/// the last relation id handed out when one is applied is kept under this key, outside of
+/// any transaction. The id of a relation whose creation failed is then never handed out
+/// again, so that no new relation ever sees the rows left of it.
+pub(crate) fn last_bulk_load_id_key() -> Vec<u8> {
+    Tuple(vec![DataValue::Bool(false)]).encode_as_key(RelationId::SYSTEM)
+}
+
+/// A read-only transaction, shared by the threads evaluating rules in parallel.
+#[derive(Clone, Copy)]
+pub(crate) struct SharedTx<'a>(&'a SessionTx);
+
+// A read-only transaction has no RocksDB transaction: it reads from a snapshot of the base
+// DB, through gets and iterators of their own, which RocksDB allows from many threads at
+// once. Everything else of `SessionTx` is atomics and locks. Transactions that write are
+// never shared, as one RocksDB transaction must not be used by several threads.
+unsafe impl Sync for SharedTx<'_> {}
+
+impl<'a> SharedTx<'a> {
+    pub(crate) fn get(self) -> &'a SessionTx {
+        self.0
+    }
 }
 
 impl SessionTx {
+    /// `None` unless the transaction is read-only.
+    pub(crate) fn share(&self) -> Option<SharedTx<'_>> {
+        if self.tx.is_read_only() {
+            Some(SharedTx(self))
+        } else {
+            None
+        }
+    }
     pub(crate) fn new_rule_store(&self, rule_name: MagicSymbol, arity: usize) -> InMemRelation {
         let old_count = self.mem_store_id.fetch_add(1, Ordering::AcqRel);
         let old_count = old_count & 0x00ff_ffffu32;
-        InMemRelation::new(StoredRelationId(old_count), rule_name, arity)
+        InMemRelation::new(
+            StoredRelationId(old_count),
+            rule_name,
+            arity,
+            self.memory_budget.clone(),
+        )
     }
 
     pub(crate) fn new_temp_store(&self, span: SourceSpan) -> InMemRelation {
@@ -39,6 +90,7 @@ impl SessionTx {
                 inner: Symbol::new("", span),
             },
             0,
+            self.memory_budget.clone(),
         )
     }
 
@@ -46,10 +98,15 @@ impl SessionTx {
         let tuple = Tuple(vec![DataValue::Null]);
         let t_encoded = tuple.encode_as_key(RelationId::SYSTEM);
         let found = self.tx.get(&t_encoded, false)?;
-        Ok(match found {
+        let committed = match found {
+            None => RelationId::SYSTEM,
+            Some(slice) => RelationId::raw_decode(&slice),
+        };
+        let bulk_loaded = match self.tx.get(&last_bulk_load_id_key(), false)? {
             None => RelationId::SYSTEM,
             Some(slice) => RelationId::raw_decode(&slice),
-        })
+        };
+        Ok(committed.max(bulk_loaded))
     }
 
     pub fn commit_tx(&mut self) -> Result<()> {
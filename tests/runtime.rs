@@ -0,0 +1,405 @@
+/*
+ * Copyright 2022, The Cozo Project Authors. Licensed under AGPL-3 or later.
+ */
+
+use serde_json::{json, Map, Value};
+
+use cozo::{Db, DbOptions};
+
+fn new_db(name: &str) -> Db {
+    new_db_with_options(name, DbOptions::default())
+}
+
+fn new_db_with_options(name: &str, options: DbOptions) -> Db {
+    let path = format!("_test_runtime_{}", name);
+    _ = std::fs::remove_dir_all(&path);
+    Db::new_with_options(path, options).unwrap()
+}
+
+fn rows(db: &Db, script: &str) -> Value {
+    db.run_script(script, &Default::default())
+        .unwrap()
+        .get("rows")
+        .unwrap()
+        .clone()
+}
+
+#[test]
+fn parallel_evaluation_matches_serial() {
+    let db = new_db("parallel");
+    let edges = (0..100)
+        .flat_map(|i| {
+            [
+                json!([i, (i * 7 + 3) % 100]),
+                json!([i, (i * 13 + 1) % 100]),
+            ]
+        })
+        .collect::<Vec<_>>();
+    let mut params = Map::new();
+    params.insert("edges".to_string(), json!(edges));
+    db.run_script(
+        "?[fr, to] <- $edges :create edge {fr: Int, to: Int}",
+        &params,
+    )
+    .unwrap();
+
+    let program = r#"
+        reach[a, b] := *edge[a, b]
+        reach[a, b] := reach[a, c], *edge[c, b]
+        back[a, b] := *edge[b, a]
+        back[a, b] := back[a, c], *edge[b, c]
+        ?[a, b, c] := reach[a, b], back[b, c], a < 5, c < 5
+    "#;
+    // read-only, so the rules of each epoch are evaluated in parallel
+    let parallel = rows(&db, program);
+    // storing the result makes it a write, which is evaluated on one thread
+    db.run_script(
+        &format!("{} :create out {{a, b, c}}", program),
+        &Default::default(),
+    )
+    .unwrap();
+    let serial = rows(&db, "?[a, b, c] := *out[a, b, c]");
+    assert!(!serial.as_array().unwrap().is_empty());
+    assert_eq!(parallel, serial);
+}
+
+#[test]
+fn merged_rows_keep_column_types() {
+    let db = new_db("merge");
+    db.run_script(
+        ":create agg {k: String => n: Int default 0, total: Int default 0, tags: [Int] default []}",
+        &Default::default(),
+    )
+    .unwrap();
+    let merge = ":merge agg {k => n: count, total: sum = v, tags: union}";
+    db.run_script(
+        &format!(
+            "?[k, v, tags] <- [['a', 1, [1]], ['a', 2, [2, 1]], ['b', 3, []]] {}",
+            merge
+        ),
+        &Default::default(),
+    )
+    .unwrap();
+    db.run_script(
+        &format!("?[k, v, tags] <- [['a', 4, [3]]] {}", merge),
+        &Default::default(),
+    )
+    .unwrap();
+    assert_eq!(
+        rows(&db, "?[k, n, total, tags] := *agg[k, n, total, tags]"),
+        json!([["a", 3, 7, [1, 2, 3]], ["b", 1, 3, []]])
+    );
+
+    // a column that the aggregation would change the type of
+    assert!(db
+        .run_script(
+            "?[k, v] <- [['a', 1]] :merge agg {k => n: union, total: sum = v, tags: union}",
+            &Default::default(),
+        )
+        .is_err());
+
+    db.run_script(":create loose {k => x}", &Default::default())
+        .unwrap();
+    db.run_script(
+        "?[k, x] <- [[1, 1]] :merge loose {k => x: sum}",
+        &Default::default(),
+    )
+    .unwrap();
+    // a value that cannot be summed is rejected, and the stored one is kept
+    assert!(db
+        .run_script(
+            "?[k, x] <- [[1, 'one']] :merge loose {k => x: sum}",
+            &Default::default(),
+        )
+        .is_err());
+    assert_eq!(rows(&db, "?[k, x] := *loose[k, x]"), json!([[1, 1]]));
+}
+
+#[test]
+fn bulk_loads_are_applied_with_the_commit() {
+    let db = new_db("bulk_load");
+    let mut params = Map::new();
+    params.insert(
+        "rows".to_string(),
+        json!((0..20000).map(|i| json!([i])).collect::<Vec<_>>()),
+    );
+    db.run_script("?[a] <- $rows :create big {a} :bulk_load", &params)
+        .unwrap();
+    assert_eq!(rows(&db, "?[count(a)] := *big[a]"), json!([[20000]]));
+
+    // the whole script fails, so the relation is never created
+    assert!(db
+        .run_script(
+            "{?[a] <- $rows :create other {a} :bulk_load} {?[a] <- [[1]] :assert none}",
+            &params,
+        )
+        .is_err());
+    assert!(db
+        .run_script("?[a] := *other[a]", &Default::default())
+        .is_err());
+    let leftovers = std::fs::read_dir("_test_runtime_bulk_load")
+        .unwrap()
+        .filter(|entry| {
+            entry
+                .as_ref()
+                .unwrap()
+                .file_name()
+                .to_string_lossy()
+                .starts_with("bulk_load_")
+        })
+        .count();
+    assert_eq!(leftovers, 0);
+}
+
+#[test]
+fn failed_bulk_loads_leave_no_rows() {
+    let options = || DbOptions {
+        optimistic_transactions: true,
+        ..Default::default()
+    };
+    let db = new_db_with_options("failed_bulk_load", options());
+    let mut params = Map::new();
+    params.insert(
+        "rows".to_string(),
+        json!((0..20000).map(|i| json!([i])).collect::<Vec<_>>()),
+    );
+    // the rows are written before the commit, which then fails as another relation is
+    // created in the meantime, with the lower id
+    let loading = {
+        let db = db.clone();
+        std::thread::spawn(move || {
+            db.run_script(
+                "{?[a] <- [[1]] :sleep 2} {?[a] <- $rows :create other {a} :bulk_load}",
+                &params,
+            )
+        })
+    };
+    std::thread::sleep(std::time::Duration::from_millis(500));
+    db.run_script("?[a] <- [[1]] :create unrelated {a}", &Default::default())
+        .unwrap();
+    assert!(loading.join().unwrap().is_err());
+    assert!(db
+        .run_script("?[a] := *other[a]", &Default::default())
+        .is_err());
+
+    // the id of the relation never created is not handed out again, and no new relation
+    // sees the rows written for it
+    drop(db);
+    let db = Db::new_with_options("_test_runtime_failed_bulk_load", options()).unwrap();
+    db.run_script(":create fresh {a}", &Default::default())
+        .unwrap();
+    assert_eq!(rows(&db, "?[a] := *fresh[a]"), json!([]));
+}
+
+#[test]
+fn checkpoints_and_backups() {
+    let root = "_test_runtime_backups";
+    let _ = std::fs::remove_dir_all(root);
+    let db = new_db_with_options(
+        "backed_up",
+        DbOptions {
+            backup_root: Some(root.to_string()),
+            ..Default::default()
+        },
+    );
+    db.run_script("?[a] <- [[1]] :create r {a}", &Default::default())
+        .unwrap();
+
+    db.run_script("::checkpoint 'checkpoint'", &Default::default())
+        .unwrap();
+    // scripts cannot write outside of the backup root
+    for path in ["'../escaped'", "'/tmp/escaped'", "''"] {
+        assert!(db
+            .run_script(&format!("::checkpoint {}", path), &Default::default())
+            .is_err());
+    }
+    assert!(new_db("no_backup_root")
+        .run_script("::backup 'anywhere'", &Default::default())
+        .is_err());
+
+    db.run_script("::backup 'backups'", &Default::default())
+        .unwrap();
+    db.run_script("?[a] <- [[2]] :put r {a}", &Default::default())
+        .unwrap();
+    db.run_script("::backup 'backups'", &Default::default())
+        .unwrap();
+
+    // a database cannot be restored into while it is open
+    let backups = format!("{}/backups", root);
+    assert!(Db::restore_backup(&backups, "_test_runtime_backed_up").is_err());
+
+    let restored = "_test_runtime_restored";
+    let _ = std::fs::remove_dir_all(restored);
+    Db::restore_backup(&backups, restored).unwrap();
+    let restored = Db::new(restored).unwrap();
+    assert_eq!(rows(&restored, "?[a] := *r[a]"), json!([[1], [2]]));
+
+    let checkpoint = Db::new(format!("{}/checkpoint", root)).unwrap();
+    assert_eq!(rows(&checkpoint, "?[a] := *r[a]"), json!([[1]]));
+}
+
+/// Compactions run in the background: waits for the one started by `script` to finish.
+fn compact(db: &Db, script: &str) {
+    let id = rows(db, script)[0][1].clone();
+    loop {
+        let compactions = rows(db, "::compactions");
+        let status = compactions
+            .as_array()
+            .unwrap()
+            .iter()
+            .find(|row| row[0] == id)
+            .unwrap()[4]
+            .clone();
+        if status != json!("RUNNING") {
+            assert_eq!(status, json!("OK"));
+            return;
+        }
+        std::thread::sleep(std::time::Duration::from_millis(10));
+    }
+}
+
+#[test]
+fn expired_rows_are_dropped() {
+    let db = new_db("ttl");
+    let now = std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .unwrap()
+        .as_secs();
+    let mut params = Map::new();
+    params.insert(
+        "rows".to_string(),
+        json!([[null, 1, "null"], [0, 2, "old"], [now, 3, "new"]]),
+    );
+    db.run_script(
+        "?[ts, id, v] <- $rows :create events {ts: Int?, id: Int => v}",
+        &params,
+    )
+    .unwrap();
+    db.run_script("::set_ttl events ts 3600", &Default::default())
+        .unwrap();
+    compact(&db, "::compact events");
+    // rows without a timestamp never expire
+    assert_eq!(rows(&db, "?[id] := *events[_, id, _]"), json!([[1], [3]]));
+
+    // a replaced relation keeps its TTL
+    params.insert(
+        "rows".to_string(),
+        json!([[null, 1, "null"], [0, 4, "old"], [now, 3, "new"]]),
+    );
+    db.run_script(
+        "?[ts, id, v] <- $rows :replace events {ts: Int?, id: Int => v}",
+        &params,
+    )
+    .unwrap();
+    assert_eq!(
+        rows(&db, "?[id] := *events[_, id, _]"),
+        json!([[1], [3], [4]])
+    );
+    compact(&db, "::compact");
+    assert_eq!(rows(&db, "?[id] := *events[_, id, _]"), json!([[1], [3]]));
+}
+
+#[test]
+fn triggers_see_rows_written_earlier_in_a_batch() {
+    let db = new_db("triggers");
+    db.run_script(
+        "?[k, v] <- [[1, 'a']] :create kv {k => v}",
+        &Default::default(),
+    )
+    .unwrap();
+    db.run_script(":create log {k, v}", &Default::default())
+        .unwrap();
+    db.run_script(
+        "::set_triggers kv on put { ?[k, v] := _old[k, v] :put log {k, v} }",
+        &Default::default(),
+    )
+    .unwrap();
+    db.run_script(
+        "?[k, v] <- [[1, 'b'], [1, 'c'], [2, 'x']] :put kv {k => v}",
+        &Default::default(),
+    )
+    .unwrap();
+    assert_eq!(
+        rows(&db, "?[k, v] := *kv[k, v]"),
+        json!([[1, "c"], [2, "x"]])
+    );
+    assert_eq!(
+        rows(&db, "?[k, v] := *log[k, v]"),
+        json!([[1, "a"], [1, "b"]])
+    );
+}
+
+#[test]
+fn queries_spill_beyond_the_memory_budget() {
+    let db = new_db_with_options(
+        "spill",
+        DbOptions {
+            query_memory_budget: 1,
+            ..Default::default()
+        },
+    );
+    let edges = (0..200)
+        .map(|i| json!([i, (i + 1) % 200]))
+        .collect::<Vec<_>>();
+    let mut params = Map::new();
+    params.insert("edges".to_string(), json!(edges));
+    db.run_script("?[fr, to] <- $edges :create edge {fr, to}", &params)
+        .unwrap();
+    // every pair of nodes is connected
+    assert_eq!(
+        rows(
+            &db,
+            "reach[a, b] := *edge[a, b] \
+             reach[a, b] := reach[a, c], *edge[c, b] \
+             ?[count(a)] := reach[a, b]"
+        ),
+        json!([[40000]])
+    );
+    let spill_dirs = |path: &str| {
+        std::fs::read_dir(path)
+            .unwrap()
+            .filter(|entry| {
+                entry
+                    .as_ref()
+                    .unwrap()
+                    .file_name()
+                    .to_string_lossy()
+                    .starts_with("spill_")
+            })
+            .count()
+    };
+    assert_eq!(spill_dirs("_test_runtime_spill"), 0);
+
+    // opening the database again fails, and leaves the files of the open one alone
+    std::fs::create_dir("_test_runtime_spill/spill_in_use").unwrap();
+    assert!(Db::new("_test_runtime_spill").is_err());
+    assert_eq!(spill_dirs("_test_runtime_spill"), 1);
+}
+
+#[test]
+fn prepared_scripts_follow_the_schema() {
+    let db = new_db("prepared");
+    db.run_script(
+        "?[a, b] <- [[1, 'x'], [2, 'y']] :create r {a => b}",
+        &Default::default(),
+    )
+    .unwrap();
+    let query = db.prepare("?[b] := *r{a, b}, a = $a").unwrap();
+    let run = |a: i64| {
+        let mut params = Map::new();
+        params.insert("a".to_string(), json!(a));
+        db.run_prepared(&query, &params).unwrap()["rows"].clone()
+    };
+    assert_eq!(run(1), json!([["x"]]));
+    assert_eq!(run(2), json!([["y"]]));
+    assert_eq!(run(3), json!([]));
+
+    // the columns move, so a program rewritten against the old schema reads the wrong ones
+    db.run_script("::remove r", &Default::default()).unwrap();
+    db.run_script(
+        "?[a, c, b] <- [[1, 0, 'z']] :create r {a, c => b}",
+        &Default::default(),
+    )
+    .unwrap();
+    assert_eq!(run(1), json!([["z"]]));
+}